@@ -0,0 +1,992 @@
+/*
+ * Film Processor Benchmark
+ * Compares the staged per-stage pipeline against the fused single-pass
+ * kernels on a synthetic image and verifies that their output matches.
+ *
+ * Usage: film_bench [width height [iterations]]
+ * Set FILM_KERNEL=scalar|sse2|avx2|avx512 to force a kernel variant and
+ * FILM_THREADS=n to size the row-band thread pool.
+ */
+
+#include "film_kernels.h"
+#include "thread_pool.h"
+#include "jpeg_encoder.h"
+#include "jpeg_decoder.h"
+#include "qoi_codec.h"
+#include "codec_libjpeg.h"
+#include "buffer_pool.h"
+#define STBI_ONLY_JPEG          // Only to decode the encoder output
+#define STBI_ONLY_PNG           // (stb warns about an unused argument without it)
+// Allocations as in the library, so the buffer pool applies to stb
+#define STBI_MALLOC(size) image_buffer_calloc(size)
+#define STBI_REALLOC_SIZED(ptr, old_size, new_size) image_buffer_realloc(ptr, old_size, new_size)
+#define STBI_FREE(ptr) image_buffer_release(ptr)
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <sys/resource.h>
+
+#define DEFAULT_WIDTH 6000
+#define DEFAULT_HEIGHT 4000
+#define DEFAULT_ITERATIONS 5
+#define GRAIN_SEED 12345u
+
+typedef void (*PipelineFn)(unsigned char *img, int width, int height, int channels);
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Deterministic photo-like test pattern
+static void fill_test_image(unsigned char *img, int width, int height, int channels) {
+    unsigned int state = 1;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            unsigned char *px = img + ((size_t)y * width + x) * channels;
+            state = state * 1103515245u + 12345u;
+            px[0] = (unsigned char)((x * 255 / width + (state >> 28)) & 0xFF);
+            px[1] = (unsigned char)((y * 255 / height + (state >> 24)) & 0xFF);
+            px[2] = (unsigned char)(((x + y) & 0xFF) ^ (state >> 16));
+            for (int c = 3; c < channels; c++) px[c] = 255;
+        }
+    }
+}
+
+static void staged_to_negative(unsigned char *img, int width, int height, int channels) {
+    apply_negative(img, width, height, channels);
+    apply_film_color_cast(img, width, height, channels);
+    apply_grain(img, width, height, channels, FILM_GRAIN_INTENSITY, GRAIN_SEED);
+    draw_sprocket_holes(img, width, height, channels);
+}
+
+static void staged_to_positive(unsigned char *img, int width, int height, int channels) {
+    crop_sprocket_holes(img, width, height, channels);
+    remove_film_color_cast(img, width, height, channels);
+    apply_negative(img, width, height, channels);
+}
+
+static void fused_negative(unsigned char *img, int width, int height, int channels) {
+    fused_to_negative(img, width, height, channels, FILM_GRAIN_INTENSITY, GRAIN_SEED);
+}
+
+static void fused_positive(unsigned char *img, int width, int height, int channels) {
+    fused_to_positive(img, width, height, channels);
+}
+
+static void textured_negative(unsigned char *img, int width, int height, int channels) {
+    fused_to_negative_textured(img, width, height, channels,
+                               grain_cache_lookup(FILM_GRAIN_INTENSITY, channels), GRAIN_SEED);
+}
+
+// Whole pool, row bands; output must not depend on the band count
+static void parallel_negative(unsigned char *img, int width, int height, int channels) {
+    FusedJob job = { FUSED_NEGATIVE, image_buffer_wrap(img, width, height, channels, 0),
+                     FILM_GRAIN_INTENSITY, NULL, GRAIN_SEED, 1, 0, 0 };
+    fused_run(&job, 0);
+}
+
+static void parallel_positive(unsigned char *img, int width, int height, int channels) {
+    FusedJob job = { FUSED_POSITIVE, image_buffer_wrap(img, width, height, channels, 0),
+                     0, NULL, 0, 1, 0, 0 };
+    fused_run(&job, 0);
+}
+
+// Run a pipeline on a fresh copy of the source, return best time in ms
+static double run_pipeline(PipelineFn fn, const unsigned char *src, unsigned char *dst,
+                           int width, int height, int channels, int iterations) {
+    size_t size = (size_t)width * height * channels;
+    double best = -1.0;
+
+    for (int i = 0; i < iterations; i++) {
+        memcpy(dst, src, size);
+        double start = now_ms();
+        fn(dst, width, height, channels);
+        double elapsed = now_ms() - start;
+        if (best < 0 || elapsed < best) best = elapsed;
+    }
+    return best;
+}
+
+// Modeled DRAM traffic: every full pass reads and writes the whole image
+static void report(const char *name, double ms, double passes, size_t image_bytes, int pixels) {
+    double bytes = passes * 2.0 * image_bytes;
+    printf("  %-22s %9.2f ms  %8.1f MPix/s  %6.2f GB moved  %6.2f GB/s\n",
+           name, ms, pixels / (ms * 1000.0), bytes / 1e9, bytes / (ms * 1e6));
+}
+
+static int compare_case(const char *label, const char *staged_name, PipelineFn staged,
+                        double staged_passes, const char *fused_name, PipelineFn fused,
+                        double fused_passes, const unsigned char *src,
+                        int width, int height, int channels, int iterations) {
+    size_t size = (size_t)width * height * channels;
+    unsigned char *a = malloc(size);
+    unsigned char *b = malloc(size);
+    if (!a || !b) {
+        fprintf(stderr, "Out of memory\n");
+        free(a);
+        free(b);
+        return 0;
+    }
+
+    double staged_ms = run_pipeline(staged, src, a, width, height, channels, iterations);
+    double fused_ms = run_pipeline(fused, src, b, width, height, channels, iterations);
+    int identical = memcmp(a, b, size) == 0;
+
+    printf("%s (%d channels)\n", label, channels);
+    report(staged_name, staged_ms, staged_passes, size, width * height);
+    report(fused_name, fused_ms, fused_passes, size, width * height);
+    printf("  speedup %.2fx, traffic saved %.2f GB per image, output %s\n\n",
+           staged_ms / fused_ms, (staged_passes - fused_passes) * 2.0 * size / 1e9,
+           identical ? "bit-identical" : "MISMATCH");
+
+    free(a);
+    free(b);
+    return identical;
+}
+
+// Per-pixel hash grain against the cached grain texture (different noise,
+// so only timing is compared)
+static void compare_grain(const unsigned char *src, int width, int height, int channels,
+                          int iterations) {
+    size_t size = (size_t)width * height * channels;
+    unsigned char *dst = malloc(size);
+    if (!dst) {
+        fprintf(stderr, "Out of memory\n");
+        return;
+    }
+
+    double hash_ms = run_pipeline(fused_negative, src, dst, width, height, channels, iterations);
+    double texture_ms = run_pipeline(textured_negative, src, dst, width, height, channels, iterations);
+
+    printf("to-negative grain source (%d channels)\n", channels);
+    report("per-pixel hash", hash_ms, 1.0, size, width * height);
+    report("cached texture", texture_ms, 1.0, size, width * height);
+    printf("  texture speedup %.2fx\n\n", hash_ms / texture_ms);
+    free(dst);
+}
+
+// Best time over all rows of one row kernel, in ms
+static double time_rows(const RowKernels *rows, int negative, unsigned char *img,
+                        int width, int height, int channels, int iterations) {
+    size_t row_bytes = (size_t)width * channels;
+    double best = -1.0;
+
+    for (int i = 0; i < iterations; i++) {
+        fill_test_image(img, width, height, channels);
+        double start = now_ms();
+        for (int y = 0; y < height; y++) {
+            GrainParams grain = { grain_key(GRAIN_SEED), (unsigned int)y * width, FILM_GRAIN_INTENSITY };
+            if (negative) {
+                rows->negative_row(img + y * row_bytes, width, &grain);
+            } else {
+                rows->positive_row(img + y * row_bytes, width);
+            }
+        }
+        double elapsed = now_ms() - start;
+        if (best < 0 || elapsed < best) best = elapsed;
+    }
+    return best;
+}
+
+// Row kernel throughput per variant for RGB and RGBA (PNG with alpha)
+static void compare_layouts(int width, int height, int iterations) {
+    const KernelSet *sets[] = { &kernels_scalar, &kernels_sse2, &kernels_avx2, &kernels_avx512 };
+    unsigned char *img = malloc((size_t)width * height * 4);
+    if (!img) {
+        fprintf(stderr, "Out of memory\n");
+        return;
+    }
+
+    printf("row kernels by channel layout (MPix/s)\n");
+    printf("  %-8s %12s %12s %12s %12s\n", "variant", "neg RGB", "neg RGBA", "pos RGB", "pos RGBA");
+    for (size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+        if (!sets[i]->supported()) continue;
+        double mpix[4];
+        for (int k = 0; k < 4; k++) {
+            int channels = 3 + k % 2;
+            double ms = time_rows(kernels_for_layout(sets[i], channels), k < 2, img,
+                                  width, height, channels, iterations);
+            mpix[k] = (double)width * height / (ms * 1000.0);
+        }
+        printf("  %-8s %12.1f %12.1f %12.1f %12.1f\n", sets[i]->name, mpix[0], mpix[1], mpix[2], mpix[3]);
+    }
+    printf("\n");
+    free(img);
+}
+
+// Encoded file held in memory
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+} ByteSink;
+
+static void sink_write(void *context, const void *data, size_t size) {
+    ByteSink *sink = context;
+    if (sink->size + size > sink->capacity) {
+        size_t capacity = sink->capacity ? sink->capacity * 2 : 1 << 20;
+        while (capacity < sink->size + size) capacity *= 2;
+        unsigned char *grown = realloc(sink->data, capacity);
+        if (!grown) return;
+        sink->data = grown;
+        sink->capacity = capacity;
+    }
+    memcpy(sink->data + sink->size, data, size);
+    sink->size += size;
+}
+
+static void stb_sink_write(void *context, void *data, int size) {
+    sink_write(context, data, (size_t)size);
+}
+
+// Best time for one encoder configuration; a NULL kernel set selects stb
+static double time_encode(const ImageBuffer *img, const KernelSet *kernels, int max_threads,
+                          ByteSink *sink, int iterations) {
+    double best = -1.0;
+    for (int i = 0; i < iterations; i++) {
+        sink->size = 0;
+        double start = now_ms();
+        if (!kernels) {
+            stbi_write_jpg_to_func(stb_sink_write, sink, img->width, img->height, img->channels,
+                                   img->data, 90);
+        } else {
+            EncodeOptions options = {0};
+            options.max_threads = max_threads;
+            jpeg_encode_with(kernels, img, &options, sink_write, sink);
+        }
+        double elapsed = now_ms() - start;
+        if (best < 0 || elapsed < best) best = elapsed;
+    }
+    return best;
+}
+
+static unsigned char *decode_rgb(const ByteSink *sink, int width, int height) {
+    int w, h, n;
+    unsigned char *pixels = stbi_load_from_memory(sink->data, (int)sink->size, &w, &h, &n, 3);
+    if (pixels && (w != width || h != height)) {
+        stbi_image_free(pixels);
+        return NULL;
+    }
+    return pixels;
+}
+
+// PSNR of a decoded encode against the source's color channels
+static double psnr(const unsigned char *src, const unsigned char *decoded, int width, int height,
+                   int channels) {
+    double sum = 0.0;
+    size_t pixels = (size_t)width * height;
+    for (size_t i = 0; i < pixels; i++) {
+        for (int c = 0; c < 3; c++) {
+            double d = (double)src[i * channels + c] - decoded[i * 3 + c];
+            sum += d * d;
+        }
+    }
+    double mse = sum / (pixels * 3.0);
+    return mse > 0 ? 10.0 * log10(255.0 * 255.0 / mse) : 99.0;
+}
+
+static void report_encode(const char *name, double ms, int pixels, const ByteSink *sink, double db) {
+    printf("  %-22s %9.2f ms  %8.1f MPix/s  %9zu bytes  %6.2f dB\n",
+           name, ms, pixels / (ms * 1000.0), sink->size, db);
+}
+
+// stb_image_write against the strip encoder: the float reference path must
+// decode identically to stb (strips only reset the DC predictors), and the
+// SIMD path must stay within JPEG_PSNR_TOLERANCE of it
+#define JPEG_PSNR_TOLERANCE 0.25
+
+static int compare_encode(const unsigned char *src, int width, int height, int channels,
+                          int iterations) {
+    ImageBuffer img = image_buffer_wrap((unsigned char *)src, width, height, channels, 0);
+    const KernelSet *active = film_kernels();
+    ByteSink stb = {0}, reference = {0}, serial = {0}, parallel = {0};
+
+    double stb_ms = time_encode(&img, NULL, 1, &stb, iterations);
+    double reference_ms = time_encode(&img, &kernels_scalar, 1, &reference, iterations);
+    double serial_ms = time_encode(&img, active, 1, &serial, iterations);
+    double parallel_ms = time_encode(&img, active, 0, &parallel, iterations);
+
+    unsigned char *stb_px = decode_rgb(&stb, width, height);
+    unsigned char *reference_px = decode_rgb(&reference, width, height);
+    unsigned char *simd_px = decode_rgb(&parallel, width, height);
+    int ok = stb_px && reference_px && simd_px;
+    double stb_db = 0, reference_db = 0, simd_db = 0;
+    if (ok) {
+        stb_db = psnr(src, stb_px, width, height, channels);
+        reference_db = psnr(src, reference_px, width, height, channels);
+        simd_db = psnr(src, simd_px, width, height, channels);
+        ok = memcmp(stb_px, reference_px, (size_t)width * height * 3) == 0 &&
+             serial.size == parallel.size && memcmp(serial.data, parallel.data, serial.size) == 0 &&
+             simd_db >= reference_db - JPEG_PSNR_TOLERANCE;
+    }
+
+    char name[64];
+    printf("JPEG encode q90 (%d channels)\n", channels);
+    report_encode("stb_image_write", stb_ms, width * height, &stb, stb_db);
+    report_encode("strips scalar, serial", reference_ms, width * height, &reference, reference_db);
+    snprintf(name, sizeof(name), "strips %s, serial", active->name);
+    report_encode(name, serial_ms, width * height, &serial, simd_db);
+    snprintf(name, sizeof(name), "strips %s, pool", active->name);
+    report_encode(name, parallel_ms, width * height, &parallel, simd_db);
+    printf("  speedup %.2fx over stb, PSNR delta %+.3f dB, %s\n\n", stb_ms / parallel_ms,
+           simd_db - reference_db, ok ? "parity ok" : "PARITY MISMATCH");
+
+    stbi_image_free(stb_px);
+    stbi_image_free(reference_px);
+    stbi_image_free(simd_px);
+    free(stb.data);
+    free(reference.data);
+    free(serial.data);
+    free(parallel.data);
+    return ok;
+}
+
+static double best_of(double best, double start) {
+    double elapsed = now_ms() - start;
+    return best < 0 || elapsed < best ? elapsed : best;
+}
+
+// Standard against optimized Huffman tables at a few qualities: the extra
+// symbol pass costs CPU, the tables save bytes, and pixels must not change
+static int compare_huffman(const unsigned char *src, int width, int height, int channels,
+                           int iterations) {
+    static const int qualities[] = { 50, 75, 90 };
+    ImageBuffer img = image_buffer_wrap((unsigned char *)src, width, height, channels, 0);
+    ByteSink standard = {0}, optimized = {0};
+    int ok = 1;
+
+    printf("JPEG Huffman tables (%d channels)\n", channels);
+    for (size_t i = 0; i < sizeof(qualities) / sizeof(qualities[0]); i++) {
+        EncodeOptions options = {0};
+        options.quality = qualities[i];
+        double standard_ms = -1.0, optimized_ms = -1.0;
+        for (int k = 0; k < iterations; k++) {
+            standard.size = 0;
+            options.optimize_huffman = 0;
+            double start = now_ms();
+            jpeg_encode(&img, &options, sink_write, &standard);
+            standard_ms = best_of(standard_ms, start);
+
+            optimized.size = 0;
+            options.optimize_huffman = 1;
+            start = now_ms();
+            jpeg_encode(&img, &options, sink_write, &optimized);
+            optimized_ms = best_of(optimized_ms, start);
+        }
+
+        unsigned char *standard_px = decode_rgb(&standard, width, height);
+        unsigned char *optimized_px = decode_rgb(&optimized, width, height);
+        int same = standard_px && optimized_px &&
+                   memcmp(standard_px, optimized_px, (size_t)width * height * 3) == 0;
+        ok &= same;
+        printf("  q%-3d %9.2f -> %9.2f ms (%+5.0f%% CPU)  %9zu -> %9zu bytes (%5.1f%% saved)  %s\n",
+               qualities[i], standard_ms, optimized_ms, 100.0 * (optimized_ms - standard_ms) / standard_ms,
+               standard.size, optimized.size, 100.0 * (1.0 - (double)optimized.size / standard.size),
+               same ? "pixels ok" : "PIXEL MISMATCH");
+        stbi_image_free(standard_px);
+        stbi_image_free(optimized_px);
+    }
+    printf("\n");
+
+    free(standard.data);
+    free(optimized.data);
+    return ok;
+}
+
+// Largest quality whose full encode fits, found by re-encoding from scratch
+static int naive_fit(const ImageBuffer *img, size_t max_bytes, ByteSink *sink, int *encodes) {
+    int lo = 1, hi = 90, best = 0;
+    *encodes = 0;
+    while (lo <= hi) {
+        EncodeOptions options = {0};
+        options.quality = lo + (hi - lo) / 2;
+        options.subsampling = SUBSAMPLING_420;
+        sink->size = 0;
+        jpeg_encode(img, &options, sink_write, sink);
+        ++*encodes;
+        if (sink->size <= max_bytes) {
+            best = options.quality;
+            lo = options.quality + 1;
+        } else {
+            hi = options.quality - 1;
+        }
+    }
+    return best;
+}
+
+// max_bytes against a binary search of full encodes, at 60% of the q90 size,
+// and a budget the q90 file already meets against a plain encode
+static int compare_target_size(const unsigned char *src, int width, int height, int channels,
+                               int iterations) {
+    ImageBuffer img = image_buffer_wrap((unsigned char *)src, width, height, channels, 0);
+    ByteSink full = {0}, fitted = {0};
+    EncodeOptions options = {0};
+    jpeg_encode(&img, &options, sink_write, &full);
+    size_t full_size = full.size;
+    size_t budget = full_size * 6 / 10;
+
+    EncodeStats stats = {0}, roomy_stats = {0};
+    EncodeOptions plain = {0}, roomy = {0};
+    roomy.max_bytes = full_size;
+    roomy.stats = &roomy_stats;
+    options.max_bytes = budget;
+    options.stats = &stats;
+    double fit_ms = -1.0, naive_ms = -1.0, plain_ms = -1.0, roomy_ms = -1.0;
+    int naive_quality = 0, encodes = 0;
+    for (int i = 0; i < iterations; i++) {
+        fitted.size = 0;
+        double start = now_ms();
+        jpeg_encode(&img, &options, sink_write, &fitted);
+        fit_ms = best_of(fit_ms, start);
+
+        start = now_ms();
+        naive_quality = naive_fit(&img, budget, &full, &encodes);
+        naive_ms = best_of(naive_ms, start);
+
+        full.size = 0;
+        start = now_ms();
+        jpeg_encode(&img, &plain, sink_write, &full);
+        plain_ms = best_of(plain_ms, start);
+
+        full.size = 0;
+        start = now_ms();
+        jpeg_encode(&img, &roomy, sink_write, &full);
+        roomy_ms = best_of(roomy_ms, start);
+    }
+
+    int ok = stats.quality > 0 && fitted.size <= budget && roomy_stats.quality == 90 && full.size == full_size;
+    printf("JPEG target size %zu bytes (%d channels)\n", budget, channels);
+    printf("  %-22s %9.2f ms  q%-3d %2d encodes\n", "re-encode search", naive_ms, naive_quality, encodes);
+    printf("  %-22s %9.2f ms  q%-3d %2d passes  %9zu bytes\n", "max_bytes", fit_ms, stats.quality,
+           stats.passes, fitted.size);
+    printf("  %-22s %9.2f ms\n", "q90, no budget", plain_ms);
+    printf("  %-22s %9.2f ms  q%-3d %2d passes  %9zu bytes\n", "q90 within budget", roomy_ms,
+           roomy_stats.quality, roomy_stats.passes, full.size);
+    printf("  speedup %.2fx, %s\n\n", naive_ms / fit_ms, ok ? "fits" : "OVER BUDGET");
+
+    free(full.data);
+    free(fitted.data);
+    return ok;
+}
+
+// Inverting a q90 JPEG: decode, invert and re-encode the pixels, against
+// negating the decoded coefficients and entropy-coding them again, and
+// against rewriting the scan with the source's own codes (invert_jpeg's
+// default). All are measured against the inverted decode of the source;
+// the transform paths must not lose more than the pixel path's second
+// quantization does.
+static int compare_invert(const unsigned char *src, int width, int height, int channels,
+                          int iterations) {
+    ImageBuffer img = image_buffer_wrap((unsigned char *)src, width, height, channels, 0);
+    ByteSink source = {0}, pixel = {0}, transform = {0}, rewrite = {0};
+    EncodeOptions options = {0};
+    jpeg_encode(&img, &options, sink_write, &source);
+
+    double pixel_ms = -1.0, transform_ms = -1.0, rewrite_ms = -1.0;
+    for (int i = 0; i < iterations; i++) {
+        pixel.size = 0;
+        double start = now_ms();
+        int w, h, n;
+        unsigned char *decoded = stbi_load_from_memory(source.data, (int)source.size, &w, &h, &n, 3);
+        ImageBuffer inverted = image_buffer_wrap(decoded, w, h, 3, 0);
+        invert_rows(&inverted, 0, h);
+        jpeg_encode(&inverted, &options, sink_write, &pixel);
+        pixel_ms = best_of(pixel_ms, start);
+        stbi_image_free(decoded);
+
+        transform.size = 0;
+        start = now_ms();
+        JpegCoefficients coefficients;
+        if (jpeg_decode_coefficients(source.data, source.size, &coefficients)) {
+            jpeg_coefficients_invert(&coefficients);
+            jpeg_encode_coefficients(&coefficients, &options, sink_write, &transform);
+            jpeg_coefficients_free(&coefficients);
+        }
+        transform_ms = best_of(transform_ms, start);
+
+        rewrite.size = 0;
+        start = now_ms();
+        jpeg_invert_entropy(source.data, source.size, sink_write, &rewrite);
+        rewrite_ms = best_of(rewrite_ms, start);
+    }
+
+    unsigned char *reference = decode_rgb(&source, width, height);
+    unsigned char *pixel_px = decode_rgb(&pixel, width, height);
+    unsigned char *transform_px = decode_rgb(&transform, width, height);
+    unsigned char *rewrite_px = decode_rgb(&rewrite, width, height);
+    int ok = reference && pixel_px && transform_px && rewrite_px;
+    double pixel_db = 0, transform_db = 0, rewrite_db = 0;
+    if (ok) {
+        ImageBuffer expected = image_buffer_wrap(reference, width, height, 3, 0);
+        invert_rows(&expected, 0, height);
+        pixel_db = psnr(reference, pixel_px, width, height, 3);
+        transform_db = psnr(reference, transform_px, width, height, 3);
+        rewrite_db = psnr(reference, rewrite_px, width, height, 3);
+        ok = transform_db >= pixel_db && rewrite_db >= pixel_db;
+    }
+
+    printf("JPEG invert (q90 source, %zu bytes)\n", source.size);
+    report_encode("pixels", pixel_ms, width * height, &pixel, pixel_db);
+    report_encode("DCT coefficients", transform_ms, width * height, &transform, transform_db);
+    report_encode("scan rewrite", rewrite_ms, width * height, &rewrite, rewrite_db);
+    printf("  speedup %.2fx (coefficients %.2fx), %s\n\n", pixel_ms / rewrite_ms, pixel_ms / transform_ms,
+           ok ? "no generation loss" : "TRANSFORM LOSS");
+
+    stbi_image_free(reference);
+    stbi_image_free(pixel_px);
+    stbi_image_free(transform_px);
+    stbi_image_free(rewrite_px);
+    free(source.data);
+    free(pixel.data);
+    free(transform.data);
+    free(rewrite.data);
+    return ok;
+}
+
+// Preview decode of a q90 JPEG: stb_image at full size against the reduced
+// IDCT at 1/2, 1/4 and 1/8, each compared with the full decode averaged
+// down to the same size
+static int compare_scaled_decode(const unsigned char *src, int width, int height, int channels,
+                                 int iterations) {
+    ImageBuffer img = image_buffer_wrap((unsigned char *)src, width, height, channels, 0);
+    ByteSink source = {0};
+    EncodeOptions options = {0};
+    jpeg_encode(&img, &options, sink_write, &source);
+
+    double full_ms = -1.0;
+    unsigned char *full = NULL;
+    for (int i = 0; i < iterations; i++) {
+        stbi_image_free(full);
+        double start = now_ms();
+        int w, h, n;
+        full = stbi_load_from_memory(source.data, (int)source.size, &w, &h, &n, 3);
+        full_ms = best_of(full_ms, start);
+    }
+
+    int ok = full != NULL;
+    printf("JPEG preview decode (q90 source)\n");
+    printf("  %-22s %9.2f ms  %5dx%-5d\n", "stb_image full size", full_ms, width, height);
+    ImageBuffer reference = image_buffer_wrap(full, width, height, 3, 0);
+    for (int scale = 2; ok && scale <= 8; scale *= 2) {
+        double ms = -1.0;
+        ImageBuffer scaled = {0};
+        for (int i = 0; i < iterations; i++) {
+            image_buffer_free(&scaled);
+            double start = now_ms();
+            scaled = jpeg_decode_scaled(source.data, source.size, scale);
+            ms = best_of(ms, start);
+        }
+
+        int w = (width + scale - 1) / scale;
+        int h = (height + scale - 1) / scale;
+        ImageBuffer expected = image_buffer_downscale(&reference, w, h);
+        ok = scaled.data && expected.data && scaled.width == w && scaled.height == h;
+        double db = 0.0;
+        if (ok) {
+            double sum = 0.0;
+            for (int y = 0; y < h; y++) {
+                for (int x = 0; x < w * 3; x++) {
+                    double d = (double)scaled.data[y * scaled.stride + x] - expected.data[y * expected.stride + x];
+                    sum += d * d;
+                }
+            }
+            double mse = sum / ((double)w * h * 3.0);
+            db = mse > 0 ? 10.0 * log10(255.0 * 255.0 / mse) : 99.0;
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "reduced IDCT 1/%d", scale);
+        printf("  %-22s %9.2f ms  %5dx%-5d  %6.2f dB vs averaged  %5.1fx\n",
+               name, ms, w, h, db, full_ms / ms);
+        image_buffer_free(&scaled);
+        image_buffer_free(&expected);
+    }
+    printf("\n");
+
+    stbi_image_free(full);
+    free(source.data);
+    return ok;
+}
+
+// Streamed pipeline for compare_streaming: decoded bands are copied into
+// the encoder's window, and each full window is processed and coded
+typedef struct {
+    JpegStream *stream;
+    FusedJob job;
+    ImageBuffer window;
+    int window_first;
+    size_t held;               // Largest band plus window, in bytes
+} StreamBench;
+
+static void stream_rows(void *context, const JpegCoefficients *image, const ImageBuffer *rows, int y) {
+    StreamBench *b = context;
+    size_t held = rows->stride * rows->height + b->window.stride * b->window.height;
+    if (held > b->held) b->held = held;
+
+    for (int r = 0; r < rows->height; r++) {
+        memcpy(b->window.data + (size_t)(y + r - b->window_first) * b->window.stride,
+               rows->data + (size_t)r * rows->stride, (size_t)image->width * rows->channels);
+        if (y + r + 1 == b->window_first + b->window.height) {
+            b->job.image = b->window;
+            b->job.first_row = b->window_first;
+            fused_run(&b->job, 0);
+            jpeg_stream_flush(b->stream);
+            b->window = jpeg_stream_window(b->stream, &b->window_first);
+        }
+    }
+}
+
+// To-negative from a q90 JPEG to JPEG: decode the whole image, process and
+// encode it, against decoding, processing and encoding a window of restart
+// strips at a time. The files must be identical.
+static int compare_streaming(const unsigned char *src, int width, int height, int channels,
+                             int iterations) {
+    ImageBuffer img = image_buffer_wrap((unsigned char *)src, width, height, channels, 0);
+    ByteSink source = {0}, buffered = {0}, streamed = {0};
+    EncodeOptions options = {0};
+    jpeg_encode(&img, &options, sink_write, &source);
+
+    FusedJob negative = { FUSED_NEGATIVE, img, FILM_GRAIN_INTENSITY, NULL, GRAIN_SEED, 1, 0, height };
+    double buffered_ms = -1.0, streamed_ms = -1.0;
+    size_t held = 0;
+    for (int i = 0; i < iterations; i++) {
+        buffered.size = 0;
+        double start = now_ms();
+        int w, h, n;
+        unsigned char *decoded = stbi_load_from_memory(source.data, (int)source.size, &w, &h, &n, 3);
+        FusedJob job = negative;
+        job.image = image_buffer_wrap(decoded, w, h, 3, 0);
+        fused_run(&job, 0);
+        jpeg_encode(&job.image, &options, sink_write, &buffered);
+        buffered_ms = best_of(buffered_ms, start);
+        stbi_image_free(decoded);
+
+        streamed.size = 0;
+        start = now_ms();
+        StreamBench bench = { jpeg_stream_begin(width, height, 3, &options, sink_write, &streamed),
+                              negative, {0}, 0, 0 };
+        if (bench.stream) {
+            bench.window = jpeg_stream_window(bench.stream, &bench.window_first);
+            jpeg_decode_pixels(source.data, source.size, stream_rows, &bench, 0);
+            jpeg_stream_end(bench.stream);
+        }
+        streamed_ms = best_of(streamed_ms, start);
+        held = bench.held;
+    }
+
+    int ok = buffered.size > 0 && buffered.size == streamed.size &&
+        memcmp(buffered.data, streamed.data, buffered.size) == 0;
+    double image_mb = (double)width * height * 3 / (1 << 20);
+    printf("JPEG to-negative pipeline (q90 source)\n");
+    printf("  %-22s %9.2f ms  %8.1f MB of pixels held\n", "whole image", buffered_ms, image_mb);
+    printf("  %-22s %9.2f ms  %8.1f MB of pixels held\n", "row bands", streamed_ms, held / (double)(1 << 20));
+    printf("  %.0fx less pixel memory, output %s\n\n", image_mb * (1 << 20) / (held ? held : 1),
+           ok ? "identical" : "DIFFERS");
+
+    free(source.data);
+    free(buffered.data);
+    free(streamed.data);
+    return ok;
+}
+
+// The built-in JPEG decoder and encoder against the libjpeg-turbo backend,
+// on a q90 source and at q90; skipped when the backend is not compiled in
+static int compare_codecs(const unsigned char *src, int width, int height, int channels,
+                          int iterations) {
+    const ImageCodec *turbo = libjpeg_codec();
+    if (!turbo) return 1;
+
+    ImageBuffer img = image_buffer_wrap((unsigned char *)src, width, height, channels, 0);
+    ByteSink source = {0}, encoded = {0};
+    EncodeOptions options = {0};
+    jpeg_encode(&img, &options, sink_write, &source);
+
+    double stb_ms = -1.0, turbo_ms = -1.0;
+    unsigned char *reference = NULL;
+    ImageBuffer decoded = {0};
+    for (int i = 0; i < iterations; i++) {
+        stbi_image_free(reference);
+        double start = now_ms();
+        int w, h, n;
+        reference = stbi_load_from_memory(source.data, (int)source.size, &w, &h, &n, 3);
+        stb_ms = best_of(stb_ms, start);
+
+        image_buffer_free(&decoded);
+        start = now_ms();
+        decoded = turbo->decode(source.data, source.size, 0, NULL, 0);
+        turbo_ms = best_of(turbo_ms, start);
+    }
+
+    int ok = reference && decoded.data && decoded.width == width && decoded.height == height;
+    double db = 0.0;
+    if (ok) {
+        unsigned char *packed = malloc((size_t)width * height * 3);
+        ok = packed != NULL;
+        for (int y = 0; ok && y < height; y++) {
+            memcpy(packed + (size_t)y * width * 3, decoded.data + (size_t)y * decoded.stride,
+                   (size_t)width * 3);
+        }
+        if (ok) db = psnr(reference, packed, width, height, 3);
+        free(packed);
+    }
+    printf("JPEG codec backends (q90 source, %s)\n", turbo->name);
+    printf("  %-22s %9.2f ms  %8.1f MPix/s\n", "decode stb_image", stb_ms,
+           width * (double)height / (stb_ms * 1000.0));
+    printf("  %-22s %9.2f ms  %8.1f MPix/s  %6.2f dB vs stb\n", "decode libjpeg-turbo", turbo_ms,
+           width * (double)height / (turbo_ms * 1000.0), db);
+
+    double builtin_ms = time_encode(&img, film_kernels(), 0, &encoded, iterations);
+    unsigned char *pixels = decode_rgb(&encoded, width, height);
+    double builtin_db = pixels ? psnr(src, pixels, width, height, channels) : 0.0;
+    report_encode("encode built-in", builtin_ms, width * height, &encoded, builtin_db);
+    stbi_image_free(pixels);
+
+    double encode_ms = -1.0;
+    for (int i = 0; i < iterations; i++) {
+        encoded.size = 0;
+        double start = now_ms();
+        turbo->encode_jpeg(&img, &options, sink_write, &encoded);
+        encode_ms = best_of(encode_ms, start);
+    }
+    pixels = decode_rgb(&encoded, width, height);
+    double turbo_db = pixels ? psnr(src, pixels, width, height, channels) : 0.0;
+    report_encode("encode libjpeg-turbo", encode_ms, width * height, &encoded, turbo_db);
+    stbi_image_free(pixels);
+    ok &= pixels != NULL;
+    printf("  decode %.2fx, encode %.2fx vs built-in, PSNR delta %+.3f dB\n\n",
+           stb_ms / turbo_ms, builtin_ms / encode_ms, turbo_db - builtin_db);
+
+    stbi_image_free(reference);
+    image_buffer_free(&decoded);
+    free(source.data);
+    free(encoded.data);
+    return ok;
+}
+
+static long minor_faults(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+// Repeated full-size stb_image decodes of a q90 JPEG, each image freed
+// before the next, with the buffer pool off and on. Page faults are the
+// kernel zero-filling fresh pages for each new mapping; both runs are
+// measured after one warm-up decode, as a server's steady state.
+static int compare_pooled_decode(const unsigned char *src, int width, int height, int channels,
+                                 int iterations) {
+    ImageBuffer img = image_buffer_wrap((unsigned char *)src, width, height, channels, 0);
+    ByteSink source = {0};
+    EncodeOptions options = {0};
+    jpeg_encode(&img, &options, sink_write, &source);
+
+    static const char *names[2] = { "stb_image, no pool", "stb_image, pooled" };
+    double ms[2], faults[2];
+    unsigned long hits = 0, allocations = 0;
+    int ok = 1;
+    for (int pooled = 0; pooled < 2; pooled++) {
+        buffer_pool_init(pooled ? (size_t)width * height * 8 : 0);
+        int w, h, n;
+        stbi_image_free(stbi_load_from_memory(source.data, (int)source.size, &w, &h, &n, 3));
+
+        BufferPoolStats before = buffer_pool_stats();
+        long start_faults = minor_faults();
+        ms[pooled] = -1.0;
+        for (int i = 0; i < iterations; i++) {
+            double start = now_ms();
+            unsigned char *decoded = stbi_load_from_memory(source.data, (int)source.size, &w, &h, &n, 3);
+            ms[pooled] = best_of(ms[pooled], start);
+            ok &= decoded != NULL;
+            stbi_image_free(decoded);
+        }
+        faults[pooled] = (double)(minor_faults() - start_faults) / iterations;
+        BufferPoolStats after = buffer_pool_stats();
+        hits = after.hits - before.hits;
+        allocations = hits + after.misses - before.misses;
+    }
+    buffer_pool_init(0);
+
+    printf("JPEG decode buffers (q90 source, image freed after each decode)\n");
+    printf("  %-22s %9.2f ms  %9.0f page faults per decode\n", names[0], ms[0], faults[0]);
+    printf("  %-22s %9.2f ms  %9.0f page faults per decode  %lu/%lu pool hits\n", names[1], ms[1],
+           faults[1], hits, allocations);
+    printf("  speedup %.2fx\n\n", ms[0] / ms[1]);
+
+    free(source.data);
+    return ok;
+}
+
+// Full-size decode of a q90 JPEG with the encoder's restart strips:
+// stb_image against the parallel decoder on the whole pool, which must give
+// the same pixels. Skipped with no pool workers (FILM_THREADS).
+static int compare_parallel_decode(const unsigned char *src, int width, int height, int channels,
+                                   int iterations) {
+    ImageBuffer img = image_buffer_wrap((unsigned char *)src, width, height, channels, 0);
+    ByteSink source = {0};
+    EncodeOptions options = {0};
+    jpeg_encode(&img, &options, sink_write, &source);
+
+    int tasks = jpeg_parallel_tasks(source.data, source.size, 0);
+    if (tasks < 2) {
+        printf("JPEG parallel decode skipped: no restart markers or no pool workers\n\n");
+        free(source.data);
+        return 1;
+    }
+
+    double stb_ms = -1.0, parallel_ms = -1.0;
+    unsigned char *reference = NULL;
+    ImageBuffer decoded = {0};
+    for (int i = 0; i < iterations; i++) {
+        stbi_image_free(reference);
+        double start = now_ms();
+        int w, h, n;
+        reference = stbi_load_from_memory(source.data, (int)source.size, &w, &h, &n, 3);
+        stb_ms = best_of(stb_ms, start);
+
+        image_buffer_free(&decoded);
+        start = now_ms();
+        decoded = jpeg_decode_parallel(source.data, source.size, NULL, 0);
+        parallel_ms = best_of(parallel_ms, start);
+    }
+
+    int ok = reference && decoded.data;
+    for (int y = 0; ok && y < height; y++) {
+        ok = memcmp(decoded.data + (size_t)y * decoded.stride, reference + (size_t)y * width * 3,
+                    (size_t)width * 3) == 0;
+    }
+    printf("JPEG parallel decode (q90 source with restart markers)\n");
+    printf("  %-22s %9.2f ms  %8.1f MPix/s\n", "stb_image", stb_ms, width * (double)height / (stb_ms * 1000.0));
+    printf("  %-22s %9.2f ms  %8.1f MPix/s  %d threads\n", "restart intervals", parallel_ms,
+           width * (double)height / (parallel_ms * 1000.0), tasks);
+    printf("  speedup %.2fx, output %s\n\n", stb_ms / parallel_ms, ok ? "identical" : "DIFFERS");
+
+    stbi_image_free(reference);
+    image_buffer_free(&decoded);
+    free(source.data);
+    return ok;
+}
+
+// Lossless outputs: stb's PNG writer against QOI, which must round-trip
+static int compare_lossless(const unsigned char *src, int width, int height, int channels,
+                            int iterations) {
+    ImageBuffer img = image_buffer_wrap((unsigned char *)src, width, height, channels, 0);
+    ByteSink png = {0}, qoi = {0};
+    ImageBuffer decoded = {0};
+    double png_ms = -1.0, qoi_ms = -1.0, decode_ms = -1.0;
+
+    for (int i = 0; i < iterations; i++) {
+        png.size = 0;
+        double start = now_ms();
+        stbi_write_png_to_func(stb_sink_write, &png, width, height, channels, src, width * channels);
+        png_ms = best_of(png_ms, start);
+
+        qoi.size = 0;
+        start = now_ms();
+        qoi_encode(&img, sink_write, &qoi);
+        qoi_ms = best_of(qoi_ms, start);
+
+        image_buffer_free(&decoded);
+        start = now_ms();
+        decoded = qoi_decode(qoi.data, qoi.size);
+        decode_ms = best_of(decode_ms, start);
+    }
+
+    int ok = decoded.data && decoded.channels == channels;
+    for (int y = 0; ok && y < height; y++) {
+        size_t row_bytes = (size_t)width * channels;
+        ok = memcmp(decoded.data + y * decoded.stride, src + y * row_bytes, row_bytes) == 0;
+    }
+
+    int pixels = width * height;
+    printf("lossless encode (%d channels)\n", channels);
+    printf("  %-22s %9.2f ms  %8.1f MPix/s  %9zu bytes\n", "stb PNG", png_ms, pixels / (png_ms * 1000.0), png.size);
+    printf("  %-22s %9.2f ms  %8.1f MPix/s  %9zu bytes\n", "QOI", qoi_ms, pixels / (qoi_ms * 1000.0), qoi.size);
+    printf("  %-22s %9.2f ms  %8.1f MPix/s\n", "QOI decode", decode_ms, pixels / (decode_ms * 1000.0));
+    printf("  QOI speedup %.1fx over PNG, round trip %s\n\n", png_ms / qoi_ms, ok ? "ok" : "MISMATCH");
+
+    image_buffer_free(&decoded);
+    free(png.data);
+    free(qoi.data);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    int width = DEFAULT_WIDTH;
+    int height = DEFAULT_HEIGHT;
+    int iterations = DEFAULT_ITERATIONS;
+
+    if (argc >= 3) {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+    }
+    if (argc >= 4) {
+        iterations = atoi(argv[3]);
+    }
+    if (width <= 0 || height <= 0 || iterations <= 0) {
+        fprintf(stderr, "Usage: %s [width height [iterations]]\n", argv[0]);
+        return 1;
+    }
+
+    printf("=== Film Processor Benchmark ===\n");
+    char *threads_env = getenv("FILM_THREADS");
+    int workers = thread_pool_init(threads_env ? atoi(threads_env) : 0);
+    printf("Image: %dx%d (%.1f MP), best of %d runs, %s kernels, %d pool workers\n\n",
+           width, height, width * (double)height / 1e6, iterations, film_kernels()->name, workers);
+
+    int ok = 1;
+    double border = 2.0 * (height / 15) / height;
+    size_t cache_bytes = grain_cache_build(512, 4, 16u << 20);
+
+    for (int channels = 3; channels <= 4; channels++) {
+        size_t size = (size_t)width * height * channels;
+        unsigned char *src = malloc(size);
+        if (!src) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        fill_test_image(src, width, height, channels);
+
+        // to-negative: negate + cast + grain full passes, sprocket border rows
+        ok &= compare_case("to-negative", "staged", staged_to_negative, 3.0 + border,
+                           "fused", fused_negative, 1.0, src, width, height, channels, iterations);
+        // to-positive: crop border rows, then cast removal + negate full passes
+        ok &= compare_case("to-positive", "staged", staged_to_positive, 2.0 + border,
+                           "fused", fused_positive, 1.0, src, width, height, channels, iterations);
+        // Row bands on the pool against the single-threaded fused pass
+        ok &= compare_case("to-negative bands", "single thread", fused_negative, 1.0,
+                           "row bands", parallel_negative, 1.0, src, width, height, channels, iterations);
+        ok &= compare_case("to-positive bands", "single thread", fused_positive, 1.0,
+                           "row bands", parallel_positive, 1.0, src, width, height, channels, iterations);
+        if (cache_bytes > 0) {
+            compare_grain(src, width, height, channels, iterations);
+        }
+        ok &= compare_encode(src, width, height, channels, iterations);
+        ok &= compare_huffman(src, width, height, channels, iterations);
+        ok &= compare_target_size(src, width, height, channels, iterations);
+        if (channels == 3) {
+            ok &= compare_invert(src, width, height, channels, iterations);
+            ok &= compare_scaled_decode(src, width, height, channels, iterations);
+            ok &= compare_streaming(src, width, height, channels, iterations);
+            ok &= compare_codecs(src, width, height, channels, iterations);
+            ok &= compare_pooled_decode(src, width, height, channels, iterations);
+            ok &= compare_parallel_decode(src, width, height, channels, iterations);
+        }
+        ok &= compare_lossless(src, width, height, channels, iterations);
+        free(src);
+    }
+
+    compare_layouts(width, height, iterations);
+
+    grain_cache_free();
+    border_cache_free();
+    thread_pool_shutdown();
+    return ok ? 0 : 1;
+}
@@ -11,23 +11,316 @@
 // Processing modes
 typedef enum {
     MODE_TO_NEGATIVE,
-    MODE_TO_POSITIVE
+    MODE_TO_POSITIVE,
+    MODE_INVERT            // Plain color inversion: no cast, grain or border
 } ProcessMode;
 
-// Result structure
+// Grain source for to-negative
+typedef enum {
+    GRAIN_AUTO,            // Cached texture when available, else per-pixel hash
+    GRAIN_HASH,            // Per-pixel counter-based generator
+    GRAIN_TEXTURE          // Cached tileable texture (falls back to hash if absent)
+} GrainMode;
+
+// Optional processing parameters (zero-initialize for defaults)
 typedef struct {
-    unsigned char *data;
+    int use_seed;          // Use `seed` for grain instead of a fresh one
+    unsigned int seed;     // Grain seed; the same seed reproduces the same output
+    GrainMode grain_mode;
+    int max_threads;       // Row-band parallelism cap for this call (0 = whole pool, 1 = serial)
+    int crop_border;       // To-positive: drop the sprocket border rows instead of whitening them
+    int max_dimension;     // Shrink so neither side exceeds this many pixels (0 = full size)
+    int budget_held;       // The caller already holds this input's pixel budget
+                           // (acquire_pixel_budget), so the call does not admit it again
+} ProcessOptions;
+
+// Pixel budget settings (zero fields mean no limit). Inputs are admitted
+// by the size their header declares, before any pixels are decoded.
+typedef struct {
+    double max_megapixels;       // Largest image one call accepts
+    double inflight_megapixels;  // Pixels of all images being processed at once
+    int wait_ms;                 // How long a call queues for in-flight room before giving up
+} PixelBudgetConfig;
+
+// Outcome of admitting an image to the pixel budget
+typedef enum {
+    BUDGET_OK,
+    BUDGET_TOO_LARGE,      // Over max_megapixels
+    BUDGET_BUSY            // No in-flight room within wait_ms
+} BudgetStatus;
+
+// Grain texture cache settings (zero fields take the defaults)
+typedef struct {
+    int tile_size;         // Tile edge in pixels (default 512)
+    int variants;          // Distinct tiles per channel layout (default 4)
+    size_t max_bytes;      // Memory budget for all tiles (default 16 MB)
+} GrainCacheConfig;
+
+// Buffers allocated by the library start on a 64-byte boundary and have
+// at least IMAGE_BUFFER_PADDING readable bytes past the last pixel, so
+// vector loads may run over a row's tail
+#define IMAGE_BUFFER_ALIGN 64
+#define IMAGE_BUFFER_PADDING 64
+
+// Image buffer: `height` rows of `width` pixels, `stride` bytes apart.
+// A view (crop, tile, border) shares another buffer's pixels and has
+// owns == 0.
+typedef struct {
+    unsigned char *data;   // First pixel of the first row
     int width;
     int height;
     int channels;
+    size_t stride;         // Bytes from one row start to the next (>= width * channels)
+    unsigned char *base;   // Allocation to free (when owns)
+    int owns;              // This buffer frees `base`
+} ImageBuffer;
+
+// Allocate an uninitialized buffer with a 64-byte-aligned stride
+// (data == NULL on failure). Library buffers come from a size-classed
+// pool, so freeing one keeps its memory for the next image of its size
+// class (see init_buffer_pool).
+ImageBuffer image_buffer_alloc(int width, int height, int channels);
+
+// Non-owning buffer over caller memory (stride 0 = tightly packed)
+ImageBuffer image_buffer_wrap(unsigned char *data, int width, int height, int channels, size_t stride);
+
+// Non-owning view of a rectangle of `src` (clamped to its bounds)
+ImageBuffer image_buffer_view(const ImageBuffer *src, int x, int y, int width, int height);
+
+// Free an owning buffer; views are just cleared
+void image_buffer_free(ImageBuffer *buffer);
+
+// New buffer of `src` shrunk to width x height (no larger than `src`) by
+// area averaging: each output pixel is the mean of the source area it
+// covers (data == NULL on bad sizes or out of memory)
+ImageBuffer image_buffer_downscale(const ImageBuffer *src, int width, int height);
+
+// Result structure
+typedef struct {
+    ImageBuffer image;     // Output pixels (may be a crop of a larger allocation)
+    unsigned int seed;     // Grain seed used (to-negative only)
+    int decode_scale;      // The input was decoded at 1/decode_scale of its size (1, 2, 4 or 8)
+    BudgetStatus budget;   // Why the input was refused before decoding, if it was
     int success;
     char error_message[256];
 } ImageResult;
 
-// Main processing function
+// Output sink for encoders: receives consecutive pieces of the file
+typedef void (*WriteFn)(void *context, const void *data, size_t size);
+
+// Output file formats
+typedef enum {
+    IMAGE_FORMAT_JPEG,     // Baseline JPEG (default)
+    IMAGE_FORMAT_PNG,
+    IMAGE_FORMAT_BMP,
+    IMAGE_FORMAT_QOI       // Lossless, much faster than PNG (qoiformat.org)
+} ImageFormat;
+
+// JPEG chroma subsampling
+typedef enum {
+    SUBSAMPLING_AUTO,      // 4:2:0 at quality 90 and below, else 4:4:4 (as stb)
+    SUBSAMPLING_420,       // Chroma at half resolution both ways: smaller files
+    SUBSAMPLING_444        // Full-resolution chroma: sharper color edges
+} Subsampling;
+
+// What an encode produced (optional, see EncodeOptions.stats)
+typedef struct {
+    int quality;           // JPEG quality used (lowered to meet max_bytes)
+    int passes;            // Coding passes over the image: 1 (2 with optimized tables)
+                           // unless max_bytes lowers the quality, which adds size
+                           // probes, the check and the final pass
+    int over_budget;       // max_bytes is out of reach even at quality 1
+} EncodeStats;
+
+// Encoder settings (zero fields take the defaults)
+typedef struct {
+    ImageFormat format;
+    int quality;           // JPEG quality 1-100 (default 90)
+    Subsampling subsampling;
+    int max_threads;       // Restart strips coded at once (0 = whole pool, 1 = serial)
+    size_t max_bytes;      // JPEG byte budget: the highest quality up to `quality`
+                           // whose file fits is used (0 = no limit)
+    int optimize_huffman;  // JPEG Huffman tables fitted to the image: smaller
+                           // files for one extra symbol-counting pass
+    EncodeStats *stats;    // Filled in when not NULL
+} EncodeOptions;
+
+// Image codec backend: how uploads are decoded and JPEGs encoded. The
+// default "stb" backend decodes with stb_image (and the built-in reduced
+// IDCT for previews) and encodes with the built-in strip encoder; a
+// "libjpeg-turbo" backend is compiled in when the Makefile finds the
+// library. Inputs a backend does not probe as its own fall back to the
+// default, and PNG, BMP and QOI output is the same under every backend.
+typedef struct {
+    const char *name;
+    // Size and channels (1-4) decode would give, reading only the headers.
+    // 0 if this backend cannot decode the input; the default backend then
+    // takes it.
+    int (*probe)(const unsigned char *data, size_t size, int *width, int *height, int *channels);
+    // Full-size decode (data == NULL on failure, with a message in `error`)
+    // on up to max_threads threads (0 = the whole pool; backends may use one)
+    ImageBuffer (*decode)(const unsigned char *data, size_t size, int max_threads,
+                          char *error, size_t error_size);
+    // Full-size decode into `dest`, a caller buffer of the probed size and
+    // channels. 0 if this input needs `decode` instead (dest may have been
+    // written). May be NULL.
+    int (*decode_into)(const unsigned char *data, size_t size, const ImageBuffer *dest, int max_threads);
+    // Decode at 1/scale (2, 4 or 8; sides rounded up), or data == NULL when
+    // the input needs a full-size decode instead. May be NULL.
+    ImageBuffer (*decode_scaled)(const unsigned char *data, size_t size, int scale);
+    // Baseline JPEG through `write`, with encode_jpeg's options. Returns 1
+    // on success.
+    int (*encode_jpeg)(const ImageBuffer *image, const EncodeOptions *options,
+                       WriteFn write, void *context);
+} ImageCodec;
+
+// Growable in-memory output (use output_buffer_write as the WriteFn and
+// the buffer as its context; zero-initialize before use)
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    int failed;            // Set if an allocation failed; data is then incomplete
+} OutputBuffer;
+
+// Main processing function; input may be JPEG, PNG, BMP, TGA, GIF, PSD,
+// HDR, PIC, PNM (via stb_image) or QOI
 ImageResult process_image(const unsigned char *input_data, size_t input_size, ProcessMode mode);
 
+// Processing with options (NULL for defaults). The input's header is
+// probed and admitted to the pixel budget before it is decoded, unless
+// options->budget_held.
+ImageResult process_image_ex(const unsigned char *input_data, size_t input_size, ProcessMode mode,
+                             const ProcessOptions *options);
+
 // Free image result
 void free_image_result(ImageResult *result);
 
+// Process a JPEG and write the result as JPEG through `write` without
+// ever holding the whole image: rows are decoded, processed and encoded
+// one band of restart strips at a time, so memory stays at a few MCU rows
+// of the input plus a wave of encoder strips of at most 4 MB
+// (JPEG_STREAM_MAX_BYTES), whatever the pool size. The output is
+// byte-identical to process_image_ex followed by encode_image with the
+// same seed. Returns 1 on success, 0 if the request needs the buffered
+// path instead (not a sequential JPEG, fewer than 3 channels,
+// max_dimension, max_bytes, optimize_huffman, a non-JPEG format or a
+// codec backend other than stb; nothing has been written), -1 if it failed
+// after output started. JPEGs with restart markers are decoded a window
+// of intervals at a time on the pool (JPEG_PARALLEL_WINDOW_BYTES, 8 MB).
+// Pass a seed from new_grain_seed in `options` to know it before the
+// first write.
+int process_image_stream(const unsigned char *input_data, size_t input_size, ProcessMode mode,
+                         const ProcessOptions *options, const EncodeOptions *encode,
+                         WriteFn write, void *context);
+
+// Width, height and channels the input decodes to, read from its header
+// alone. Returns 0 if no codec backend recognizes it.
+int probe_image(const unsigned char *input_data, size_t input_size,
+                int *width, int *height, int *channels);
+
+// Decode the input into `dest`, a buffer of the size and channels
+// probe_image reports (image_buffer_alloc draws one from the buffer pool).
+// QOI, JPEG under libjpeg-turbo and JPEGs with restart markers (on the
+// whole thread pool) are decoded straight into it; other inputs are
+// decoded by the backend and copied in. Returns 1 on success, 0 with a
+// message in `error`.
+int decode_image_into(const unsigned char *input_data, size_t input_size, const ImageBuffer *dest,
+                      char *error, size_t error_size);
+
+// A fresh grain seed, as process_image_ex picks when none is given
+unsigned int new_grain_seed(void);
+
+// Invert a JPEG without decoding it to pixels: the quantized DCT
+// coefficients are negated (luma DC shifted by the nearest quantizer step
+// to -8), so there is no requantization loss. Works on sequential Huffman
+// JPEGs with 1 or 3 components; the output keeps the input's quantizers
+// and subsampling. By default the scans are rewritten in one pass with the
+// source's own Huffman codes and restart intervals (jpeg_invert_entropy).
+// With `optimize_huffman` set, or when the source's DC table lacks a
+// needed code, the coefficients are decoded and entropy-coded again, and
+// the Huffman tables, restart strips and thread cap of `options` apply.
+// Returns 1 on success, 0 if the input needs the pixel pipeline instead
+// (nothing has been written; use process_image_ex with MODE_INVERT), -1
+// if encoding failed.
+int invert_jpeg(const unsigned char *input_data, size_t input_size, const EncodeOptions *options,
+                WriteFn write, void *context);
+
+// Encode an image as baseline JPEG through `write` (NULL options for
+// defaults). Large images are coded as restart-marker strips in parallel;
+// the output is the same for any thread count. Returns 1 on success.
+int encode_jpeg(const ImageBuffer *image, const EncodeOptions *options,
+                WriteFn write, void *context);
+
+// Encode an image in `options->format` through `write` (NULL options for
+// JPEG defaults). PNG and BMP are produced in memory and written at
+// once; JPEG and QOI are written as they are coded. Returns 1 on success.
+int encode_image(const ImageBuffer *image, const EncodeOptions *options,
+                 WriteFn write, void *context);
+
+// Chroma subsampling a JPEG encode with these options uses (never AUTO)
+Subsampling encode_subsampling(const EncodeOptions *options);
+
+// MIME type of a format ("image/jpeg", ...)
+const char *image_format_mime_type(ImageFormat format);
+
+// WriteFn appending to an OutputBuffer
+void output_buffer_write(void *context, const void *data, size_t size);
+
+// Release an OutputBuffer's memory
+void output_buffer_free(OutputBuffer *buffer);
+
+// Precompute the grain texture cache; call once at startup, before
+// processing. Returns the bytes allocated (0 if the budget fits no tile).
+size_t init_grain_cache(const GrainCacheConfig *config);
+
+// Keep up to `max_bytes` of freed image buffers for reuse, by size class,
+// so steady-state requests decode into memory that is already mapped and
+// faulted in. 0 (the default) returns buffers to the system when freed.
+void init_buffer_pool(size_t max_bytes);
+
+// Buffer pool counters (get_buffer_pool_stats)
+typedef struct {
+    size_t cached_bytes;       // Freed buffers held for reuse
+    size_t max_bytes;          // Cap on cached_bytes
+    unsigned long hits;        // Allocations served from the pool
+    unsigned long misses;      // Poolable allocations that needed fresh memory
+} BufferPoolStats;
+
+BufferPoolStats get_buffer_pool_stats(void);
+
+// Start the shared processing thread pool with `threads` workers
+// (0 = one per online CPU, less the calling thread). Optional: the pool
+// starts with the default size on first use. Returns the worker count.
+int init_thread_pool(int threads);
+
+// Set the limits process_image_ex admits inputs against; call once at
+// startup, before processing. There are no limits until it is called.
+void init_pixel_budget(const PixelBudgetConfig *config);
+
+// Admit a width x height image: BUDGET_TOO_LARGE at once if it is over
+// max_megapixels, otherwise wait up to wait_ms for in-flight room. An
+// image larger than the whole in-flight budget is admitted when nothing
+// else is in flight. Callers of process_image_stream and invert_jpeg
+// admit their inputs this way; give back what was admitted with
+// release_pixel_budget.
+BudgetStatus acquire_pixel_budget(int width, int height);
+
+// Return an admitted image's pixels to the in-flight budget
+void release_pixel_budget(int width, int height);
+
+// Codec backend compiled in under `name` ("stb", "libjpeg-turbo"), or NULL
+const ImageCodec *find_image_codec(const char *name);
+
+// Backend used by process_image_ex, encode_jpeg and encode_image from now
+// on (NULL for the default). Set it at startup, before processing.
+void set_image_codec(const ImageCodec *codec);
+
+// Backend in use
+const ImageCodec *get_image_codec(void);
+
+// Name of the pixel kernel variant selected for this CPU
+// ("scalar", "sse2", "avx2" or "avx512"; FILM_KERNEL env var overrides)
+const char *get_kernel_name(void);
+
 #endif // FILM_PROCESSOR_H
@@ -2,8 +2,100 @@
 
 # Film Processor API Test Script
 
-API_URL="http://localhost:8080"
+API_URL="${API_URL:-http://localhost:8080}"
 TEST_IMAGE="$1"
+PASSED=0
+FAILED=0
+
+# Record one check: description, expected value, actual value
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "   ok: $1"
+        PASSED=$((PASSED + 1))
+    else
+        echo "   FAIL: $1 (expected '$2', got '$3')"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+# POST the test image to a path; prints the HTTP status, keeps the
+# response headers in test_headers.txt and the body in the output file
+post() {
+    local path="$1" output="$2"
+    shift 2
+    curl -s -X POST "$API_URL$path" -F "image=@$TEST_IMAGE" \
+      -D test_headers.txt -o "$output" -w "%{http_code}" "$@"
+}
+
+# Value of a header from the last post
+header() {
+    grep -i "^$1:" test_headers.txt | head -1 | cut -d' ' -f2- | tr -d '\r'
+}
+
+size_of() {
+    wc -c < "$1" | tr -d ' '
+}
+
+# Write a minimal 64x48 three-component baseline JPEG with one defect to
+# the output file. The tables hold one code each, DC difference category 1
+# and end of block, so all-zero data decodes as flat blocks stepping down
+# by one DC quantizer (64) each.
+#   dht: an extra AC table listing 16 codes of length 1, where two fit
+#   sampling: horizontal factors 3, 2 and 1, where 2 does not divide 3
+#   dri_length: a DRI segment one byte short of its restart interval
+#   restart: none; a restart interval of one MCU, RST0-RST7 in turn, and
+#            a luma step up instead of down in every third interval
+#   rst_order: as restart, with each pair of RST markers swapped
+corrupt_jpeg() {
+    python3 - "$1" "$2" <<'PY'
+import struct, sys
+defect, path = sys.argv[1], sys.argv[2]
+
+def segment(marker, body):
+    return struct.pack(">BBH", 0xFF, marker, len(body) + 2) + body
+
+def table(table_class, counts, values, number=0):
+    return bytes([table_class << 4 | number]) + bytes(counts + [0] * (16 - len(counts))) + bytes(values)
+
+sampling = [0x11, 0x11, 0x11]
+tables = table(0, [1], [1]) + table(1, [1], [0])
+if defect == "dht":
+    tables += table(1, [16], [0] * 16, 3)
+elif defect == "sampling":
+    sampling = [0x31, 0x21, 0x11]
+
+scan = b"\x00" * 64
+markers = None
+if defect == "restart":
+    markers = list(range(47))
+elif defect == "rst_order":
+    markers = [i ^ 1 for i in range(47)]
+if markers is not None:
+    # Bits 0 s 0, 000, 000 (code, sign, end of block per component), 1-padded
+    interval = [bytes([(i % 3 == 0) << 6, 0x7F]) for i in range(48)]
+    scan = b"".join(interval[i] + bytes([0xFF, 0xD0 + m % 8]) for i, m in enumerate(markers))
+    scan += interval[47]
+
+jpeg = b"\xff\xd8" + segment(0xDB, b"\x00\x40" + b"\x01" * 63)
+jpeg += segment(0xC4, tables)
+if defect == "dri_length":
+    jpeg += segment(0xDD, b"\x00")
+elif markers is not None:
+    jpeg += segment(0xDD, struct.pack(">H", 1))
+jpeg += segment(0xC0, struct.pack(">BHHB", 8, 48, 64, 3) +
+                b"".join(bytes([i + 1, sampling[i], 0]) for i in range(3)))
+jpeg += segment(0xDA, b"\x03\x01\x00\x02\x00\x03\x00\x00\x3f\x00")
+jpeg += scan + b"\xff\xd9"
+open(path, "wb").write(jpeg)
+PY
+}
+
+# POST a corrupt JPEG to a route; prints "refused" for a 4xx or 5xx answer
+post_corrupt() {
+    local status
+    status=$(curl -s -X POST "$API_URL$1" -F "image=@$2" -o /dev/null -w "%{http_code}")
+    [ "$status" -ge 400 ] 2>/dev/null && echo refused || echo "$status"
+}
 
 if [ -z "$TEST_IMAGE" ]; then
     echo "Usage: $0 <test_image.jpg>"
@@ -46,9 +138,157 @@ curl -X POST "$API_URL/api/to-positive" \
 echo "Output saved to: test_restored.jpg"
 echo ""
 
+# Test 5: Reproducible grain
+echo "5. Testing the grain seed..."
+check "seed=42 status" 200 "$(post "/api/to-negative?seed=42" test_seed_a.jpg)"
+check "X-Grain-Seed echoes the seed" 42 "$(header X-Grain-Seed)"
+post "/api/to-negative?seed=42" test_seed_b.jpg > /dev/null
+check "same seed, same output" same "$(cmp -s test_seed_a.jpg test_seed_b.jpg && echo same || echo differs)"
+check "invalid seed" 400 "$(post "/api/to-negative?seed=abc" /dev/null)"
+echo ""
+
+# Test 6: Grain source
+echo "6. Testing the grain source..."
+check "grain=texture" 200 "$(post "/api/to-negative?grain=texture&seed=7" /dev/null)"
+check "grain=hash" 200 "$(post "/api/to-negative?grain=hash&seed=7" /dev/null)"
+check "invalid grain" 400 "$(post "/api/to-negative?grain=film" /dev/null)"
+echo ""
+
+# Test 7: Border crop
+echo "7. Testing the border crop..."
+check "border=keep" 200 "$(post "/api/to-positive?border=keep" test_border_keep.jpg)"
+check "border=crop" 200 "$(post "/api/to-positive?border=crop" test_border_crop.jpg)"
+check "cropped output is smaller" yes \
+  "$([ "$(size_of test_border_crop.jpg)" -lt "$(size_of test_border_keep.jpg)" ] && echo yes || echo no)"
+check "invalid border" 400 "$(post "/api/to-positive?border=trim" /dev/null)"
+echo ""
+
+# Test 8: Output formats
+echo "8. Testing output formats..."
+check "format=png status" 200 "$(post "/api/to-positive?format=png" test_output.png)"
+check "format=png type" image/png "$(header Content-Type)"
+check "format=qoi status" 200 "$(post "/api/to-positive?format=qoi" test_output.qoi)"
+check "format=qoi type" image/qoi "$(header Content-Type)"
+check "Accept: image/bmp" image/bmp \
+  "$(post "/api/to-positive" /dev/null -H "Accept: image/bmp" > /dev/null; header Content-Type)"
+check "Accept with no image type" 406 "$(post "/api/to-positive" /dev/null -H "Accept: text/html")"
+check "invalid format" 400 "$(post "/api/to-positive?format=gif" /dev/null)"
+echo ""
+
+# Test 9: JPEG quality, subsampling and metrics
+echo "9. Testing quality, subsampling and metrics..."
+check "quality=60" 200 "$(post "/api/to-positive?quality=60" test_q60.jpg)"
+check "quality=100&subsampling=444" 200 "$(post "/api/to-positive?quality=100&subsampling=444" test_q100.jpg)"
+check "lower quality is smaller" yes \
+  "$([ "$(size_of test_q60.jpg)" -lt "$(size_of test_q100.jpg)" ] && echo yes || echo no)"
+check "invalid quality" 400 "$(post "/api/to-positive?quality=0" /dev/null)"
+check "invalid subsampling" 400 "$(post "/api/to-positive?subsampling=422" /dev/null)"
+check "URL-encoded subsampling=4%3A2%3A0" 200 "$(post "/api/to-positive?subsampling=4%3A2%3A0" /dev/null)"
+post "/api/to-positive?quality=60&subsampling=4%3a4%3A4" test_q60_444_escaped.jpg > /dev/null
+post "/api/to-positive?quality=60&subsampling=444" test_q60_444.jpg > /dev/null
+check "escaped value decoded" same \
+  "$(cmp -s test_q60_444_escaped.jpg test_q60_444.jpg && echo same || echo differs)"
+check "truncated escape kept literal" 400 "$(post "/api/to-positive?subsampling=4%3" /dev/null)"
+check "metrics status" 200 "$(curl -s "$API_URL/metrics" -o test_metrics.json -w "%{http_code}")"
+check "metrics list outputs" yes "$(grep -q '"outputs"' test_metrics.json && echo yes || echo no)"
+echo ""
+
+# Test 10: Target file size
+echo "10. Testing max_bytes..."
+BUDGET=$(( $(size_of test_q100.jpg) / 2 ))
+check "max_bytes=$BUDGET" 200 "$(post "/api/to-positive?max_bytes=$BUDGET" test_max_bytes.jpg)"
+check "output fits max_bytes" yes \
+  "$([ "$(size_of test_max_bytes.jpg)" -le "$BUDGET" ] && echo yes || echo no)"
+check "max_bytes too small" 422 "$(post "/api/to-positive?max_bytes=100" /dev/null)"
+check "max_bytes with a lossless format" 400 "$(post "/api/to-positive?max_bytes=$BUDGET&format=png" /dev/null)"
+echo ""
+
+# Test 11: Optimized Huffman tables
+echo "11. Testing huffman..."
+check "huffman=standard" 200 "$(post "/api/to-positive?huffman=standard" test_huff_std.jpg)"
+check "huffman=optimized" 200 "$(post "/api/to-positive?huffman=optimized" test_huff_opt.jpg)"
+check "optimized tables are smaller" yes \
+  "$([ "$(size_of test_huff_opt.jpg)" -lt "$(size_of test_huff_std.jpg)" ] && echo yes || echo no)"
+check "invalid huffman" 400 "$(post "/api/to-positive?huffman=best" /dev/null)"
+echo ""
+
+# Test 12: Invert (the test image should be a sequential JPEG)
+echo "12. Testing invert..."
+check "invert status" 200 "$(post "/api/invert" test_inverted.jpg)"
+check "JPEG inverted in the DCT domain" transform "$(header X-Invert-Path)"
+check "X-Invert-Path readable cross-origin" "X-Grain-Seed, X-Invert-Path" \
+  "$(header Access-Control-Expose-Headers)"
+check "invert with a quality" 200 "$(post "/api/invert?quality=80" /dev/null)"
+check "quality takes the pixel path" pixel "$(header X-Invert-Path)"
+check "invert with format=png" 200 "$(post "/api/invert?format=png" /dev/null)"
+check "PNG output takes the pixel path" pixel "$(header X-Invert-Path)"
+echo ""
+
+# Test 13: Downscaled previews
+echo "13. Testing max_dimension..."
+check "max_dimension=64" 200 "$(post "/api/to-negative?max_dimension=64" test_preview.jpg)"
+check "preview is smaller" yes \
+  "$([ "$(size_of test_preview.jpg)" -lt "$(size_of test_negative.jpg)" ] && echo yes || echo no)"
+check "invalid max_dimension" 400 "$(post "/api/to-negative?max_dimension=0" /dev/null)"
+echo ""
+
+# Test 14: Pixel budget. The upload's header claims 20000x20000 pixels,
+# over the default FILM_MAX_MEGAPIXELS, so it is refused before decoding.
+echo "14. Testing the pixel budget..."
+printf '\377\330\377\300\000\021\010\116\040\116\040\003\001\042\000\002\021\001\003\021\001\377\331' \
+  > test_huge_header.jpg
+check "image over the megapixel limit" 413 \
+  "$(curl -s -X POST "$API_URL/api/to-negative" -F "image=@test_huge_header.jpg" -o /dev/null -w "%{http_code}")"
+# With BUSY_CHECK=1 and a server started with FILM_INFLIGHT_MEGAPIXELS=0.1
+# and FILM_BUDGET_WAIT_MS=1, concurrent uploads must be turned away
+if [ "$BUSY_CHECK" = "1" ]; then
+    for i in 1 2 3 4; do
+        post "/api/to-positive?quality=100&huffman=optimized" /dev/null > "test_busy_$i.txt" &
+    done
+    wait
+    check "concurrent uploads over the in-flight budget" yes \
+      "$(cat test_busy_*.txt | grep -q 503 && echo yes || echo no)"
+fi
+echo ""
+
+# Test 15: Corrupt Huffman tables
+echo "15. Testing a corrupt DHT segment..."
+corrupt_jpeg dht test_corrupt_dht.jpg
+check "invert refuses an over-subscribed Huffman table" refused "$(post_corrupt /api/invert test_corrupt_dht.jpg)"
+check "to-negative refuses it" refused "$(post_corrupt /api/to-negative test_corrupt_dht.jpg)"
+check "server still healthy" 200 "$(curl -s "$API_URL/health" -o /dev/null -w "%{http_code}")"
+echo ""
+
+# Test 16: Sampling factors the upsampler cannot step through
+echo "16. Testing a frame with uneven sampling factors..."
+corrupt_jpeg sampling test_corrupt_sampling.jpg
+check "to-negative refuses a 2 beside a 3" refused "$(post_corrupt /api/to-negative test_corrupt_sampling.jpg)"
+check "invert refuses it" refused "$(post_corrupt /api/invert test_corrupt_sampling.jpg)"
+check "preview refuses it" refused "$(post_corrupt "/api/to-negative?max_dimension=16" test_corrupt_sampling.jpg)"
+check "server still healthy" 200 "$(curl -s "$API_URL/health" -o /dev/null -w "%{http_code}")"
+echo ""
+
+# Test 17: Restart markers
+echo "17. Testing malformed restart intervals..."
+corrupt_jpeg dri_length test_corrupt_dri.jpg
+check "to-negative refuses a short DRI segment" refused "$(post_corrupt /api/to-negative test_corrupt_dri.jpg)"
+check "invert refuses it" refused "$(post_corrupt /api/invert test_corrupt_dri.jpg)"
+corrupt_jpeg restart test_restart.jpg
+corrupt_jpeg rst_order test_corrupt_rst.jpg
+for file in test_restart.jpg test_corrupt_rst.jpg; do
+    curl -s -X POST "$API_URL/api/to-negative?seed=7" -F "image=@$file" -o "${file%.jpg}_out.jpg"
+done
+check "RST markers out of order decode like in order" yes \
+    "$(cmp -s test_restart_out.jpg test_corrupt_rst_out.jpg && [ "$(size_of test_restart_out.jpg)" -gt 0 ] && echo yes)"
+check "server still healthy" 200 "$(curl -s "$API_URL/health" -o /dev/null -w "%{http_code}")"
+echo ""
+
 echo "=== Test Complete ==="
+echo "Checks: $PASSED passed, $FAILED failed"
 echo ""
 echo "Results:"
 echo "  - Original: $TEST_IMAGE"
 echo "  - Negative: test_negative.jpg"
 echo "  - Restored: test_restored.jpg"
+
+[ "$FAILED" -eq 0 ]
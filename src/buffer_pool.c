@@ -0,0 +1,123 @@
+/*
+ * Image Buffer Pool
+ * Every block carries a 64-byte header with its size class, so a block
+ * is returned by pointer alone and views of it need not remember the
+ * allocation size. Released blocks of a class are kept on a free list
+ * until the pool's byte cap is reached.
+ */
+
+#include "buffer_pool.h"
+#include "film_kernels.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+#define HEADER_SIZE IMAGE_BUFFER_ALIGN
+#define MIN_SHIFT 16               // log2(BUFFER_POOL_MIN_BLOCK)
+#define MAX_SHIFT 40
+#define CLASSES ((MAX_SHIFT - MIN_SHIFT) * 4)
+
+typedef struct BlockHeader {
+    struct BlockHeader *next;      // Free list link while cached
+    size_t capacity;               // Usable bytes (the class size)
+    int size_class;                // -1 for blocks that are never cached
+} BlockHeader;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static BlockHeader *free_lists[CLASSES];
+static size_t cached_bytes = 0;
+static size_t max_bytes = 0;
+static unsigned long hits = 0;
+static unsigned long misses = 0;
+
+// Size class of `size` and its rounded-up capacity: four classes per
+// power of two (1, 1.25, 1.5 and 1.75 times it), so at most 25% is wasted.
+// -1 for blocks too small or too large to cache.
+static int size_class(size_t size, size_t *capacity) {
+    *capacity = size;
+    if (size < BUFFER_POOL_MIN_BLOCK) return -1;
+
+    int shift = 63 - __builtin_clzll((unsigned long long)size);
+    size_t step = (size_t)1 << (shift - 2);
+    size_t quarters = (size + step - 1) / step;    // 4..8
+    int index = (shift - MIN_SHIFT) * 4 + (int)quarters - 4;
+    if (index >= CLASSES) return -1;
+    *capacity = quarters * step;
+    return index;
+}
+
+void buffer_pool_init(size_t bytes) {
+    pthread_mutex_lock(&pool_lock);
+    max_bytes = bytes;
+    int over = cached_bytes > bytes;
+    pthread_mutex_unlock(&pool_lock);
+    if (over) buffer_pool_trim();
+}
+
+void *buffer_pool_alloc(size_t size) {
+    size_t capacity;
+    int index = size_class(size, &capacity);
+
+    if (index >= 0) {
+        pthread_mutex_lock(&pool_lock);
+        BlockHeader *block = free_lists[index];
+        if (block) {
+            free_lists[index] = block->next;
+            cached_bytes -= block->capacity;
+            hits++;
+        } else {
+            misses++;
+        }
+        pthread_mutex_unlock(&pool_lock);
+        if (block) return (unsigned char *)block + HEADER_SIZE;
+    }
+
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, IMAGE_BUFFER_ALIGN, HEADER_SIZE + capacity + IMAGE_BUFFER_PADDING) != 0) {
+        return NULL;
+    }
+    BlockHeader *block = ptr;
+    block->next = NULL;
+    block->capacity = capacity;
+    block->size_class = index;
+    return (unsigned char *)block + HEADER_SIZE;
+}
+
+void buffer_pool_free(void *ptr) {
+    if (!ptr) return;
+    BlockHeader *block = (BlockHeader *)((unsigned char *)ptr - HEADER_SIZE);
+
+    if (block->size_class >= 0) {
+        pthread_mutex_lock(&pool_lock);
+        int keep = cached_bytes + block->capacity <= max_bytes;
+        if (keep) {
+            block->next = free_lists[block->size_class];
+            free_lists[block->size_class] = block;
+            cached_bytes += block->capacity;
+        }
+        pthread_mutex_unlock(&pool_lock);
+        if (keep) return;
+    }
+    free(block);
+}
+
+void buffer_pool_trim(void) {
+    pthread_mutex_lock(&pool_lock);
+    for (int i = 0; i < CLASSES; i++) {
+        BlockHeader *block = free_lists[i];
+        while (block) {
+            BlockHeader *next = block->next;
+            free(block);
+            block = next;
+        }
+        free_lists[i] = NULL;
+    }
+    cached_bytes = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+BufferPoolStats buffer_pool_stats(void) {
+    pthread_mutex_lock(&pool_lock);
+    BufferPoolStats stats = { cached_bytes, max_bytes, hits, misses };
+    pthread_mutex_unlock(&pool_lock);
+    return stats;
+}
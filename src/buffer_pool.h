@@ -0,0 +1,36 @@
+/*
+ * Image Buffer Pool
+ * Size-classed cache of released pixel allocations owned by the library,
+ * so steady-state requests reuse memory that is already mapped and
+ * faulted in instead of going back to mmap/munmap for every image
+ */
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include "film_processor.h"
+
+// Blocks under this size are never cached (stb_image's small tables and
+// the like go straight back to the allocator)
+#define BUFFER_POOL_MIN_BLOCK (64 * 1024)
+
+// Keep up to `max_bytes` of released blocks for reuse (0, the default,
+// returns every block to the system at once). Lowering the cap below
+// what is cached releases the cache.
+void buffer_pool_init(size_t max_bytes);
+
+// 64-byte-aligned block of at least `size` bytes plus IMAGE_BUFFER_PADDING,
+// rounded up to its size class (four per power of two). NULL on failure.
+// A block handed out aliases nothing live, like malloc's, which lets the
+// optimizer reason about stb_image's buffers once this is inlined into it.
+__attribute__((malloc)) void *buffer_pool_alloc(size_t size);
+
+// Return a block from buffer_pool_alloc (NULL is ignored)
+void buffer_pool_free(void *ptr);
+
+// Release every cached block to the system
+void buffer_pool_trim(void);
+
+BufferPoolStats buffer_pool_stats(void);
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,298 @@
+/*
+ * libjpeg-turbo Codec Backend Implementation
+ * libjpeg reports errors through a callback that must not return, so each
+ * call sets a jump point and the callback longjmps back to it instead of
+ * exiting the process. Warnings about corrupt data are dropped: like
+ * stb_image, a damaged stream still decodes as far as it goes. Encoded
+ * output goes to the WriteFn a buffer at a time. A byte budget (max_bytes)
+ * is met by the built-in encoder, which owns the quality search.
+ */
+
+#include "codec_libjpeg.h"
+
+#ifdef FILM_HAVE_LIBJPEG
+
+#include "jpeg_decoder.h"
+#include "jpeg_encoder.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+// Encoder output is handed to the sink in pieces of this size
+#define LIBJPEG_OUT_CHUNK 65536
+
+// Scanlines requested per jpeg_read_scanlines / jpeg_write_scanlines call
+#define LIBJPEG_ROWS 16
+
+typedef struct {
+    struct jpeg_error_mgr mgr;
+    jmp_buf escape;
+    char message[JMSG_LENGTH_MAX];
+} CodecError;
+
+static void error_exit(j_common_ptr cinfo) {
+    CodecError *err = (CodecError *)cinfo->err;
+    cinfo->err->format_message(cinfo, err->message);
+    longjmp(err->escape, 1);
+}
+
+static void ignore_message(j_common_ptr cinfo) {
+    (void)cinfo;
+}
+
+static struct jpeg_error_mgr *init_error(CodecError *err) {
+    jpeg_std_error(&err->mgr);
+    err->mgr.error_exit = error_exit;
+    err->mgr.output_message = ignore_message;
+    err->message[0] = '\0';
+    return &err->mgr;
+}
+
+// Decoder state; lives in memory across the jump point
+typedef struct {
+    struct jpeg_decompress_struct cinfo;
+    CodecError err;
+    ImageBuffer image;
+} Decode;
+
+// Grey and three-component JPEGs; CMYK is left to stb_image
+static int read_header(Decode *d, const unsigned char *data, size_t size) {
+    jpeg_mem_src(&d->cinfo, data, (unsigned long)size);
+    if (jpeg_read_header(&d->cinfo, TRUE) != JPEG_HEADER_OK) return 0;
+    return d->cinfo.num_components == 1 || d->cinfo.num_components == 3;
+}
+
+static int libjpeg_probe(const unsigned char *data, size_t size, int *width, int *height, int *channels) {
+    if (!jpeg_probe(data, size)) return 0;
+
+    Decode d;
+    d.cinfo.err = init_error(&d.err);
+    if (setjmp(d.err.escape)) {
+        jpeg_destroy_decompress(&d.cinfo);
+        return 0;
+    }
+    jpeg_create_decompress(&d.cinfo);
+    int ok = read_header(&d, data, size);
+    if (ok) {
+        *width = (int)d.cinfo.image_width;
+        *height = (int)d.cinfo.image_height;
+        *channels = d.cinfo.num_components == 1 ? 1 : 3;
+    }
+    jpeg_destroy_decompress(&d.cinfo);
+    return ok;
+}
+
+// Decode at 1/scale, using libjpeg's scaled IDCT, into `dest` when it is
+// given (it must match the output size) or else a new buffer
+static ImageBuffer decode_at(const unsigned char *data, size_t size, int scale, const ImageBuffer *dest,
+                             char *error, size_t error_size) {
+    Decode d;
+    memset(&d.image, 0, sizeof(d.image));
+    d.cinfo.err = init_error(&d.err);
+    if (setjmp(d.err.escape)) {
+        if (error) snprintf(error, error_size, "Failed to load image: %s", d.err.message);
+        image_buffer_free(&d.image);
+        jpeg_destroy_decompress(&d.cinfo);
+        return d.image;
+    }
+    jpeg_create_decompress(&d.cinfo);
+    if (!jpeg_probe(data, size) || !read_header(&d, data, size)) {
+        if (error) snprintf(error, error_size, "Failed to load image: not a grey or color JPEG");
+        jpeg_destroy_decompress(&d.cinfo);
+        return d.image;
+    }
+
+    d.cinfo.out_color_space = d.cinfo.num_components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+    d.cinfo.scale_num = 1;
+    d.cinfo.scale_denom = (unsigned int)scale;
+    jpeg_start_decompress(&d.cinfo);
+
+    if (dest) {
+        if ((int)d.cinfo.output_width != dest->width || (int)d.cinfo.output_height != dest->height ||
+            d.cinfo.output_components != dest->channels) {
+            jpeg_destroy_decompress(&d.cinfo);
+            return d.image;
+        }
+        d.image = image_buffer_view(dest, 0, 0, dest->width, dest->height);
+    } else {
+        d.image = image_buffer_alloc((int)d.cinfo.output_width, (int)d.cinfo.output_height,
+                                     d.cinfo.output_components);
+    }
+    if (!d.image.data) {
+        if (error) snprintf(error, error_size, "Failed to load image: out of memory");
+        jpeg_destroy_decompress(&d.cinfo);
+        return d.image;
+    }
+
+    while (d.cinfo.output_scanline < d.cinfo.output_height) {
+        JSAMPROW rows[LIBJPEG_ROWS];
+        unsigned int first = d.cinfo.output_scanline;
+        unsigned int count = d.cinfo.output_height - first < LIBJPEG_ROWS ?
+            d.cinfo.output_height - first : LIBJPEG_ROWS;
+        for (unsigned int r = 0; r < count; r++) {
+            rows[r] = d.image.data + (size_t)(first + r) * d.image.stride;
+        }
+        jpeg_read_scanlines(&d.cinfo, rows, count);
+    }
+    jpeg_finish_decompress(&d.cinfo);
+    jpeg_destroy_decompress(&d.cinfo);
+    return d.image;
+}
+
+static ImageBuffer libjpeg_decode(const unsigned char *data, size_t size, int max_threads,
+                                  char *error, size_t error_size) {
+    (void)max_threads;
+    return decode_at(data, size, 1, NULL, error, error_size);
+}
+
+static int libjpeg_decode_into(const unsigned char *data, size_t size, const ImageBuffer *dest, int max_threads) {
+    (void)max_threads;
+    ImageBuffer view = decode_at(data, size, 1, dest, NULL, 0);
+    return view.data != NULL;
+}
+
+static ImageBuffer libjpeg_decode_scaled(const unsigned char *data, size_t size, int scale) {
+    return decode_at(data, size, scale, NULL, NULL, 0);
+}
+
+// Destination manager writing through a WriteFn
+typedef struct {
+    struct jpeg_destination_mgr mgr;
+    WriteFn write;
+    void *context;
+    unsigned char buffer[LIBJPEG_OUT_CHUNK];
+} SinkDestination;
+
+static void init_destination(j_compress_ptr cinfo) {
+    SinkDestination *dest = (SinkDestination *)cinfo->dest;
+    dest->mgr.next_output_byte = dest->buffer;
+    dest->mgr.free_in_buffer = sizeof(dest->buffer);
+}
+
+static boolean empty_output_buffer(j_compress_ptr cinfo) {
+    SinkDestination *dest = (SinkDestination *)cinfo->dest;
+    dest->write(dest->context, dest->buffer, sizeof(dest->buffer));
+    dest->mgr.next_output_byte = dest->buffer;
+    dest->mgr.free_in_buffer = sizeof(dest->buffer);
+    return TRUE;
+}
+
+static void term_destination(j_compress_ptr cinfo) {
+    SinkDestination *dest = (SinkDestination *)cinfo->dest;
+    size_t used = sizeof(dest->buffer) - dest->mgr.free_in_buffer;
+    if (used > 0) dest->write(dest->context, dest->buffer, used);
+}
+
+// Encoder state; lives in memory across the jump point
+typedef struct {
+    struct jpeg_compress_struct cinfo;
+    CodecError err;
+    SinkDestination *dest;
+    unsigned char *grey;       // Grey + alpha input: one row without the alpha
+} Encode;
+
+static int libjpeg_encode(const ImageBuffer *image, const EncodeOptions *options,
+                          WriteFn write, void *context) {
+    if (options && options->max_bytes > 0) return jpeg_encode(image, options, write, context);
+    if (!image || !image->data || image->width <= 0 || image->height <= 0 ||
+        image->width > 0xFFFF || image->height > 0xFFFF ||
+        image->channels < 1 || image->channels > 4) {
+        return 0;
+    }
+
+    int quality = options && options->quality ? options->quality : 90;
+    quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+    int optimize = options && options->optimize_huffman;
+    EncodeStats *stats = options ? options->stats : NULL;
+
+    Encode e;
+    e.dest = malloc(sizeof(SinkDestination));
+    e.grey = image->channels == 2 ? malloc((size_t)image->width) : NULL;
+    if (!e.dest || (image->channels == 2 && !e.grey)) {
+        free(e.dest);
+        free(e.grey);
+        return 0;
+    }
+    e.cinfo.err = init_error(&e.err);
+    if (setjmp(e.err.escape)) {
+        jpeg_destroy_compress(&e.cinfo);
+        free(e.dest);
+        free(e.grey);
+        return 0;
+    }
+    jpeg_create_compress(&e.cinfo);
+
+    e.dest->mgr.init_destination = init_destination;
+    e.dest->mgr.empty_output_buffer = empty_output_buffer;
+    e.dest->mgr.term_destination = term_destination;
+    e.dest->write = write;
+    e.dest->context = context;
+    e.cinfo.dest = &e.dest->mgr;
+
+    e.cinfo.image_width = (JDIMENSION)image->width;
+    e.cinfo.image_height = (JDIMENSION)image->height;
+    if (image->channels <= 2) {
+        e.cinfo.input_components = 1;
+        e.cinfo.in_color_space = JCS_GRAYSCALE;
+    } else {
+        e.cinfo.input_components = image->channels;
+        e.cinfo.in_color_space = image->channels == 4 ? JCS_EXT_RGBX : JCS_RGB;
+    }
+    jpeg_set_defaults(&e.cinfo);
+    jpeg_set_quality(&e.cinfo, quality, TRUE);
+    e.cinfo.optimize_coding = optimize ? TRUE : FALSE;
+    if (image->channels > 2) {
+        int factor = encode_subsampling(options) == SUBSAMPLING_420 ? 2 : 1;
+        e.cinfo.comp_info[0].h_samp_factor = factor;
+        e.cinfo.comp_info[0].v_samp_factor = factor;
+    }
+
+    jpeg_start_compress(&e.cinfo, TRUE);
+    while (e.cinfo.next_scanline < e.cinfo.image_height) {
+        JSAMPROW rows[LIBJPEG_ROWS];
+        unsigned int first = e.cinfo.next_scanline;
+        unsigned int count = e.cinfo.image_height - first < LIBJPEG_ROWS ?
+            e.cinfo.image_height - first : LIBJPEG_ROWS;
+        if (e.grey) {
+            const unsigned char *src = image->data + (size_t)first * image->stride;
+            for (int x = 0; x < image->width; x++) e.grey[x] = src[2 * x];
+            rows[0] = e.grey;
+            count = 1;
+        } else {
+            for (unsigned int r = 0; r < count; r++) {
+                rows[r] = image->data + (size_t)(first + r) * image->stride;
+            }
+        }
+        jpeg_write_scanlines(&e.cinfo, rows, count);
+    }
+    jpeg_finish_compress(&e.cinfo);
+    jpeg_destroy_compress(&e.cinfo);
+    free(e.dest);
+    free(e.grey);
+
+    if (stats) {
+        stats->quality = quality;
+        stats->passes = optimize ? 2 : 1;
+        stats->over_budget = 0;
+    }
+    return 1;
+}
+
+static const ImageCodec libjpeg = {
+    "libjpeg-turbo", libjpeg_probe, libjpeg_decode, libjpeg_decode_into, libjpeg_decode_scaled,
+    libjpeg_encode
+};
+
+const ImageCodec *libjpeg_codec(void) {
+    return &libjpeg;
+}
+
+#else
+
+const ImageCodec *libjpeg_codec(void) {
+    return NULL;
+}
+
+#endif // FILM_HAVE_LIBJPEG
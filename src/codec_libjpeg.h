@@ -0,0 +1,16 @@
+/*
+ * libjpeg-turbo Codec Backend
+ * Decodes and encodes JPEG through the libjpeg API. Compiled in when the
+ * Makefile finds jpeglib.h and libjpeg on the build host
+ * (FILM_HAVE_LIBJPEG); select it with set_image_codec.
+ */
+
+#ifndef CODEC_LIBJPEG_H
+#define CODEC_LIBJPEG_H
+
+#include "film_kernels.h"
+
+// The backend, named "libjpeg-turbo", or NULL when it was not compiled in
+const ImageCodec *libjpeg_codec(void);
+
+#endif // CODEC_LIBJPEG_H
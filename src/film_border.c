@@ -0,0 +1,180 @@
+/*
+ * Sprocket Border Templates
+ * The border depends only on the image dimensions, so its two distinct
+ * rows (film base, and film base with holes) are rendered once per
+ * (width, channels) and copied into place. The cache keeps the most
+ * recently drawn sizes, replacing the least recently hit one when full.
+ */
+
+#include "film_kernels.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define BORDER_R 220
+#define BORDER_G 150
+#define BORDER_B 130
+#define HOLE_VALUE 240
+
+#define MAX_TEMPLATES 16
+
+typedef struct {
+    int width;
+    int channels;
+    unsigned char *base;       // Film base row (alpha bytes 0)
+    unsigned char *holes;      // Same row with the sprocket holes punched in
+    unsigned long last_hit;    // template_clock at its last lookup
+    int users;                 // Draws copying from it; never replaced while > 0
+} BorderTemplate;
+
+static BorderTemplate templates[MAX_TEMPLATES];
+static int template_count = 0;
+static unsigned long template_clock = 0;
+static pthread_mutex_t template_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Write the color bytes of one border row; alpha is left untouched
+static void render_row(unsigned char *row, int width, int channels, int holes) {
+    int hole_width = width / 25;
+    int spacing = width / 12;
+
+    for (int x = 0; x < width; x++) {
+        int idx = x * channels;
+        row[idx] = BORDER_R;
+        row[idx + 1] = BORDER_G;
+        row[idx + 2] = BORDER_B;
+    }
+
+    if (!holes || spacing <= 0) return;
+
+    for (int hole_num = 0; hole_num < width / spacing; hole_num++) {
+        int hole_x = hole_num * spacing + spacing / 4;
+        for (int x = hole_x; x < hole_x + hole_width && x < width; x++) {
+            int idx = x * channels;
+            row[idx] = HOLE_VALUE;
+            row[idx + 1] = HOLE_VALUE;
+            row[idx + 2] = HOLE_VALUE;
+        }
+    }
+}
+
+// Slot for a new template: a free one, else the least recently hit that
+// no draw is using; NULL if every slot is in use. Call with the lock held.
+static BorderTemplate *template_slot(void) {
+    if (template_count < MAX_TEMPLATES) return &templates[template_count++];
+
+    BorderTemplate *oldest = NULL;
+    for (int i = 0; i < MAX_TEMPLATES; i++) {
+        if (!templates[i].users && (!oldest || templates[i].last_hit < oldest->last_hit)) {
+            oldest = &templates[i];
+        }
+    }
+    return oldest;
+}
+
+// Cached template, rendered on a miss, held until border_template_release;
+// NULL if it cannot be cached
+static const BorderTemplate *border_template(int width, int channels) {
+    pthread_mutex_lock(&template_lock);
+    BorderTemplate *found = NULL;
+    for (int i = 0; i < template_count && !found; i++) {
+        if (templates[i].width == width && templates[i].channels == channels) found = &templates[i];
+    }
+
+    if (!found) {
+        size_t row_bytes = (size_t)width * channels;
+        unsigned char *rows = calloc(2, row_bytes);
+        found = rows ? template_slot() : NULL;
+        if (found) {
+            free(found->base);
+            found->width = width;
+            found->channels = channels;
+            found->base = rows;
+            found->holes = rows + row_bytes;
+            render_row(found->base, width, channels, 0);
+            render_row(found->holes, width, channels, 1);
+        } else {
+            free(rows);
+        }
+    }
+
+    if (found) {
+        found->last_hit = ++template_clock;
+        found->users++;
+    }
+    pthread_mutex_unlock(&template_lock);
+    return found;
+}
+
+static void border_template_release(const BorderTemplate *t) {
+    pthread_mutex_lock(&template_lock);
+    templates[t - templates].users--;
+    pthread_mutex_unlock(&template_lock);
+}
+
+// Copy a template row, keeping the destination's alpha
+static void copy_row(unsigned char *dst, const unsigned char *src, int width, int channels) {
+    if (channels == 3) {
+        memcpy(dst, src, (size_t)width * 3);
+    } else if (channels == 4) {
+        static const unsigned char alpha_bytes[4] = { 0, 0, 0, 0xFF };
+        unsigned int alpha_mask;
+        memcpy(&alpha_mask, alpha_bytes, 4);
+        for (int x = 0; x < width; x++) {
+            unsigned int d, s;
+            memcpy(&d, dst + (size_t)x * 4, 4);
+            memcpy(&s, src + (size_t)x * 4, 4);
+            d = (d & alpha_mask) | s;
+            memcpy(dst + (size_t)x * 4, &d, 4);
+        }
+    } else {
+        for (int x = 0; x < width; x++) {
+            memcpy(dst + (size_t)x * channels, src + (size_t)x * channels, 3);
+        }
+    }
+}
+
+// Write the border rows that fall in [y_begin, y_end) of the frame
+void draw_sprocket_rows_at(const ImageBuffer *img, int first_row, int frame_height,
+                           int y_begin, int y_end) {
+    int width = img->width;
+    int height = frame_height;
+    int channels = img->channels;
+    int border_height = height / 15;
+    int hole_top = border_height / 4;
+    int hole_bottom = hole_top + border_height / 2;
+    const BorderTemplate *t = NULL;
+
+    for (int y = y_begin; y < y_end; y++) {
+        if (y >= border_height && y < height - border_height) {
+            y = height - border_height - 1;   // Skip the picture area
+            continue;
+        }
+
+        int border_y = (y < border_height) ? y : height - 1 - y;
+        int holes = border_y >= hole_top && border_y < hole_bottom;
+        unsigned char *row = img->data + (size_t)(y - first_row) * img->stride;
+
+        if (!t) t = border_template(width, channels);
+        if (t) {
+            copy_row(row, holes ? t->holes : t->base, width, channels);
+        } else {
+            render_row(row, width, channels, holes);
+        }
+    }
+    if (t) border_template_release(t);
+}
+
+void draw_sprocket_rows(const ImageBuffer *img, int y_begin, int y_end) {
+    draw_sprocket_rows_at(img, 0, img->height, y_begin, y_end);
+}
+
+// Only safe once no request is drawing borders (e.g. at shutdown)
+void border_cache_free(void) {
+    pthread_mutex_lock(&template_lock);
+    for (int i = 0; i < template_count; i++) {
+        free(templates[i].base);
+        memset(&templates[i], 0, sizeof(templates[i]));
+    }
+    template_count = 0;
+    pthread_mutex_unlock(&template_lock);
+}
@@ -0,0 +1,98 @@
+/*
+ * Film Grain Texture Cache
+ * Precomputed tileable grain tiles, so per-request grain becomes a
+ * streaming saturating add instead of per-pixel random number generation
+ */
+
+#include "film_kernels.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+#define MAX_TEXTURES 8
+
+static GrainTexture textures[MAX_TEXTURES];
+static int texture_count = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Gaussian-like grain (sum of four uniforms, Irwin-Hall) with about the
+// same variance as the uniform hash grain of the same intensity. Every
+// pixel is independent, so the tile wraps seamlessly in both directions.
+static void fill_tile(signed char *tile, int size, int channels, int intensity, unsigned int variant) {
+    unsigned int key = grain_key(0x5eed0000U + variant);
+    int half = (intensity + 1) / 2;
+
+    for (int i = 0; i < size * size; i++) {
+        int g = 0;
+        for (int k = 0; k < 4; k++) {
+            g += grain_value(key, (unsigned int)i * 4 + k, half);
+        }
+        if (g > 127) g = 127;
+        if (g < -127) g = -127;
+
+        signed char *px = tile + (size_t)i * channels;
+        px[0] = (signed char)g;
+        px[1] = (signed char)g;
+        px[2] = (signed char)g;
+        if (channels == 4) px[3] = 0;
+    }
+}
+
+// Add one texture (all variants) unless it would exceed the budget
+static size_t add_texture(int intensity, int channels, int size, int variants, size_t budget) {
+    size_t bytes = (size_t)variants * size * size * channels;
+    if (texture_count == MAX_TEXTURES || bytes > budget) return 0;
+
+    signed char *data = malloc(bytes);
+    if (!data) return 0;
+
+    for (int v = 0; v < variants; v++) {
+        fill_tile(data + (size_t)v * size * size * channels, size, channels, intensity, (unsigned int)v);
+    }
+
+    GrainTexture *texture = &textures[texture_count];
+    texture->intensity = intensity;
+    texture->channels = channels;
+    texture->size = size;
+    texture->variants = variants;
+    texture->data = data;
+    __atomic_store_n(&texture_count, texture_count + 1, __ATOMIC_RELEASE);
+    return bytes;
+}
+
+// Build RGB and RGBA textures for the pipeline's grain intensity
+size_t grain_cache_build(int tile_size, int variants, size_t max_bytes) {
+    size_t used = 0;
+
+    if (tile_size <= 0 || variants <= 0) return 0;
+
+    pthread_mutex_lock(&cache_lock);
+    for (int channels = 3; channels <= 4; channels++) {
+        if (grain_cache_lookup(FILM_GRAIN_INTENSITY, channels)) continue;
+        used += add_texture(FILM_GRAIN_INTENSITY, channels, tile_size, variants, max_bytes - used);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return used;
+}
+
+const GrainTexture *grain_cache_lookup(int intensity, int channels) {
+    int count = __atomic_load_n(&texture_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        if (textures[i].intensity == intensity && textures[i].channels == channels) {
+            return &textures[i];
+        }
+    }
+    return NULL;
+}
+
+// Only safe once no request is using the cache (e.g. at shutdown)
+void grain_cache_free(void) {
+    pthread_mutex_lock(&cache_lock);
+    int count = texture_count;
+    __atomic_store_n(&texture_count, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < count; i++) {
+        free(textures[i].data);
+        textures[i].data = NULL;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
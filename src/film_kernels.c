@@ -0,0 +1,467 @@
+/*
+ * Film Processor Pixel Kernels Implementation
+ */
+
+#include "film_kernels.h"
+#include "thread_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// Smallest row band worth handing to another thread
+#define MIN_BAND_ROWS 32
+
+// Clamp value between 0 and 255
+static unsigned char clamp(int value) {
+    if (value < 0) return 0;
+    if (value > 255) return 255;
+    return (unsigned char)value;
+}
+
+// Per-channel tables composing inversion and color cast for each mode
+typedef struct {
+    unsigned char r[256];
+    unsigned char g[256];
+    unsigned char b[256];
+} ChannelLut;
+
+static ChannelLut negative_lut;
+static ChannelLut positive_lut;
+static pthread_once_t lut_once = PTHREAD_ONCE_INIT;
+
+// Build the tables with the exact float expressions of the staged kernels
+static void build_luts(void) {
+    for (int v = 0; v < 256; v++) {
+        unsigned char inv = 255 - v;
+        negative_lut.r[v] = clamp((int)(inv * CAST_R_SCALE + CAST_R_OFFSET));
+        negative_lut.g[v] = clamp((int)(inv * CAST_G_SCALE + CAST_G_OFFSET));
+        negative_lut.b[v] = clamp((int)(inv * CAST_B_SCALE + CAST_B_OFFSET));
+
+        positive_lut.r[v] = 255 - clamp((int)((v - CAST_R_OFFSET) / CAST_R_SCALE));
+        positive_lut.g[v] = 255 - clamp((int)((v - CAST_G_OFFSET) / CAST_G_SCALE));
+        positive_lut.b[v] = 255 - clamp((int)((v - CAST_B_OFFSET) / CAST_B_SCALE));
+    }
+}
+
+// Invert colors
+void apply_negative(unsigned char *img, int width, int height, int channels) {
+    for (int i = 0; i < width * height; i++) {
+        int idx = i * channels;
+        img[idx] = 255 - img[idx];
+        img[idx + 1] = 255 - img[idx + 1];
+        img[idx + 2] = 255 - img[idx + 2];
+    }
+}
+
+// Apply orange color cast
+void apply_film_color_cast(unsigned char *img, int width, int height, int channels) {
+    for (int i = 0; i < width * height; i++) {
+        int idx = i * channels;
+        unsigned char r = img[idx];
+        unsigned char g = img[idx + 1];
+        unsigned char b = img[idx + 2];
+
+        img[idx] = clamp((int)(r * CAST_R_SCALE + CAST_R_OFFSET));
+        img[idx + 1] = clamp((int)(g * CAST_G_SCALE + CAST_G_OFFSET));
+        img[idx + 2] = clamp((int)(b * CAST_B_SCALE + CAST_B_OFFSET));
+    }
+}
+
+// Remove orange color cast
+void remove_film_color_cast(unsigned char *img, int width, int height, int channels) {
+    for (int i = 0; i < width * height; i++) {
+        int idx = i * channels;
+        unsigned char r = img[idx];
+        unsigned char g = img[idx + 1];
+        unsigned char b = img[idx + 2];
+
+        img[idx] = clamp((int)((r - CAST_R_OFFSET) / CAST_R_SCALE));
+        img[idx + 1] = clamp((int)((g - CAST_G_OFFSET) / CAST_G_SCALE));
+        img[idx + 2] = clamp((int)((b - CAST_B_OFFSET) / CAST_B_SCALE));
+    }
+}
+
+// Add film grain
+void apply_grain(unsigned char *img, int width, int height, int channels, int intensity, unsigned int seed) {
+    unsigned int key = grain_key(seed);
+    for (int i = 0; i < width * height; i++) {
+        int idx = i * channels;
+        int grain = grain_value(key, (unsigned int)i, intensity);
+        img[idx] = clamp(img[idx] + grain);
+        img[idx + 1] = clamp(img[idx + 1] + grain);
+        img[idx + 2] = clamp(img[idx + 2] + grain);
+    }
+}
+
+// Draw sprocket holes
+void draw_sprocket_holes(unsigned char *img, int width, int height, int channels) {
+    ImageBuffer buffer = image_buffer_wrap(img, width, height, channels, 0);
+    draw_sprocket_rows(&buffer, 0, height);
+}
+
+// Remove sprocket holes
+void crop_sprocket_holes(unsigned char *img, int width, int height, int channels) {
+    int border_height = height / 15;
+
+    for (int y = 0; y < border_height; y++) {
+        for (int x = 0; x < width; x++) {
+            int top_idx = (y * width + x) * channels;
+            int bottom_idx = ((height - 1 - y) * width + x) * channels;
+
+            img[top_idx] = 0;
+            img[top_idx + 1] = 0;
+            img[top_idx + 2] = 0;
+            img[bottom_idx] = 0;
+            img[bottom_idx + 1] = 0;
+            img[bottom_idx + 2] = 0;
+        }
+    }
+}
+
+// Byte position of channel c within a 32-bit RGBA pixel load
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define RGBA_SHIFT(c) (24 - 8 * (c))
+#else
+#define RGBA_SHIFT(c) (8 * (c))
+#endif
+#define RGBA_ALPHA_MASK (0xFFu << RGBA_SHIFT(3))
+#define RGBA_CHANNEL(p, c) (((p) >> RGBA_SHIFT(c)) & 0xFF)
+
+// Scalar reference row kernels
+void negative_row_rgb_scalar(unsigned char *row, int pixels, const GrainParams *grain) {
+    pthread_once(&lut_once, build_luts);
+    for (int x = 0; x < pixels; x++) {
+        unsigned char *px = row + x * 3;
+        int g = grain_value(grain->key, grain->first_pixel + (unsigned int)x, grain->intensity);
+        px[0] = clamp(negative_lut.r[px[0]] + g);
+        px[1] = clamp(negative_lut.g[px[1]] + g);
+        px[2] = clamp(negative_lut.b[px[2]] + g);
+    }
+}
+
+void textured_row_rgb_scalar(unsigned char *row, int pixels, const signed char *grain) {
+    pthread_once(&lut_once, build_luts);
+    for (int x = 0; x < pixels; x++) {
+        unsigned char *px = row + x * 3;
+        const signed char *g = grain + x * 3;
+        px[0] = clamp(negative_lut.r[px[0]] + g[0]);
+        px[1] = clamp(negative_lut.g[px[1]] + g[1]);
+        px[2] = clamp(negative_lut.b[px[2]] + g[2]);
+    }
+}
+
+void positive_row_rgb_scalar(unsigned char *row, int pixels) {
+    pthread_once(&lut_once, build_luts);
+    for (int x = 0; x < pixels; x++) {
+        unsigned char *px = row + x * 3;
+        px[0] = positive_lut.r[px[0]];
+        px[1] = positive_lut.g[px[1]];
+        px[2] = positive_lut.b[px[2]];
+    }
+}
+
+// RGBA: one 32-bit load and store per pixel, alpha bits kept as loaded
+void negative_row_rgba_scalar(unsigned char *row, int pixels, const GrainParams *grain) {
+    pthread_once(&lut_once, build_luts);
+    for (int x = 0; x < pixels; x++) {
+        unsigned int p;
+        memcpy(&p, row + x * 4, 4);
+        int g = grain_value(grain->key, grain->first_pixel + (unsigned int)x, grain->intensity);
+        p = (p & RGBA_ALPHA_MASK) |
+            (unsigned int)clamp(negative_lut.r[RGBA_CHANNEL(p, 0)] + g) << RGBA_SHIFT(0) |
+            (unsigned int)clamp(negative_lut.g[RGBA_CHANNEL(p, 1)] + g) << RGBA_SHIFT(1) |
+            (unsigned int)clamp(negative_lut.b[RGBA_CHANNEL(p, 2)] + g) << RGBA_SHIFT(2);
+        memcpy(row + x * 4, &p, 4);
+    }
+}
+
+void textured_row_rgba_scalar(unsigned char *row, int pixels, const signed char *grain) {
+    pthread_once(&lut_once, build_luts);
+    for (int x = 0; x < pixels; x++) {
+        unsigned int p;
+        const signed char *g = grain + x * 4;
+        memcpy(&p, row + x * 4, 4);
+        p = (p & RGBA_ALPHA_MASK) |
+            (unsigned int)clamp(negative_lut.r[RGBA_CHANNEL(p, 0)] + g[0]) << RGBA_SHIFT(0) |
+            (unsigned int)clamp(negative_lut.g[RGBA_CHANNEL(p, 1)] + g[1]) << RGBA_SHIFT(1) |
+            (unsigned int)clamp(negative_lut.b[RGBA_CHANNEL(p, 2)] + g[2]) << RGBA_SHIFT(2);
+        memcpy(row + x * 4, &p, 4);
+    }
+}
+
+void positive_row_rgba_scalar(unsigned char *row, int pixels) {
+    pthread_once(&lut_once, build_luts);
+    for (int x = 0; x < pixels; x++) {
+        unsigned int p;
+        memcpy(&p, row + x * 4, 4);
+        p = (p & RGBA_ALPHA_MASK) |
+            (unsigned int)positive_lut.r[RGBA_CHANNEL(p, 0)] << RGBA_SHIFT(0) |
+            (unsigned int)positive_lut.g[RGBA_CHANNEL(p, 1)] << RGBA_SHIFT(1) |
+            (unsigned int)positive_lut.b[RGBA_CHANNEL(p, 2)] << RGBA_SHIFT(2);
+        memcpy(row + x * 4, &p, 4);
+    }
+}
+
+static int scalar_supported(void) {
+    return 1;
+}
+
+const KernelSet kernels_scalar = {
+    "scalar", scalar_supported,
+    { negative_row_rgb_scalar, textured_row_rgb_scalar, positive_row_rgb_scalar },
+    { negative_row_rgba_scalar, textured_row_rgba_scalar, positive_row_rgba_scalar },
+    { NULL, NULL }   // Float reference JPEG encoder
+};
+
+// Check a SIMD variant against the scalar reference on every input value,
+// for both modes, both channel layouts and unaligned pixel offsets
+static int kernels_match_reference(const KernelSet *set) {
+    enum { TEST_PIXELS = 1024 + 5 };
+    static unsigned char expected[TEST_PIXELS * 4], actual[TEST_PIXELS * 4];
+    static signed char texture[TEST_PIXELS * 4];
+    GrainParams grain = { grain_key(12345), 77, FILM_GRAIN_INTENSITY };
+
+    for (int channels = 3; channels <= 4; channels++) {
+        int bytes = TEST_PIXELS * channels;
+        for (int i = 0; i < bytes; i++) {
+            expected[i] = (unsigned char)(i * 7 + i / 256);
+            texture[i] = (channels == 4 && i % 4 == 3) ? 0 : (signed char)((i * 37) % 255 - 127);
+        }
+
+        const RowKernels *reference = kernels_for_layout(&kernels_scalar, channels);
+        const RowKernels *rows = kernels_for_layout(set, channels);
+
+        memcpy(actual, expected, bytes);
+        reference->negative_row(expected, TEST_PIXELS, &grain);
+        rows->negative_row(actual, TEST_PIXELS, &grain);
+        if (memcmp(expected, actual, bytes) != 0) return 0;
+
+        reference->textured_row(expected, TEST_PIXELS, texture);
+        rows->textured_row(actual, TEST_PIXELS, texture);
+        if (memcmp(expected, actual, bytes) != 0) return 0;
+
+        reference->positive_row(expected, TEST_PIXELS);
+        rows->positive_row(actual, TEST_PIXELS);
+        if (memcmp(expected, actual, bytes) != 0) return 0;
+    }
+    return 1;
+}
+
+static const KernelSet *active_kernels = &kernels_scalar;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void select_kernels(void) {
+    const KernelSet *candidates[] = { &kernels_avx512, &kernels_avx2, &kernels_sse2, &kernels_scalar };
+    int count = sizeof(candidates) / sizeof(candidates[0]);
+    const char *forced = getenv("FILM_KERNEL");
+    int start = 0;
+
+    if (forced && forced[0]) {
+        for (start = 0; start < count; start++) {
+            if (strcmp(forced, candidates[start]->name) == 0) break;
+        }
+        if (start == count) {
+            fprintf(stderr, "FILM_KERNEL=%s not recognized, using auto-detection\n", forced);
+            start = 0;
+        }
+    }
+
+    // Forced variants fall back to the next narrower one the CPU supports
+    for (int i = start; i < count; i++) {
+        const KernelSet *set = candidates[i];
+        if (set->supported() && (set == &kernels_scalar || kernels_match_reference(set))) {
+            active_kernels = set;
+            return;
+        }
+    }
+}
+
+const KernelSet *film_kernels(void) {
+    pthread_once(&kernels_once, select_kernels);
+    return active_kernels;
+}
+
+// Invert, cast and grain in one traversal. Grain comes from the
+// counter-based generator keyed by pixel index, so border rows can be
+// skipped outright and written only once, with the sprocket pattern.
+void fused_to_negative_at(const ImageBuffer *img, int first_row, int frame_height,
+                          int grain_intensity, unsigned int seed, int y_begin, int y_end) {
+    const RowKernels *rows = kernels_for_layout(film_kernels(), img->channels);
+    GrainParams grain = { grain_key(seed), 0, grain_intensity };
+    int border_height = frame_height / 15;
+
+    draw_sprocket_rows_at(img, first_row, frame_height, y_begin, y_end);
+    if (y_begin < border_height) y_begin = border_height;
+    if (y_end > frame_height - border_height) y_end = frame_height - border_height;
+
+    for (int y = y_begin; y < y_end; y++) {
+        unsigned char *row = img->data + (size_t)(y - first_row) * img->stride;
+
+        grain.first_pixel = (unsigned int)y * (unsigned int)img->width;
+        rows->negative_row(row, img->width, &grain);
+    }
+}
+
+void fused_to_negative_rows(const ImageBuffer *img, int grain_intensity, unsigned int seed,
+                            int y_begin, int y_end) {
+    fused_to_negative_at(img, 0, img->height, grain_intensity, seed, y_begin, y_end);
+}
+
+// Same traversal with grain streamed from a cached texture. The seed picks
+// the tile and its wrap-around offset; each row is applied in contiguous
+// tile segments.
+void fused_to_negative_textured_at(const ImageBuffer *img, int first_row, int frame_height,
+                                   const GrainTexture *texture, unsigned int seed,
+                                   int y_begin, int y_end) {
+    const RowKernels *rows = kernels_for_layout(film_kernels(), img->channels);
+    int width = img->width;
+    int channels = img->channels;
+    int size = texture->size;
+    size_t tile_row_bytes = (size_t)size * channels;
+    unsigned int key = grain_key(seed);
+    const signed char *tile = texture->data +
+        (size_t)(key % (unsigned int)texture->variants) * size * tile_row_bytes;
+    int offset_x = (int)(grain_hash(key) % (unsigned int)size);
+    int offset_y = (int)(grain_hash(key + 1) % (unsigned int)size);
+    int border_height = frame_height / 15;
+
+    draw_sprocket_rows_at(img, first_row, frame_height, y_begin, y_end);
+    if (y_begin < border_height) y_begin = border_height;
+    if (y_end > frame_height - border_height) y_end = frame_height - border_height;
+
+    for (int y = y_begin; y < y_end; y++) {
+        unsigned char *row = img->data + (size_t)(y - first_row) * img->stride;
+
+        const signed char *tile_row = tile + (size_t)((y + offset_y) % size) * tile_row_bytes;
+        int col = offset_x;
+        for (int x = 0; x < width; ) {
+            int pixels = size - col;
+            if (pixels > width - x) pixels = width - x;
+            rows->textured_row(row + (size_t)x * channels, pixels,
+                               tile_row + (size_t)col * channels);
+            x += pixels;
+            col = 0;
+        }
+    }
+}
+
+void fused_to_negative_textured_rows(const ImageBuffer *img, const GrainTexture *texture,
+                                     unsigned int seed, int y_begin, int y_end) {
+    fused_to_negative_textured_at(img, 0, img->height, texture, seed, y_begin, y_end);
+}
+
+// Crop, remove cast and invert in one traversal, one row kernel call per row.
+// A cropped (black) border pixel always comes out of cast removal as 0,
+// so after inversion it is written directly as white.
+void fused_to_positive_at(const ImageBuffer *img, int first_row, int frame_height,
+                          int y_begin, int y_end) {
+    const RowKernels *rows = kernels_for_layout(film_kernels(), img->channels);
+    int border_height = frame_height / 15;
+
+    for (int y = y_begin; y < y_end; y++) {
+        unsigned char *row = img->data + (size_t)(y - first_row) * img->stride;
+
+        if (y < border_height || y >= frame_height - border_height) {
+            for (int x = 0; x < img->width; x++) {
+                int idx = x * img->channels;
+                row[idx] = 255;
+                row[idx + 1] = 255;
+                row[idx + 2] = 255;
+            }
+            continue;
+        }
+
+        rows->positive_row(row, img->width);
+    }
+}
+
+void fused_to_positive_rows(const ImageBuffer *img, int y_begin, int y_end) {
+    fused_to_positive_at(img, 0, img->height, y_begin, y_end);
+}
+
+// To-positive on rows that are all picture (the border already cropped away)
+void fused_to_positive_picture_rows(const ImageBuffer *img, int y_begin, int y_end) {
+    const RowKernels *rows = kernels_for_layout(film_kernels(), img->channels);
+
+    for (int y = y_begin; y < y_end; y++) {
+        rows->positive_row(img->data + (size_t)y * img->stride, img->width);
+    }
+}
+
+// Plain byte loops the compiler vectorizes; RGBA skips the alpha byte
+void invert_rows(const ImageBuffer *img, int y_begin, int y_end) {
+    size_t row_bytes = (size_t)img->width * img->channels;
+
+    for (int y = y_begin; y < y_end; y++) {
+        unsigned char *row = img->data + (size_t)y * img->stride;
+        if (img->channels == 4) {
+            for (size_t i = 0; i < row_bytes; i += 4) {
+                row[i] ^= 0xFF;
+                row[i + 1] ^= 0xFF;
+                row[i + 2] ^= 0xFF;
+            }
+        } else {
+            for (size_t i = 0; i < row_bytes; i++) row[i] ^= 0xFF;
+        }
+    }
+}
+
+void fused_to_negative(unsigned char *img, int width, int height, int channels,
+                       int grain_intensity, unsigned int seed) {
+    ImageBuffer buffer = image_buffer_wrap(img, width, height, channels, 0);
+    fused_to_negative_rows(&buffer, grain_intensity, seed, 0, height);
+}
+
+void fused_to_negative_textured(unsigned char *img, int width, int height, int channels,
+                                const GrainTexture *texture, unsigned int seed) {
+    ImageBuffer buffer = image_buffer_wrap(img, width, height, channels, 0);
+    fused_to_negative_textured_rows(&buffer, texture, seed, 0, height);
+}
+
+void fused_to_positive(unsigned char *img, int width, int height, int channels) {
+    ImageBuffer buffer = image_buffer_wrap(img, width, height, channels, 0);
+    fused_to_positive_rows(&buffer, 0, height);
+}
+
+// One row band of a FusedJob
+static void fused_band(void *arg, int band) {
+    const FusedJob *job = arg;
+    int first = job->first_row;
+    int frame_height = job->frame_height ? job->frame_height : job->image.height;
+    int y_begin = (int)((long long)job->image.height * band / job->bands);
+    int y_end = (int)((long long)job->image.height * (band + 1) / job->bands);
+
+    switch (job->op) {
+    case FUSED_NEGATIVE:
+        fused_to_negative_at(&job->image, first, frame_height, job->grain_intensity, job->seed,
+                             first + y_begin, first + y_end);
+        break;
+    case FUSED_NEGATIVE_TEXTURED:
+        fused_to_negative_textured_at(&job->image, first, frame_height, job->texture, job->seed,
+                                      first + y_begin, first + y_end);
+        break;
+    case FUSED_POSITIVE:
+        fused_to_positive_at(&job->image, first, frame_height, first + y_begin, first + y_end);
+        break;
+    case FUSED_POSITIVE_PICTURE:
+        fused_to_positive_picture_rows(&job->image, y_begin, y_end);
+        break;
+    case FUSED_INVERT:
+        invert_rows(&job->image, y_begin, y_end);
+        break;
+    }
+}
+
+// Split the job into row bands on the shared pool. Every row depends only
+// on its own pixels and index (grain included), so the output is the same
+// for any band count.
+void fused_run(FusedJob *job, int max_threads) {
+    int bands = thread_pool_size() + 1;
+    if (max_threads > 0 && bands > max_threads) bands = max_threads;
+    if (bands > job->image.height / MIN_BAND_ROWS) bands = job->image.height / MIN_BAND_ROWS;
+    if (bands < 1) bands = 1;
+
+    job->bands = bands;
+    thread_pool_run(fused_band, job, bands);
+}
@@ -0,0 +1,223 @@
+/*
+ * Film Processor Pixel Kernels
+ * Internal per-pixel stages shared by the library and the benchmark tool
+ */
+
+#ifndef FILM_KERNELS_H
+#define FILM_KERNELS_H
+
+#include "film_processor.h"
+#include <stddef.h>
+
+// Grain intensity used by the to-negative pipeline
+#define FILM_GRAIN_INTENSITY 12
+
+// Orange film base cast: out = in * SCALE + OFFSET per channel
+#define CAST_R_SCALE 1.15f
+#define CAST_G_SCALE 1.05f
+#define CAST_B_SCALE 0.85f
+#define CAST_R_OFFSET 20
+#define CAST_G_OFFSET 10
+#define CAST_B_OFFSET 0
+
+// Counter-based grain generator: a stateless hash of (seed, pixel index),
+// so any pixel's grain can be computed independently, in any order, on any
+// thread or SIMD lane, with no shared state
+static inline unsigned int grain_hash(unsigned int x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+// Per-image key derived from the user-visible seed
+static inline unsigned int grain_key(unsigned int seed) {
+    return grain_hash(seed + 0x9e3779b9U);
+}
+
+// Grain for one pixel, uniform in [-intensity, intensity]
+static inline int grain_value(unsigned int key, unsigned int pixel, int intensity) {
+    unsigned int h = grain_hash(pixel ^ key) >> 16;
+    return (int)((h * (unsigned int)(2 * intensity + 1)) >> 16) - intensity;
+}
+
+// Grain parameters for one run of pixels
+typedef struct {
+    unsigned int key;          // grain_key(seed)
+    unsigned int first_pixel;  // Image pixel index of the run's first pixel
+    int intensity;
+} GrainParams;
+
+// Precomputed tileable grain (film_grain.c): `variants` tiles of
+// size x size pixels, stored expanded to the channel layout (0 on alpha
+// bytes) so applying grain is a streaming saturating add
+typedef struct {
+    int intensity;
+    int channels;
+    int size;
+    int variants;
+    signed char *data;
+} GrainTexture;
+
+// Build the texture cache for the default intensity within the memory
+// budget; returns the bytes used
+size_t grain_cache_build(int tile_size, int variants, size_t max_bytes);
+
+// Cached texture for (intensity, channels), or NULL to use the hash path
+const GrainTexture *grain_cache_lookup(int intensity, int channels);
+
+// Release all cached textures
+void grain_cache_free(void);
+
+// Aligned allocation with IMAGE_BUFFER_PADDING tail bytes from the buffer
+// pool, released with image_buffer_release (image_buffer.c). The calloc
+// variant backs stb_image's allocations
+void *image_buffer_malloc(size_t size);
+void *image_buffer_calloc(size_t size);
+void *image_buffer_realloc(void *ptr, size_t old_size, size_t new_size);
+void image_buffer_release(void *ptr);
+
+// Write the sprocket border rows that fall in [y_begin, y_end), copied
+// from row templates cached per (width, channels) (film_border.c)
+void draw_sprocket_rows(const ImageBuffer *img, int y_begin, int y_end);
+
+// The same for a window of a taller frame: img holds frame rows
+// [first_row, first_row + img->height) of a frame_height-row image, and
+// y_begin and y_end are frame rows inside the window
+void draw_sprocket_rows_at(const ImageBuffer *img, int first_row, int frame_height,
+                           int y_begin, int y_end);
+
+// Release all cached border templates
+void border_cache_free(void);
+
+// Staged reference kernels (one full-image pass each)
+void apply_negative(unsigned char *img, int width, int height, int channels);
+void apply_film_color_cast(unsigned char *img, int width, int height, int channels);
+void remove_film_color_cast(unsigned char *img, int width, int height, int channels);
+void apply_grain(unsigned char *img, int width, int height, int channels, int intensity, unsigned int seed);
+void draw_sprocket_holes(unsigned char *img, int width, int height, int channels);
+void crop_sprocket_holes(unsigned char *img, int width, int height, int channels);
+
+// Fused kernels: a single traversal producing output bit-identical to the
+// staged pipeline for the same seed (border rows written once)
+void fused_to_negative(unsigned char *img, int width, int height, int channels,
+                       int grain_intensity, unsigned int seed);
+
+// Fused to-negative with grain streamed from a cached texture, at a
+// seed-chosen tile and offset (not bit-identical to the hash path)
+void fused_to_negative_textured(unsigned char *img, int width, int height, int channels,
+                                const GrainTexture *texture, unsigned int seed);
+void fused_to_positive(unsigned char *img, int width, int height, int channels);
+
+// Same kernels on rows [y_begin, y_end) of a strided buffer
+void fused_to_negative_rows(const ImageBuffer *img, int grain_intensity, unsigned int seed,
+                            int y_begin, int y_end);
+void fused_to_negative_textured_rows(const ImageBuffer *img, const GrainTexture *texture,
+                                     unsigned int seed, int y_begin, int y_end);
+void fused_to_positive_rows(const ImageBuffer *img, int y_begin, int y_end);
+
+// Same kernels on a window of frame rows, as in draw_sprocket_rows_at:
+// borders and grain follow frame row numbers, so processing a frame window
+// by window gives the same pixels as one pass over the whole frame
+void fused_to_negative_at(const ImageBuffer *img, int first_row, int frame_height,
+                          int grain_intensity, unsigned int seed, int y_begin, int y_end);
+void fused_to_negative_textured_at(const ImageBuffer *img, int first_row, int frame_height,
+                                   const GrainTexture *texture, unsigned int seed,
+                                   int y_begin, int y_end);
+void fused_to_positive_at(const ImageBuffer *img, int first_row, int frame_height,
+                          int y_begin, int y_end);
+
+// To-positive for a cropped view: every row is picture, no border handling
+void fused_to_positive_picture_rows(const ImageBuffer *img, int y_begin, int y_end);
+
+// Plain inversion of the color channels; RGBA alpha is kept
+void invert_rows(const ImageBuffer *img, int y_begin, int y_end);
+
+// A whole-image fused pass, run in row bands on the shared thread pool
+typedef enum {
+    FUSED_NEGATIVE,
+    FUSED_NEGATIVE_TEXTURED,
+    FUSED_POSITIVE,
+    FUSED_POSITIVE_PICTURE,    // image is a view of the picture rows only
+    FUSED_INVERT
+} FusedOp;
+
+typedef struct {
+    FusedOp op;
+    ImageBuffer image;
+    int grain_intensity;            // FUSED_NEGATIVE
+    const GrainTexture *texture;    // FUSED_NEGATIVE_TEXTURED
+    unsigned int seed;
+    int bands;                      // Set by fused_run
+    int first_row;                  // image is frame rows [first_row, first_row + height)
+    int frame_height;               // of a frame this tall (0: image is the whole frame)
+} FusedJob;
+
+// Run the job on at most max_threads threads (0 = whole pool, caller included)
+void fused_run(FusedJob *job, int max_threads);
+
+// Row kernels: map `pixels` pixels of one row in place. The negative row
+// kernel also generates and adds the grain, the textured one adds a
+// per-byte grain buffer; alpha is passed through unchanged by all. Each
+// kernel is specialized for one channel layout.
+typedef void (*NegativeRowFn)(unsigned char *row, int pixels, const GrainParams *grain);
+typedef void (*TexturedRowFn)(unsigned char *row, int pixels, const signed char *grain);
+typedef void (*PositiveRowFn)(unsigned char *row, int pixels);
+
+// Row kernels for one channel layout
+typedef struct {
+    NegativeRowFn negative_row;
+    TexturedRowFn textured_row;
+    PositiveRowFn positive_row;
+} RowKernels;
+
+// JPEG encoder stages (see jpeg_encoder.h). YccRowFn converts one row of
+// 1-4 channel pixels to level-shifted Y and to Cb/Cr with two fraction
+// bits; FdctQuantFn transforms and quantizes `blocks` adjacent 8x8 blocks
+// of a plane into natural-order coefficients.
+typedef void (*YccRowFn)(const unsigned char *src, int width, int channels,
+                         short *y, short *cb, short *cr);
+typedef void (*FdctQuantFn)(const short *plane, size_t stride, int blocks,
+                            const float *fdtbl, short *coef);
+
+typedef struct {
+    YccRowFn ycc_row;               // NULL: use the float reference encoder
+    FdctQuantFn fdct_quant;
+} EncodeKernels;
+
+// Kernel variant, selected once per process
+typedef struct {
+    const char *name;
+    int (*supported)(void);
+    RowKernels rgb;                 // 3 bytes per pixel
+    RowKernels rgba;                // 4 bytes per pixel, one 32-bit lane each
+    EncodeKernels encode;
+} KernelSet;
+
+// Scalar reference row kernels (lookup tables), also used for SIMD tails
+void negative_row_rgb_scalar(unsigned char *row, int pixels, const GrainParams *grain);
+void textured_row_rgb_scalar(unsigned char *row, int pixels, const signed char *grain);
+void positive_row_rgb_scalar(unsigned char *row, int pixels);
+void negative_row_rgba_scalar(unsigned char *row, int pixels, const GrainParams *grain);
+void textured_row_rgba_scalar(unsigned char *row, int pixels, const signed char *grain);
+void positive_row_rgba_scalar(unsigned char *row, int pixels);
+
+// All variants; the SIMD ones live in film_kernels_simd.c and report
+// themselves unsupported on non-x86 builds
+extern const KernelSet kernels_scalar;
+extern const KernelSet kernels_sse2;
+extern const KernelSet kernels_avx2;
+extern const KernelSet kernels_avx512;
+
+// Active kernel set. Picks the widest variant the CPU supports, unless the
+// FILM_KERNEL environment variable (scalar, sse2, avx2, avx512) forces one.
+const KernelSet *film_kernels(void);
+
+// Row kernels of a set for an image's channel count (4 = RGBA, else RGB)
+static inline const RowKernels *kernels_for_layout(const KernelSet *set, int channels) {
+    return channels == 4 ? &set->rgba : &set->rgb;
+}
+
+#endif // FILM_KERNELS_H
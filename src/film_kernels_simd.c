@@ -0,0 +1,778 @@
+/*
+ * Film Processor SIMD Kernels
+ * Hand-vectorized SSE2, AVX2 and AVX-512 row kernels. Each is compiled for
+ * its ISA with a target attribute so the binary itself stays portable;
+ * film_kernels() picks one at runtime.
+ *
+ * The kernels repeat the scalar float expressions lane by lane (convert,
+ * multiply or divide, add, truncate, saturate), so they match the lookup
+ * tables bit for bit. Build with -ffp-contract=off to keep it that way.
+ * Grain is generated in-lane with the same counter-based hash as
+ * grain_value(), indexed by each byte's pixel.
+ */
+
+#include "film_kernels.h"
+#include "jpeg_encoder.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+#include <pthread.h>
+
+// RGB rows are processed byte-wise in blocks of three vectors, the
+// smallest run that starts every block on a pixel boundary. RGBA rows use
+// one 32-bit lane per pixel: channels are shifted out of the lane, so each
+// pixel's grain is generated once and the alpha byte is masked back in.
+
+// Widest RGB block: three AVX-512 vectors
+#define BLOCK_BYTES_MAX 192
+
+// Per-byte lane constants for one RGB block
+typedef struct {
+    float scale[BLOCK_BYTES_MAX];
+    float offset_f[BLOCK_BYTES_MAX];
+    int offset_i[BLOCK_BYTES_MAX];
+    int pixel[BLOCK_BYTES_MAX];            // Pixel of each byte within the block
+} LaneTable;
+
+static LaneTable rgb_lanes;
+static pthread_once_t lane_once = PTHREAD_ONCE_INIT;
+
+static void build_lane_table(void) {
+    const float scale[3] = { CAST_R_SCALE, CAST_G_SCALE, CAST_B_SCALE };
+    const int offset[3] = { CAST_R_OFFSET, CAST_G_OFFSET, CAST_B_OFFSET };
+
+    for (int i = 0; i < BLOCK_BYTES_MAX; i++) {
+        int c = i % 3;
+        rgb_lanes.scale[i] = scale[c];
+        rgb_lanes.offset_f[i] = (float)offset[c];
+        rgb_lanes.offset_i[i] = offset[c];
+        rgb_lanes.pixel[i] = i / 3;
+    }
+}
+
+static const LaneTable *rgb_lane_table(void) {
+    pthread_once(&lane_once, build_lane_table);
+    return &rgb_lanes;
+}
+
+// Grain for the scalar tail of a row, `pixels` into the run
+static GrainParams tail_grain(const GrainParams *grain, int pixels) {
+    GrainParams tail = *grain;
+    tail.first_pixel += (unsigned int)pixels;
+    return tail;
+}
+
+// Cast constants for the 32-bit RGBA lanes, by channel
+static const float cast_scale[3] = { CAST_R_SCALE, CAST_G_SCALE, CAST_B_SCALE };
+static const int cast_offset[3] = { CAST_R_OFFSET, CAST_G_OFFSET, CAST_B_OFFSET };
+
+// ---------------------------------------------------------------- SSE2 ---
+
+#define SSE2_BLOCK 48
+
+static int sse2_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("sse2")))
+static inline void widen_sse2(__m128i v, __m128i q[4]) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    q[0] = _mm_unpacklo_epi16(lo, zero);
+    q[1] = _mm_unpackhi_epi16(lo, zero);
+    q[2] = _mm_unpacklo_epi16(hi, zero);
+    q[3] = _mm_unpackhi_epi16(hi, zero);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i narrow_sse2(const __m128i q[4]) {
+    return _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+}
+
+// 32-bit multiply (low half) from SSE2's even-lane 32x32->64 multiply
+__attribute__((target("sse2")))
+static inline __m128i mullo32_sse2(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+// grain_value() for four pixels
+__attribute__((target("sse2")))
+static inline __m128i grain_sse2(__m128i pixel, __m128i key, __m128i range, __m128i intensity) {
+    __m128i x = _mm_xor_si128(pixel, key);
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    x = mullo32_sse2(x, _mm_set1_epi32(0x7feb352d));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+    x = mullo32_sse2(x, _mm_set1_epi32((int)0x846ca68bU));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    x = _mm_mulhi_epu16(_mm_srli_epi32(x, 16), range);
+    return _mm_sub_epi32(x, intensity);
+}
+
+__attribute__((target("sse2")))
+static void negative_row_rgb_sse2(unsigned char *row, int pixels, const GrainParams *grain) {
+    const LaneTable *lt = rgb_lane_table();
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8(-1);
+    const __m128i max8 = _mm_set1_epi16(255);
+    const __m128i key = _mm_set1_epi32((int)grain->key);
+    const __m128i range = _mm_set1_epi16((short)(2 * grain->intensity + 1));
+    const __m128i intensity = _mm_set1_epi32(grain->intensity);
+    int bytes = pixels * 3;
+    int n = bytes - bytes % SSE2_BLOCK;
+
+    for (int i = 0; i < n; i += SSE2_BLOCK) {
+        __m128i base = _mm_set1_epi32((int)(grain->first_pixel + (unsigned int)(i / 3)));
+        for (int k = 0; k < SSE2_BLOCK; k += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(row + i + k));
+            __m128i q[4], g[4];
+            widen_sse2(_mm_xor_si128(v, ones), q);
+            for (int j = 0; j < 4; j++) {
+                __m128 f = _mm_cvtepi32_ps(q[j]);
+                f = _mm_mul_ps(f, _mm_loadu_ps(lt->scale + k + 4 * j));
+                f = _mm_add_ps(f, _mm_loadu_ps(lt->offset_f + k + 4 * j));
+                q[j] = _mm_cvttps_epi32(f);
+
+                __m128i pixel = _mm_add_epi32(base, _mm_loadu_si128((const __m128i *)(lt->pixel + k + 4 * j)));
+                g[j] = grain_sse2(pixel, key, range, intensity);
+            }
+
+            // Clamp the cast to [0, 255] in 16 bits, add grain, saturate
+            __m128i c01 = _mm_min_epi16(_mm_max_epi16(_mm_packs_epi32(q[0], q[1]), zero), max8);
+            __m128i c23 = _mm_min_epi16(_mm_max_epi16(_mm_packs_epi32(q[2], q[3]), zero), max8);
+            c01 = _mm_add_epi16(c01, _mm_packs_epi32(g[0], g[1]));
+            c23 = _mm_add_epi16(c23, _mm_packs_epi32(g[2], g[3]));
+            __m128i out = _mm_packus_epi16(c01, c23);
+            _mm_storeu_si128((__m128i *)(row + i + k), out);
+        }
+    }
+
+    GrainParams tail = tail_grain(grain, n / 3);
+    negative_row_rgb_scalar(row + n, (bytes - n) / 3, &tail);
+}
+
+__attribute__((target("sse2")))
+static void textured_row_rgb_sse2(unsigned char *row, int pixels, const signed char *grain) {
+    const LaneTable *lt = rgb_lane_table();
+    const __m128i ones = _mm_set1_epi8(-1);
+    const __m128i bias = _mm_set1_epi8(-128);
+    int bytes = pixels * 3;
+    int n = bytes - bytes % SSE2_BLOCK;
+
+    for (int i = 0; i < n; i += SSE2_BLOCK) {
+        for (int k = 0; k < SSE2_BLOCK; k += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(row + i + k));
+            __m128i q[4];
+            widen_sse2(_mm_xor_si128(v, ones), q);
+            for (int j = 0; j < 4; j++) {
+                __m128 f = _mm_cvtepi32_ps(q[j]);
+                f = _mm_mul_ps(f, _mm_loadu_ps(lt->scale + k + 4 * j));
+                f = _mm_add_ps(f, _mm_loadu_ps(lt->offset_f + k + 4 * j));
+                q[j] = _mm_cvttps_epi32(f);
+            }
+            __m128i out = narrow_sse2(q);
+
+            // Saturating unsigned + signed add via the biased signed domain
+            __m128i g = _mm_loadu_si128((const __m128i *)(grain + i + k));
+            out = _mm_xor_si128(_mm_adds_epi8(_mm_xor_si128(out, bias), g), bias);
+            _mm_storeu_si128((__m128i *)(row + i + k), out);
+        }
+    }
+    textured_row_rgb_scalar(row + n, (bytes - n) / 3, grain + n);
+}
+
+__attribute__((target("sse2")))
+static void positive_row_rgb_sse2(unsigned char *row, int pixels) {
+    const LaneTable *lt = rgb_lane_table();
+    const __m128i ones = _mm_set1_epi8(-1);
+    int bytes = pixels * 3;
+    int n = bytes - bytes % SSE2_BLOCK;
+
+    for (int i = 0; i < n; i += SSE2_BLOCK) {
+        for (int k = 0; k < SSE2_BLOCK; k += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(row + i + k));
+            __m128i q[4];
+            widen_sse2(v, q);
+            for (int j = 0; j < 4; j++) {
+                __m128i t = _mm_sub_epi32(q[j], _mm_loadu_si128((const __m128i *)(lt->offset_i + k + 4 * j)));
+                __m128 f = _mm_div_ps(_mm_cvtepi32_ps(t), _mm_loadu_ps(lt->scale + k + 4 * j));
+                q[j] = _mm_cvttps_epi32(f);
+            }
+            __m128i out = _mm_xor_si128(narrow_sse2(q), ones);
+            _mm_storeu_si128((__m128i *)(row + i + k), out);
+        }
+    }
+    positive_row_rgb_scalar(row + n, (bytes - n) / 3);
+}
+
+// Channel c of four RGBA pixels through the film cast (unclamped)
+__attribute__((target("sse2")))
+static inline __m128i cast_rgba_sse2(__m128i inv, int c) {
+    __m128i ch = _mm_and_si128(_mm_srli_epi32(inv, 8 * c), _mm_set1_epi32(0xFF));
+    __m128 f = _mm_mul_ps(_mm_cvtepi32_ps(ch), _mm_set1_ps(cast_scale[c]));
+    f = _mm_add_ps(f, _mm_set1_ps((float)cast_offset[c]));
+    return _mm_cvttps_epi32(f);
+}
+
+// SSE2 has no 32-bit min/max, so channels are clamped by saturating packs:
+// planar bytes r0-3 g0-3 b0-3 are interleaved back with the original alpha
+__attribute__((target("sse2")))
+static inline __m128i interleave_rgba_sse2(__m128i planar, __m128i v) {
+    __m128i a = _mm_srli_epi32(v, 24);
+    a = _mm_packus_epi16(_mm_packs_epi32(a, a), a);
+    __m128i rg = _mm_unpacklo_epi8(planar, _mm_srli_si128(planar, 4));
+    __m128i ba = _mm_unpacklo_epi8(_mm_srli_si128(planar, 8), a);
+    return _mm_unpacklo_epi16(rg, ba);
+}
+
+__attribute__((target("sse2")))
+static void negative_row_rgba_sse2(unsigned char *row, int pixels, const GrainParams *grain) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8(-1);
+    const __m128i max8 = _mm_set1_epi16(255);
+    const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i key = _mm_set1_epi32((int)grain->key);
+    const __m128i range = _mm_set1_epi16((short)(2 * grain->intensity + 1));
+    const __m128i intensity = _mm_set1_epi32(grain->intensity);
+    int n = pixels - pixels % 4;
+
+    for (int x = 0; x < n; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(row + x * 4));
+        __m128i inv = _mm_xor_si128(v, ones);
+        __m128i pixel = _mm_add_epi32(_mm_set1_epi32((int)(grain->first_pixel + (unsigned int)x)), lane);
+        __m128i g = grain_sse2(pixel, key, range, intensity);
+        g = _mm_packs_epi32(g, g);
+
+        // Clamp the cast in 16 bits, add grain, saturate on the final pack
+        __m128i rg = _mm_packs_epi32(cast_rgba_sse2(inv, 0), cast_rgba_sse2(inv, 1));
+        __m128i bb = _mm_packs_epi32(cast_rgba_sse2(inv, 2), zero);
+        rg = _mm_add_epi16(_mm_min_epi16(_mm_max_epi16(rg, zero), max8), g);
+        bb = _mm_add_epi16(_mm_min_epi16(_mm_max_epi16(bb, zero), max8), g);
+        __m128i out = interleave_rgba_sse2(_mm_packus_epi16(rg, bb), v);
+        _mm_storeu_si128((__m128i *)(row + x * 4), out);
+    }
+
+    GrainParams tail = tail_grain(grain, n);
+    negative_row_rgba_scalar(row + n * 4, pixels - n, &tail);
+}
+
+__attribute__((target("sse2")))
+static void textured_row_rgba_sse2(unsigned char *row, int pixels, const signed char *grain) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8(-1);
+    const __m128i bias = _mm_set1_epi8(-128);
+    int n = pixels - pixels % 4;
+
+    for (int x = 0; x < n; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(row + x * 4));
+        __m128i inv = _mm_xor_si128(v, ones);
+        __m128i rg = _mm_packs_epi32(cast_rgba_sse2(inv, 0), cast_rgba_sse2(inv, 1));
+        __m128i bb = _mm_packs_epi32(cast_rgba_sse2(inv, 2), zero);
+        __m128i out = interleave_rgba_sse2(_mm_packus_epi16(rg, bb), v);
+
+        // Alpha grain bytes are 0, so the saturating add keeps alpha
+        __m128i g = _mm_loadu_si128((const __m128i *)(grain + x * 4));
+        out = _mm_xor_si128(_mm_adds_epi8(_mm_xor_si128(out, bias), g), bias);
+        _mm_storeu_si128((__m128i *)(row + x * 4), out);
+    }
+    textured_row_rgba_scalar(row + n * 4, pixels - n, grain + n * 4);
+}
+
+__attribute__((target("sse2")))
+static void positive_row_rgba_sse2(unsigned char *row, int pixels) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i byte = _mm_set1_epi32(0xFF);
+    const __m128i rgb = _mm_set1_epi32(0x00FFFFFF);
+    int n = pixels - pixels % 4;
+
+    for (int x = 0; x < n; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(row + x * 4));
+        __m128i c[3];
+        for (int k = 0; k < 3; k++) {
+            __m128i ch = _mm_and_si128(_mm_srli_epi32(v, 8 * k), byte);
+            __m128i t = _mm_sub_epi32(ch, _mm_set1_epi32(cast_offset[k]));
+            c[k] = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(t), _mm_set1_ps(cast_scale[k])));
+        }
+        __m128i planar = _mm_packus_epi16(_mm_packs_epi32(c[0], c[1]), _mm_packs_epi32(c[2], zero));
+        __m128i out = _mm_xor_si128(interleave_rgba_sse2(planar, v), rgb);
+        _mm_storeu_si128((__m128i *)(row + x * 4), out);
+    }
+    positive_row_rgba_scalar(row + n * 4, pixels - n);
+}
+
+const KernelSet kernels_sse2 = {
+    "sse2", sse2_supported,
+    { negative_row_rgb_sse2, textured_row_rgb_sse2, positive_row_rgb_sse2 },
+    { negative_row_rgba_sse2, textured_row_rgba_sse2, positive_row_rgba_sse2 },
+    { ycc_row_sse2, fdct_quant_sse2 }
+};
+
+// ---------------------------------------------------------------- AVX2 ---
+
+#define AVX2_BLOCK 96
+
+static int avx2_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static inline void widen_avx2(__m256i v, __m256i q[4]) {
+    __m128i lo = _mm256_castsi256_si128(v);
+    __m128i hi = _mm256_extracti128_si256(v, 1);
+    q[0] = _mm256_cvtepu8_epi32(lo);
+    q[1] = _mm256_cvtepu8_epi32(_mm_srli_si128(lo, 8));
+    q[2] = _mm256_cvtepu8_epi32(hi);
+    q[3] = _mm256_cvtepu8_epi32(_mm_srli_si128(hi, 8));
+}
+
+// Packs work per 128-bit lane; the permutes restore byte order
+__attribute__((target("avx2")))
+static inline __m256i narrow_avx2(const __m256i q[4]) {
+    __m256i ab = _mm256_permute4x64_epi64(_mm256_packs_epi32(q[0], q[1]), 0xD8);
+    __m256i cd = _mm256_permute4x64_epi64(_mm256_packs_epi32(q[2], q[3]), 0xD8);
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(ab, cd), 0xD8);
+}
+
+// grain_value() for eight pixels
+__attribute__((target("avx2")))
+static inline __m256i grain_avx2(__m256i pixel, __m256i key, __m256i range, __m256i intensity) {
+    __m256i x = _mm256_xor_si256(pixel, key);
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x7feb352d));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32((int)0x846ca68bU));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    x = _mm256_mulhi_epu16(_mm256_srli_epi32(x, 16), range);
+    return _mm256_sub_epi32(x, intensity);
+}
+
+__attribute__((target("avx2")))
+static void negative_row_rgb_avx2(unsigned char *row, int pixels, const GrainParams *grain) {
+    const LaneTable *lt = rgb_lane_table();
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi8(-1);
+    const __m256i max8 = _mm256_set1_epi32(255);
+    const __m256i key = _mm256_set1_epi32((int)grain->key);
+    const __m256i range = _mm256_set1_epi16((short)(2 * grain->intensity + 1));
+    const __m256i intensity = _mm256_set1_epi32(grain->intensity);
+    int bytes = pixels * 3;
+    int n = bytes - bytes % AVX2_BLOCK;
+
+    for (int i = 0; i < n; i += AVX2_BLOCK) {
+        __m256i base = _mm256_set1_epi32((int)(grain->first_pixel + (unsigned int)(i / 3)));
+        for (int k = 0; k < AVX2_BLOCK; k += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(row + i + k));
+            __m256i q[4];
+            widen_avx2(_mm256_xor_si256(v, ones), q);
+            for (int j = 0; j < 4; j++) {
+                __m256 f = _mm256_cvtepi32_ps(q[j]);
+                f = _mm256_mul_ps(f, _mm256_loadu_ps(lt->scale + k + 8 * j));
+                f = _mm256_add_ps(f, _mm256_loadu_ps(lt->offset_f + k + 8 * j));
+                __m256i cast = _mm256_min_epi32(_mm256_max_epi32(_mm256_cvttps_epi32(f), zero), max8);
+
+                __m256i pixel = _mm256_add_epi32(base, _mm256_loadu_si256((const __m256i *)(lt->pixel + k + 8 * j)));
+                q[j] = _mm256_add_epi32(cast, grain_avx2(pixel, key, range, intensity));
+            }
+            __m256i out = narrow_avx2(q);
+            _mm256_storeu_si256((__m256i *)(row + i + k), out);
+        }
+    }
+
+    GrainParams tail = tail_grain(grain, n / 3);
+    negative_row_rgb_scalar(row + n, (bytes - n) / 3, &tail);
+}
+
+__attribute__((target("avx2")))
+static void textured_row_rgb_avx2(unsigned char *row, int pixels, const signed char *grain) {
+    const LaneTable *lt = rgb_lane_table();
+    const __m256i ones = _mm256_set1_epi8(-1);
+    const __m256i bias = _mm256_set1_epi8(-128);
+    int bytes = pixels * 3;
+    int n = bytes - bytes % AVX2_BLOCK;
+
+    for (int i = 0; i < n; i += AVX2_BLOCK) {
+        for (int k = 0; k < AVX2_BLOCK; k += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(row + i + k));
+            __m256i q[4];
+            widen_avx2(_mm256_xor_si256(v, ones), q);
+            for (int j = 0; j < 4; j++) {
+                __m256 f = _mm256_cvtepi32_ps(q[j]);
+                f = _mm256_mul_ps(f, _mm256_loadu_ps(lt->scale + k + 8 * j));
+                f = _mm256_add_ps(f, _mm256_loadu_ps(lt->offset_f + k + 8 * j));
+                q[j] = _mm256_cvttps_epi32(f);
+            }
+            __m256i out = narrow_avx2(q);
+
+            __m256i g = _mm256_loadu_si256((const __m256i *)(grain + i + k));
+            out = _mm256_xor_si256(_mm256_adds_epi8(_mm256_xor_si256(out, bias), g), bias);
+            _mm256_storeu_si256((__m256i *)(row + i + k), out);
+        }
+    }
+    textured_row_rgb_scalar(row + n, (bytes - n) / 3, grain + n);
+}
+
+__attribute__((target("avx2")))
+static void positive_row_rgb_avx2(unsigned char *row, int pixels) {
+    const LaneTable *lt = rgb_lane_table();
+    const __m256i ones = _mm256_set1_epi8(-1);
+    int bytes = pixels * 3;
+    int n = bytes - bytes % AVX2_BLOCK;
+
+    for (int i = 0; i < n; i += AVX2_BLOCK) {
+        for (int k = 0; k < AVX2_BLOCK; k += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(row + i + k));
+            __m256i q[4];
+            widen_avx2(v, q);
+            for (int j = 0; j < 4; j++) {
+                __m256i t = _mm256_sub_epi32(q[j], _mm256_loadu_si256((const __m256i *)(lt->offset_i + k + 8 * j)));
+                __m256 f = _mm256_div_ps(_mm256_cvtepi32_ps(t), _mm256_loadu_ps(lt->scale + k + 8 * j));
+                q[j] = _mm256_cvttps_epi32(f);
+            }
+            __m256i out = _mm256_xor_si256(narrow_avx2(q), ones);
+            _mm256_storeu_si256((__m256i *)(row + i + k), out);
+        }
+    }
+    positive_row_rgb_scalar(row + n, (bytes - n) / 3);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i clamp255_avx2(__m256i x) {
+    return _mm256_min_epi32(_mm256_max_epi32(x, _mm256_setzero_si256()), _mm256_set1_epi32(255));
+}
+
+// Channel c of eight RGBA pixels through the film cast (unclamped)
+__attribute__((target("avx2")))
+static inline __m256i cast_rgba_avx2(__m256i inv, int c) {
+    __m256i ch = _mm256_and_si256(_mm256_srli_epi32(inv, 8 * c), _mm256_set1_epi32(0xFF));
+    __m256 f = _mm256_mul_ps(_mm256_cvtepi32_ps(ch), _mm256_set1_ps(cast_scale[c]));
+    f = _mm256_add_ps(f, _mm256_set1_ps((float)cast_offset[c]));
+    return _mm256_cvttps_epi32(f);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i pack_rgba_avx2(const __m256i c[3], __m256i v) {
+    __m256i out = _mm256_and_si256(v, _mm256_set1_epi32((int)0xFF000000U));
+    out = _mm256_or_si256(out, c[0]);
+    out = _mm256_or_si256(out, _mm256_slli_epi32(c[1], 8));
+    return _mm256_or_si256(out, _mm256_slli_epi32(c[2], 16));
+}
+
+__attribute__((target("avx2")))
+static void negative_row_rgba_avx2(unsigned char *row, int pixels, const GrainParams *grain) {
+    const __m256i ones = _mm256_set1_epi8(-1);
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i key = _mm256_set1_epi32((int)grain->key);
+    const __m256i range = _mm256_set1_epi16((short)(2 * grain->intensity + 1));
+    const __m256i intensity = _mm256_set1_epi32(grain->intensity);
+    int n = pixels - pixels % 8;
+
+    for (int x = 0; x < n; x += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(row + x * 4));
+        __m256i inv = _mm256_xor_si256(v, ones);
+        __m256i pixel = _mm256_add_epi32(_mm256_set1_epi32((int)(grain->first_pixel + (unsigned int)x)), lane);
+        __m256i g = grain_avx2(pixel, key, range, intensity);
+        __m256i c[3];
+        for (int k = 0; k < 3; k++) {
+            c[k] = clamp255_avx2(_mm256_add_epi32(clamp255_avx2(cast_rgba_avx2(inv, k)), g));
+        }
+        _mm256_storeu_si256((__m256i *)(row + x * 4), pack_rgba_avx2(c, v));
+    }
+
+    GrainParams tail = tail_grain(grain, n);
+    negative_row_rgba_scalar(row + n * 4, pixels - n, &tail);
+}
+
+__attribute__((target("avx2")))
+static void textured_row_rgba_avx2(unsigned char *row, int pixels, const signed char *grain) {
+    const __m256i ones = _mm256_set1_epi8(-1);
+    const __m256i bias = _mm256_set1_epi8(-128);
+    int n = pixels - pixels % 8;
+
+    for (int x = 0; x < n; x += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(row + x * 4));
+        __m256i inv = _mm256_xor_si256(v, ones);
+        __m256i c[3];
+        for (int k = 0; k < 3; k++) {
+            c[k] = clamp255_avx2(cast_rgba_avx2(inv, k));
+        }
+        __m256i out = pack_rgba_avx2(c, v);
+
+        __m256i g = _mm256_loadu_si256((const __m256i *)(grain + x * 4));
+        out = _mm256_xor_si256(_mm256_adds_epi8(_mm256_xor_si256(out, bias), g), bias);
+        _mm256_storeu_si256((__m256i *)(row + x * 4), out);
+    }
+    textured_row_rgba_scalar(row + n * 4, pixels - n, grain + n * 4);
+}
+
+__attribute__((target("avx2")))
+static void positive_row_rgba_avx2(unsigned char *row, int pixels) {
+    const __m256i byte = _mm256_set1_epi32(0xFF);
+    int n = pixels - pixels % 8;
+
+    for (int x = 0; x < n; x += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(row + x * 4));
+        __m256i c[3];
+        for (int k = 0; k < 3; k++) {
+            __m256i ch = _mm256_and_si256(_mm256_srli_epi32(v, 8 * k), byte);
+            __m256i t = _mm256_sub_epi32(ch, _mm256_set1_epi32(cast_offset[k]));
+            __m256 f = _mm256_div_ps(_mm256_cvtepi32_ps(t), _mm256_set1_ps(cast_scale[k]));
+            c[k] = _mm256_xor_si256(clamp255_avx2(_mm256_cvttps_epi32(f)), byte);
+        }
+        _mm256_storeu_si256((__m256i *)(row + x * 4), pack_rgba_avx2(c, v));
+    }
+    positive_row_rgba_scalar(row + n * 4, pixels - n);
+}
+
+const KernelSet kernels_avx2 = {
+    "avx2", avx2_supported,
+    { negative_row_rgb_avx2, textured_row_rgb_avx2, positive_row_rgb_avx2 },
+    { negative_row_rgba_avx2, textured_row_rgba_avx2, positive_row_rgba_avx2 },
+    { ycc_row_avx2, fdct_quant_avx2 }
+};
+
+// ------------------------------------------------------------- AVX-512 ---
+
+#define AVX512_BLOCK 192
+
+static int avx512_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline void widen_avx512(__m512i v, __m512i q[4]) {
+    q[0] = _mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(v, 0));
+    q[1] = _mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(v, 1));
+    q[2] = _mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(v, 2));
+    q[3] = _mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(v, 3));
+}
+
+// Clamp to [0, 255] and narrow back to bytes in order
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i narrow_avx512(const __m512i q[4]) {
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i out = _mm512_castsi128_si512(_mm512_cvtusepi32_epi8(_mm512_max_epi32(q[0], zero)));
+    out = _mm512_inserti32x4(out, _mm512_cvtusepi32_epi8(_mm512_max_epi32(q[1], zero)), 1);
+    out = _mm512_inserti32x4(out, _mm512_cvtusepi32_epi8(_mm512_max_epi32(q[2], zero)), 2);
+    return _mm512_inserti32x4(out, _mm512_cvtusepi32_epi8(_mm512_max_epi32(q[3], zero)), 3);
+}
+
+// grain_value() for sixteen pixels
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i grain_avx512(__m512i pixel, __m512i key, __m512i range, __m512i intensity) {
+    __m512i x = _mm512_xor_si512(pixel, key);
+    x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 16));
+    x = _mm512_mullo_epi32(x, _mm512_set1_epi32(0x7feb352d));
+    x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 15));
+    x = _mm512_mullo_epi32(x, _mm512_set1_epi32((int)0x846ca68bU));
+    x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 16));
+    x = _mm512_mulhi_epu16(_mm512_srli_epi32(x, 16), range);
+    return _mm512_sub_epi32(x, intensity);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void negative_row_rgb_avx512(unsigned char *row, int pixels, const GrainParams *grain) {
+    const LaneTable *lt = rgb_lane_table();
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i ones = _mm512_set1_epi8(-1);
+    const __m512i max8 = _mm512_set1_epi32(255);
+    const __m512i key = _mm512_set1_epi32((int)grain->key);
+    const __m512i range = _mm512_set1_epi16((short)(2 * grain->intensity + 1));
+    const __m512i intensity = _mm512_set1_epi32(grain->intensity);
+    int bytes = pixels * 3;
+    int n = bytes - bytes % AVX512_BLOCK;
+
+    for (int i = 0; i < n; i += AVX512_BLOCK) {
+        __m512i base = _mm512_set1_epi32((int)(grain->first_pixel + (unsigned int)(i / 3)));
+        for (int k = 0; k < AVX512_BLOCK; k += 64) {
+            __m512i v = _mm512_loadu_si512((const void *)(row + i + k));
+            __m512i q[4];
+            widen_avx512(_mm512_xor_si512(v, ones), q);
+            for (int j = 0; j < 4; j++) {
+                __m512 f = _mm512_cvtepi32_ps(q[j]);
+                f = _mm512_mul_ps(f, _mm512_loadu_ps(lt->scale + k + 16 * j));
+                f = _mm512_add_ps(f, _mm512_loadu_ps(lt->offset_f + k + 16 * j));
+                __m512i cast = _mm512_min_epi32(_mm512_max_epi32(_mm512_cvttps_epi32(f), zero), max8);
+
+                __m512i pixel = _mm512_add_epi32(base, _mm512_loadu_si512((const void *)(lt->pixel + k + 16 * j)));
+                q[j] = _mm512_add_epi32(cast, grain_avx512(pixel, key, range, intensity));
+            }
+            __m512i out = narrow_avx512(q);
+            _mm512_storeu_si512((void *)(row + i + k), out);
+        }
+    }
+
+    GrainParams tail = tail_grain(grain, n / 3);
+    negative_row_rgb_scalar(row + n, (bytes - n) / 3, &tail);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void textured_row_rgb_avx512(unsigned char *row, int pixels, const signed char *grain) {
+    const LaneTable *lt = rgb_lane_table();
+    const __m512i ones = _mm512_set1_epi8(-1);
+    const __m512i bias = _mm512_set1_epi8(-128);
+    int bytes = pixels * 3;
+    int n = bytes - bytes % AVX512_BLOCK;
+
+    for (int i = 0; i < n; i += AVX512_BLOCK) {
+        for (int k = 0; k < AVX512_BLOCK; k += 64) {
+            __m512i v = _mm512_loadu_si512((const void *)(row + i + k));
+            __m512i q[4];
+            widen_avx512(_mm512_xor_si512(v, ones), q);
+            for (int j = 0; j < 4; j++) {
+                __m512 f = _mm512_cvtepi32_ps(q[j]);
+                f = _mm512_mul_ps(f, _mm512_loadu_ps(lt->scale + k + 16 * j));
+                f = _mm512_add_ps(f, _mm512_loadu_ps(lt->offset_f + k + 16 * j));
+                q[j] = _mm512_cvttps_epi32(f);
+            }
+            __m512i out = narrow_avx512(q);
+
+            __m512i g = _mm512_loadu_si512((const void *)(grain + i + k));
+            out = _mm512_xor_si512(_mm512_adds_epi8(_mm512_xor_si512(out, bias), g), bias);
+            _mm512_storeu_si512((void *)(row + i + k), out);
+        }
+    }
+    textured_row_rgb_scalar(row + n, (bytes - n) / 3, grain + n);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void positive_row_rgb_avx512(unsigned char *row, int pixels) {
+    const LaneTable *lt = rgb_lane_table();
+    const __m512i ones = _mm512_set1_epi8(-1);
+    int bytes = pixels * 3;
+    int n = bytes - bytes % AVX512_BLOCK;
+
+    for (int i = 0; i < n; i += AVX512_BLOCK) {
+        for (int k = 0; k < AVX512_BLOCK; k += 64) {
+            __m512i v = _mm512_loadu_si512((const void *)(row + i + k));
+            __m512i q[4];
+            widen_avx512(v, q);
+            for (int j = 0; j < 4; j++) {
+                __m512i t = _mm512_sub_epi32(q[j], _mm512_loadu_si512((const void *)(lt->offset_i + k + 16 * j)));
+                __m512 f = _mm512_div_ps(_mm512_cvtepi32_ps(t), _mm512_loadu_ps(lt->scale + k + 16 * j));
+                q[j] = _mm512_cvttps_epi32(f);
+            }
+            __m512i out = _mm512_xor_si512(narrow_avx512(q), ones);
+            _mm512_storeu_si512((void *)(row + i + k), out);
+        }
+    }
+    positive_row_rgb_scalar(row + n, (bytes - n) / 3);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i clamp255_avx512(__m512i x) {
+    return _mm512_min_epi32(_mm512_max_epi32(x, _mm512_setzero_si512()), _mm512_set1_epi32(255));
+}
+
+// Channel c of sixteen RGBA pixels through the film cast (unclamped)
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i cast_rgba_avx512(__m512i inv, int c) {
+    __m512i ch = _mm512_and_si512(_mm512_srli_epi32(inv, 8 * c), _mm512_set1_epi32(0xFF));
+    __m512 f = _mm512_mul_ps(_mm512_cvtepi32_ps(ch), _mm512_set1_ps(cast_scale[c]));
+    f = _mm512_add_ps(f, _mm512_set1_ps((float)cast_offset[c]));
+    return _mm512_cvttps_epi32(f);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i pack_rgba_avx512(const __m512i c[3], __m512i v) {
+    __m512i out = _mm512_and_si512(v, _mm512_set1_epi32((int)0xFF000000U));
+    out = _mm512_or_si512(out, c[0]);
+    out = _mm512_or_si512(out, _mm512_slli_epi32(c[1], 8));
+    return _mm512_or_si512(out, _mm512_slli_epi32(c[2], 16));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void negative_row_rgba_avx512(unsigned char *row, int pixels, const GrainParams *grain) {
+    const __m512i ones = _mm512_set1_epi8(-1);
+    const __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i key = _mm512_set1_epi32((int)grain->key);
+    const __m512i range = _mm512_set1_epi16((short)(2 * grain->intensity + 1));
+    const __m512i intensity = _mm512_set1_epi32(grain->intensity);
+    int n = pixels - pixels % 16;
+
+    for (int x = 0; x < n; x += 16) {
+        __m512i v = _mm512_loadu_si512((const void *)(row + x * 4));
+        __m512i inv = _mm512_xor_si512(v, ones);
+        __m512i pixel = _mm512_add_epi32(_mm512_set1_epi32((int)(grain->first_pixel + (unsigned int)x)), lane);
+        __m512i g = grain_avx512(pixel, key, range, intensity);
+        __m512i c[3];
+        for (int k = 0; k < 3; k++) {
+            c[k] = clamp255_avx512(_mm512_add_epi32(clamp255_avx512(cast_rgba_avx512(inv, k)), g));
+        }
+        _mm512_storeu_si512((void *)(row + x * 4), pack_rgba_avx512(c, v));
+    }
+
+    GrainParams tail = tail_grain(grain, n);
+    negative_row_rgba_scalar(row + n * 4, pixels - n, &tail);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void textured_row_rgba_avx512(unsigned char *row, int pixels, const signed char *grain) {
+    const __m512i ones = _mm512_set1_epi8(-1);
+    const __m512i bias = _mm512_set1_epi8(-128);
+    int n = pixels - pixels % 16;
+
+    for (int x = 0; x < n; x += 16) {
+        __m512i v = _mm512_loadu_si512((const void *)(row + x * 4));
+        __m512i inv = _mm512_xor_si512(v, ones);
+        __m512i c[3];
+        for (int k = 0; k < 3; k++) {
+            c[k] = clamp255_avx512(cast_rgba_avx512(inv, k));
+        }
+        __m512i out = pack_rgba_avx512(c, v);
+
+        __m512i g = _mm512_loadu_si512((const void *)(grain + x * 4));
+        out = _mm512_xor_si512(_mm512_adds_epi8(_mm512_xor_si512(out, bias), g), bias);
+        _mm512_storeu_si512((void *)(row + x * 4), out);
+    }
+    textured_row_rgba_scalar(row + n * 4, pixels - n, grain + n * 4);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void positive_row_rgba_avx512(unsigned char *row, int pixels) {
+    const __m512i byte = _mm512_set1_epi32(0xFF);
+    int n = pixels - pixels % 16;
+
+    for (int x = 0; x < n; x += 16) {
+        __m512i v = _mm512_loadu_si512((const void *)(row + x * 4));
+        __m512i c[3];
+        for (int k = 0; k < 3; k++) {
+            __m512i ch = _mm512_and_si512(_mm512_srli_epi32(v, 8 * k), byte);
+            __m512i t = _mm512_sub_epi32(ch, _mm512_set1_epi32(cast_offset[k]));
+            __m512 f = _mm512_div_ps(_mm512_cvtepi32_ps(t), _mm512_set1_ps(cast_scale[k]));
+            c[k] = _mm512_xor_si512(clamp255_avx512(_mm512_cvttps_epi32(f)), byte);
+        }
+        _mm512_storeu_si512((void *)(row + x * 4), pack_rgba_avx512(c, v));
+    }
+    positive_row_rgba_scalar(row + n * 4, pixels - n);
+}
+
+const KernelSet kernels_avx512 = {
+    "avx512", avx512_supported,
+    { negative_row_rgb_avx512, textured_row_rgb_avx512, positive_row_rgb_avx512 },
+    { negative_row_rgba_avx512, textured_row_rgba_avx512, positive_row_rgba_avx512 },
+    { ycc_row_avx2, fdct_quant_avx2 }   // AVX-512 CPUs all have AVX2
+};
+
+#else // Non-x86 targets: only the scalar kernels exist
+
+static int simd_unsupported(void) {
+    return 0;
+}
+
+#define SCALAR_ROWS \
+    { negative_row_rgb_scalar, textured_row_rgb_scalar, positive_row_rgb_scalar }, \
+    { negative_row_rgba_scalar, textured_row_rgba_scalar, positive_row_rgba_scalar }, \
+    { NULL, NULL }
+
+const KernelSet kernels_sse2 = { "sse2", simd_unsupported, SCALAR_ROWS };
+const KernelSet kernels_avx2 = { "avx2", simd_unsupported, SCALAR_ROWS };
+const KernelSet kernels_avx512 = { "avx512", simd_unsupported, SCALAR_ROWS };
+
+#endif
@@ -2,193 +2,586 @@
  * Film Processor Library Implementation
  */
 
+#include "film_kernels.h"
+
+// Decoded images land in aligned, tail-padded buffers, zeroed because a
+// pooled block still holds an earlier image
+#define STBI_MALLOC(size) image_buffer_calloc(size)
+#define STBI_REALLOC_SIZED(ptr, old_size, new_size) image_buffer_realloc(ptr, old_size, new_size)
+#define STBI_FREE(ptr) image_buffer_release(ptr)
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
 #include "film_processor.h"
+#include "thread_pool.h"
+#include "jpeg_encoder.h"
+#include "jpeg_decoder.h"
+#include "qoi_codec.h"
+#include "codec_libjpeg.h"
+#include "buffer_pool.h"
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <errno.h>
+#include <pthread.h>
 
-// Clamp value between 0 and 255
-static unsigned char clamp(int value) {
-    if (value < 0) return 0;
-    if (value > 255) return 255;
-    return (unsigned char)value;
+// Fresh grain seed per call, without any shared lock: clock jitter mixed
+// with an atomic call counter
+unsigned int new_grain_seed(void) {
+    static unsigned int counter = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    unsigned int n = __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+    return grain_key((unsigned int)ts.tv_nsec ^ (unsigned int)ts.tv_sec * 2654435761U ^ n * 0x85ebca6bU);
 }
 
-// Generate random number for grain
-static int random_grain(int range) {
-    return (rand() % (range * 2 + 1)) - range;
+// Default backend: stb_image decodes (QOI through its own codec, as it is
+// not an stb_image format), the built-in decoder splits JPEGs with restart
+// markers across threads and serves sequential JPEG previews, and the
+// built-in strip encoder writes JPEG
+static int stb_probe(const unsigned char *data, size_t size, int *width, int *height, int *channels) {
+    if (qoi_probe(data, size)) return qoi_info(data, size, width, height, channels);
+    return stbi_info_from_memory(data, (int)size, width, height, channels);
 }
 
-// Invert colors
-static void apply_negative(unsigned char *img, int width, int height, int channels) {
-    for (int i = 0; i < width * height; i++) {
-        int idx = i * channels;
-        img[idx] = 255 - img[idx];
-        img[idx + 1] = 255 - img[idx + 1];
-        img[idx + 2] = 255 - img[idx + 2];
+static ImageBuffer stb_decode(const unsigned char *data, size_t size, int max_threads,
+                              char *error, size_t error_size) {
+    ImageBuffer image = {0};
+    if (jpeg_probe(data, size)) {
+        image = jpeg_decode_parallel(data, size, NULL, max_threads);
+        if (image.data) return image;
+    }
+    if (qoi_probe(data, size)) {
+        image = qoi_decode(data, size);
+        if (image.data == NULL) snprintf(error, error_size, "Failed to load image: corrupt QOI or out of memory");
+        return image;
+    }
+
+    int width, height, channels;
+    unsigned char *img = stbi_load_from_memory(data, (int)size, &width, &height, &channels, 0);
+    if (img == NULL) {
+        snprintf(error, error_size, "Failed to load image: %s", stbi_failure_reason());
+        return image;
     }
+    image = image_buffer_wrap(img, width, height, channels, 0);
+    image.base = img;
+    image.owns = 1;
+    return image;
 }
 
-// Apply orange color cast
-static void apply_film_color_cast(unsigned char *img, int width, int height, int channels) {
-    for (int i = 0; i < width * height; i++) {
-        int idx = i * channels;
-        unsigned char r = img[idx];
-        unsigned char g = img[idx + 1];
-        unsigned char b = img[idx + 2];
+// QOI, and JPEGs the parallel decoder takes, are decoded straight into the
+// caller's buffer. stb_image has no such entry point, but its allocations
+// come from the buffer pool (STBI_MALLOC), so other inputs go through
+// stb_decode without a fresh mapping each time.
+static int stb_decode_into(const unsigned char *data, size_t size, const ImageBuffer *dest, int max_threads) {
+    if (jpeg_probe(data, size)) return jpeg_decode_parallel(data, size, dest, max_threads).data != NULL;
+    if (qoi_probe(data, size)) return qoi_decode_into(data, size, dest);
+    return 0;
+}
 
-        img[idx] = clamp((int)(r * 1.15f + 20));
-        img[idx + 1] = clamp((int)(g * 1.05f + 10));
-        img[idx + 2] = clamp((int)(b * 0.85f));
-    }
+static ImageBuffer stb_decode_scaled(const unsigned char *data, size_t size, int scale) {
+    ImageBuffer image = {0};
+    if (!jpeg_probe(data, size)) return image;
+    return jpeg_decode_scaled(data, size, scale);
 }
 
-// Remove orange color cast
-static void remove_film_color_cast(unsigned char *img, int width, int height, int channels) {
-    for (int i = 0; i < width * height; i++) {
-        int idx = i * channels;
-        unsigned char r = img[idx];
-        unsigned char g = img[idx + 1];
-        unsigned char b = img[idx + 2];
+static const ImageCodec stb_codec = {
+    "stb", stb_probe, stb_decode, stb_decode_into, stb_decode_scaled, jpeg_encode
+};
 
-        img[idx] = clamp((int)((r - 20) / 1.15f));
-        img[idx + 1] = clamp((int)((g - 10) / 1.05f));
-        img[idx + 2] = clamp((int)(b / 0.85f));
-    }
+static const ImageCodec *active_codec = &stb_codec;
+
+const ImageCodec *find_image_codec(const char *name) {
+    if (!name) return NULL;
+    if (strcmp(name, stb_codec.name) == 0) return &stb_codec;
+    const ImageCodec *libjpeg = libjpeg_codec();
+    if (libjpeg && strcmp(name, libjpeg->name) == 0) return libjpeg;
+    return NULL;
 }
 
-// Add film grain
-static void apply_grain(unsigned char *img, int width, int height, int channels, int intensity) {
-    for (int i = 0; i < width * height; i++) {
-        int idx = i * channels;
-        int grain = random_grain(intensity);
-        img[idx] = clamp(img[idx] + grain);
-        img[idx + 1] = clamp(img[idx + 1] + grain);
-        img[idx + 2] = clamp(img[idx + 2] + grain);
-    }
+void set_image_codec(const ImageCodec *codec) {
+    active_codec = codec ? codec : &stb_codec;
 }
 
-// Draw sprocket holes
-static void draw_sprocket_holes(unsigned char *img, int width, int height, int channels) {
-    int border_height = height / 15;
-    int hole_width = width / 25;
-    int hole_height = border_height / 2;
-    int spacing = width / 12;
+const ImageCodec *get_image_codec(void) {
+    return active_codec;
+}
 
-    for (int y = 0; y < border_height; y++) {
-        for (int x = 0; x < width; x++) {
-            int top_idx = (y * width + x) * channels;
-            int bottom_idx = ((height - 1 - y) * width + x) * channels;
+// Largest decode scale (1/2, 1/4 or 1/8) whose longer side still reaches
+// `max_dimension`; 1 for anything else
+static int pick_decode_scale(int width, int height, int max_dimension) {
+    if (max_dimension <= 0) return 1;
+    int longer = width > height ? width : height;
+    int scale = 8;
+    while (scale > 1 && (longer + scale - 1) / scale < max_dimension) scale /= 2;
+    return scale;
+}
 
-            img[top_idx] = 220;
-            img[top_idx + 1] = 150;
-            img[top_idx + 2] = 130;
-            img[bottom_idx] = 220;
-            img[bottom_idx + 1] = 150;
-            img[bottom_idx + 2] = 130;
-        }
+// Backend that decodes the input (the active one, or the default for
+// inputs it does not take) and the size it declares; NULL if neither
+// recognizes the header
+static const ImageCodec *probe_input(const unsigned char *input_data, size_t input_size,
+                                     int *width, int *height, int *channels) {
+    if (active_codec->probe(input_data, input_size, width, height, channels)) return active_codec;
+    if (active_codec != &stb_codec && stb_codec.probe(input_data, input_size, width, height, channels)) {
+        return &stb_codec;
     }
+    return NULL;
+}
 
-    for (int hole_num = 0; hole_num < width / spacing; hole_num++) {
-        int hole_x = hole_num * spacing + spacing / 4;
-        for (int y = border_height / 4; y < border_height / 4 + hole_height; y++) {
-            for (int x = hole_x; x < hole_x + hole_width && x < width; x++) {
-                int top_idx = (y * width + x) * channels;
-                int bottom_idx = ((height - 1 - y) * width + x) * channels;
+int probe_image(const unsigned char *input_data, size_t input_size,
+                int *width, int *height, int *channels) {
+    return probe_input(input_data, input_size, width, height, channels) != NULL;
+}
 
-                img[top_idx] = 240;
-                img[top_idx + 1] = 240;
-                img[top_idx + 2] = 240;
-                img[bottom_idx] = 240;
-                img[bottom_idx + 1] = 240;
-                img[bottom_idx + 2] = 240;
-            }
+// Decode the input to pixels through `codec`. An input that may shrink by
+// half or more is decoded straight to that size when the backend can;
+// anything else is decoded at full size.
+static ImageBuffer decode_input(const ImageCodec *codec, const unsigned char *input_data, size_t input_size,
+                                int width, int height, int max_dimension, int max_threads,
+                                int *decode_scale, char *error, size_t error_size) {
+    ImageBuffer image = {0};
+    int scale = pick_decode_scale(width, height, max_dimension);
+    if (scale > 1 && codec->decode_scaled) {
+        image = codec->decode_scaled(input_data, input_size, scale);
+        if (image.data) {
+            *decode_scale = scale;
+            return image;
         }
     }
+    return codec->decode(input_data, input_size, max_threads, error, error_size);
 }
 
-// Remove sprocket holes
-static void crop_sprocket_holes(unsigned char *img, int width, int height, int channels) {
-    int border_height = height / 15;
-
-    for (int y = 0; y < border_height; y++) {
-        for (int x = 0; x < width; x++) {
-            int top_idx = (y * width + x) * channels;
-            int bottom_idx = ((height - 1 - y) * width + x) * channels;
+int decode_image_into(const unsigned char *input_data, size_t input_size, const ImageBuffer *dest,
+                      char *error, size_t error_size) {
+    int width, height, channels;
+    const ImageCodec *codec = probe_input(input_data, input_size, &width, &height, &channels);
+    if (!codec) {
+        snprintf(error, error_size, "Failed to load image: unknown format or corrupt header");
+        return 0;
+    }
+    if (!dest || !dest->data || dest->width != width || dest->height != height || dest->channels != channels) {
+        snprintf(error, error_size, "Destination is not %dx%d with %d channels", width, height, channels);
+        return 0;
+    }
+    if (codec->decode_into && codec->decode_into(input_data, input_size, dest, 0)) return 1;
 
-            img[top_idx] = 0;
-            img[top_idx + 1] = 0;
-            img[top_idx + 2] = 0;
-            img[bottom_idx] = 0;
-            img[bottom_idx + 1] = 0;
-            img[bottom_idx + 2] = 0;
-        }
+    ImageBuffer image = codec->decode(input_data, input_size, 0, error, error_size);
+    if (!image.data) return 0;
+    for (int y = 0; y < height; y++) {
+        memcpy(dest->data + (size_t)y * dest->stride, image.data + (size_t)y * image.stride,
+               (size_t)width * channels);
     }
+    image_buffer_free(&image);
+    return 1;
 }
 
-// Main processing function
-ImageResult process_image(const unsigned char *input_data, size_t input_size, ProcessMode mode) {
-    ImageResult result = {0};
+// Pixel budget: limits from init_pixel_budget (0 = none) and the pixels
+// of the images admitted and not yet released
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    long long max_pixels;
+    long long inflight_limit;
+    int wait_ms;
+    long long inflight;
+} budget = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0 };
+
+void init_pixel_budget(const PixelBudgetConfig *config) {
+    budget.max_pixels = (config && config->max_megapixels > 0) ?
+        (long long)(config->max_megapixels * 1e6) : 0;
+    budget.inflight_limit = (config && config->inflight_megapixels > 0) ?
+        (long long)(config->inflight_megapixels * 1e6) : 0;
+    budget.wait_ms = (config && config->wait_ms > 0) ? config->wait_ms : 0;
+}
 
-    // Initialize random seed
-    static int seeded = 0;
-    if (!seeded) {
-        srand(time(NULL));
-        seeded = 1;
+static int over_inflight_budget(long long pixels) {
+    return budget.inflight_limit > 0 && budget.inflight > 0 &&
+        budget.inflight + pixels > budget.inflight_limit;
+}
+
+BudgetStatus acquire_pixel_budget(int width, int height) {
+    long long pixels = (long long)width * height;
+    if (budget.max_pixels > 0 && pixels > budget.max_pixels) return BUDGET_TOO_LARGE;
+
+    pthread_mutex_lock(&budget.lock);
+    if (over_inflight_budget(pixels)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += budget.wait_ms / 1000;
+        deadline.tv_nsec += (long)(budget.wait_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (over_inflight_budget(pixels)) {
+            if (pthread_cond_timedwait(&budget.released, &budget.lock, &deadline) == ETIMEDOUT &&
+                over_inflight_budget(pixels)) {
+                pthread_mutex_unlock(&budget.lock);
+                return BUDGET_BUSY;
+            }
+        }
     }
+    budget.inflight += pixels;
+    pthread_mutex_unlock(&budget.lock);
+    return BUDGET_OK;
+}
 
-    // Load image from memory
-    int width, height, channels;
-    unsigned char *img = stbi_load_from_memory(input_data, input_size, &width, &height, &channels, 0);
+void release_pixel_budget(int width, int height) {
+    pthread_mutex_lock(&budget.lock);
+    budget.inflight -= (long long)width * height;
+    pthread_cond_broadcast(&budget.released);
+    pthread_mutex_unlock(&budget.lock);
+}
 
-    if (img == NULL) {
+// Decode and process an admitted input
+static ImageResult process_admitted(const ImageCodec *codec, const unsigned char *input_data,
+                                    size_t input_size, int input_width, int input_height,
+                                    ProcessMode mode, const ProcessOptions *options) {
+    ImageResult result = {0};
+    unsigned int seed = (options && options->use_seed) ? options->seed : new_grain_seed();
+
+    // Load image from memory, at a reduced size when a preview is asked for
+    int max_dimension = options ? options->max_dimension : 0;
+    int decode_scale = 1;
+    ImageBuffer image = decode_input(codec, input_data, input_size, input_width, input_height,
+                                     max_dimension, options ? options->max_threads : 0, &decode_scale,
+                                     result.error_message, sizeof(result.error_message));
+    if (image.data == NULL) {
         result.success = 0;
-        snprintf(result.error_message, sizeof(result.error_message),
-                "Failed to load image: %s", stbi_failure_reason());
         return result;
     }
 
-    if (channels < 3) {
+    if (image.channels < 3) {
         result.success = 0;
         snprintf(result.error_message, sizeof(result.error_message),
                 "Image must have at least 3 channels (RGB)");
-        stbi_image_free(img);
+        image_buffer_free(&image);
         return result;
     }
 
-    // Apply processing based on mode
+    // The scaled decode lands between max_dimension and twice that; area
+    // averaging takes the longer side the rest of the way
+    int longer = image.width > image.height ? image.width : image.height;
+    if (max_dimension > 0 && longer > max_dimension) {
+        int width = image.width >= image.height ? max_dimension :
+            (int)(((long long)image.width * max_dimension + longer / 2) / longer);
+        int height = image.height >= image.width ? max_dimension :
+            (int)(((long long)image.height * max_dimension + longer / 2) / longer);
+        ImageBuffer scaled = image_buffer_downscale(&image, width > 0 ? width : 1, height > 0 ? height : 1);
+        image_buffer_free(&image);
+        if (scaled.data == NULL) {
+            result.success = 0;
+            snprintf(result.error_message, sizeof(result.error_message),
+                    "Failed to downscale image: out of memory");
+            return result;
+        }
+        image = scaled;
+    }
+
+    // Apply processing based on mode (single fused pass over the pixels,
+    // split into row bands across the thread pool)
+    int width = image.width;
+    int height = image.height;
+    int channels = image.channels;
+    FusedJob job = { FUSED_POSITIVE, image, FILM_GRAIN_INTENSITY, NULL, seed, 1, 0, 0 };
+
     if (mode == MODE_TO_NEGATIVE) {
-        apply_negative(img, width, height, channels);
-        apply_film_color_cast(img, width, height, channels);
-        apply_grain(img, width, height, channels, 12);
-        draw_sprocket_holes(img, width, height, channels);
-    } else {
-        crop_sprocket_holes(img, width, height, channels);
-        remove_film_color_cast(img, width, height, channels);
-        apply_negative(img, width, height, channels);
+        GrainMode grain_mode = options ? options->grain_mode : GRAIN_AUTO;
+        job.texture = grain_mode == GRAIN_HASH ? NULL :
+            grain_cache_lookup(FILM_GRAIN_INTENSITY, channels);
+        job.op = job.texture ? FUSED_NEGATIVE_TEXTURED : FUSED_NEGATIVE;
+    } else if (mode == MODE_INVERT) {
+        job.op = FUSED_INVERT;
+    } else if (options && options->crop_border) {
+        // Zero-copy view of the picture rows: the border is never
+        // processed or encoded
+        int border_height = height / 15;
+        job.op = FUSED_POSITIVE_PICTURE;
+        job.image = image_buffer_view(&image, 0, border_height, width, height - 2 * border_height);
     }
+    fused_run(&job, options ? options->max_threads : 0);
 
-    // Prepare result
-    result.data = img;
-    result.width = width;
-    result.height = height;
-    result.channels = channels;
+    // Prepare result: the (possibly cropped) image owns the decoded buffer
+    result.image = job.image;
+    result.image.base = image.base;
+    result.image.owns = 1;
+    result.seed = seed;
+    result.decode_scale = decode_scale;
     result.success = 1;
     result.error_message[0] = '\0';
 
     return result;
 }
 
+// Processing with options: the header is read and the image admitted to
+// the pixel budget for the duration of the call before anything is
+// allocated for its pixels
+ImageResult process_image_ex(const unsigned char *input_data, size_t input_size, ProcessMode mode,
+                             const ProcessOptions *options) {
+    ImageResult result = {0};
+    int width, height, channels;
+    const ImageCodec *codec = probe_input(input_data, input_size, &width, &height, &channels);
+    if (!codec) {
+        snprintf(result.error_message, sizeof(result.error_message),
+                "Failed to load image: unknown format or corrupt header");
+        return result;
+    }
+
+    int admit = !(options && options->budget_held);
+    if (admit) {
+        result.budget = acquire_pixel_budget(width, height);
+        if (result.budget == BUDGET_TOO_LARGE) {
+            snprintf(result.error_message, sizeof(result.error_message),
+                    "Image too large: %dx%d is over the %.1f megapixel limit",
+                    width, height, budget.max_pixels / 1e6);
+            return result;
+        }
+        if (result.budget == BUDGET_BUSY) {
+            snprintf(result.error_message, sizeof(result.error_message),
+                    "Pixel budget busy: no room for %dx%d within %d ms", width, height, budget.wait_ms);
+            return result;
+        }
+    }
+
+    result = process_admitted(codec, input_data, input_size, width, height, mode, options);
+    if (admit) release_pixel_budget(width, height);
+    return result;
+}
+
+// Main processing function
+ImageResult process_image(const unsigned char *input_data, size_t input_size, ProcessMode mode) {
+    return process_image_ex(input_data, input_size, mode, NULL);
+}
+
+// Streaming pipeline state: decoded bands are copied into the encoder's
+// window of rows, and each full window is processed and coded
+typedef struct {
+    JpegStream *stream;
+    FusedJob job;              // image and first_row are set per window
+    ImageBuffer window;
+    int window_first;          // Output row of the window's first row
+    int crop_top;              // Input rows dropped above the output (border=crop)
+    int out_height;
+    int max_threads;
+    int flushed;               // Some output has been written
+    int failed;
+} StreamPipeline;
+
+static int pipeline_flush(StreamPipeline *p) {
+    p->job.image = p->window;
+    p->job.first_row = p->window_first;
+    fused_run(&p->job, p->max_threads);
+    p->flushed = 1;
+    if (!jpeg_stream_flush(p->stream)) return 0;
+    p->window = jpeg_stream_window(p->stream, &p->window_first);
+    return 1;
+}
+
+static void pipeline_rows(void *context, const JpegCoefficients *image, const ImageBuffer *rows, int y) {
+    StreamPipeline *p = context;
+    size_t row_bytes = (size_t)image->width * rows->channels;
+
+    for (int r = 0; r < rows->height && !p->failed; r++) {
+        int out_row = y + r - p->crop_top;
+        if (out_row < 0 || out_row >= p->out_height) continue;
+
+        memcpy(p->window.data + (size_t)(out_row - p->window_first) * p->window.stride,
+               rows->data + (size_t)r * rows->stride, row_bytes);
+        if (out_row + 1 == p->window_first + p->window.height && !pipeline_flush(p)) p->failed = 1;
+    }
+}
+
+// Decode, process and encode a band of rows at a time
+int process_image_stream(const unsigned char *input_data, size_t input_size, ProcessMode mode,
+                         const ProcessOptions *options, const EncodeOptions *encode,
+                         WriteFn write, void *context) {
+    int width, height, channels;
+    if (active_codec != &stb_codec ||
+        (options && options->max_dimension > 0) || (encode && encode->format != IMAGE_FORMAT_JPEG) ||
+        !jpeg_probe(input_data, input_size) ||
+        !stbi_info_from_memory(input_data, input_size, &width, &height, &channels) || channels < 3) {
+        return 0;
+    }
+
+    StreamPipeline p;
+    memset(&p, 0, sizeof(p));
+    p.max_threads = options ? options->max_threads : 0;
+    p.out_height = height;
+    p.job.seed = (options && options->use_seed) ? options->seed : new_grain_seed();
+    p.job.grain_intensity = FILM_GRAIN_INTENSITY;
+    p.job.frame_height = height;
+
+    if (mode == MODE_TO_NEGATIVE) {
+        GrainMode grain_mode = options ? options->grain_mode : GRAIN_AUTO;
+        p.job.texture = grain_mode == GRAIN_HASH ? NULL :
+            grain_cache_lookup(FILM_GRAIN_INTENSITY, channels);
+        p.job.op = p.job.texture ? FUSED_NEGATIVE_TEXTURED : FUSED_NEGATIVE;
+    } else if (mode == MODE_INVERT) {
+        p.job.op = FUSED_INVERT;
+    } else if (options && options->crop_border) {
+        p.crop_top = height / 15;
+        p.out_height = height - 2 * p.crop_top;
+        p.job.op = FUSED_POSITIVE_PICTURE;
+    } else {
+        p.job.op = FUSED_POSITIVE;
+    }
+
+    p.stream = jpeg_stream_begin(width, p.out_height, channels, encode, write, context);
+    if (!p.stream) return 0;
+    p.window = jpeg_stream_window(p.stream, &p.window_first);
+
+    int decoded = jpeg_decode_pixels(input_data, input_size, pipeline_rows, &p, p.max_threads);
+    int ok = jpeg_stream_end(p.stream);
+    if (decoded && ok && !p.failed) return 1;
+    return p.flushed ? -1 : 0;
+}
+
 // Free image result
 void free_image_result(ImageResult *result) {
-    if (result && result->data) {
-        stbi_image_free(result->data);
-        result->data = NULL;
+    if (result) {
+        image_buffer_free(&result->image);
+    }
+}
+
+// Transform-domain inversion; the coefficients never become pixels
+int invert_jpeg(const unsigned char *input_data, size_t input_size, const EncodeOptions *options,
+                WriteFn write, void *context) {
+    // The source's own Huffman codes serve unless fitted tables are asked
+    // for: one pass over the scans and no coefficient blocks
+    if (!(options && options->optimize_huffman) &&
+        jpeg_invert_entropy(input_data, input_size, write, context)) {
+        if (options && options->stats) {
+            options->stats->quality = 0;
+            options->stats->passes = 1;
+            options->stats->over_budget = 0;
+        }
+        return 1;
+    }
+
+    JpegCoefficients coefficients;
+    if (!jpeg_decode_coefficients(input_data, input_size, &coefficients)) return 0;
+
+    jpeg_coefficients_invert(&coefficients);
+    int ok = jpeg_encode_coefficients(&coefficients, options, write, context);
+    jpeg_coefficients_free(&coefficients);
+    return ok ? 1 : -1;
+}
+
+// Encode JPEG through the caller's sink; no temporary files
+int encode_jpeg(const ImageBuffer *image, const EncodeOptions *options,
+                WriteFn write, void *context) {
+    return active_codec->encode_jpeg(image, options, write, context);
+}
+
+// stb_image_write callback forwarding to a WriteFn
+typedef struct {
+    WriteFn write;
+    void *context;
+} StbSink;
+
+static void stb_sink_write(void *context, void *data, int size) {
+    StbSink *sink = context;
+    sink->write(sink->context, data, (size_t)size);
+}
+
+int encode_image(const ImageBuffer *image, const EncodeOptions *options,
+                 WriteFn write, void *context) {
+    ImageFormat format = options ? options->format : IMAGE_FORMAT_JPEG;
+    if (format == IMAGE_FORMAT_JPEG) return encode_jpeg(image, options, write, context);
+    if (format == IMAGE_FORMAT_QOI) return qoi_encode(image, write, context);
+
+    if (!image || !image->data || image->width <= 0 || image->height <= 0) return 0;
+
+    StbSink sink = { write, context };
+    int width = image->width;
+    int height = image->height;
+    int channels = image->channels;
+    if (format == IMAGE_FORMAT_PNG) {
+        return stbi_write_png_to_func(stb_sink_write, &sink, width, height, channels,
+                                      image->data, (int)image->stride);
+    }
+    if (format != IMAGE_FORMAT_BMP) return 0;
+
+    // stb's BMP writer takes no stride: pack strided rows first
+    size_t row_bytes = (size_t)width * channels;
+    if (image->stride == row_bytes) {
+        return stbi_write_bmp_to_func(stb_sink_write, &sink, width, height, channels, image->data);
+    }
+    unsigned char *packed = malloc(row_bytes * height);
+    if (!packed) return 0;
+    for (int y = 0; y < height; y++) {
+        memcpy(packed + y * row_bytes, image->data + y * image->stride, row_bytes);
+    }
+    int ok = stbi_write_bmp_to_func(stb_sink_write, &sink, width, height, channels, packed);
+    free(packed);
+    return ok;
+}
+
+const char *image_format_mime_type(ImageFormat format) {
+    switch (format) {
+        case IMAGE_FORMAT_PNG: return "image/png";
+        case IMAGE_FORMAT_BMP: return "image/bmp";
+        case IMAGE_FORMAT_QOI: return "image/qoi";
+        default: return "image/jpeg";
+    }
+}
+
+void output_buffer_write(void *context, const void *data, size_t size) {
+    OutputBuffer *buffer = context;
+    if (buffer->failed) return;
+
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 64 * 1024;
+        while (capacity < buffer->size + size) capacity *= 2;
+        unsigned char *grown = realloc(buffer->data, capacity);
+        if (!grown) {
+            buffer->failed = 1;
+            return;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+void output_buffer_free(OutputBuffer *buffer) {
+    if (buffer) {
+        free(buffer->data);
+        buffer->data = NULL;
+        buffer->size = 0;
+        buffer->capacity = 0;
+        buffer->failed = 0;
     }
 }
+
+// Precompute grain textures
+size_t init_grain_cache(const GrainCacheConfig *config) {
+    int tile_size = (config && config->tile_size > 0) ? config->tile_size : 512;
+    int variants = (config && config->variants > 0) ? config->variants : 4;
+    size_t max_bytes = (config && config->max_bytes > 0) ? config->max_bytes : 16u << 20;
+    return grain_cache_build(tile_size, variants, max_bytes);
+}
+
+// Cap the memory kept for reusing freed image buffers
+void init_buffer_pool(size_t max_bytes) {
+    buffer_pool_init(max_bytes);
+}
+
+BufferPoolStats get_buffer_pool_stats(void) {
+    return buffer_pool_stats();
+}
+
+// Size the shared processing thread pool
+int init_thread_pool(int threads) {
+    return thread_pool_init(threads);
+}
+
+// Name of the selected pixel kernel variant
+const char *get_kernel_name(void) {
+    return film_kernels()->name;
+}
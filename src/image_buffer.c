@@ -0,0 +1,181 @@
+/*
+ * Image Buffers
+ * Aligned, strided pixel storage and zero-copy views
+ */
+
+#include "film_kernels.h"
+#include "buffer_pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Aligned allocation with tail padding, drawn from the buffer pool
+void *image_buffer_malloc(size_t size) {
+    return buffer_pool_alloc(size);
+}
+
+// Zero-filled, for stb_image: on corrupt input it can return planes and
+// pixels it never wrote, which would otherwise show another request's data
+void *image_buffer_calloc(size_t size) {
+    void *ptr = buffer_pool_alloc(size);
+    if (ptr) memset(ptr, 0, size);
+    return ptr;
+}
+
+void image_buffer_release(void *ptr) {
+    buffer_pool_free(ptr);
+}
+
+// Pool blocks cannot grow in place, so move the block by hand
+void *image_buffer_realloc(void *ptr, size_t old_size, size_t new_size) {
+    void *moved = image_buffer_malloc(new_size);
+    if (moved && ptr) {
+        memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+        image_buffer_release(ptr);
+    }
+    return moved;
+}
+
+ImageBuffer image_buffer_alloc(int width, int height, int channels) {
+    ImageBuffer buffer = {0};
+    if (width <= 0 || height <= 0 || channels <= 0) return buffer;
+
+    size_t stride = ((size_t)width * channels + IMAGE_BUFFER_ALIGN - 1) &
+                    ~(size_t)(IMAGE_BUFFER_ALIGN - 1);
+    unsigned char *base = image_buffer_malloc(stride * height);
+    if (!base) return buffer;
+
+    buffer.data = base;
+    buffer.width = width;
+    buffer.height = height;
+    buffer.channels = channels;
+    buffer.stride = stride;
+    buffer.base = base;
+    buffer.owns = 1;
+    return buffer;
+}
+
+ImageBuffer image_buffer_wrap(unsigned char *data, int width, int height, int channels, size_t stride) {
+    ImageBuffer buffer = {0};
+    buffer.data = data;
+    buffer.width = width;
+    buffer.height = height;
+    buffer.channels = channels;
+    buffer.stride = stride ? stride : (size_t)width * channels;
+    return buffer;
+}
+
+ImageBuffer image_buffer_view(const ImageBuffer *src, int x, int y, int width, int height) {
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x > src->width) x = src->width;
+    if (y > src->height) y = src->height;
+    if (width > src->width - x) width = src->width - x;
+    if (height > src->height - y) height = src->height - y;
+    if (width < 0) width = 0;
+    if (height < 0) height = 0;
+
+    return image_buffer_wrap(src->data + (size_t)y * src->stride + (size_t)x * src->channels,
+                             width, height, src->channels, src->stride);
+}
+
+void image_buffer_free(ImageBuffer *buffer) {
+    if (!buffer) return;
+    if (buffer->owns) {
+        image_buffer_release(buffer->base);
+    }
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+// Area-average taps of one axis: output sample i covers source positions
+// [i * ratio, (i + 1) * ratio), and each source sample it touches weighs
+// by how much of it lies inside (the weights of a sample sum to 1)
+typedef struct {
+    int *first;            // First source sample of each output sample
+    int *count;
+    float *weight;         // count[i] weights per output sample, back to back
+    int *offset;           // Index of output sample i's first weight
+} AreaTaps;
+
+static void free_taps(AreaTaps *taps) {
+    free(taps->first);
+    free(taps->count);
+    free(taps->weight);
+    free(taps->offset);
+}
+
+static int build_taps(AreaTaps *taps, int src, int dst) {
+    double ratio = (double)src / dst;
+    taps->first = malloc((size_t)dst * sizeof(int));
+    taps->count = malloc((size_t)dst * sizeof(int));
+    taps->offset = malloc((size_t)dst * sizeof(int));
+    taps->weight = malloc(((size_t)src + 2 * (size_t)dst) * sizeof(float));
+    if (!taps->first || !taps->count || !taps->offset || !taps->weight) return 0;
+
+    int k = 0;
+    for (int i = 0; i < dst; i++) {
+        double begin = i * ratio;
+        double end = (i + 1) * ratio;
+        int first = (int)begin;
+        int last = (int)end;
+        if (last >= src || last == end) last--;
+
+        taps->first[i] = first;
+        taps->count[i] = last - first + 1;
+        taps->offset[i] = k;
+        for (int j = first; j <= last; j++) {
+            double lo = j < begin ? begin : j;
+            double hi = j + 1 > end ? end : j + 1;
+            taps->weight[k++] = (float)((hi - lo) / ratio);
+        }
+    }
+    return 1;
+}
+
+ImageBuffer image_buffer_downscale(const ImageBuffer *src, int width, int height) {
+    ImageBuffer dst = {0};
+    if (!src || !src->data || width <= 0 || height <= 0 || width > src->width || height > src->height) {
+        return dst;
+    }
+
+    int channels = src->channels;
+    size_t row_len = (size_t)width * channels;
+    AreaTaps x_taps = {0}, y_taps = {0};
+    float *row = malloc(row_len * sizeof(float));
+    float *sum = malloc(row_len * sizeof(float));
+    if (row && sum && build_taps(&x_taps, src->width, width) && build_taps(&y_taps, src->height, height)) {
+        dst = image_buffer_alloc(width, height, channels);
+    }
+
+    // Each output row sums its source rows, each filtered horizontally on
+    // the way in (a source row on a boundary is filtered twice)
+    for (int y = 0; dst.data && y < height; y++) {
+        memset(sum, 0, row_len * sizeof(float));
+        for (int j = 0; j < y_taps.count[y]; j++) {
+            const unsigned char *in = src->data + (size_t)(y_taps.first[y] + j) * src->stride;
+            float wy = y_taps.weight[y_taps.offset[y] + j];
+
+            for (int x = 0; x < width; x++) {
+                const float *w = x_taps.weight + x_taps.offset[x];
+                const unsigned char *p = in + (size_t)x_taps.first[x] * channels;
+                for (int c = 0; c < channels; c++) {
+                    float s = 0.0f;
+                    for (int i = 0; i < x_taps.count[x]; i++) s += w[i] * p[i * channels + c];
+                    row[x * channels + c] = s;
+                }
+            }
+            for (size_t i = 0; i < row_len; i++) sum[i] += wy * row[i];
+        }
+
+        unsigned char *out = dst.data + (size_t)y * dst.stride;
+        for (size_t i = 0; i < row_len; i++) {
+            float v = sum[i] + 0.5f;
+            out[i] = (unsigned char)(v >= 255.0f ? 255 : (int)v);
+        }
+    }
+
+    free(row);
+    free(sum);
+    free_taps(&x_taps);
+    free_taps(&y_taps);
+    return dst;
+}
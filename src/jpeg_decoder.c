@@ -0,0 +1,1565 @@
+/*
+ * Sequential JPEG Decoder Implementation
+ * Markers are parsed in one pass over the file; each scan's entropy-coded
+ * segment is read through a 64-bit bit buffer, with a 9-bit lookup for the
+ * common short Huffman codes and a canonical-code walk for the rest
+ * (JPEG Annex F). The quantized coefficients are the product; the pixel
+ * outputs, the reduced-size decode for previews and the stb_image-exact
+ * full-size decode, consume them one MCU row at a time.
+ */
+
+#include "jpeg_decoder.h"
+#include "thread_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+
+// Huffman codes up to this length decode with one table lookup
+#define FAST_BITS 9
+
+// Quantized DC range of 8-bit samples: the DC term is 8 * the block mean
+// of level-shifted samples, so |DC| stays under 1024 for any quantizer.
+// Keeping to it bounds every DC difference to category 11.
+#define DC_MIN (-1024)
+#define DC_MAX 1023
+
+typedef struct {
+    unsigned short fast[1 << FAST_BITS];  // length << 8 | symbol (0: longer code)
+    int maxcode[17];           // Largest code of each length (-1: none)
+    int offset[17];            // `values` index of a length's codes, less its first code
+    unsigned char values[256];
+    unsigned short code[256];  // Each symbol's code, for rewriting a scan
+    unsigned char length[256]; // Its length (0: the table has no code for it)
+    int defined;
+} HuffDecoder;
+
+typedef struct {
+    const unsigned char *p;    // Next unread byte
+    const unsigned char *end;
+    unsigned long long buf;    // Pending bits, MSB first
+    int count;
+    int marker;                // Stopped at a marker: further bits read as zero
+} BitReader;
+
+// Output of jpeg_invert_entropy, written whole once the input is known to
+// be good
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    unsigned int bit_buf;
+    int bit_cnt;
+    int failed;
+} ScanWriter;
+
+typedef struct {
+    JpegCoefficients *out;
+    HuffDecoder dc[4];
+    HuffDecoder ac[4];
+    int quant_defined;         // Bit mask of loaded DQT tables
+    int restart_interval;      // MCUs per restart interval (0: none)
+    int frame;                 // SOF seen
+    int adobe_transform;       // APP14 color transform (-1: no Adobe marker)
+    int jfif;                  // JFIF APP0 seen
+    int scanned;               // Bit mask of components decoded by a scan
+    JpegRowFn on_row;          // Row consumer (NULL: keep every block)
+    void *row_context;
+    int streaming;             // Blocks hold one MCU row, handed to on_row as it completes
+    struct ParallelDecode *parallel;   // Decode the scan on the pool instead (jpeg_decode_parallel)
+    ScanWriter *invert;        // Rewrite the file inverted instead (jpeg_invert_entropy)
+    int scale;                 // Reduced-size decode (jpeg_decode_scaled), 0 for full size
+} JpegDecoder;
+
+// Natural (row-major) index of each zigzag position
+static const unsigned char natural_order[64] = {
+    0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5, 12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static int read16(const unsigned char *p) {
+    return p[0] << 8 | p[1];
+}
+
+int jpeg_probe(const unsigned char *data, size_t size) {
+    return data && size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF;
+}
+
+// Canonical decoding tables from DHT code-length counts; 0 if the counts
+// describe more codes than fit their lengths or than `values` holds. The
+// counts are checked before each length is filled, so a corrupt table
+// never writes past `fast` or `values`.
+static int build_decoder(HuffDecoder *h, const unsigned char counts[16], const unsigned char *values) {
+    int code = 0;
+    int k = 0;
+    h->defined = 0;
+    memset(h->fast, 0, sizeof(h->fast));
+    memset(h->length, 0, sizeof(h->length));
+    for (int length = 1; length <= 16; length++) {
+        int n = counts[length - 1];
+        if (code + n > 1 << length || k + n > 256) return 0;
+        h->offset[length] = k - code;
+        for (int i = 0; i < n; i++, k++, code++) {
+            h->values[k] = values[k];
+            if (!h->length[values[k]]) {
+                h->code[values[k]] = (unsigned short)code;
+                h->length[values[k]] = (unsigned char)length;
+            }
+            if (length <= FAST_BITS) {
+                int first = code << (FAST_BITS - length);
+                for (int j = 0; j < 1 << (FAST_BITS - length); j++) {
+                    h->fast[first + j] = (unsigned short)(length << 8 | values[k]);
+                }
+            }
+        }
+        h->maxcode[length] = n ? code - 1 : -1;
+        code <<= 1;
+    }
+    h->defined = 1;
+    return 1;
+}
+
+// Top the bit buffer up to at least 57 bits, unstuffing 0xFF 0x00. At a
+// marker the reader stops in front of it and pads with zero bits.
+static void refill(BitReader *r) {
+    while (r->count <= 56) {
+        unsigned int c = 0;
+        if (!r->marker && r->p < r->end) {
+            c = *r->p;
+            if (c != 0xFF) {
+                r->p++;
+            } else if (r->p + 1 < r->end && r->p[1] == 0x00) {
+                r->p += 2;
+            } else {
+                r->marker = 1;
+                c = 0;
+            }
+        }
+        r->buf |= (unsigned long long)c << (56 - r->count);
+        r->count += 8;
+    }
+}
+
+static inline void consume(BitReader *r, int n) {
+    r->buf <<= n;
+    r->count -= n;
+}
+
+// Next Huffman symbol, or -1 for a code the table does not have
+static inline int decode_symbol(BitReader *r, const HuffDecoder *h) {
+    if (r->count < 16) refill(r);
+    int fast = h->fast[r->buf >> (64 - FAST_BITS)];
+    if (fast) {
+        consume(r, fast >> 8);
+        return fast & 255;
+    }
+
+    unsigned int bits = (unsigned int)(r->buf >> 48);
+    for (int length = FAST_BITS + 1; length <= 16; length++) {
+        int code = (int)(bits >> (16 - length));
+        if (code <= h->maxcode[length]) {
+            consume(r, length);
+            return h->values[h->offset[length] + code];
+        }
+    }
+    return -1;
+}
+
+// `bits` value bits extended to a signed value (JPEG Figure F.12)
+static inline int receive_extend(BitReader *r, int bits) {
+    if (bits == 0) return 0;
+    if (r->count < 16) refill(r);
+    int v = (int)(r->buf >> (64 - bits));
+    consume(r, bits);
+    return v < 1 << (bits - 1) ? v - (1 << bits) + 1 : v;
+}
+
+// Decode one block into zeroed `coef`; 0 on a corrupt code
+static int decode_block(BitReader *r, const HuffDecoder *dc, const HuffDecoder *ac, int *pred, short *coef) {
+    int t = decode_symbol(r, dc);
+    if (t < 0 || t > 11) return 0;
+    *pred += receive_extend(r, t);
+    if (*pred < DC_MIN || *pred > DC_MAX) return 0;
+    coef[0] = (short)*pred;
+
+    for (int k = 1; k < 64; ) {
+        int rs = decode_symbol(r, ac);
+        if (rs < 0) return 0;
+        int run = rs >> 4;
+        int bits = rs & 15;
+        if (bits == 0) {
+            if (run != 15) break;
+            k += 16;
+            continue;
+        }
+        k += run;
+        if (k > 63 || bits > 10) return 0;
+        coef[natural_order[k++]] = (short)receive_extend(r, bits);
+    }
+    return 1;
+}
+
+// Decode one block's DC into `coef`, reading past its AC terms without
+// storing them; the rest of `coef` is left as it was
+static int decode_block_dc(BitReader *r, const HuffDecoder *dc, const HuffDecoder *ac, int *pred, short *coef) {
+    int t = decode_symbol(r, dc);
+    if (t < 0 || t > 11) return 0;
+    *pred += receive_extend(r, t);
+    if (*pred < DC_MIN || *pred > DC_MAX) return 0;
+    coef[0] = (short)*pred;
+
+    for (int k = 1; k < 64; ) {
+        int rs = decode_symbol(r, ac);
+        if (rs < 0) return 0;
+        int run = rs >> 4;
+        int bits = rs & 15;
+        if (bits == 0) {
+            if (run != 15) break;
+            k += 16;
+            continue;
+        }
+        k += run + 1;
+        if (k > 64 || bits > 10) return 0;
+        if (r->count < 16) refill(r);
+        consume(r, bits);
+    }
+    return 1;
+}
+
+// Samples per block side of component `i` in a 1/scale decode: chroma
+// subsampled by 2 is decoded at twice the luma size (up to 8) so it lands
+// on the output grid
+static int scaled_size(const JpegCoefficients *image, int i, int scale) {
+    const JpegComponent *c = &image->comp[i];
+    int n = 8 / scale;
+    int fx = image->max_h / c->h;
+    int fy = image->max_v / c->v;
+    int k = 1;
+    while (n * k * 2 <= 8 && fx % (k * 2) == 0 && fy % (k * 2) == 0) k *= 2;
+    return n * k;
+}
+
+// A component reduced to one sample per block needs only its DC terms
+static int dc_only(const JpegDecoder *dec, int i) {
+    return dec->scale && scaled_size(dec->out, i, dec->scale) == 1;
+}
+
+// Resynchronize on the RSTn marker that ends a restart interval
+static int next_restart(BitReader *r) {
+    const unsigned char *p = r->p;
+    while (p + 1 < r->end && !(p[0] == 0xFF && p[1] != 0x00 && p[1] != 0xFF)) p++;
+    if (p + 1 >= r->end || p[1] < 0xD0 || p[1] > 0xD7) return 0;
+
+    r->p = p + 2;
+    r->buf = 0;
+    r->count = 0;
+    r->marker = 0;
+    return 1;
+}
+
+// MCUs across and down a scan of `ns` components. One component alone is
+// coded block by block over its own size; several are interleaved in MCUs
+// of h x v blocks each.
+static void scan_mcus(const JpegCoefficients *image, int ns, const int *scan, int *mcus_w, int *mcus_h) {
+    *mcus_w = image->mcus_per_row;
+    *mcus_h = image->mcu_rows;
+    if (ns == 1) {
+        const JpegComponent *c = &image->comp[scan[0]];
+        int w = (image->width * c->h + image->max_h - 1) / image->max_h;
+        int h = (image->height * c->v + image->max_v - 1) / image->max_v;
+        *mcus_w = (w + 7) / 8;
+        *mcus_h = (h + 7) / 8;
+    }
+}
+
+// Skip the padding bits (and anything else) after a scan up to the next marker
+static const unsigned char *scan_end(const unsigned char *p, const unsigned char *end) {
+    while (p + 1 < end && !(p[0] == 0xFF && p[1] != 0x00 && p[1] != 0xFF)) p++;
+    return p + 1 < end ? p : end;
+}
+
+// Entropy-decode one scan of `ns` components (indices in `scan`, tables in
+// `td` / `ta`) starting at `p`; returns the position of the marker that
+// follows the scan, or NULL if it is corrupt
+static const unsigned char *decode_scan(JpegDecoder *dec, const unsigned char *p, const unsigned char *end,
+                                        int ns, const int *scan, const int *td, const int *ta) {
+    JpegCoefficients *out = dec->out;
+    BitReader r = { p, end, 0, 0, 0 };
+    int pred[JPEG_MAX_COMPONENTS] = { 0 };
+    int mcus_w, mcus_h;
+    scan_mcus(out, ns, scan, &mcus_w, &mcus_h);
+    int dc[JPEG_MAX_COMPONENTS];
+    for (int i = 0; i < ns; i++) dc[i] = dc_only(dec, scan[i]);
+
+    long long mcus = (long long)mcus_w * mcus_h;
+    for (long long m = 0; m < mcus; m++) {
+        if (dec->restart_interval && m > 0 && m % dec->restart_interval == 0) {
+            if (!next_restart(&r)) return NULL;
+            memset(pred, 0, sizeof(pred));
+        }
+
+        int mx = (int)(m % mcus_w);
+        int my = (int)(m / mcus_w);
+        for (int i = 0; i < ns; i++) {
+            JpegComponent *c = &out->comp[scan[i]];
+            int h = ns == 1 ? 1 : c->h;
+            int v = ns == 1 ? 1 : c->v;
+            for (int by = 0; by < v; by++) {
+                for (int bx = 0; bx < h; bx++) {
+                    size_t row = dec->streaming ? (size_t)by : (size_t)my * v + by;
+                    size_t block = row * c->blocks_w + (size_t)mx * h + bx;
+                    short *coef = c->coef + block * 64;
+                    if (dc[i] ? !decode_block_dc(&r, &dec->dc[td[i]], &dec->ac[ta[i]], &pred[i], coef)
+                          : !decode_block(&r, &dec->dc[td[i]], &dec->ac[ta[i]], &pred[i], coef)) {
+                        return NULL;
+                    }
+                }
+            }
+        }
+
+        // A finished MCU row goes to the consumer, and its blocks are
+        // cleared for the next one (DC alone is always overwritten)
+        if (dec->streaming && mx == mcus_w - 1) {
+            short *blocks[JPEG_MAX_COMPONENTS] = { 0 };
+            for (int i = 0; i < out->components; i++) blocks[i] = out->comp[i].coef;
+            dec->on_row(dec->row_context, out, my, blocks);
+            for (int i = 0; i < out->components; i++) {
+                const JpegComponent *c = &out->comp[i];
+                if (!dc_only(dec, i)) memset(c->coef, 0, (size_t)c->blocks_w * c->v * 64 * sizeof(short));
+            }
+        }
+    }
+
+    return scan_end(r.p, end);
+}
+
+// Grow the output to take `bytes` more; 0 if memory runs out
+static int scan_reserve(ScanWriter *w, size_t bytes) {
+    if (w->size + bytes <= w->capacity) return 1;
+
+    size_t capacity = w->capacity ? w->capacity * 2 : 64 * 1024;
+    while (capacity < w->size + bytes) capacity *= 2;
+    unsigned char *grown = realloc(w->data, capacity);
+    if (!grown) {
+        w->failed = 1;
+        return 0;
+    }
+    w->data = grown;
+    w->capacity = capacity;
+    return 1;
+}
+
+static int scan_append(ScanWriter *w, const unsigned char *bytes, size_t size) {
+    if (!scan_reserve(w, size)) return 0;
+    memcpy(w->data + w->size, bytes, size);
+    w->size += size;
+    return 1;
+}
+
+// Append `length` bits MSB first, stuffing a zero after every 0xFF byte
+static inline void put_bits(ScanWriter *w, unsigned int code, int length) {
+    w->bit_cnt += length;
+    w->bit_buf |= code << (24 - w->bit_cnt);
+    while (w->bit_cnt >= 8) {
+        unsigned char c = (w->bit_buf >> 16) & 255;
+        w->data[w->size++] = c;
+        if (c == 255) {
+            w->data[w->size++] = 0;
+        }
+        w->bit_buf <<= 8;
+        w->bit_cnt -= 8;
+    }
+}
+
+// Pad the last byte with 1 bits
+static void flush_bits(ScanWriter *w) {
+    put_bits(w, 0x7F, 7);
+    w->bit_buf = 0;
+    w->bit_cnt = 0;
+}
+
+// Quantizer steps the inverted DC term of `component` moves by (see
+// jpeg_coefficients_invert)
+static int invert_dc_shift(const JpegCoefficients *image, int component) {
+    int q = image->quant[image->comp[component].quant][0];
+    return component == 0 || image->rgb ? (8 + q / 2) / q : 0;
+}
+
+// Copy one block's codes from `r` to `w`, inverted as
+// jpeg_coefficients_invert would invert its coefficients: each AC value's
+// bits are complemented (v -> -v, same magnitude category and code), and
+// the DC difference is taken again between the inverted DC terms. 0 where
+// decode_block would fail, or for a DC difference the table has no code for.
+static int invert_block(BitReader *r, ScanWriter *w, const HuffDecoder *dc, const HuffDecoder *ac,
+                        int *pred, int *inverted, int shift) {
+    int t = decode_symbol(r, dc);
+    if (t < 0 || t > 11) return 0;
+    *pred += receive_extend(r, t);
+    if (*pred < DC_MIN || *pred > DC_MAX) return 0;
+    int value = -*pred - shift;
+    value = value < DC_MIN ? DC_MIN : value > DC_MAX ? DC_MAX : value;
+    int diff = value - *inverted;
+    *inverted = value;
+    int magnitude = diff < 0 ? -diff : diff;
+    int bits = magnitude ? 32 - __builtin_clz((unsigned int)magnitude) : 0;
+    if (!dc->length[bits]) return 0;
+    put_bits(w, dc->code[bits], dc->length[bits]);
+    if (diff < 0) diff--;
+    put_bits(w, (unsigned int)diff & ((1u << bits) - 1), bits);
+
+    for (int k = 1; k < 64; ) {
+        int rs = decode_symbol(r, ac);
+        if (rs < 0) return 0;
+        put_bits(w, ac->code[rs], ac->length[rs]);
+        int run = rs >> 4;
+        bits = rs & 15;
+        if (bits == 0) {
+            if (run != 15) break;
+            k += 16;
+            continue;
+        }
+        k += run + 1;
+        if (k > 64 || bits > 10) return 0;
+        if (r->count < 16) refill(r);
+        unsigned int v = (unsigned int)(r->buf >> (64 - bits));
+        consume(r, bits);
+        put_bits(w, ~v & ((1u << bits) - 1), bits);
+    }
+    return 1;
+}
+
+// decode_scan for jpeg_invert_entropy: the scan is rewritten inverted into
+// dec->invert with the same tables and restart intervals
+static const unsigned char *invert_scan(JpegDecoder *dec, const unsigned char *p, const unsigned char *end,
+                                        int ns, const int *scan, const int *td, const int *ta) {
+    const JpegCoefficients *out = dec->out;
+    ScanWriter *w = dec->invert;
+    BitReader r = { p, end, 0, 0, 0 };
+    int pred[JPEG_MAX_COMPONENTS] = { 0 };
+    int inverted[JPEG_MAX_COMPONENTS] = { 0 };
+    int shift[JPEG_MAX_COMPONENTS];
+    for (int i = 0; i < ns; i++) shift[i] = invert_dc_shift(out, scan[i]);
+    int mcus_w, mcus_h;
+    scan_mcus(out, ns, scan, &mcus_w, &mcus_h);
+
+    long long mcus = (long long)mcus_w * mcus_h;
+    for (long long m = 0; m < mcus; m++) {
+        if (dec->restart_interval && m > 0 && m % dec->restart_interval == 0) {
+            if (!next_restart(&r) || !scan_reserve(w, 8)) return NULL;
+            memset(pred, 0, sizeof(pred));
+            memset(inverted, 0, sizeof(inverted));
+            flush_bits(w);
+            w->data[w->size++] = 0xFF;
+            w->data[w->size++] = (unsigned char)(0xD0 + (m / dec->restart_interval - 1) % 8);
+        }
+
+        for (int i = 0; i < ns; i++) {
+            const JpegComponent *c = &out->comp[scan[i]];
+            int blocks = ns == 1 ? 1 : c->h * c->v;
+            for (int b = 0; b < blocks; b++) {
+                // A block is at most 64 codes of 16 + 11 bits, every byte stuffed
+                if (!scan_reserve(w, 512) ||
+                    !invert_block(&r, w, &dec->dc[td[i]], &dec->ac[ta[i]], &pred[i], &inverted[i], shift[i])) {
+                    return NULL;
+                }
+            }
+        }
+    }
+    if (!scan_reserve(w, 8)) return NULL;
+    flush_bits(w);
+    return scan_end(r.p, end);
+}
+
+static int parse_dqt(JpegDecoder *dec, const unsigned char *seg, int len) {
+    while (len > 0) {
+        int precision = seg[0] >> 4;
+        int table = seg[0] & 15;
+        int bytes = 1 + 64 * (precision + 1);
+        if (precision > 1 || table > 3 || len < bytes) return 0;
+        for (int k = 0; k < 64; k++) {
+            int q = precision ? read16(seg + 1 + 2 * k) : seg[1 + k];
+            if (q == 0) return 0;
+            dec->out->quant[table][natural_order[k]] = (unsigned short)q;
+        }
+        dec->quant_defined |= 1 << table;
+        seg += bytes;
+        len -= bytes;
+    }
+    return 1;
+}
+
+static int parse_dht(JpegDecoder *dec, const unsigned char *seg, int len) {
+    while (len > 0) {
+        if (len < 17) return 0;
+        int table_class = seg[0] >> 4;
+        int table = seg[0] & 15;
+        int total = 0;
+        for (int i = 0; i < 16; i++) total += seg[1 + i];
+        if (table_class > 1 || table > 3 || total > 256 || len < 17 + total) return 0;
+        HuffDecoder *h = table_class ? &dec->ac[table] : &dec->dc[table];
+        if (!build_decoder(h, seg + 1, seg + 17)) return 0;
+        seg += 17 + total;
+        len -= 17 + total;
+    }
+    return 1;
+}
+
+static int parse_sof(JpegDecoder *dec, const unsigned char *seg, int len) {
+    JpegCoefficients *out = dec->out;
+    if (dec->frame || len < 6) return 0;
+    int n = seg[5];
+    if (seg[0] != 8 || (n != 1 && n != JPEG_MAX_COMPONENTS) || len < 6 + 3 * n) return 0;
+
+    out->height = read16(seg + 1);
+    out->width = read16(seg + 3);
+    out->components = n;
+    if (out->width == 0 || out->height == 0) return 0;   // Height from DNL is not supported
+
+    out->max_h = 1;
+    out->max_v = 1;
+    for (int i = 0; i < n; i++) {
+        JpegComponent *c = &out->comp[i];
+        c->id = seg[6 + 3 * i];
+        c->h = n == 1 ? 1 : seg[7 + 3 * i] >> 4;
+        c->v = n == 1 ? 1 : seg[7 + 3 * i] & 15;
+        c->quant = seg[8 + 3 * i];
+        if (c->h < 1 || c->h > 4 || c->v < 1 || c->v > 4 || c->quant > 3) return 0;
+        if (c->h > out->max_h) out->max_h = c->h;
+        if (c->v > out->max_v) out->max_v = c->v;
+    }
+
+    out->mcus_per_row = (out->width + 8 * out->max_h - 1) / (8 * out->max_h);
+    out->mcu_rows = (out->height + 8 * out->max_v - 1) / (8 * out->max_v);
+    for (int i = 0; i < n; i++) {
+        JpegComponent *c = &out->comp[i];
+        // Upsampling works in whole steps, as in stb_image
+        if (out->max_h % c->h || out->max_v % c->v) return 0;
+        c->blocks_w = out->mcus_per_row * c->h;
+        c->blocks_h = out->mcu_rows * c->v;
+    }
+    dec->frame = 1;
+    return 1;
+}
+
+static const unsigned char *parallel_scan(JpegDecoder *dec, const unsigned char *p, const unsigned char *end,
+                                          int ns, const int *scan, const int *td, const int *ta);
+
+// SOS header, then its entropy-coded data; returns the position after the
+// scan (NULL on error)
+static const unsigned char *parse_sos(JpegDecoder *dec, const unsigned char *seg, int len,
+                                      const unsigned char *end) {
+    JpegCoefficients *out = dec->out;
+    if (!dec->frame || len < 1) return NULL;
+    int ns = seg[0];
+    if (ns < 1 || ns > out->components || len != 4 + 2 * ns) return NULL;
+
+    int scan[JPEG_MAX_COMPONENTS], td[JPEG_MAX_COMPONENTS], ta[JPEG_MAX_COMPONENTS];
+    for (int i = 0; i < ns; i++) {
+        int id = seg[1 + 2 * i];
+        scan[i] = -1;
+        for (int c = 0; c < out->components; c++) {
+            if (out->comp[c].id == id) scan[i] = c;
+        }
+        td[i] = seg[2 + 2 * i] >> 4;
+        ta[i] = seg[2 + 2 * i] & 15;
+        if (scan[i] < 0 || (dec->scanned & 1 << scan[i]) || td[i] > 3 || ta[i] > 3 ||
+            !dec->dc[td[i]].defined || !dec->ac[ta[i]].defined ||
+            !(dec->quant_defined & 1 << out->comp[scan[i]].quant)) {
+            return NULL;
+        }
+        dec->scanned |= 1 << scan[i];
+    }
+
+    // Sequential scans cover the whole spectrum with no successive approximation
+    const unsigned char *spectral = seg + 1 + 2 * ns;
+    if (spectral[0] != 0 || spectral[1] != 63 || spectral[2] != 0) return NULL;
+
+    // The color space is settled by now (APP markers come before the
+    // scans); stb_image's rule, so both decoders agree
+    out->rgb = out->components == 3 && ((dec->adobe_transform == 0 && !dec->jfif) ||
+        (out->comp[0].id == 'R' && out->comp[1].id == 'G' && out->comp[2].id == 'B'));
+
+    if (dec->parallel) return parallel_scan(dec, seg + len, end, ns, scan, td, ta);
+    if (dec->invert) return invert_scan(dec, seg + len, end, ns, scan, td, ta);
+
+    // Blocks are allocated at the first scan: a consumer of rows needs only
+    // one MCU row of them when that scan interleaves every component
+    if (!out->comp[0].coef) {
+        dec->streaming = dec->on_row && ns == out->components;
+        for (int i = 0; i < out->components; i++) {
+            JpegComponent *c = &out->comp[i];
+            size_t rows = dec->streaming ? (size_t)c->v : (size_t)c->blocks_h;
+            c->coef = calloc((size_t)c->blocks_w * rows, 64 * sizeof(short));
+            if (!c->coef) return NULL;
+        }
+    }
+
+    return decode_scan(dec, seg + len, end, ns, scan, td, ta);
+}
+
+// Parse and entropy-decode the whole stream into `out`, handing MCU rows to
+// `on_row` when it is set (for a 1/scale decode if `scale`, which drops
+// the AC terms it does not need), into pixels on the pool with `parallel`,
+// or rewritten inverted into `invert`
+static int decode_jpeg(const unsigned char *data, size_t size, JpegCoefficients *out,
+                       JpegRowFn on_row, void *row_context, int scale, struct ParallelDecode *parallel,
+                       ScanWriter *invert) {
+    memset(out, 0, sizeof(*out));
+    if (!jpeg_probe(data, size)) return 0;
+
+    JpegDecoder *dec = calloc(1, sizeof(JpegDecoder));
+    if (!dec) return 0;
+    dec->out = out;
+    dec->adobe_transform = -1;
+    dec->on_row = on_row;
+    dec->row_context = row_context;
+    dec->scale = scale;
+    dec->parallel = parallel;
+    dec->invert = invert;
+
+    const unsigned char *p = data + 2;
+    const unsigned char *end = data + size;
+    int ok = 0;
+    for (;;) {
+        // A file cut short after its last scan still decodes
+        if (end - p < 2) {
+            ok = dec->frame && dec->scanned == (1 << out->components) - 1;
+            break;
+        }
+        if (p[0] != 0xFF) break;
+        int marker = p[1];
+        p += 2;
+        if (marker == 0xFF) {
+            p--;               // Fill byte
+            continue;
+        }
+        if (marker == 0xD9) {
+            ok = dec->frame && dec->scanned == (1 << out->components) - 1;
+            break;
+        }
+        if (marker >= 0xD0 && marker <= 0xD7) continue;
+
+        if (end - p < 2) break;
+        int len = read16(p);
+        if (len < 2 || end - p < len) break;
+        const unsigned char *seg = p + 2;
+        len -= 2;
+        p += len + 2;
+
+        // The inverted file keeps the frame, its tables and the markers
+        // that settle its color space
+        if (invert && (marker == 0xC0 || marker == 0xC1 || marker == 0xC4 || marker == 0xDB ||
+                       marker == 0xDD || marker == 0xDA ||
+                       (marker == 0xE0 && len >= 5 && memcmp(seg, "JFIF", 5) == 0) ||
+                       (marker == 0xEE && len >= 12 && memcmp(seg, "Adobe", 5) == 0)) &&
+            !scan_append(invert, seg - 4, (size_t)len + 4)) {
+            break;
+        }
+
+        if (marker == 0xC0 || marker == 0xC1) {
+            if (!parse_sof(dec, seg, len)) break;
+        } else if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            break;             // Progressive, lossless, hierarchical or arithmetic
+        } else if (marker == 0xC4) {
+            if (!parse_dht(dec, seg, len)) break;
+        } else if (marker == 0xDB) {
+            if (!parse_dqt(dec, seg, len)) break;
+        } else if (marker == 0xDD) {
+            if (len < 2) break;
+            dec->restart_interval = read16(seg);
+        } else if (marker == 0xDA) {
+            p = parse_sos(dec, seg, len, end);
+            if (!p) break;
+        } else if (marker == 0xDC) {
+            break;             // DNL
+        } else if (marker == 0xE0 && len >= 5 && memcmp(seg, "JFIF", 5) == 0) {
+            dec->jfif = 1;
+        } else if (marker == 0xEE && len >= 12 && memcmp(seg, "Adobe", 5) == 0) {
+            dec->adobe_transform = seg[11];
+        }
+    }
+
+    // Blocks kept whole (one scan per component) reach the consumer now
+    if (ok && on_row && !dec->streaming) {
+        for (int my = 0; my < out->mcu_rows; my++) {
+            short *blocks[JPEG_MAX_COMPONENTS] = { 0 };
+            for (int i = 0; i < out->components; i++) {
+                const JpegComponent *c = &out->comp[i];
+                blocks[i] = c->coef + (size_t)my * c->v * c->blocks_w * 64;
+            }
+            on_row(row_context, out, my, blocks);
+        }
+    }
+    free(dec);
+    if (!ok) jpeg_coefficients_free(out);
+    return ok;
+}
+
+int jpeg_decode_coefficients(const unsigned char *data, size_t size, JpegCoefficients *out) {
+    return decode_jpeg(data, size, out, NULL, NULL, 0, NULL, NULL);
+}
+
+int jpeg_decode_rows(const unsigned char *data, size_t size, JpegRowFn fn, void *context) {
+    JpegCoefficients image;
+    int ok = decode_jpeg(data, size, &image, fn, context, 0, NULL, NULL);
+    jpeg_coefficients_free(&image);
+    return ok;
+}
+
+void jpeg_coefficients_free(JpegCoefficients *coefficients) {
+    if (!coefficients) return;
+    for (int i = 0; i < JPEG_MAX_COMPONENTS; i++) free(coefficients->comp[i].coef);
+    memset(coefficients, 0, sizeof(*coefficients));
+}
+
+// A level-shifted sample s becomes 255 - (s + 128) - 128 = -s - 1. The DCT
+// is linear, so every coefficient is negated; the -1 is a flat block
+// whose only term is DC = -8, which the quantizer can carry exactly when
+// it divides 8 (otherwise the nearest step, within one sample level).
+// Chroma of an inverted RGB image is exactly negated (Cb and Cr have no
+// constant term), so only luma, or every channel of an RGB JPEG, shifts.
+void jpeg_coefficients_invert(JpegCoefficients *coefficients) {
+    for (int i = 0; i < coefficients->components; i++) {
+        JpegComponent *c = &coefficients->comp[i];
+        int shift = invert_dc_shift(coefficients, i);
+        size_t blocks = (size_t)c->blocks_w * c->blocks_h;
+
+        for (short *coef = c->coef; blocks > 0; blocks--, coef += 64) {
+            int dc = -coef[0] - shift;
+            for (int k = 0; k < 64; k++) coef[k] = (short)-coef[k];
+            coef[0] = (short)(dc < DC_MIN ? DC_MIN : dc > DC_MAX ? DC_MAX : dc);
+        }
+    }
+}
+
+int jpeg_invert_entropy(const unsigned char *data, size_t size, WriteFn write, void *context) {
+    static const unsigned char soi[] = { 0xFF, 0xD8 };
+    static const unsigned char eoi[] = { 0xFF, 0xD9 };
+    ScanWriter w = { 0 };
+    JpegCoefficients image = { 0 };
+    int ok = scan_append(&w, soi, sizeof(soi)) && decode_jpeg(data, size, &image, NULL, NULL, 0, NULL, &w) &&
+        scan_append(&w, eoi, sizeof(eoi));
+    if (ok) write(context, w.data, w.size);
+    jpeg_coefficients_free(&image);
+    free(w.data);
+    return ok;
+}
+
+// Reduced-size decode state, set up from the frame at its first MCU row
+typedef struct {
+    int scale;
+    int started;
+    int failed;
+    ImageBuffer image;
+    int size[JPEG_MAX_COMPONENTS];         // Samples per block side
+    int rep_x[JPEG_MAX_COMPONENTS];        // Output pixels per sample
+    int rep_y[JPEG_MAX_COMPONENTS];
+    float basis[JPEG_MAX_COMPONENTS][8][8];
+    unsigned char *plane[JPEG_MAX_COMPONENTS];  // One MCU row of samples
+    size_t plane_stride[JPEG_MAX_COMPONENTS];
+    int *column[JPEG_MAX_COMPONENTS];      // Sample column of each output column
+} ScaledDecode;
+
+// N-point IDCT matrix: entry [x][u] is frequency u's 8-point basis
+// function (with its C(u) / 2 factor) averaged over the 8 / N samples
+// that output sample x covers
+static void scaled_basis(int n, float basis[8][8]) {
+    int group = 8 / n;
+    for (int x = 0; x < n; x++) {
+        for (int u = 0; u < n; u++) {
+            double sum = 0.0;
+            for (int j = 0; j < group; j++) sum += cos((2 * (group * x + j) + 1) * u * M_PI / 16);
+            basis[x][u] = (float)(sum / group * (u ? 0.5 : 0.5 / sqrt(2.0)));
+        }
+    }
+}
+
+// Dequantize one block's n x n lowest frequencies and transform them into
+// an n x n square of samples. Inlined once per size so the loops unroll;
+// zero rows of coefficients (most of them, in a photo) are skipped.
+static inline __attribute__((always_inline))
+void idct_block_n(const short *coef, const unsigned short *quant, const int n, const float basis[8][8],
+                  unsigned char *out, size_t stride) {
+    float rows[8][8];
+    int nonzero[8];
+    for (int v = 0; v < n; v++) {
+        float f[8];
+        int any = 0;
+        for (int u = 0; u < n; u++) {
+            f[u] = (float)(coef[v * 8 + u] * quant[v * 8 + u]);
+            any |= coef[v * 8 + u];
+        }
+        nonzero[v] = any;
+        for (int x = 0; x < n; x++) rows[v][x] = 0.0f;
+        if (!any) continue;
+        for (int x = 0; x < n; x++) {
+            for (int u = 0; u < n; u++) rows[v][x] += f[u] * basis[x][u];
+        }
+    }
+
+    float cols[8][8];
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++) cols[y][x] = 128.5f;
+        for (int v = 0; v < n; v++) {
+            if (!nonzero[v]) continue;
+            for (int x = 0; x < n; x++) cols[y][x] += basis[y][v] * rows[v][x];
+        }
+    }
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++) {
+            float s = cols[y][x];
+            out[(size_t)y * stride + x] = (unsigned char)(s < 1.0f ? 0 : s >= 255.0f ? 255 : (int)s);
+        }
+    }
+}
+
+static void idct_block(const short *coef, const unsigned short *quant, int n, const float basis[8][8],
+                       unsigned char *out, size_t stride) {
+    switch (n) {
+    case 8: idct_block_n(coef, quant, 8, basis, out, stride); break;
+    case 4: idct_block_n(coef, quant, 4, basis, out, stride); break;
+    case 2: idct_block_n(coef, quant, 2, basis, out, stride); break;
+    default: {
+        int s = (coef[0] * quant[0] + 1024 * 8 + 4) / 8 - 1024 + 128;
+        *out = (unsigned char)(s < 0 ? 0 : s > 255 ? 255 : s);
+    }
+    }
+}
+
+// Pick each component's IDCT size (scaled_size); any factor that leaves
+// is covered by repeating samples
+static int scaled_setup(ScaledDecode *sd, const JpegCoefficients *image) {
+    int n = 8 / sd->scale;
+    for (int i = 0; i < image->components; i++) {
+        const JpegComponent *c = &image->comp[i];
+        int k = scaled_size(image, i, sd->scale) / n;
+        sd->size[i] = n * k;
+        sd->rep_x[i] = image->max_h / c->h / k;
+        sd->rep_y[i] = image->max_v / c->v / k;
+        scaled_basis(sd->size[i], sd->basis[i]);
+        sd->plane_stride[i] = (size_t)c->blocks_w * sd->size[i];
+        sd->plane[i] = malloc(sd->plane_stride[i] * c->v * sd->size[i]);
+        if (!sd->plane[i]) return 0;
+    }
+
+    sd->image = image_buffer_alloc((image->width + sd->scale - 1) / sd->scale,
+                                   (image->height + sd->scale - 1) / sd->scale,
+                                   image->components == 1 ? 1 : 3);
+    if (!sd->image.data) return 0;
+    for (int i = 0; i < image->components; i++) {
+        sd->column[i] = malloc((size_t)sd->image.width * sizeof(int));
+        if (!sd->column[i]) return 0;
+        for (int x = 0; x < sd->image.width; x++) sd->column[i][x] = x / sd->rep_x[i];
+    }
+    return 1;
+}
+
+static void scaled_row(void *context, const JpegCoefficients *image, int mcu_row,
+                       short *const blocks[JPEG_MAX_COMPONENTS]) {
+    ScaledDecode *sd = context;
+    if (!sd->started) {
+        sd->started = 1;
+        sd->failed = !scaled_setup(sd, image);
+    }
+    if (sd->failed) return;
+
+    for (int i = 0; i < image->components; i++) {
+        const JpegComponent *c = &image->comp[i];
+        int n = sd->size[i];
+        for (int by = 0; by < c->v; by++) {
+            for (int bx = 0; bx < c->blocks_w; bx++) {
+                idct_block(blocks[i] + ((size_t)by * c->blocks_w + bx) * 64, image->quant[c->quant], n,
+                           sd->basis[i], sd->plane[i] + (size_t)by * n * sd->plane_stride[i] + (size_t)bx * n,
+                           sd->plane_stride[i]);
+            }
+        }
+    }
+
+    // Upsample and convert this MCU row's band of output rows
+    ImageBuffer *out = &sd->image;
+    int band = image->max_v * 8 / sd->scale;
+    int y0 = mcu_row * band;
+    int rows = out->height - y0 < band ? out->height - y0 : band;
+    for (int y = 0; y < rows; y++) {
+        unsigned char *dst = out->data + (size_t)(y0 + y) * out->stride;
+        const unsigned char *s0 = sd->plane[0] + (size_t)(y / sd->rep_y[0]) * sd->plane_stride[0];
+        if (image->components == 1) {
+            memcpy(dst, s0, (size_t)out->width);
+            continue;
+        }
+
+        const unsigned char *s1 = sd->plane[1] + (size_t)(y / sd->rep_y[1]) * sd->plane_stride[1];
+        const unsigned char *s2 = sd->plane[2] + (size_t)(y / sd->rep_y[2]) * sd->plane_stride[2];
+        const int *c0 = sd->column[0], *c1 = sd->column[1], *c2 = sd->column[2];
+        for (int x = 0; x < out->width; x++, dst += 3) {
+            int a = s0[c0[x]];
+            int b = s1[c1[x]];
+            int c = s2[c2[x]];
+            if (image->rgb) {
+                dst[0] = (unsigned char)a;
+                dst[1] = (unsigned char)b;
+                dst[2] = (unsigned char)c;
+                continue;
+            }
+
+            // JFIF YCbCr to RGB in 16.16 fixed point
+            int luma = (a << 16) + 32768;
+            int r = (luma + (c - 128) * 91881) >> 16;
+            int g = (luma - (b - 128) * 22554 - (c - 128) * 46802) >> 16;
+            int bl = (luma + (b - 128) * 116130) >> 16;
+            dst[0] = (unsigned char)(r < 0 ? 0 : r > 255 ? 255 : r);
+            dst[1] = (unsigned char)(g < 0 ? 0 : g > 255 ? 255 : g);
+            dst[2] = (unsigned char)(bl < 0 ? 0 : bl > 255 ? 255 : bl);
+        }
+    }
+}
+
+ImageBuffer jpeg_decode_scaled(const unsigned char *data, size_t size, int scale) {
+    ScaledDecode sd;
+    memset(&sd, 0, sizeof(sd));
+    if (scale != 1 && scale != 2 && scale != 4 && scale != 8) return sd.image;
+    sd.scale = scale;
+
+    JpegCoefficients image;
+    int ok = decode_jpeg(data, size, &image, scaled_row, &sd, scale, NULL, NULL) && sd.started && !sd.failed;
+    jpeg_coefficients_free(&image);
+    for (int i = 0; i < JPEG_MAX_COMPONENTS; i++) {
+        free(sd.plane[i]);
+        free(sd.column[i]);
+    }
+    if (!ok) image_buffer_free(&sd.image);
+    return sd.image;
+}
+
+// Full-size decode. The IDCT (jidctint's ISLOW), the fancy upsampling and
+// the color conversion are ported from stb_image, and so are the rules of
+// which chroma rows pair with each output row, so the output matches
+// stbi_load_from_memory bit for bit. Upsampling an MCU row's last rows
+// needs the first chroma row of the next one, so samples live in a ring
+// of three MCU rows and output trails decoding by up to one MCU row.
+#define PIXEL_RING 3
+
+typedef struct {
+    JpegPixelFn fn;
+    void *context;
+    int started;
+    int failed;
+    int channels;
+    unsigned char *ring[JPEG_MAX_COMPONENTS];   // ring_mcu_rows MCU rows of samples
+    int ring_mcu_rows;                         // PIXEL_RING, or every MCU row (jpeg_decode_parallel)
+    size_t stride[JPEG_MAX_COMPONENTS];
+    int band_rows[JPEG_MAX_COMPONENTS];        // Sample rows per MCU row
+    int rows[JPEG_MAX_COMPONENTS];             // Sample rows that cover the image
+    int available;                             // MCU rows decoded so far
+    // stb_image's resampler state, per component
+    int hs[JPEG_MAX_COMPONENTS], vs[JPEG_MAX_COMPONENTS];
+    int w_lores[JPEG_MAX_COMPONENTS];
+    int ystep[JPEG_MAX_COMPONENTS], ypos[JPEG_MAX_COMPONENTS];
+    int line0[JPEG_MAX_COMPONENTS], line1[JPEG_MAX_COMPONENTS];
+    unsigned char *linebuf[JPEG_MAX_COMPONENTS];
+    ImageBuffer band;                          // Output rows waiting for `fn`
+    int band_first;
+    int band_used;
+    int next_row;                              // Next output row to produce
+} PixelDecode;
+
+#define F2F(x) ((int)((x) * 4096 + 0.5))
+#define FSH(x) ((x) * 4096)
+
+#define IDCT_1D(s0, s1, s2, s3, s4, s5, s6, s7) \
+    int t0, t1, t2, t3, p1, p2, p3, p4, p5, x0, x1, x2, x3; \
+    p2 = s2; \
+    p3 = s6; \
+    p1 = (p2 + p3) * F2F(0.5411961f); \
+    t2 = p1 + p3 * F2F(-1.847759065f); \
+    t3 = p1 + p2 * F2F(0.765366865f); \
+    p2 = s0; \
+    p3 = s4; \
+    t0 = FSH(p2 + p3); \
+    t1 = FSH(p2 - p3); \
+    x0 = t0 + t3; \
+    x3 = t0 - t3; \
+    x1 = t1 + t2; \
+    x2 = t1 - t2; \
+    t0 = s7; \
+    t1 = s5; \
+    t2 = s3; \
+    t3 = s1; \
+    p3 = t0 + t2; \
+    p4 = t1 + t3; \
+    p1 = t0 + t3; \
+    p2 = t1 + t2; \
+    p5 = (p3 + p4) * F2F(1.175875602f); \
+    t0 = t0 * F2F(0.298631336f); \
+    t1 = t1 * F2F(2.053119869f); \
+    t2 = t2 * F2F(3.072711026f); \
+    t3 = t3 * F2F(1.501321110f); \
+    p1 = p5 + p1 * F2F(-0.899976223f); \
+    p2 = p5 + p2 * F2F(-2.562915447f); \
+    p3 = p3 * F2F(-1.961570560f); \
+    p4 = p4 * F2F(-0.390180644f); \
+    t3 += p1 + p4; \
+    t2 += p2 + p3; \
+    t1 += p2 + p4; \
+    t0 += p1 + p3;
+
+static inline unsigned char clamp_sample(int x) {
+    return (unsigned int)x > 255 ? (x < 0 ? 0 : 255) : (unsigned char)x;
+}
+
+// Dequantize (to short, as stb_image does) and run the 8x8 integer IDCT
+static void idct_islow(const short *coef, const unsigned short *quant, unsigned char *out, size_t stride) {
+    short d[64];
+    int val[64];
+    for (int k = 0; k < 64; k++) d[k] = (short)(coef[k] * quant[k]);
+
+    // Columns, keeping 2 extra bits; all-zero AC columns are flat
+    for (int i = 0; i < 8; i++) {
+        const short *s = d + i;
+        int *v = val + i;
+        if (s[8] == 0 && s[16] == 0 && s[24] == 0 && s[32] == 0 && s[40] == 0 && s[48] == 0 && s[56] == 0) {
+            int dcterm = s[0] * 4;
+            v[0] = v[8] = v[16] = v[24] = v[32] = v[40] = v[48] = v[56] = dcterm;
+        } else {
+            IDCT_1D(s[0], s[8], s[16], s[24], s[32], s[40], s[48], s[56])
+            x0 += 512; x1 += 512; x2 += 512; x3 += 512;
+            v[0] = (x0 + t3) >> 10;
+            v[56] = (x0 - t3) >> 10;
+            v[8] = (x1 + t2) >> 10;
+            v[48] = (x1 - t2) >> 10;
+            v[16] = (x2 + t1) >> 10;
+            v[40] = (x2 - t1) >> 10;
+            v[24] = (x3 + t0) >> 10;
+            v[32] = (x3 - t0) >> 10;
+        }
+    }
+
+    // Rows: remove the 1 << 17 scale with rounding, and undo the level shift.
+    // A row with no AC terms is flat, with the value the full pass gives.
+    for (int i = 0; i < 8; i++, out += stride) {
+        const int *v = val + i * 8;
+        if ((v[1] | v[2] | v[3] | v[4] | v[5] | v[6] | v[7]) == 0) {
+            memset(out, clamp_sample((v[0] * 4096 + 65536 + (128 << 17)) >> 17), 8);
+            continue;
+        }
+        IDCT_1D(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7])
+        x0 += 65536 + (128 << 17);
+        x1 += 65536 + (128 << 17);
+        x2 += 65536 + (128 << 17);
+        x3 += 65536 + (128 << 17);
+        out[0] = clamp_sample((x0 + t3) >> 17);
+        out[7] = clamp_sample((x0 - t3) >> 17);
+        out[1] = clamp_sample((x1 + t2) >> 17);
+        out[6] = clamp_sample((x1 - t2) >> 17);
+        out[2] = clamp_sample((x2 + t1) >> 17);
+        out[5] = clamp_sample((x2 - t1) >> 17);
+        out[3] = clamp_sample((x3 + t0) >> 17);
+        out[4] = clamp_sample((x3 - t0) >> 17);
+    }
+}
+
+// One upsampled row of `w` samples, `hs` output pixels each: triangle
+// filters for 2x horizontal and/or vertical, repetition otherwise
+static const unsigned char *resample_row(unsigned char *out, const unsigned char *near, const unsigned char *far,
+                                         int w, int hs, int vs) {
+    if (hs == 1 && vs == 1) return near;
+
+    if (hs == 1 && vs == 2) {
+        for (int i = 0; i < w; i++) out[i] = (unsigned char)((3 * near[i] + far[i] + 2) >> 2);
+        return out;
+    }
+
+    if (hs == 2 && vs == 1) {
+        if (w == 1) {
+            out[0] = out[1] = near[0];
+            return out;
+        }
+        out[0] = near[0];
+        out[1] = (unsigned char)((near[0] * 3 + near[1] + 2) >> 2);
+        int i;
+        for (i = 1; i < w - 1; i++) {
+            int n = 3 * near[i] + 2;
+            out[i * 2] = (unsigned char)((n + near[i - 1]) >> 2);
+            out[i * 2 + 1] = (unsigned char)((n + near[i + 1]) >> 2);
+        }
+        out[i * 2] = (unsigned char)((near[w - 2] * 3 + near[w - 1] + 2) >> 2);
+        out[i * 2 + 1] = near[w - 1];
+        return out;
+    }
+
+    if (hs == 2 && vs == 2) {
+        if (w == 1) {
+            out[0] = out[1] = (unsigned char)((3 * near[0] + far[0] + 2) >> 2);
+            return out;
+        }
+        int t1 = 3 * near[0] + far[0];
+        out[0] = (unsigned char)((t1 + 2) >> 2);
+        for (int i = 1; i < w; i++) {
+            int t0 = t1;
+            t1 = 3 * near[i] + far[i];
+            out[i * 2 - 1] = (unsigned char)((3 * t0 + t1 + 8) >> 4);
+            out[i * 2] = (unsigned char)((3 * t1 + t0 + 8) >> 4);
+        }
+        out[w * 2 - 1] = (unsigned char)((t1 + 2) >> 2);
+        return out;
+    }
+
+    for (int i = 0; i < w; i++) {
+        for (int j = 0; j < hs; j++) out[i * hs + j] = near[i];
+    }
+    return out;
+}
+
+// stb_image's reduced-precision YCbCr to RGB (the same in its SIMD path)
+#define F2F_RGB(x) (((int)((x) * 4096.0f + 0.5f)) << 8)
+
+static void ycbcr_to_rgb_row(unsigned char *out, const unsigned char *y, const unsigned char *pcb,
+                             const unsigned char *pcr, int count) {
+    for (int i = 0; i < count; i++, out += 3) {
+        int y_fixed = (y[i] << 20) + (1 << 19);
+        int cr = pcr[i] - 128;
+        int cb = pcb[i] - 128;
+        int r = y_fixed + cr * F2F_RGB(1.40200f);
+        int g = y_fixed + (cr * -F2F_RGB(0.71414f)) + ((cb * -F2F_RGB(0.34414f)) & 0xffff0000);
+        int b = y_fixed + cb * F2F_RGB(1.77200f);
+        out[0] = clamp_sample(r >> 20);
+        out[1] = clamp_sample(g >> 20);
+        out[2] = clamp_sample(b >> 20);
+    }
+}
+
+// Sample layout and resampler state at the first output row; 0 if a
+// component's upsampled rows would read past its blocks
+static int pixel_layout(PixelDecode *pd, const JpegCoefficients *image) {
+    pd->channels = image->components == 1 ? 1 : 3;
+    for (int i = 0; i < image->components; i++) {
+        const JpegComponent *c = &image->comp[i];
+        pd->hs[i] = image->max_h / c->h;
+        pd->vs[i] = image->max_v / c->v;
+        pd->w_lores[i] = (image->width + pd->hs[i] - 1) / pd->hs[i];
+        pd->rows[i] = (image->height * c->v + image->max_v - 1) / image->max_v;
+        pd->ystep[i] = pd->vs[i] >> 1;
+        pd->band_rows[i] = 8 * c->v;
+        pd->stride[i] = (size_t)c->blocks_w * 8;
+        if ((size_t)pd->w_lores[i] > pd->stride[i]) return 0;
+    }
+    return 1;
+}
+
+static int pixel_setup(PixelDecode *pd, const JpegCoefficients *image) {
+    if (!pixel_layout(pd, image)) return 0;
+    pd->ring_mcu_rows = PIXEL_RING;
+    for (int i = 0; i < image->components; i++) {
+        pd->ring[i] = malloc(pd->stride[i] * pd->band_rows[i] * PIXEL_RING);
+        pd->linebuf[i] = malloc((size_t)image->width + 3);
+        if (!pd->ring[i] || !pd->linebuf[i]) return 0;
+    }
+    pd->band = image_buffer_alloc(image->width, 8 * image->max_v, pd->channels);
+    return pd->band.data != NULL;
+}
+
+static const unsigned char *ring_row(const PixelDecode *pd, int component, int row) {
+    int band = pd->band_rows[component];
+    return pd->ring[component] +
+        ((size_t)(row / band % pd->ring_mcu_rows) * band + (size_t)(row % band)) * pd->stride[component];
+}
+
+static void flush_band(PixelDecode *pd, const JpegCoefficients *image) {
+    if (pd->band_used == 0) return;
+    ImageBuffer rows = image_buffer_view(&pd->band, 0, 0, pd->band.width, pd->band_used);
+    pd->fn(pd->context, image, &rows, pd->band_first);
+    pd->band_first += pd->band_used;
+    pd->band_used = 0;
+}
+
+// Step component i's resampler past one output row
+static void advance_row(PixelDecode *pd, int i) {
+    if (++pd->ystep[i] >= pd->vs[i]) {
+        pd->ystep[i] = 0;
+        pd->line0[i] = pd->line1[i];
+        if (++pd->ypos[i] < pd->rows[i]) pd->line1[i]++;
+    }
+}
+
+// Output row next_row into `dst`, from its decoded sample rows
+static void convert_row(PixelDecode *pd, const JpegCoefficients *image, unsigned char *dst) {
+    const unsigned char *out[JPEG_MAX_COMPONENTS];
+    for (int i = 0; i < image->components; i++) {
+        int y_bot = pd->ystep[i] >= (pd->vs[i] >> 1);
+        const unsigned char *near = ring_row(pd, i, y_bot ? pd->line1[i] : pd->line0[i]);
+        const unsigned char *far = ring_row(pd, i, y_bot ? pd->line0[i] : pd->line1[i]);
+        out[i] = resample_row(pd->linebuf[i], near, far, pd->w_lores[i], pd->hs[i], pd->vs[i]);
+        advance_row(pd, i);
+    }
+
+    if (image->components == 1) {
+        memcpy(dst, out[0], (size_t)image->width);
+    } else if (image->rgb) {
+        for (int x = 0; x < image->width; x++, dst += 3) {
+            dst[0] = out[0][x];
+            dst[1] = out[1][x];
+            dst[2] = out[2][x];
+        }
+    } else {
+        ycbcr_to_rgb_row(dst, out[0], out[1], out[2], image->width);
+    }
+    pd->next_row++;
+}
+
+// Produce every output row whose sample rows have been decoded
+static void emit_rows(PixelDecode *pd, const JpegCoefficients *image) {
+    while (pd->next_row < image->height) {
+        for (int i = 0; i < image->components; i++) {
+            if (pd->line1[i] >= pd->available * pd->band_rows[i]) return;
+        }
+
+        convert_row(pd, image, pd->band.data + (size_t)pd->band_used * pd->band.stride);
+        if (++pd->band_used == pd->band.height) flush_band(pd, image);
+    }
+    flush_band(pd, image);
+}
+
+static void pixel_row(void *context, const JpegCoefficients *image, int mcu_row,
+                      short *const blocks[JPEG_MAX_COMPONENTS]) {
+    PixelDecode *pd = context;
+    if (!pd->started) {
+        pd->started = 1;
+        pd->failed = !pixel_setup(pd, image);
+    }
+    if (pd->failed) return;
+
+    for (int i = 0; i < image->components; i++) {
+        const JpegComponent *c = &image->comp[i];
+        unsigned char *slot = pd->ring[i] + (size_t)(mcu_row % pd->ring_mcu_rows) * pd->band_rows[i] * pd->stride[i];
+        for (int by = 0; by < c->v; by++) {
+            for (int bx = 0; bx < c->blocks_w; bx++) {
+                idct_islow(blocks[i] + ((size_t)by * c->blocks_w + bx) * 64, image->quant[c->quant],
+                           slot + (size_t)by * 8 * pd->stride[i] + (size_t)bx * 8, pd->stride[i]);
+            }
+        }
+    }
+
+    // The last MCU row completes every component
+    pd->available = mcu_row + 1 == image->mcu_rows ? INT_MAX / 64 : mcu_row + 1;
+    emit_rows(pd, image);
+}
+
+// Sequential jpeg_decode_pixels: one MCU row at a time through the ring
+static int decode_pixels_serial(const unsigned char *data, size_t size, JpegPixelFn fn, void *context) {
+    PixelDecode pd;
+    memset(&pd, 0, sizeof(pd));
+    pd.fn = fn;
+    pd.context = context;
+
+    int ok = jpeg_decode_rows(data, size, pixel_row, &pd) && pd.started && !pd.failed;
+    for (int i = 0; i < JPEG_MAX_COMPONENTS; i++) {
+        free(pd.ring[i]);
+        free(pd.linebuf[i]);
+    }
+    image_buffer_free(&pd.band);
+    return ok;
+}
+
+// Parallel decode of a scan with restart intervals. Each interval starts
+// with zero DC predictions on a byte boundary, so runs of intervals are
+// entropy-decoded and transformed independently, each into its own blocks
+// of the sample planes. Upsampling pairs an output row with chroma rows
+// that may belong to another run, so a window's samples are finished
+// before its rows are produced in row bands, each band starting its
+// resampler state where the previous band leaves it. The planes hold the
+// whole image, or for jpeg_decode_pixels a ring of MCU rows: a window of
+// intervals plus the MCU row its first output rows still need and the one
+// its last interval may share with the next window.
+struct ParallelDecode {
+    const ImageBuffer *dest;   // Caller's buffer (NULL: allocate one)
+    JpegPixelFn fn;            // Rows go to fn a window at a time (NULL: decode the whole image)
+    void *context;
+    int max_threads;
+    int probe;                 // Only count the tasks
+    int tasks;                 // Threads used; then the tasks of the current run
+    int emitted;               // Rows have been handed to fn
+    const JpegCoefficients *image;
+    const unsigned char *end;
+    int ns;
+    int scan[JPEG_MAX_COMPONENTS];
+    const HuffDecoder *dc[JPEG_MAX_COMPONENTS];
+    const HuffDecoder *ac[JPEG_MAX_COMPONENTS];
+    int restart_interval;
+    const unsigned char **starts;              // Entropy-coded data of each interval
+    int intervals;
+    int first_interval;                        // Intervals of the current window
+    int last_interval;
+    int last_row;                              // Output rows of the current window end here
+    unsigned char *plane[JPEG_MAX_COMPONENTS];
+    PixelDecode layout;                        // Resampler state at the window's first row, over the planes
+    ImageBuffer output;                        // Whole image, or the rows of one window
+    int output_first;                          // Frame row of output's first row
+    unsigned char *failed;                     // Per task
+};
+
+// Start of every restart interval after `p`, found from its RSTn marker.
+// 0 unless there are exactly `count` intervals, their markers in sequence,
+// and a marker after the last one; *scan_end is that marker.
+static int find_restarts(const unsigned char *p, const unsigned char *end, const unsigned char **starts,
+                         int count, const unsigned char **scan_end) {
+    int found = 0;
+    starts[found++] = p;
+    for (;;) {
+        p = memchr(p, 0xFF, (size_t)(end - p));
+        if (!p || p + 1 >= end) return 0;
+        if (p[1] == 0x00 || p[1] == 0xFF) {
+            p++;               // Stuffed byte, or a fill byte before a marker
+            continue;
+        }
+        if (p[1] < 0xD0 || p[1] > 0xD7) break;
+        if (found == count || p[1] != 0xD0 + (found - 1) % 8) return 0;
+        starts[found++] = p + 2;
+        p += 2;
+    }
+    *scan_end = p;
+    return found == count;
+}
+
+static void decode_intervals(void *arg, int task) {
+    struct ParallelDecode *pd = arg;
+    const JpegCoefficients *image = pd->image;
+    int count = pd->last_interval - pd->first_interval;
+    int first = pd->first_interval + (int)((long long)count * task / pd->tasks);
+    int last = pd->first_interval + (int)((long long)count * (task + 1) / pd->tasks);
+    long long mcus = (long long)image->mcus_per_row * image->mcu_rows;
+    short coef[64];
+
+    for (int k = first; k < last; k++) {
+        BitReader r = { pd->starts[k], pd->end, 0, 0, 0 };
+        int pred[JPEG_MAX_COMPONENTS] = { 0 };
+        long long m_end = (long long)(k + 1) * pd->restart_interval;
+        if (m_end > mcus) m_end = mcus;
+
+        for (long long m = (long long)k * pd->restart_interval; m < m_end; m++) {
+            int mx = (int)(m % image->mcus_per_row);
+            int slot = (int)(m / image->mcus_per_row) % pd->layout.ring_mcu_rows;
+            for (int i = 0; i < pd->ns; i++) {
+                int ci = pd->scan[i];
+                const JpegComponent *c = &image->comp[ci];
+                size_t stride = pd->layout.stride[ci];
+                for (int by = 0; by < c->v; by++) {
+                    for (int bx = 0; bx < c->h; bx++) {
+                        memset(coef, 0, sizeof(coef));
+                        if (!decode_block(&r, pd->dc[i], pd->ac[i], &pred[i], coef)) {
+                            pd->failed[task] = 1;
+                            return;
+                        }
+                        unsigned char *out = pd->plane[ci] + (size_t)((slot * c->v + by) * 8) * stride +
+                            (size_t)(mx * c->h + bx) * 8;
+                        idct_islow(coef, image->quant[c->quant], out, stride);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void convert_band(void *arg, int task) {
+    struct ParallelDecode *pd = arg;
+    const JpegCoefficients *image = pd->image;
+    int first_row = pd->layout.next_row;
+    int y_begin = first_row + (int)((long long)(pd->last_row - first_row) * task / pd->tasks);
+    int y_end = first_row + (int)((long long)(pd->last_row - first_row) * (task + 1) / pd->tasks);
+
+    PixelDecode px = pd->layout;
+    int ok = 1;
+    for (int i = 0; i < image->components; i++) {
+        px.linebuf[i] = malloc((size_t)image->width + 3);
+        ok &= px.linebuf[i] != NULL;
+    }
+    if (ok) {
+        for (; px.next_row < y_begin; px.next_row++) {
+            for (int i = 0; i < image->components; i++) advance_row(&px, i);
+        }
+        while (px.next_row < y_end) {
+            convert_row(&px, image, pd->output.data + (size_t)(px.next_row - pd->output_first) * pd->output.stride);
+        }
+    }
+    for (int i = 0; i < image->components; i++) free(px.linebuf[i]);
+    if (!ok) pd->failed[task] = 1;
+}
+
+static int tasks_ok(const struct ParallelDecode *pd) {
+    for (int t = 0; t < pd->tasks; t++) {
+        if (pd->failed[t]) return 0;
+    }
+    return 1;
+}
+
+// Step `pd` past every output row whose samples lie in the first
+// `available` MCU rows (emit_rows without the output)
+static void skip_ready_rows(PixelDecode *pd, const JpegCoefficients *image) {
+    while (pd->next_row < image->height) {
+        for (int i = 0; i < image->components; i++) {
+            if (pd->line1[i] >= pd->available * pd->band_rows[i]) return;
+        }
+        for (int i = 0; i < image->components; i++) advance_row(pd, i);
+        pd->next_row++;
+    }
+}
+
+// Intervals per window for jpeg_decode_pixels, within
+// JPEG_PARALLEL_WINDOW_BYTES of planes and output rows; 0 when fewer than
+// two fit
+static int window_intervals(const struct ParallelDecode *pd, const JpegCoefficients *image, int channels) {
+    size_t mcu_row_bytes = (size_t)8 * image->max_v * image->width * channels;
+    for (int i = 0; i < image->components; i++) mcu_row_bytes += pd->layout.stride[i] * pd->layout.band_rows[i];
+
+    long long mcu_rows = (long long)(JPEG_PARALLEL_WINDOW_BYTES / mcu_row_bytes) - 3;
+    long long intervals = mcu_rows * image->mcus_per_row / pd->restart_interval;
+    if (intervals > pd->intervals) intervals = pd->intervals;
+    return intervals < 2 ? 0 : (int)intervals;
+}
+
+// Decode the scan at `p` (one interleaved scan of every component) into
+// pd->output or to pd->fn; returns the marker after it, or NULL to leave
+// the input to a sequential decode (or on failure)
+static const unsigned char *parallel_scan(JpegDecoder *dec, const unsigned char *p, const unsigned char *end,
+                                          int ns, const int *scan, const int *td, const int *ta) {
+    struct ParallelDecode *pd = dec->parallel;
+    const JpegCoefficients *image = dec->out;
+    if (ns != image->components || dec->restart_interval == 0) return NULL;
+
+    long long mcus = (long long)image->mcus_per_row * image->mcu_rows;
+    long long intervals = (mcus + dec->restart_interval - 1) / dec->restart_interval;
+    int tasks = thread_pool_size() + 1;
+    if (pd->max_threads > 0 && tasks > pd->max_threads) tasks = pd->max_threads;
+    if (tasks > intervals) tasks = (int)intervals;
+    if (tasks > image->height) tasks = image->height;
+    if (tasks < 2 || intervals > INT_MAX) return NULL;
+
+    // Intervals per window and the MCU rows of samples that takes
+    int channels = image->components == 1 ? 1 : 3;
+    pd->intervals = (int)intervals;
+    pd->restart_interval = dec->restart_interval;
+    if (!pixel_layout(&pd->layout, image)) return NULL;
+    int window = pd->fn ? window_intervals(pd, image, channels) : pd->intervals;
+    if (window == 0) return NULL;
+    if (tasks > window) tasks = window;
+    long long window_rows = ((long long)window * pd->restart_interval + image->mcus_per_row - 1) /
+        image->mcus_per_row;
+    pd->layout.ring_mcu_rows = pd->fn && window_rows + 2 < image->mcu_rows ? (int)window_rows + 2 : image->mcu_rows;
+
+    pd->starts = malloc((size_t)intervals * sizeof(*pd->starts));
+    const unsigned char *scan_end;
+    if (!pd->starts || !find_restarts(p, end, pd->starts, pd->intervals, &scan_end)) return NULL;
+    pd->tasks = tasks;
+    if (pd->probe) return NULL;
+
+    pd->image = image;
+    pd->end = end;
+    pd->ns = ns;
+    for (int i = 0; i < ns; i++) {
+        pd->scan[i] = scan[i];
+        pd->dc[i] = &dec->dc[td[i]];
+        pd->ac[i] = &dec->ac[ta[i]];
+    }
+
+    // Planes come from the buffer pool, like stb_image's
+    for (int i = 0; i < image->components; i++) {
+        pd->plane[i] = image_buffer_malloc(pd->layout.stride[i] * pd->layout.band_rows[i] *
+                                           pd->layout.ring_mcu_rows);
+        if (!pd->plane[i]) return NULL;
+        pd->layout.ring[i] = pd->plane[i];
+    }
+
+    // A window's rows lie in the MCU rows it touches and the one held
+    // back by the previous window, as many as the ring holds
+    if (pd->fn) {
+        long long rows = (long long)pd->layout.ring_mcu_rows * 8 * image->max_v;
+        pd->output = image_buffer_alloc(image->width, rows < image->height ? (int)rows : image->height, channels);
+    } else if (pd->dest) {
+        if (pd->dest->width != image->width || pd->dest->height != image->height ||
+            pd->dest->channels != channels) {
+            return NULL;
+        }
+        pd->output = image_buffer_view(pd->dest, 0, 0, image->width, image->height);
+    } else {
+        pd->output = image_buffer_alloc(image->width, image->height, channels);
+    }
+    pd->failed = calloc(tasks, 1);
+    if (!pd->output.data || !pd->failed) return NULL;
+
+    for (int k = 0; k < pd->intervals; k += window) {
+        pd->first_interval = k;
+        pd->last_interval = pd->intervals - k > window ? k + window : pd->intervals;
+        pd->tasks = pd->last_interval - k < tasks ? pd->last_interval - k : tasks;
+        thread_pool_run(decode_intervals, pd, pd->tasks);
+        if (!tasks_ok(pd)) return NULL;
+
+        // The last interval completes every component
+        PixelDecode next = pd->layout;
+        next.available = pd->last_interval == pd->intervals ? INT_MAX / 64 :
+            (int)((long long)pd->last_interval * pd->restart_interval / image->mcus_per_row);
+        skip_ready_rows(&next, image);
+        pd->last_row = next.next_row;
+        if (pd->last_row - pd->layout.next_row > pd->output.height) return NULL;
+
+        pd->output_first = pd->fn ? pd->layout.next_row : 0;
+        pd->tasks = pd->last_row - pd->layout.next_row < tasks ? pd->last_row - pd->layout.next_row : tasks;
+        if (pd->tasks > 0) {
+            thread_pool_run(convert_band, pd, pd->tasks);
+            if (!tasks_ok(pd)) return NULL;
+            if (pd->fn) {
+                ImageBuffer rows = image_buffer_view(&pd->output, 0, 0, image->width,
+                                                     pd->last_row - pd->layout.next_row);
+                pd->fn(pd->context, image, &rows, pd->layout.next_row);
+                pd->emitted = 1;
+            }
+        }
+        pd->layout = next;
+    }
+    pd->tasks = tasks;
+    return scan_end;
+}
+
+// Run the parser with `pd`; 1 if the whole stream decoded
+static int run_parallel(const unsigned char *data, size_t size, struct ParallelDecode *pd) {
+    JpegCoefficients image;
+    int ok = decode_jpeg(data, size, &image, NULL, NULL, 0, pd, NULL);
+    jpeg_coefficients_free(&image);
+    free(pd->starts);
+    free(pd->failed);
+    for (int i = 0; i < JPEG_MAX_COMPONENTS; i++) image_buffer_release(pd->plane[i]);
+    return ok;
+}
+
+int jpeg_decode_pixels(const unsigned char *data, size_t size, JpegPixelFn fn, void *context, int max_threads) {
+    if (max_threads != 1) {
+        struct ParallelDecode pd;
+        memset(&pd, 0, sizeof(pd));
+        pd.fn = fn;
+        pd.context = context;
+        pd.max_threads = max_threads;
+
+        int ok = run_parallel(data, size, &pd);
+        image_buffer_free(&pd.output);
+        if (ok || pd.emitted) return ok;
+    }
+    return decode_pixels_serial(data, size, fn, context);
+}
+
+ImageBuffer jpeg_decode_parallel(const unsigned char *data, size_t size, const ImageBuffer *dest, int max_threads) {
+    struct ParallelDecode pd;
+    memset(&pd, 0, sizeof(pd));
+    pd.dest = dest;
+    pd.max_threads = max_threads;
+
+    if (!run_parallel(data, size, &pd)) image_buffer_free(&pd.output);
+    return pd.output;
+}
+
+int jpeg_parallel_tasks(const unsigned char *data, size_t size, int max_threads) {
+    struct ParallelDecode pd;
+    memset(&pd, 0, sizeof(pd));
+    pd.max_threads = max_threads;
+    pd.probe = 1;
+
+    run_parallel(data, size, &pd);
+    return pd.tasks;
+}
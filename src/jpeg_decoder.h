@@ -0,0 +1,141 @@
+/*
+ * Sequential JPEG Decoder
+ * Parses Huffman-coded sequential JPEGs (baseline and extended 8-bit, one
+ * interleaved scan or one scan per component) and entropy-decodes them into
+ * quantized DCT coefficient blocks. Transform-domain operations edit the
+ * blocks in place and jpeg_encode_coefficients writes them back, so the
+ * image never goes through the IDCT, color conversion or requantization;
+ * jpeg_invert_entropy inverts without the blocks, rewriting the
+ * entropy-coded data as it is read. jpeg_decode_scaled turns the blocks
+ * into pixels at 1/2, 1/4 or 1/8 size with a reduced IDCT, for previews
+ * that need no full-size decode,
+ * jpeg_decode_pixels into full-size rows a band at a time, and
+ * jpeg_decode_parallel into a full-size image on the thread pool when the
+ * stream has restart markers (jpeg_decode_pixels then also decodes a
+ * window of rows at a time on the pool).
+ */
+
+#ifndef JPEG_DECODER_H
+#define JPEG_DECODER_H
+
+#include "film_kernels.h"
+
+// Grey or three-component images only (no CMYK / YCCK)
+#define JPEG_MAX_COMPONENTS 3
+
+// Most bytes of samples and output rows jpeg_decode_pixels holds for a
+// window of restart intervals decoded in parallel
+#define JPEG_PARALLEL_WINDOW_BYTES (8 << 20)
+
+typedef struct {
+    int id;                    // Component identifier from SOF
+    int h, v;                  // Sampling factors (1 and 1 for a grey image)
+    int quant;                 // Quantization table index
+    int blocks_w;              // Blocks per row and column, padded to whole MCUs
+    int blocks_h;
+    short *coef;               // blocks_w * blocks_h blocks, 64 natural-order values each
+} JpegComponent;
+
+typedef struct {
+    int width;
+    int height;
+    int components;            // 1 or 3
+    int rgb;                   // Components are R, G, B (ids 'R' 'G' 'B', or Adobe transform 0
+                               // without JFIF), not Y, Cb, Cr
+    int max_h, max_v;          // Largest sampling factors: an MCU is 8*max_h x 8*max_v pixels
+    int mcus_per_row;
+    int mcu_rows;
+    unsigned short quant[4][64];   // Quantizers in natural order
+    JpegComponent comp[JPEG_MAX_COMPONENTS];
+} JpegCoefficients;
+
+// 1 if `data` starts with a JPEG SOI marker
+int jpeg_probe(const unsigned char *data, size_t size);
+
+// Entropy-decode every scan of `data` into `out`. Returns 1 on success, or
+// 0 (with `out` cleared) if the stream is progressive, arithmetic-coded,
+// not 8-bit, has another component count, has a sampling factor that does
+// not divide the largest one, is corrupt, or memory runs out.
+int jpeg_decode_coefficients(const unsigned char *data, size_t size, JpegCoefficients *out);
+
+// Receives each MCU row of blocks in decoding order: blocks[c] holds
+// component c's comp[c].v rows of comp[c].blocks_w blocks. The blocks are
+// only valid during the call.
+typedef void (*JpegRowFn)(void *context, const JpegCoefficients *image, int mcu_row,
+                          short *const blocks[JPEG_MAX_COMPONENTS]);
+
+// Decode `data` like jpeg_decode_coefficients, but hand every MCU row to
+// `fn` instead of keeping the blocks. A single interleaved scan (the usual
+// layout) is decoded with one MCU row of blocks in memory; one scan per
+// component needs them all until the last scan. Returns 1 on success; on
+// failure some rows may already have been delivered.
+int jpeg_decode_rows(const unsigned char *data, size_t size, JpegRowFn fn, void *context);
+
+// Receives decoded rows [y, y + rows->height) of `image` in order, at
+// most 8 * image->max_v at a time from a sequential decode and a window
+// of them from a parallel one. The rows may be modified; they are only
+// valid during the call.
+typedef void (*JpegPixelFn)(void *context, const JpegCoefficients *image, const ImageBuffer *rows, int y);
+
+// Decode to full-size pixels, handed to `fn` a band of rows at a time as
+// the MCU rows are decoded, so the whole image is never in memory. The
+// IDCT, chroma upsampling and color conversion are stb_image's, and the
+// rows are identical to stbi_load_from_memory's (1 channel for grey, 3
+// for color). Returns 1 on success, or 0 for the inputs
+// jpeg_decode_coefficients rejects or out of memory. An unsupported
+// frame is rejected before any rows; corrupt entropy-coded data can fail
+// after some. When jpeg_decode_parallel would take the input, windows of
+// restart intervals within JPEG_PARALLEL_WINDOW_BYTES are decoded and
+// converted on up to max_threads threads (0 = the whole pool, 1 =
+// sequential); images whose intervals are too large for two to fit are
+// decoded sequentially.
+int jpeg_decode_pixels(const unsigned char *data, size_t size, JpegPixelFn fn, void *context,
+                       int max_threads);
+
+// Decode to full-size pixels on the thread pool. The entropy-coded data is
+// split at its RSTn restart markers, runs of restart intervals are
+// entropy-decoded and transformed on separate threads, and the output is
+// upsampled and color converted in row bands; the pixels are
+// jpeg_decode_pixels' (stb_image's). Writes into `dest` when it is given
+// (width x height with 1 or 3 channels; a view of it is returned), or else
+// into a new buffer. Uses up to max_threads threads (0 = the whole pool).
+// data == NULL when the input needs a sequential decode instead: no restart
+// interval, one scan per component, markers missing or out of order, fewer
+// than two threads to use, or anything jpeg_decode_pixels rejects (dest
+// may then have been written).
+ImageBuffer jpeg_decode_parallel(const unsigned char *data, size_t size, const ImageBuffer *dest,
+                                 int max_threads);
+
+// Threads jpeg_decode_parallel would split `data` across, judged from its
+// headers and restart markers without decoding (0 when it would decline)
+int jpeg_parallel_tasks(const unsigned char *data, size_t size, int max_threads);
+
+// Decode to pixels at 1/scale of the full size (scale 1, 2, 4 or 8; sides
+// rounded up): each block goes through an N x N IDCT of its lowest
+// frequencies (N = 8 / scale), weighted so each pixel is the mean of the
+// scale x scale square it covers, less the dropped frequencies. Chroma is
+// decoded at the size it needs, so 4:2:0 at 1/2 or smaller needs no
+// upsampling; a component reduced to one sample per block (luma at 1/8)
+// keeps only its DC terms. Grey images give one channel, color images
+// three (RGB). data == NULL for the inputs jpeg_decode_coefficients
+// rejects or out of memory.
+ImageBuffer jpeg_decode_scaled(const unsigned char *data, size_t size, int scale);
+
+// Release the coefficient blocks
+void jpeg_coefficients_free(JpegCoefficients *coefficients);
+
+// Invert the image's samples (v -> 255 - v) in place, in the transform domain
+void jpeg_coefficients_invert(JpegCoefficients *coefficients);
+
+// jpeg_coefficients_invert without the blocks: each scan is rewritten in
+// one pass with the source's own Huffman codes, which still fit since
+// negating a value keeps its magnitude category. Only the DC differences
+// are coded afresh. The frame, tables, restart intervals and JFIF or Adobe
+// marker are copied, and other APPn and COM segments dropped. The output
+// decodes to the coefficients jpeg_coefficients_invert gives and is
+// written whole through `write`. Returns 1, or 0 with nothing written for
+// the inputs jpeg_decode_coefficients rejects, out of memory, or a DC
+// difference the source's table has no code for.
+int jpeg_invert_entropy(const unsigned char *data, size_t size, WriteFn write, void *context);
+
+#endif // JPEG_DECODER_H
@@ -0,0 +1,1401 @@
+/*
+ * Baseline JPEG Encoder Implementation
+ * Two block pipelines share the tables and the entropy coder:
+ *  - the float reference path follows stb_image_write (after Jon Olick's
+ *    jo_jpeg), so a single-strip image encodes byte-identically;
+ *  - the planar path converts whole MCU rows to int16 Y/Cb/Cr planes and
+ *    runs the kernel set's SIMD color conversion and integer DCT on them.
+ * For a byte budget, either path first fills a store of unquantized
+ * blocks, and quality probes then only quantize and entropy-code those.
+ * Optimized Huffman tables take one extra pass that only counts symbols.
+ * Decoded coefficients (jpeg_decoder.c) can also be coded as they are,
+ * with the source's quantizers and sampling, through the same strips.
+ * A JpegStream codes a frame a wave of strips at a time as the caller
+ * supplies its rows.
+ */
+
+#include "jpeg_encoder.h"
+#include "thread_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+// Worst case for one coded 8x8 block, 0xFF stuffing included
+#define BLOCK_MAX_BYTES 512
+
+// Fraction bits of the coefficients kept for a target-size search; DCT
+// outputs stay within +-1024 for 8-bit samples, so they still fit a short
+#define COEF_FRACTION_BITS 4
+
+typedef struct {
+    unsigned short code;
+    unsigned short length;
+} HuffCode;
+
+// Huffman table as written to DHT: code-length counts, then the symbols
+typedef struct {
+    unsigned char counts[16];
+    unsigned char values[256];
+    int size;
+} HuffSpec;
+
+// DHT order of the tables, also the index into symbol frequencies
+enum { HUFF_DC_Y, HUFF_AC_Y, HUFF_DC_UV, HUFF_AC_UV, HUFF_TABLES };
+
+// Entropy-coded output of one strip
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    unsigned int bit_buf;
+    int bit_cnt;
+    int failed;
+} BitWriter;
+
+// Per-task state: strip output plus planar path scratch
+typedef struct {
+    BitWriter out;
+    short *scratch;
+    short *store;              // Next stored block while filling the coefficient store
+    size_t bits;               // Size-only probe: coded bits of the strip so far
+    unsigned int *freq;        // Symbol pass: [HUFF_TABLES][256] counts for the strip
+} StripWorker;
+
+typedef struct {
+    const ImageBuffer *image;
+    int first_row;             // Streaming: image holds rows [first_row, first_row + image->height)
+    int height;                // Rows in the frame
+    const EncodeKernels *kernels;  // NULL: float reference path
+    int subsample;             // 4:2:0 chroma (16x16 MCUs) instead of 4:4:4
+    int mcu_size;
+    int blocks_per_mcu;        // Y blocks, then Cb and Cr
+    int mcus_per_row;
+    int mcu_rows;
+    int rows_per_strip;        // MCU rows per restart interval
+    int strips;
+    int first_strip;           // Strip coded by task 0 of the current wave
+    int wave;                  // Strips coded at once
+    unsigned char y_table[64]; // Quantizers in zigzag order, as written to DQT
+    unsigned char uv_table[64];
+    float fdtbl_y[64];         // Quantizer reciprocals with the AAN scale folded in
+    float fdtbl_uv[64];
+    short *coefficients;       // Target-size search: every block, unquantized, in coding order
+    int storing;               // Transform pass filling `coefficients`
+    int counting;              // Size-only probe: blocks are measured, not written
+    int optimize;              // Optimized Huffman tables (two passes)
+    int gathering;             // Symbol pass: blocks only update `freq`
+    unsigned long long freq[HUFF_TABLES][256];
+    size_t value_bits;         // Symbol pass: magnitude bits after the codes
+    HuffSpec dht[HUFF_TABLES];
+    int tables;                // Tables written to DHT (2 for a grey source)
+    const JpegCoefficients *source;  // Transcoding: decoded blocks, coded unchanged
+    float qscale_y[64];        // Stored coefficient to quantized value, natural order
+    float qscale_uv[64];
+    HuffCode ydc[256], yac[256], uvdc[256], uvac[256];
+    StripWorker *workers;      // One per task of a wave
+} JpegEncoder;
+
+static const unsigned char zigzag[64] = {
+    0, 1, 5, 6, 14, 15, 27, 28, 2, 4, 7, 13, 16, 26, 29, 42, 3, 8, 12, 17, 25, 30, 41, 43, 9, 11, 18,
+    24, 31, 40, 44, 53, 10, 19, 23, 32, 39, 45, 52, 54, 20, 22, 33, 38, 46, 51, 55, 60, 21, 34, 37, 47, 50, 56, 59, 61, 35, 36, 48, 49, 57, 58, 62, 63
+};
+
+// Natural (row-major) index of each zigzag position
+static const unsigned char natural_order[64] = {
+    0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5, 12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// Standard (Annex K) quantization and Huffman tables
+static const int std_y_quant[64] = {
+    16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55, 14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62, 18, 22,
+    37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92, 49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99
+};
+static const int std_uv_quant[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99, 24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99
+};
+
+static const unsigned char std_dc_y_counts[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const unsigned char std_dc_y_values[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+static const unsigned char std_ac_y_counts[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const unsigned char std_ac_y_values[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+    0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
+};
+static const unsigned char std_dc_uv_counts[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const unsigned char std_dc_uv_values[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+static const unsigned char std_ac_uv_counts[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const unsigned char std_ac_uv_values[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
+};
+
+// Canonical codes from the code-length counts (JPEG Annex C)
+static void build_huffman(const unsigned char counts[16], const unsigned char *values, HuffCode table[256]) {
+    unsigned int code = 0;
+    int k = 0;
+    memset(table, 0, sizeof(HuffCode) * 256);
+    for (int length = 1; length <= 16; length++) {
+        for (int i = 0; i < counts[length - 1]; i++, k++) {
+            table[values[k]].code = (unsigned short)code++;
+            table[values[k]].length = (unsigned short)length;
+        }
+        code <<= 1;
+    }
+}
+
+// Length-limited optimal code for symbol frequencies (JPEG Annex K.2, as
+// in libjpeg's jpeg_gen_optimal_table). A reserved symbol with frequency 1
+// keeps any real code from being all one bits.
+static void build_optimal_spec(const unsigned long long freq_in[256], HuffSpec *spec) {
+    unsigned long long freq[257];
+    int codesize[257], others[257], bits[33] = {0};
+    for (int i = 0; i < 256; i++) freq[i] = freq_in[i];
+    freq[256] = 1;
+    for (int i = 0; i < 257; i++) {
+        codesize[i] = 0;
+        others[i] = -1;
+    }
+
+    // Huffman's algorithm; ties pick the larger symbol so the reserved one
+    // ends up deepest
+    for (;;) {
+        int c1 = -1, c2 = -1;
+        unsigned long long v = ULLONG_MAX;
+        for (int i = 0; i < 257; i++) {
+            if (freq[i] && freq[i] <= v) {
+                v = freq[i];
+                c1 = i;
+            }
+        }
+        v = ULLONG_MAX;
+        for (int i = 0; i < 257; i++) {
+            if (freq[i] && freq[i] <= v && i != c1) {
+                v = freq[i];
+                c2 = i;
+            }
+        }
+        if (c2 < 0) break;
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+        codesize[c1]++;
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = c2;
+        codesize[c2]++;
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
+
+    for (int i = 0; i < 257; i++) {
+        if (codesize[i]) bits[codesize[i]]++;
+    }
+
+    // Move codes longer than 16 bits up the tree
+    for (int i = 32; i > 16; i--) {
+        while (bits[i] > 0) {
+            int j = i - 2;
+            while (bits[j] == 0) j--;
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+
+    // Drop the reserved symbol from the longest length
+    int longest = 16;
+    while (bits[longest] == 0) longest--;
+    bits[longest]--;
+
+    for (int i = 0; i < 16; i++) spec->counts[i] = (unsigned char)bits[i + 1];
+    spec->size = 0;
+    for (int length = 1; length <= 32; length++) {
+        for (int i = 0; i < 256; i++) {
+            if (codesize[i] == length) spec->values[spec->size++] = (unsigned char)i;
+        }
+    }
+}
+
+// Make room for one more coded block
+static int writer_reserve(BitWriter *w) {
+    if (w->size + BLOCK_MAX_BYTES <= w->capacity) return 1;
+
+    size_t capacity = w->capacity ? w->capacity * 2 : 64 * 1024;
+    while (capacity < w->size + BLOCK_MAX_BYTES) capacity *= 2;
+    unsigned char *grown = realloc(w->data, capacity);
+    if (!grown) {
+        w->failed = 1;
+        return 0;
+    }
+    w->data = grown;
+    w->capacity = capacity;
+    return 1;
+}
+
+// Append `length` bits MSB first, stuffing a zero after every 0xFF byte
+static inline void put_bits(BitWriter *w, unsigned int code, int length) {
+    w->bit_cnt += length;
+    w->bit_buf |= code << (24 - w->bit_cnt);
+    while (w->bit_cnt >= 8) {
+        unsigned char c = (w->bit_buf >> 16) & 255;
+        w->data[w->size++] = c;
+        if (c == 255) {
+            w->data[w->size++] = 0;
+        }
+        w->bit_buf <<= 8;
+        w->bit_cnt -= 8;
+    }
+}
+
+static inline void put_code(BitWriter *w, const HuffCode *code) {
+    put_bits(w, code->code, code->length);
+}
+
+// Magnitude category and the value bits that follow the Huffman code
+static inline void put_value(BitWriter *w, const HuffCode *table, int run, int value) {
+    int magnitude = value < 0 ? -value : value;
+    int bits = 32 - __builtin_clz((unsigned int)magnitude);
+    if (value < 0) value--;
+    put_code(w, &table[(run << 4) + bits]);
+    put_bits(w, (unsigned int)value & ((1u << bits) - 1), bits);
+}
+
+// Pad the last byte with 1 bits
+static void flush_bits(BitWriter *w) {
+    put_bits(w, 0x7F, 7);
+    w->bit_buf = 0;
+    w->bit_cnt = 0;
+}
+
+// Forward AAN DCT of 8 values (scaled; the scale is folded into fdtbl)
+static void fdct_1d(float *d0p, float *d1p, float *d2p, float *d3p, float *d4p, float *d5p, float *d6p, float *d7p) {
+    float d0 = *d0p, d1 = *d1p, d2 = *d2p, d3 = *d3p, d4 = *d4p, d5 = *d5p, d6 = *d6p, d7 = *d7p;
+    float z1, z2, z3, z4, z5, z11, z13;
+
+    float tmp0 = d0 + d7;
+    float tmp7 = d0 - d7;
+    float tmp1 = d1 + d6;
+    float tmp6 = d1 - d6;
+    float tmp2 = d2 + d5;
+    float tmp5 = d2 - d5;
+    float tmp3 = d3 + d4;
+    float tmp4 = d3 - d4;
+
+    // Even part
+    float tmp10 = tmp0 + tmp3;
+    float tmp13 = tmp0 - tmp3;
+    float tmp11 = tmp1 + tmp2;
+    float tmp12 = tmp1 - tmp2;
+
+    d0 = tmp10 + tmp11;
+    d4 = tmp10 - tmp11;
+
+    z1 = (tmp12 + tmp13) * 0.707106781f;
+    d2 = tmp13 + z1;
+    d6 = tmp13 - z1;
+
+    // Odd part
+    tmp10 = tmp4 + tmp5;
+    tmp11 = tmp5 + tmp6;
+    tmp12 = tmp6 + tmp7;
+
+    z5 = (tmp10 - tmp12) * 0.382683433f;
+    z2 = tmp10 * 0.541196100f + z5;
+    z4 = tmp12 * 1.306562965f + z5;
+    z3 = tmp11 * 0.707106781f;
+
+    z11 = tmp7 + z3;
+    z13 = tmp7 - z3;
+
+    *d5p = z13 + z2;
+    *d3p = z13 - z2;
+    *d1p = z11 + z4;
+    *d7p = z11 - z4;
+
+    *d0p = d0;  *d2p = d2;  *d4p = d4;  *d6p = d6;
+}
+
+// Entropy-code one block of natural-order coefficients; returns its DC
+static int code_coefficients(BitWriter *w, const short *coef, int dc,
+                             const HuffCode *dc_table, const HuffCode *ac_table) {
+    if (!writer_reserve(w)) return dc;
+
+    // DC difference
+    int diff = coef[0] - dc;
+    if (diff == 0) {
+        put_code(w, &dc_table[0]);
+    } else {
+        put_value(w, dc_table, 0, diff);
+    }
+
+    // AC run-lengths in zigzag order
+    int last = 63;
+    while (last > 0 && coef[natural_order[last]] == 0) last--;
+    for (int k = 1; k <= last; k++) {
+        int run = 0;
+        while (coef[natural_order[k]] == 0) {
+            run++;
+            k++;
+        }
+        while (run >= 16) {
+            put_code(w, &ac_table[0xF0]);
+            run -= 16;
+        }
+        put_value(w, ac_table, run, coef[natural_order[k]]);
+    }
+    if (last != 63) {
+        put_code(w, &ac_table[0x00]);
+    }
+    return coef[0];
+}
+
+// Huffman code plus value bits for one (run, value) symbol
+static inline size_t value_bits(const HuffCode *table, int run, int value) {
+    int magnitude = value < 0 ? -value : value;
+    int bits = 32 - __builtin_clz((unsigned int)magnitude);
+    return table[(run << 4) + bits].length + bits;
+}
+
+// Coded size of a block in bits, walked like code_coefficients but without
+// packing bytes (so 0xFF stuffing is not included); returns its DC
+static int count_coefficients(const short *coef, int dc, const HuffCode *dc_table,
+                              const HuffCode *ac_table, size_t *bits) {
+    int diff = coef[0] - dc;
+    size_t n = diff == 0 ? dc_table[0].length : value_bits(dc_table, 0, diff);
+
+    int last = 63;
+    while (last > 0 && coef[natural_order[last]] == 0) last--;
+    for (int k = 1; k <= last; k++) {
+        int run = 0;
+        while (coef[natural_order[k]] == 0) {
+            run++;
+            k++;
+        }
+        n += (size_t)(run >> 4) * ac_table[0xF0].length;
+        n += value_bits(ac_table, run & 15, coef[natural_order[k]]);
+    }
+    if (last != 63) {
+        n += ac_table[0x00].length;
+    }
+    *bits += n;
+    return coef[0];
+}
+
+// Count the Huffman symbols of one block, walked like code_coefficients,
+// and add up their value bits; returns its DC
+static int gather_coefficients(const short *coef, int dc, unsigned int *dc_freq, unsigned int *ac_freq,
+                               size_t *bits) {
+    int diff = coef[0] - dc;
+    int magnitude = diff < 0 ? -diff : diff;
+    int category = diff == 0 ? 0 : 32 - __builtin_clz((unsigned int)magnitude);
+    dc_freq[category]++;
+    size_t n = category;
+
+    int last = 63;
+    while (last > 0 && coef[natural_order[last]] == 0) last--;
+    for (int k = 1; k <= last; k++) {
+        int run = 0;
+        while (coef[natural_order[k]] == 0) {
+            run++;
+            k++;
+        }
+        ac_freq[0xF0] += run >> 4;
+        int value = coef[natural_order[k]];
+        magnitude = value < 0 ? -value : value;
+        category = 32 - __builtin_clz((unsigned int)magnitude);
+        ac_freq[((run & 15) << 4) + category]++;
+        n += category;
+    }
+    if (last != 63) {
+        ac_freq[0x00]++;
+    }
+    *bits += n;
+    return coef[0];
+}
+
+// Entropy-code a block of component 0 (Y), 1 (Cb) or 2 (Cr), append it to
+// the coefficient store during the transform pass, or only measure it or
+// count its symbols
+static void put_block(const JpegEncoder *enc, StripWorker *worker, int component,
+                      const short *coef, int dc[3]) {
+    if (worker->store) {
+        memcpy(worker->store, coef, 64 * sizeof(short));
+        worker->store += 64;
+    } else if (enc->counting) {
+        dc[component] = count_coefficients(coef, dc[component], component ? enc->uvdc : enc->ydc,
+                                           component ? enc->uvac : enc->yac, &worker->bits);
+    } else if (enc->gathering) {
+        unsigned int *freq = worker->freq + (component ? HUFF_DC_UV : HUFF_DC_Y) * 256;
+        dc[component] = gather_coefficients(coef, dc[component], freq, freq + 256, &worker->bits);
+    } else if (component == 0) {
+        dc[0] = code_coefficients(&worker->out, coef, dc[0], enc->ydc, enc->yac);
+    } else {
+        dc[component] = code_coefficients(&worker->out, coef, dc[component], enc->uvdc, enc->uvac);
+    }
+}
+
+// Float reference: DCT and quantize one 8x8 block in place, then put it
+static void code_block(const JpegEncoder *enc, StripWorker *worker, int component,
+                       float *block, int stride, int dc[3]) {
+    const float *fdtbl = component ? enc->fdtbl_uv : enc->fdtbl_y;
+    short coef[64];
+
+    for (int off = 0; off < stride * 8; off += stride) {
+        fdct_1d(&block[off], &block[off + 1], &block[off + 2], &block[off + 3],
+                &block[off + 4], &block[off + 5], &block[off + 6], &block[off + 7]);
+    }
+    for (int off = 0; off < 8; off++) {
+        fdct_1d(&block[off], &block[off + stride], &block[off + stride * 2], &block[off + stride * 3],
+                &block[off + stride * 4], &block[off + stride * 5], &block[off + stride * 6],
+                &block[off + stride * 7]);
+    }
+
+    for (int y = 0, j = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++, j++) {
+            float v = block[y * stride + x] * fdtbl[j];
+            coef[j] = (short)(int)(v < 0 ? v - 0.5f : v + 0.5f);
+        }
+    }
+    put_block(enc, worker, component, coef, dc);
+}
+
+// Source row `row` of the frame; rows past the bottom repeat the last one
+static inline const unsigned char *source_row(const JpegEncoder *enc, int row) {
+    if (row >= enc->height) row = enc->height - 1;
+    return enc->image->data + (size_t)(row - enc->first_row) * enc->image->stride;
+}
+
+// Level-shifted YCbCr for a size x size tile at (x, y), edges replicated
+static void load_tile(const JpegEncoder *enc, int x0, int y0, int size, float *Y, float *U, float *V) {
+    const ImageBuffer *img = enc->image;
+    int channels = img->channels;
+    int ofs_g = channels > 2 ? 1 : 0;
+    int ofs_b = channels > 2 ? 2 : 0;
+
+    for (int row = y0, pos = 0; row < y0 + size; row++) {
+        const unsigned char *line = source_row(enc, row);
+        for (int col = x0; col < x0 + size; col++, pos++) {
+            const unsigned char *p = line + (size_t)(col < img->width ? col : img->width - 1) * channels;
+            float r = p[0], g = p[ofs_g], b = p[ofs_b];
+            Y[pos] = +0.29900f * r + 0.58700f * g + 0.11400f * b - 128;
+            U[pos] = -0.16874f * r - 0.33126f * g + 0.50000f * b;
+            V[pos] = +0.50000f * r - 0.41869f * g - 0.08131f * b;
+        }
+    }
+}
+
+static void code_mcu_row(const JpegEncoder *enc, StripWorker *worker, int mcu_row, int dc[3]) {
+    const ImageBuffer *img = enc->image;
+    int y = mcu_row * enc->mcu_size;
+
+    for (int x = 0; x < img->width && !worker->out.failed; x += enc->mcu_size) {
+        if (enc->subsample) {
+            float Y[256], U[256], V[256], sub_u[64], sub_v[64];
+            load_tile(enc, x, y, 16, Y, U, V);
+            code_block(enc, worker, 0, Y, 16, dc);
+            code_block(enc, worker, 0, Y + 8, 16, dc);
+            code_block(enc, worker, 0, Y + 128, 16, dc);
+            code_block(enc, worker, 0, Y + 136, 16, dc);
+
+            for (int yy = 0, pos = 0; yy < 8; yy++) {
+                for (int xx = 0; xx < 8; xx++, pos++) {
+                    int j = yy * 32 + xx * 2;
+                    sub_u[pos] = (U[j + 0] + U[j + 1] + U[j + 16] + U[j + 17]) * 0.25f;
+                    sub_v[pos] = (V[j + 0] + V[j + 1] + V[j + 16] + V[j + 17]) * 0.25f;
+                }
+            }
+            code_block(enc, worker, 1, sub_u, 8, dc);
+            code_block(enc, worker, 2, sub_v, 8, dc);
+        } else {
+            float Y[64], U[64], V[64];
+            load_tile(enc, x, y, 8, Y, U, V);
+            code_block(enc, worker, 0, Y, 8, dc);
+            code_block(enc, worker, 1, U, 8, dc);
+            code_block(enc, worker, 2, V, 8, dc);
+        }
+    }
+}
+
+void ycc_row_generic(const unsigned char *src, int width, int channels,
+                     short *y, short *cb, short *cr) {
+    int ofs_g = channels > 2 ? 1 : 0;
+    int ofs_b = channels > 2 ? 2 : 0;
+
+    for (int x = 0; x < width; x++) {
+        const unsigned char *p = src + (size_t)x * channels;
+        int r = p[0], g = p[ofs_g], b = p[ofs_b];
+        y[x] = (short)(((YCC_Y_R * r + YCC_Y_G * g + YCC_Y_B * b + (1 << 14)) >> 15) - 128);
+        cb[x] = (short)((YCC_CB_R * r + YCC_CB_G * g + YCC_CB_B * b + (1 << 12)) >> 13);
+        cr[x] = (short)((YCC_CR_R * r + YCC_CR_G * g + YCC_CR_B * b + (1 << 12)) >> 13);
+    }
+}
+
+// Planar scratch for one MCU row, in shorts: Y, full-resolution Cb/Cr
+// (two fraction bits), output-resolution Cb/Cr, then coefficients
+static size_t scratch_size(const JpegEncoder *enc) {
+    size_t luma = (size_t)enc->mcu_size * enc->mcus_per_row * enc->mcu_size;
+    size_t chroma = (size_t)64 * enc->mcus_per_row;
+    return 4 * luma + 4 * chroma;
+}
+
+static void code_mcu_row_planar(const JpegEncoder *enc, StripWorker *worker, int mcu_row, int dc[3]) {
+    const ImageBuffer *img = enc->image;
+    const EncodeKernels *kernels = enc->kernels;
+    int mcu = enc->mcu_size;
+    int width = enc->mcus_per_row * mcu;        // Luma plane width, edge-padded
+    int chroma_width = enc->mcus_per_row * 8;
+    size_t luma = (size_t)mcu * width;
+    size_t chroma = (size_t)8 * chroma_width;
+    short *y = worker->scratch;
+    short *cb_full = y + luma;
+    short *cr_full = cb_full + luma;
+    short *cb = cr_full + luma;
+    short *cr = cb + chroma;
+    short *coef_y = cr + chroma;
+    short *coef_cb = coef_y + luma;
+    short *coef_cr = coef_cb + chroma;
+
+    // Rows past the bottom repeat the last row, columns past the edge the last column
+    for (int r = 0; r < mcu; r++) {
+        short *y_row = y + (size_t)r * width;
+        short *cb_row = cb_full + (size_t)r * width;
+        short *cr_row = cr_full + (size_t)r * width;
+        kernels->ycc_row(source_row(enc, mcu_row * mcu + r), img->width, img->channels,
+                         y_row, cb_row, cr_row);
+        for (int x = img->width; x < width; x++) {
+            y_row[x] = y_row[x - 1];
+            cb_row[x] = cb_row[x - 1];
+            cr_row[x] = cr_row[x - 1];
+        }
+    }
+
+    // Chroma at output resolution: 2x2 average (4:2:0) or just descaled
+    if (enc->subsample) {
+        for (int r = 0; r < 8; r++) {
+            const short *cb0 = cb_full + (size_t)2 * r * width, *cb1 = cb0 + width;
+            const short *cr0 = cr_full + (size_t)2 * r * width, *cr1 = cr0 + width;
+            for (int x = 0; x < chroma_width; x++) {
+                cb[r * chroma_width + x] = (short)((cb0[2 * x] + cb0[2 * x + 1] + cb1[2 * x] + cb1[2 * x + 1] + 8) >> 4);
+                cr[r * chroma_width + x] = (short)((cr0[2 * x] + cr0[2 * x + 1] + cr1[2 * x] + cr1[2 * x + 1] + 8) >> 4);
+            }
+        }
+    } else {
+        for (size_t i = 0; i < chroma; i++) {
+            cb[i] = (short)((cb_full[i] + 2) >> 2);
+            cr[i] = (short)((cr_full[i] + 2) >> 2);
+        }
+    }
+
+    int luma_blocks = width / 8;
+    for (int band = 0; band < mcu / 8; band++) {
+        kernels->fdct_quant(y + (size_t)band * 8 * width, width, luma_blocks, enc->fdtbl_y,
+                            coef_y + (size_t)band * luma_blocks * 64);
+    }
+    kernels->fdct_quant(cb, chroma_width, enc->mcus_per_row, enc->fdtbl_uv, coef_cb);
+    kernels->fdct_quant(cr, chroma_width, enc->mcus_per_row, enc->fdtbl_uv, coef_cr);
+
+    // Interleave the blocks in MCU order
+    for (int m = 0; m < enc->mcus_per_row && !worker->out.failed; m++) {
+        if (enc->subsample) {
+            const short *top = coef_y + (size_t)2 * m * 64;
+            const short *bottom = top + (size_t)luma_blocks * 64;
+            put_block(enc, worker, 0, top, dc);
+            put_block(enc, worker, 0, top + 64, dc);
+            put_block(enc, worker, 0, bottom, dc);
+            put_block(enc, worker, 0, bottom + 64, dc);
+        } else {
+            put_block(enc, worker, 0, coef_y + (size_t)m * 64, dc);
+        }
+        put_block(enc, worker, 1, coef_cb + (size_t)m * 64, dc);
+        put_block(enc, worker, 2, coef_cr + (size_t)m * 64, dc);
+    }
+}
+
+// Quantize and code one MCU row from the coefficient store
+static void code_mcu_row_stored(const JpegEncoder *enc, StripWorker *worker, int mcu_row, int dc[3]) {
+    int luma_blocks = enc->blocks_per_mcu - 2;
+    const short *block = enc->coefficients + (size_t)mcu_row * enc->mcus_per_row * enc->blocks_per_mcu * 64;
+    short coef[64];
+
+    for (int m = 0; m < enc->mcus_per_row && !worker->out.failed; m++) {
+        for (int b = 0; b < enc->blocks_per_mcu; b++, block += 64) {
+            int component = b < luma_blocks ? 0 : b - luma_blocks + 1;
+            const float *qscale = component ? enc->qscale_uv : enc->qscale_y;
+            // Round half away from zero; copysignf keeps the loop branch-free
+            // so it vectorizes
+            for (int k = 0; k < 64; k++) {
+                float v = block[k] * qscale[k];
+                coef[k] = (short)(int)(v + copysignf(0.5f, v));
+            }
+            put_block(enc, worker, component, coef, dc);
+        }
+    }
+}
+
+// Code one MCU row of decoded blocks, interleaved as in the source frame
+static void code_mcu_row_source(const JpegEncoder *enc, StripWorker *worker, int mcu_row, int dc[3]) {
+    const JpegCoefficients *src = enc->source;
+
+    for (int m = 0; m < enc->mcus_per_row && !worker->out.failed; m++) {
+        for (int c = 0; c < src->components; c++) {
+            const JpegComponent *comp = &src->comp[c];
+            for (int by = 0; by < comp->v; by++) {
+                const short *block = comp->coef +
+                    ((size_t)(mcu_row * comp->v + by) * comp->blocks_w + (size_t)m * comp->h) * 64;
+                for (int bx = 0; bx < comp->h; bx++, block += 64) put_block(enc, worker, c, block, dc);
+            }
+        }
+    }
+}
+
+// Code one restart interval; DC predictors start from zero in each. The
+// transform pass runs the same rows but only fills the coefficient store.
+static void code_strip(void *arg, int task) {
+    JpegEncoder *enc = arg;
+    StripWorker *worker = &enc->workers[task];
+    BitWriter *w = &worker->out;
+    int strip = enc->first_strip + task;
+    int row_begin = strip * enc->rows_per_strip;
+    int row_end = row_begin + enc->rows_per_strip;
+    if (row_end > enc->mcu_rows) row_end = enc->mcu_rows;
+
+    int dc[3] = { 0, 0, 0 };
+    w->size = 0;
+    w->bit_buf = 0;
+    w->bit_cnt = 0;
+    worker->bits = 0;
+    if (enc->kernels && !worker->scratch) {
+        worker->scratch = malloc(scratch_size(enc) * sizeof(short));
+        if (!worker->scratch) w->failed = 1;
+    }
+    if (enc->gathering) {
+        if (!worker->freq) worker->freq = malloc(HUFF_TABLES * 256 * sizeof(unsigned int));
+        if (worker->freq) {
+            memset(worker->freq, 0, HUFF_TABLES * 256 * sizeof(unsigned int));
+        } else {
+            w->failed = 1;
+        }
+    }
+    if (enc->storing) {
+        worker->store = enc->coefficients + (size_t)row_begin * enc->mcus_per_row * enc->blocks_per_mcu * 64;
+    }
+    for (int row = row_begin; row < row_end && !w->failed; row++) {
+        if (enc->source) {
+            code_mcu_row_source(enc, worker, row, dc);
+        } else if (enc->coefficients && !enc->storing) {
+            code_mcu_row_stored(enc, worker, row, dc);
+        } else if (enc->kernels) {
+            code_mcu_row_planar(enc, worker, row, dc);
+        } else {
+            code_mcu_row(enc, worker, row, dc);
+        }
+    }
+    worker->store = NULL;
+    if (enc->storing || enc->counting || enc->gathering || w->failed || !writer_reserve(w)) return;
+
+    flush_bits(w);
+    if (strip + 1 < enc->strips) {
+        w->data[w->size++] = 0xFF;
+        w->data[w->size++] = (unsigned char)(0xD0 + (strip & 7));
+    }
+}
+
+// AAN output scale per row/column
+static const float aasf[8] = {
+    1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
+    1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f
+};
+
+// Quantizers for `quality` (stb's scaling of the Annex K tables)
+static void set_quality(JpegEncoder *enc, int quality) {
+    quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    for (int i = 0; i < 64; i++) {
+        int yti = (std_y_quant[i] * quality + 50) / 100;
+        int uvti = (std_uv_quant[i] * quality + 50) / 100;
+        enc->y_table[zigzag[i]] = (unsigned char)(yti < 1 ? 1 : yti > 255 ? 255 : yti);
+        enc->uv_table[zigzag[i]] = (unsigned char)(uvti < 1 ? 1 : uvti > 255 ? 255 : uvti);
+    }
+    for (int row = 0, k = 0; row < 8; row++) {
+        for (int col = 0; col < 8; col++, k++) {
+            enc->fdtbl_y[k] = 1 / (enc->y_table[zigzag[k]] * aasf[row] * aasf[col]);
+            enc->fdtbl_uv[k] = 1 / (enc->uv_table[zigzag[k]] * aasf[row] * aasf[col]);
+            enc->qscale_y[k] = 1.0f / (enc->y_table[zigzag[k]] << COEF_FRACTION_BITS);
+            enc->qscale_uv[k] = 1.0f / (enc->uv_table[zigzag[k]] << COEF_FRACTION_BITS);
+        }
+    }
+}
+
+// Transform pass tables: descale only, keeping COEF_FRACTION_BITS
+static void set_unquantized(JpegEncoder *enc) {
+    for (int row = 0, k = 0; row < 8; row++) {
+        for (int col = 0; col < 8; col++, k++) {
+            enc->fdtbl_y[k] = (1 << COEF_FRACTION_BITS) / (aasf[row] * aasf[col]);
+            enc->fdtbl_uv[k] = enc->fdtbl_y[k];
+        }
+    }
+}
+
+static void set_spec(HuffSpec *spec, const unsigned char counts[16], const unsigned char *values, int size) {
+    memcpy(spec->counts, counts, 16);
+    memcpy(spec->values, values, size);
+    spec->size = size;
+}
+
+// Coding tables from the DHT specs
+static void use_huffman(JpegEncoder *enc) {
+    build_huffman(enc->dht[HUFF_DC_Y].counts, enc->dht[HUFF_DC_Y].values, enc->ydc);
+    build_huffman(enc->dht[HUFF_AC_Y].counts, enc->dht[HUFF_AC_Y].values, enc->yac);
+    build_huffman(enc->dht[HUFF_DC_UV].counts, enc->dht[HUFF_DC_UV].values, enc->uvdc);
+    build_huffman(enc->dht[HUFF_AC_UV].counts, enc->dht[HUFF_AC_UV].values, enc->uvac);
+}
+
+static void setup_tables(JpegEncoder *enc, int quality) {
+    set_quality(enc, quality);
+    set_spec(&enc->dht[HUFF_DC_Y], std_dc_y_counts, std_dc_y_values, sizeof(std_dc_y_values));
+    set_spec(&enc->dht[HUFF_AC_Y], std_ac_y_counts, std_ac_y_values, sizeof(std_ac_y_values));
+    set_spec(&enc->dht[HUFF_DC_UV], std_dc_uv_counts, std_dc_uv_values, sizeof(std_dc_uv_values));
+    set_spec(&enc->dht[HUFF_AC_UV], std_ac_uv_counts, std_ac_uv_values, sizeof(std_ac_uv_values));
+    enc->tables = HUFF_TABLES;
+    use_huffman(enc);
+}
+
+// SOI through SOF of a transcoded source: JFIF (Adobe for RGB components,
+// which is how decoders tell them from YCbCr), the source's quantizers,
+// and its sampling factors and component ids. Quantizers over 255 need
+// 16-bit DQT entries and so an extended (SOF1) frame.
+static void write_source_frame(const JpegCoefficients *src, WriteFn write, void *context) {
+    static const unsigned char jfif[] = {
+        0xFF, 0xD8, 0xFF, 0xE0, 0, 0x10, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0
+    };
+    static const unsigned char adobe[] = {
+        0xFF, 0xD8, 0xFF, 0xEE, 0, 0x0E, 'A', 'd', 'o', 'b', 'e', 0, 100, 0, 0, 0, 0, 0
+    };
+    unsigned char dqt[4 + 4 * 129];
+    unsigned char sof[10 + 3 * JPEG_MAX_COMPONENTS];
+    int used = 0;
+    int extended = 0;
+    size_t n = 4;
+
+    for (int c = 0; c < src->components; c++) used |= 1 << src->comp[c].quant;
+    for (int t = 0; t < 4; t++) {
+        if (!(used & 1 << t)) continue;
+        int wide = 0;
+        for (int k = 0; k < 64; k++) wide |= src->quant[t][k] > 255;
+        extended |= wide;
+        dqt[n++] = (unsigned char)(wide << 4 | t);
+        for (int k = 0; k < 64; k++) {
+            int q = src->quant[t][natural_order[k]];
+            if (wide) dqt[n++] = (unsigned char)(q >> 8);
+            dqt[n++] = (unsigned char)q;
+        }
+    }
+    dqt[0] = 0xFF;
+    dqt[1] = 0xDB;
+    dqt[2] = (unsigned char)((n - 2) >> 8);
+    dqt[3] = (unsigned char)((n - 2) & 0xFF);
+
+    int length = 8 + 3 * src->components;
+    sof[0] = 0xFF;
+    sof[1] = extended ? 0xC1 : 0xC0;
+    sof[2] = 0;
+    sof[3] = (unsigned char)length;
+    sof[4] = 8;
+    sof[5] = (unsigned char)(src->height >> 8);
+    sof[6] = (unsigned char)(src->height & 0xFF);
+    sof[7] = (unsigned char)(src->width >> 8);
+    sof[8] = (unsigned char)(src->width & 0xFF);
+    sof[9] = (unsigned char)src->components;
+    for (int c = 0; c < src->components; c++) {
+        sof[10 + 3 * c] = (unsigned char)src->comp[c].id;
+        sof[11 + 3 * c] = (unsigned char)(src->comp[c].h << 4 | src->comp[c].v);
+        sof[12 + 3 * c] = (unsigned char)src->comp[c].quant;
+    }
+
+    if (src->rgb) {
+        write(context, adobe, sizeof(adobe));
+    } else {
+        write(context, jfif, sizeof(jfif));
+    }
+    write(context, dqt, n);
+    write(context, sof, 2 + length);
+}
+
+// SOI through SOS, with a DRI segment when the image has restart strips
+static void write_headers(const JpegEncoder *enc, WriteFn write, void *context) {
+    static const unsigned char head0[] = {
+        0xFF, 0xD8, 0xFF, 0xE0, 0, 0x10, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0, 0xFF, 0xDB, 0, 0x84, 0
+    };
+    static const unsigned char head2[] = { 0xFF, 0xDA, 0, 0xC, 3, 1, 0, 2, 0x11, 3, 0x11, 0, 0x3F, 0 };
+    static const unsigned char one = 1;
+    static const unsigned char table_ids[HUFF_TABLES] = { 0x00, 0x10, 0x01, 0x11 };
+
+    int dht_length = 2;
+    for (int t = 0; t < enc->tables; t++) dht_length += 17 + enc->dht[t].size;
+    const unsigned char dht[] = { 0xFF, 0xC4, (unsigned char)(dht_length >> 8), (unsigned char)(dht_length & 0xFF) };
+
+    if (enc->source) {
+        write_source_frame(enc->source, write, context);
+    } else {
+        int width = enc->image->width;
+        int height = enc->height;
+        const unsigned char head1[] = {
+            0xFF, 0xC0, 0, 0x11, 8, (unsigned char)(height >> 8), (unsigned char)(height & 0xFF),
+            (unsigned char)(width >> 8), (unsigned char)(width & 0xFF),
+            3, 1, (unsigned char)(enc->subsample ? 0x22 : 0x11), 0, 2, 0x11, 1, 3, 0x11, 1
+        };
+        write(context, head0, sizeof(head0));
+        write(context, enc->y_table, 64);
+        write(context, &one, 1);
+        write(context, enc->uv_table, 64);
+        write(context, head1, sizeof(head1));
+    }
+    write(context, dht, sizeof(dht));
+    for (int t = 0; t < enc->tables; t++) {
+        write(context, &table_ids[t], 1);
+        write(context, enc->dht[t].counts, 16);
+        write(context, enc->dht[t].values, enc->dht[t].size);
+    }
+
+    if (enc->strips > 1) {
+        int interval = enc->rows_per_strip * enc->mcus_per_row;
+        const unsigned char dri[] = { 0xFF, 0xDD, 0, 4, (unsigned char)(interval >> 8), (unsigned char)(interval & 0xFF) };
+        write(context, dri, sizeof(dri));
+    }
+
+    if (enc->source) {
+        // Luma (or the first RGB channel) on tables 0, the rest on tables 1
+        const JpegCoefficients *src = enc->source;
+        unsigned char sos[8 + 2 * JPEG_MAX_COMPONENTS];
+        int length = 6 + 2 * src->components;
+        sos[0] = 0xFF;
+        sos[1] = 0xDA;
+        sos[2] = 0;
+        sos[3] = (unsigned char)length;
+        sos[4] = (unsigned char)src->components;
+        for (int c = 0; c < src->components; c++) {
+            sos[5 + 2 * c] = (unsigned char)src->comp[c].id;
+            sos[6 + 2 * c] = c ? 0x11 : 0x00;
+        }
+        sos[5 + 2 * src->components] = 0;
+        sos[6 + 2 * src->components] = 0x3F;
+        sos[7 + 2 * src->components] = 0;
+        write(context, sos, 2 + length);
+    } else {
+        write(context, head2, sizeof(head2));
+    }
+}
+
+// stb's rule: subsample chroma only at quality 90 and below
+Subsampling encode_subsampling(const EncodeOptions *options) {
+    if (options && options->subsampling != SUBSAMPLING_AUTO) return options->subsampling;
+    int quality = options && options->quality ? options->quality : 90;
+    return quality <= 90 ? SUBSAMPLING_420 : SUBSAMPLING_444;
+}
+
+// Code strips [begin, end), a wave at a time on the pool. Each wave is
+// written in order through `write`, so memory stays bounded and streamed
+// responses keep flowing; without `write` the coded bytes are only added
+// to *bytes. A size-only probe adds each strip's padded bits and restart
+// marker.
+static int code_strip_range(JpegEncoder *enc, int begin, int end, WriteFn write, void *context,
+                            size_t *bytes) {
+    for (int first = begin; first < end; first += enc->wave) {
+        int tasks = end - first < enc->wave ? end - first : enc->wave;
+        enc->first_strip = first;
+        thread_pool_run(code_strip, enc, tasks);
+        for (int t = 0; t < tasks; t++) {
+            const StripWorker *worker = &enc->workers[t];
+            if (worker->out.failed) return 0;
+            if (enc->counting) {
+                *bytes += (worker->bits + 7) / 8 + (first + t + 1 < enc->strips ? 2 : 0);
+                continue;
+            }
+            if (enc->gathering) {
+                for (int i = 0; i < HUFF_TABLES * 256; i++) enc->freq[i / 256][i % 256] += worker->freq[i];
+                enc->value_bits += worker->bits;
+                continue;
+            }
+            if (write) write(context, worker->out.data, worker->out.size);
+            if (bytes) *bytes += worker->out.size;
+        }
+    }
+    return 1;
+}
+
+static int code_strips(JpegEncoder *enc, WriteFn write, void *context, size_t *bytes) {
+    return code_strip_range(enc, 0, enc->strips, write, context, bytes);
+}
+
+static void count_bytes(void *context, const void *data, size_t size) {
+    (void)data;
+    *(size_t *)context += size;
+}
+
+// Symbol pass: count the Huffman symbols the current quality produces.
+// The planar and float paths redo their transform; with a coefficient
+// store only quantization is repeated.
+static int gather_symbols(JpegEncoder *enc) {
+    memset(enc->freq, 0, sizeof(enc->freq));
+    enc->value_bits = 0;
+    enc->gathering = 1;
+    int ok = code_strips(enc, NULL, NULL, NULL);
+    enc->gathering = 0;
+    return ok;
+}
+
+// Switch to optimal tables for the current quality
+static int optimize_tables(JpegEncoder *enc) {
+    if (!gather_symbols(enc)) return 0;
+    for (int t = 0; t < enc->tables; t++) build_optimal_spec(enc->freq[t], &enc->dht[t]);
+    use_huffman(enc);
+    return 1;
+}
+
+// Scan data plus DHT symbol lists that optimal tables would give after a
+// symbol pass, leaving out padding and 0xFF stuffing like a size-only probe
+static size_t optimized_bytes(const JpegEncoder *enc) {
+    size_t bits = enc->value_bits;
+    size_t table_bytes = 0;
+    for (int t = 0; t < enc->tables; t++) {
+        HuffSpec spec;
+        build_optimal_spec(enc->freq[t], &spec);
+        table_bytes += spec.size;
+        for (int length = 1, k = 0; length <= 16; length++) {
+            for (int i = 0; i < spec.counts[length - 1]; i++, k++) {
+                bits += (size_t)length * enc->freq[t][spec.values[k]];
+            }
+        }
+    }
+    return bits / 8 + (size_t)(enc->strips - 1) * 2 + table_bytes;
+}
+
+// stb's quality curve and its inverse, in table scale percent
+static double quality_scale(int quality) {
+    return quality < 50 ? 5000.0 / quality : 200.0 - quality * 2;
+}
+
+static int scale_quality(double scale) {
+    return (int)((scale > 100 ? 5000.0 / scale : (200.0 - scale) / 2) + 0.5);
+}
+
+// Highest quality below `max_quality`, whose file of `max_quality_bytes`
+// is over `max_bytes`, that fits, or 0 if none does (-1 on allocation
+// failure). The DCT runs once into the coefficient store; each probe then
+// only quantizes and adds up code lengths (of the optimal tables for that
+// quality, when optimizing), and the result is checked with one real
+// coding pass. File size is close to a power law in the table scale, so
+// probes are guessed on log(bytes) against log(scale): below
+// `max_quality` the guess extrapolates the slope of the last two sizes
+// (at first assuming bytes fall as 1 / sqrt(scale)) with a doubling
+// minimum step, and once the edge is bracketed it is found by
+// Illinois-style false position (the end that keeps being retained has
+// its error halved).
+static int fit_quality(JpegEncoder *enc, int max_quality, size_t max_quality_bytes, size_t max_bytes,
+                       int *passes) {
+    size_t blocks = (size_t)enc->mcu_rows * enc->mcus_per_row * enc->blocks_per_mcu;
+    enc->coefficients = malloc(blocks * 64 * sizeof(short));
+    if (!enc->coefficients) return -1;
+
+    set_unquantized(enc);
+    enc->storing = 1;
+    int ok = code_strips(enc, NULL, NULL, NULL);
+    enc->storing = 0;
+    if (!ok) return -1;
+
+    size_t fixed = 2;          // EOI
+    set_quality(enc, max_quality);
+    write_headers(enc, count_bytes, &fixed);
+    if (enc->optimize) {
+        // Probes measure with the tables each quality would get
+        for (int t = 0; t < enc->tables; t++) fixed -= enc->dht[t].size;
+    }
+
+    // lo fits (0: nothing yet), hi does not; x = log(scale), y = log(bytes)
+    int lo = 0, hi = max_quality;
+    double lo_x = 0, lo_y = 0;
+    double hi_x = log(quality_scale(max_quality)), hi_y = log((double)max_quality_bytes);
+    double target = log((double)max_bytes);
+    double slope = 0.5;        // -d log(bytes) / d log(scale) below max_quality
+    int probe = scale_quality(exp(hi_x + (hi_y - target) / slope));
+    int step = 2;
+    int retained = 1;          // -1: lo moved last, 1: hi moved last
+    if (probe > hi - 1) probe = hi - 1;
+    if (probe < 1) probe = 1;
+    enc->counting = !enc->optimize;
+    while (hi - lo > 1) {
+        size_t bytes = fixed;
+        set_quality(enc, probe);
+        if (enc->optimize) {
+            if (!gather_symbols(enc)) return -1;
+            bytes += optimized_bytes(enc);
+        } else if (!code_strips(enc, NULL, NULL, &bytes)) {
+            return -1;
+        }
+        ++*passes;
+
+        double x = log(quality_scale(probe));
+        double y = log((double)bytes);
+        if (bytes <= max_bytes) {
+            lo = probe;
+            lo_x = x;
+            lo_y = y;
+            if (retained < 0) hi_y = target + (hi_y - target) / 2;
+            retained = -1;
+        } else {
+            slope = x > hi_x && y < hi_y ? (hi_y - y) / (x - hi_x) : slope;
+            hi = probe;
+            hi_x = x;
+            hi_y = y;
+            if (retained > 0) lo_y = target + (lo_y - target) / 2;
+            retained = 1;
+        }
+        if (hi - lo <= 1) break;
+
+        if (lo == 0) {
+            probe = scale_quality(exp(hi_x + (hi_y - target) / slope));
+            if (probe > hi - step) probe = hi - step;
+            step *= 2;
+        } else if (hi_y <= lo_y) {
+            probe = lo + (hi - lo) / 2;
+        } else {
+            probe = scale_quality(exp(lo_x + (target - lo_y) * (hi_x - lo_x) / (hi_y - lo_y)));
+        }
+        if (probe <= lo) probe = lo + 1;
+        if (probe >= hi) probe = hi - 1;
+    }
+
+    enc->counting = 0;
+
+    // Probes leave out 0xFF stuffing, so they can only under-count: code
+    // the candidate for real and step down while stuffing pushes it over
+    while (lo > 0) {
+        size_t bytes = fixed;
+        set_quality(enc, lo);
+        if (enc->optimize) {
+            if (!optimize_tables(enc)) return -1;
+            bytes = 2;
+            write_headers(enc, count_bytes, &bytes);
+            ++*passes;
+        }
+        if (!code_strips(enc, NULL, NULL, &bytes)) return -1;
+        ++*passes;
+        if (bytes <= max_bytes) break;
+        lo--;
+    }
+
+    // Final pass codes the winner from the same coefficients
+    if (lo > 0) ++*passes;
+    return lo;
+}
+
+// A budgeted encode's first try at the requested quality, held back
+// while it still fits in `limit`
+typedef struct {
+    unsigned char *data;
+    size_t size;               // Bytes written, counted on past `limit`
+    size_t capacity;
+    size_t limit;
+    int failed;                // Out of memory
+} BudgetSink;
+
+static void budget_write(void *context, const void *data, size_t size) {
+    BudgetSink *sink = context;
+    size_t end = sink->size + size;
+    if (end <= sink->limit && !sink->failed) {
+        if (end > sink->capacity) {
+            size_t capacity = sink->capacity ? sink->capacity * 2 : 64 * 1024;
+            while (capacity < end) capacity *= 2;
+            if (capacity > sink->limit) capacity = sink->limit;
+            unsigned char *grown = realloc(sink->data, capacity);
+            if (!grown) {
+                sink->failed = 1;
+                return;
+            }
+            sink->data = grown;
+            sink->capacity = capacity;
+        }
+        memcpy(sink->data + sink->size, data, size);
+    }
+    sink->size = end;
+}
+
+int jpeg_encode(const ImageBuffer *image, const EncodeOptions *options,
+                WriteFn write, void *context) {
+    return jpeg_encode_with(film_kernels(), image, options, write, context);
+}
+
+// Restart strip layout for MCUs of `mcu_pixels` pixels, and the workers of
+// one wave. The layout depends only on the image, never on the thread count.
+static int plan_strips(JpegEncoder *enc, int mcu_pixels, int max_threads) {
+    enc->rows_per_strip = JPEG_STRIP_PIXELS / (enc->mcus_per_row * mcu_pixels);
+    if (enc->rows_per_strip > 0xFFFF / enc->mcus_per_row) enc->rows_per_strip = 0xFFFF / enc->mcus_per_row;
+    if (enc->rows_per_strip < 1) enc->rows_per_strip = 1;
+    enc->strips = (enc->mcu_rows + enc->rows_per_strip - 1) / enc->rows_per_strip;
+
+    int wave = thread_pool_size() + 1;
+    if (max_threads > 0 && wave > max_threads) wave = max_threads;
+    if (wave > enc->strips) wave = enc->strips;
+    enc->wave = wave;
+    enc->workers = calloc(wave, sizeof(StripWorker));
+    return enc->workers != NULL;
+}
+
+// Headers, every strip and EOI
+static int write_jpeg(JpegEncoder *enc, WriteFn write, void *context) {
+    static const unsigned char eoi[] = { 0xFF, 0xD9 };
+
+    write_headers(enc, write, context);
+    if (!code_strips(enc, write, context, NULL)) return 0;
+    write(context, eoi, sizeof(eoi));
+    return 1;
+}
+
+static void free_encoder(JpegEncoder *enc) {
+    for (int t = 0; enc->workers && t < enc->wave; t++) {
+        free(enc->workers[t].out.data);
+        free(enc->workers[t].scratch);
+        free(enc->workers[t].freq);
+    }
+    free(enc->workers);
+    free(enc->coefficients);
+    free(enc);
+}
+
+// Encoder for a width x height frame at the options' quality (returned in
+// *quality), with tables, MCU geometry and strip workers set up
+static JpegEncoder *create_encoder(const KernelSet *kernels, int width, int height,
+                                   const EncodeOptions *options, int *quality_out) {
+    JpegEncoder *enc = calloc(1, sizeof(JpegEncoder));
+    if (!enc) return NULL;
+
+    int quality = options && options->quality ? options->quality : 90;
+    int max_threads = options ? options->max_threads : 0;
+    quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+    enc->height = height;
+    enc->subsample = encode_subsampling(options) == SUBSAMPLING_420;
+    enc->kernels = kernels->encode.ycc_row && quality <= JPEG_SIMD_MAX_QUALITY ? &kernels->encode : NULL;
+    setup_tables(enc, quality);
+
+    enc->mcu_size = enc->subsample ? 16 : 8;
+    enc->blocks_per_mcu = enc->subsample ? 6 : 3;
+    enc->mcus_per_row = (width + enc->mcu_size - 1) / enc->mcu_size;
+    enc->mcu_rows = (height + enc->mcu_size - 1) / enc->mcu_size;
+    if (!plan_strips(enc, enc->mcu_size * enc->mcu_size, max_threads)) {
+        free_encoder(enc);
+        return NULL;
+    }
+    *quality_out = quality;
+    return enc;
+}
+
+static int valid_frame(int width, int height, int channels) {
+    return width > 0 && height > 0 && width <= 0xFFFF && height <= 0xFFFF &&
+        channels >= 1 && channels <= 4;
+}
+
+int jpeg_encode_with(const KernelSet *kernels, const ImageBuffer *image,
+                     const EncodeOptions *options, WriteFn write, void *context) {
+    if (!image || !image->data || !valid_frame(image->width, image->height, image->channels)) {
+        return 0;
+    }
+
+    int quality;
+    JpegEncoder *enc = create_encoder(kernels, image->width, image->height, options, &quality);
+    if (!enc) return 0;
+    enc->image = image;
+
+    EncodeStats *stats = options ? options->stats : NULL;
+    size_t max_bytes = options ? options->max_bytes : 0;
+    int passes = 1;
+    int ok = 1;
+    if (stats) stats->over_budget = 0;
+    enc->optimize = options && options->optimize_huffman;
+    if (enc->optimize) {
+        ok = optimize_tables(enc);
+        passes++;
+    }
+
+    if (ok && max_bytes > 0) {
+        // Most budgets fit the requested quality: code it once, a wave at a
+        // time, and once it is over the budget stop and search lower
+        // qualities from its size projected over the whole frame
+        static const unsigned char eoi[] = { 0xFF, 0xD9 };
+        BudgetSink first = { .limit = max_bytes };
+        int coded = 0;
+        write_headers(enc, budget_write, &first);
+        while (ok && coded < enc->strips && first.size <= max_bytes) {
+            int end = enc->strips - coded < enc->wave ? enc->strips : coded + enc->wave;
+            ok = code_strip_range(enc, coded, end, budget_write, &first, NULL);
+            coded = end;
+        }
+        if (coded == enc->strips) budget_write(&first, eoi, sizeof(eoi));
+        ok = ok && !first.failed;
+        if (ok && first.size <= max_bytes) {
+            write(context, first.data, first.size);
+        } else if (ok) {
+            int rows = coded * enc->rows_per_strip < enc->mcu_rows ? coded * enc->rows_per_strip : enc->mcu_rows;
+            size_t projected = (size_t)((double)first.size * enc->mcu_rows / rows);
+            quality = fit_quality(enc, quality, projected, max_bytes, &passes);
+            ok = quality > 0;
+            if (stats) stats->over_budget = quality == 0;
+            if (ok) ok = write_jpeg(enc, write, context);
+        }
+        free(first.data);
+    } else if (ok) {
+        ok = write_jpeg(enc, write, context);
+    }
+    if (stats) {
+        stats->quality = ok ? quality : 0;
+        stats->passes = passes;
+    }
+
+    free_encoder(enc);
+    return ok;
+}
+
+int jpeg_encode_coefficients(const JpegCoefficients *coefficients, const EncodeOptions *options,
+                             WriteFn write, void *context) {
+    if (!coefficients || coefficients->components < 1) return 0;
+
+    JpegEncoder *enc = calloc(1, sizeof(JpegEncoder));
+    if (!enc) return 0;
+
+    // Quantizers come from the source; only the Huffman tables are chosen
+    setup_tables(enc, 90);
+    if (coefficients->components == 1) enc->tables = 2;
+    enc->source = coefficients;
+    enc->mcus_per_row = coefficients->mcus_per_row;
+    enc->mcu_rows = coefficients->mcu_rows;
+    for (int c = 0; c < coefficients->components; c++) {
+        enc->blocks_per_mcu += coefficients->comp[c].h * coefficients->comp[c].v;
+    }
+    if (!plan_strips(enc, 64 * coefficients->max_h * coefficients->max_v, options ? options->max_threads : 0)) {
+        free_encoder(enc);
+        return 0;
+    }
+
+    EncodeStats *stats = options ? options->stats : NULL;
+    int passes = 1;
+    int ok = 1;
+    enc->optimize = options && options->optimize_huffman;
+    if (enc->optimize) {
+        ok = optimize_tables(enc);
+        passes++;
+    }
+    if (ok) ok = write_jpeg(enc, write, context);
+    if (stats) {
+        stats->quality = 0;
+        stats->passes = passes;
+        stats->over_budget = 0;
+    }
+
+    free_encoder(enc);
+    return ok;
+}
+
+struct JpegStream {
+    JpegEncoder *enc;
+    ImageBuffer rows;          // One wave of strips
+    ImageBuffer window;        // The part of `rows` in the current wave
+    WriteFn write;
+    void *context;
+    EncodeStats *stats;
+    int quality;
+    int next_strip;            // First strip of the current wave
+    int failed;
+};
+
+JpegStream *jpeg_stream_begin(int width, int height, int channels, const EncodeOptions *options,
+                              WriteFn write, void *context) {
+    if (!valid_frame(width, height, channels) ||
+        (options && (options->max_bytes > 0 || options->optimize_huffman))) {
+        return NULL;
+    }
+
+    JpegStream *stream = calloc(1, sizeof(JpegStream));
+    if (!stream) return NULL;
+    stream->enc = create_encoder(film_kernels(), width, height, options, &stream->quality);
+    if (stream->enc) {
+        // Fewer strips per wave only codes fewer at once; the layout and
+        // bytes are unchanged
+        JpegEncoder *enc = stream->enc;
+        size_t strip_bytes = (size_t)width * channels * enc->rows_per_strip * enc->mcu_size;
+        int fit = (int)(JPEG_STREAM_MAX_BYTES / strip_bytes);
+        if (enc->wave > fit) enc->wave = fit > 1 ? fit : 1;
+        stream->rows = image_buffer_alloc(width, enc->wave * enc->rows_per_strip * enc->mcu_size, channels);
+    }
+    if (!stream->rows.data) {
+        if (stream->enc) free_encoder(stream->enc);
+        free(stream);
+        return NULL;
+    }
+
+    stream->write = write;
+    stream->context = context;
+    stream->stats = options ? options->stats : NULL;
+    stream->enc->image = &stream->window;
+    return stream;
+}
+
+ImageBuffer jpeg_stream_window(JpegStream *stream, int *first_row) {
+    const JpegEncoder *enc = stream->enc;
+    int first = stream->next_strip * enc->rows_per_strip * enc->mcu_size;
+    int end = (stream->next_strip + enc->wave) * enc->rows_per_strip * enc->mcu_size;
+    if (first > enc->height) first = enc->height;
+    if (end > enc->height) end = enc->height;
+
+    *first_row = first;
+    stream->window = image_buffer_view(&stream->rows, 0, 0, stream->rows.width, end - first);
+    return stream->window;
+}
+
+int jpeg_stream_flush(JpegStream *stream) {
+    JpegEncoder *enc = stream->enc;
+    if (stream->failed || stream->next_strip >= enc->strips) return 0;
+
+    if (stream->next_strip == 0) write_headers(enc, stream->write, stream->context);
+    int end = stream->next_strip + enc->wave < enc->strips ? stream->next_strip + enc->wave : enc->strips;
+    enc->first_row = stream->next_strip * enc->rows_per_strip * enc->mcu_size;
+    if (!code_strip_range(enc, stream->next_strip, end, stream->write, stream->context, NULL)) {
+        stream->failed = 1;
+        return 0;
+    }
+    stream->next_strip = end;
+    return 1;
+}
+
+int jpeg_stream_end(JpegStream *stream) {
+    static const unsigned char eoi[] = { 0xFF, 0xD9 };
+    if (!stream) return 0;
+
+    int ok = !stream->failed && stream->next_strip == stream->enc->strips;
+    if (ok) stream->write(stream->context, eoi, sizeof(eoi));
+    if (stream->stats) {
+        stream->stats->quality = ok ? stream->quality : 0;
+        stream->stats->passes = 1;
+        stream->stats->over_budget = 0;
+    }
+
+    image_buffer_free(&stream->rows);
+    free_encoder(stream->enc);
+    free(stream);
+    return ok;
+}
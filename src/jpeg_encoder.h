@@ -0,0 +1,94 @@
+/*
+ * Baseline JPEG Encoder
+ * Produces the same stream as stb_image_write's JPEG writer (same tables,
+ * DCT and chroma handling), but splits large images into horizontal strips
+ * separated by restart markers so the strips are coded in parallel on the
+ * shared thread pool. Kernel sets with SIMD encode stages convert colors
+ * and run the DCT in 16-bit fixed point instead, which decodes to within
+ * a fraction of a dB of the float path
+ */
+
+#ifndef JPEG_ENCODER_H
+#define JPEG_ENCODER_H
+
+#include "film_kernels.h"
+#include "jpeg_decoder.h"
+
+// Pixels per restart strip (rounded to whole MCU rows); images smaller
+// than one strip are coded without restart markers
+#define JPEG_STRIP_PIXELS (1 << 19)
+
+// Most pixel bytes a JpegStream buffers: its wave is cut to the strips
+// that fit (at least one), whatever the pool size
+#define JPEG_STREAM_MAX_BYTES (4 << 20)
+
+// Above this quality the fixed-point path's 8-bit samples cost more than
+// the quantizer does, so the float reference path is used instead
+#define JPEG_SIMD_MAX_QUALITY 95
+
+// Fixed-point RGB to YCbCr (Q15) used by the SIMD encoder path; sums
+// match the float reference coefficients to within 2^-15
+#define YCC_Y_R 9798
+#define YCC_Y_G 19235
+#define YCC_Y_B 3736
+#define YCC_CB_R (-5529)
+#define YCC_CB_G (-10855)
+#define YCC_CB_B 16384
+#define YCC_CR_R 16384
+#define YCC_CR_G (-13720)
+#define YCC_CR_B (-2664)
+
+// Encode `image` (1-4 channels; 2 = grey + ignored alpha) through `write`
+// with the quality, subsampling and thread cap from `options` (NULL for
+// defaults; the format field is ignored). The output does not depend on
+// the thread count. Returns 1 on success.
+int jpeg_encode(const ImageBuffer *image, const EncodeOptions *options,
+                WriteFn write, void *context);
+
+// jpeg_encode with an explicit kernel set instead of film_kernels()
+int jpeg_encode_with(const KernelSet *kernels, const ImageBuffer *image,
+                     const EncodeOptions *options, WriteFn write, void *context);
+
+// Entropy-code decoded coefficient blocks as they are: same quantizers,
+// sampling and component ids, new Huffman tables (optimized when
+// options->optimize_huffman) and restart strips coded in parallel like
+// jpeg_encode. Quality, subsampling and max_bytes do not apply; stats, if
+// requested, report quality 0. Returns 1 on success.
+int jpeg_encode_coefficients(const JpegCoefficients *coefficients, const EncodeOptions *options,
+                             WriteFn write, void *context);
+
+// Row-at-a-time encoding of a width x height frame with jpeg_encode's
+// quality, subsampling and strip layout, so the bytes are the same as
+// jpeg_encode of the whole frame. The caller fills each window of rows
+// from jpeg_stream_window and codes it with jpeg_stream_flush; only one
+// wave of restart strips, at most JPEG_STREAM_MAX_BYTES, is ever
+// buffered. The first flush writes the
+// headers. NULL for an invalid frame, out of memory, or max_bytes or
+// optimize_huffman, which need the whole image.
+typedef struct JpegStream JpegStream;
+
+JpegStream *jpeg_stream_begin(int width, int height, int channels, const EncodeOptions *options,
+                              WriteFn write, void *context);
+
+// The rows to fill next: frame rows [*first_row, *first_row + height).
+// Height 0 once every row has been flushed.
+ImageBuffer jpeg_stream_window(JpegStream *stream, int *first_row);
+
+// Code and write the current window. Returns 1 on success.
+int jpeg_stream_flush(JpegStream *stream);
+
+// Write EOI and free the stream. Returns 1 if every window was flushed;
+// otherwise the output is incomplete and no EOI is written.
+int jpeg_stream_end(JpegStream *stream);
+
+// Portable YccRowFn, also used for SIMD row tails and grey images
+void ycc_row_generic(const unsigned char *src, int width, int channels,
+                     short *y, short *cb, short *cr);
+
+// SIMD encoder stages (jpeg_encoder_simd.c, x86 only)
+void ycc_row_sse2(const unsigned char *src, int width, int channels, short *y, short *cb, short *cr);
+void fdct_quant_sse2(const short *plane, size_t stride, int blocks, const float *fdtbl, short *coef);
+void ycc_row_avx2(const unsigned char *src, int width, int channels, short *y, short *cb, short *cr);
+void fdct_quant_avx2(const short *plane, size_t stride, int blocks, const float *fdtbl, short *coef);
+
+#endif // JPEG_ENCODER_H
@@ -0,0 +1,387 @@
+/*
+ * JPEG Encoder SIMD Stages
+ * Fixed-point color conversion and an integer AAN forward DCT (the
+ * libjpeg "ifast" butterfly, with Q15 instead of Q8 constants so quality
+ * 95+ keeps its detail) followed by float quantization.
+ * The DCT runs on int16 vectors holding one block row each: one pass down
+ * the columns, a transpose, one pass along the rows and a transpose back.
+ * SSE2 and AVX2 compute identical values; AVX2 handles two blocks at once,
+ * one per 128-bit lane.
+ */
+
+#include "jpeg_encoder.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+// AAN multipliers in Q15 for operands doubled: mulhi(x << 1, c) is
+// (x * c) >> 15, and bit 15 of the low half rounds it to nearest (plain
+// truncation biases every product and costs ~3 dB at quality 95).
+// Second-pass operands stay below 2^14 for 8-bit samples, so the
+// doubling cannot overflow. 1.306562965 does not fit and is applied as
+// x + x * 0.306562965.
+#define DCT_PRE_SHIFT 1
+#define DCT_0_382683433 12540
+#define DCT_0_541196100 17734
+#define DCT_0_707106781 23170
+#define DCT_0_306562965 10045
+
+// One (R, G) or (B, 1) int16 pair per 32-bit lane, for madd
+#define YCC_PAIR(lo, hi) ((int)(((unsigned int)(unsigned short)(hi) << 16) | (unsigned short)(lo)))
+
+// ---------------------------------------------------------------- SSE2 ---
+
+// Rounded (x * c) >> 15
+__attribute__((target("sse2")))
+static inline __m128i dct_mul_sse2(__m128i x, short c) {
+    __m128i a = _mm_slli_epi16(x, DCT_PRE_SHIFT);
+    __m128i k = _mm_set1_epi16(c);
+    return _mm_add_epi16(_mm_mulhi_epi16(a, k), _mm_srli_epi16(_mm_mullo_epi16(a, k), 15));
+}
+
+// 1-D AAN DCT across eight registers, lane-wise
+__attribute__((target("sse2")))
+static inline void fdct_pass_sse2(__m128i d[8]) {
+    __m128i tmp0 = _mm_add_epi16(d[0], d[7]);
+    __m128i tmp7 = _mm_sub_epi16(d[0], d[7]);
+    __m128i tmp1 = _mm_add_epi16(d[1], d[6]);
+    __m128i tmp6 = _mm_sub_epi16(d[1], d[6]);
+    __m128i tmp2 = _mm_add_epi16(d[2], d[5]);
+    __m128i tmp5 = _mm_sub_epi16(d[2], d[5]);
+    __m128i tmp3 = _mm_add_epi16(d[3], d[4]);
+    __m128i tmp4 = _mm_sub_epi16(d[3], d[4]);
+
+    // Even part
+    __m128i tmp10 = _mm_add_epi16(tmp0, tmp3);
+    __m128i tmp13 = _mm_sub_epi16(tmp0, tmp3);
+    __m128i tmp11 = _mm_add_epi16(tmp1, tmp2);
+    __m128i tmp12 = _mm_sub_epi16(tmp1, tmp2);
+
+    d[0] = _mm_add_epi16(tmp10, tmp11);
+    d[4] = _mm_sub_epi16(tmp10, tmp11);
+
+    __m128i z1 = dct_mul_sse2(_mm_add_epi16(tmp12, tmp13), DCT_0_707106781);
+    d[2] = _mm_add_epi16(tmp13, z1);
+    d[6] = _mm_sub_epi16(tmp13, z1);
+
+    // Odd part
+    tmp10 = _mm_add_epi16(tmp4, tmp5);
+    tmp11 = _mm_add_epi16(tmp5, tmp6);
+    tmp12 = _mm_add_epi16(tmp6, tmp7);
+
+    __m128i z5 = dct_mul_sse2(_mm_sub_epi16(tmp10, tmp12), DCT_0_382683433);
+    __m128i z2 = _mm_add_epi16(dct_mul_sse2(tmp10, DCT_0_541196100), z5);
+    __m128i z4 = _mm_add_epi16(_mm_add_epi16(dct_mul_sse2(tmp12, DCT_0_306562965), tmp12), z5);
+    __m128i z3 = dct_mul_sse2(tmp11, DCT_0_707106781);
+
+    __m128i z11 = _mm_add_epi16(tmp7, z3);
+    __m128i z13 = _mm_sub_epi16(tmp7, z3);
+
+    d[5] = _mm_add_epi16(z13, z2);
+    d[3] = _mm_sub_epi16(z13, z2);
+    d[1] = _mm_add_epi16(z11, z4);
+    d[7] = _mm_sub_epi16(z11, z4);
+}
+
+__attribute__((target("sse2")))
+static inline void transpose_sse2(__m128i r[8]) {
+    __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+    __m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+    __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+    __m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+    __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+    __m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+    __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+    __m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+    __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+    __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+    r[0] = _mm_unpacklo_epi64(b0, b4);
+    r[1] = _mm_unpackhi_epi64(b0, b4);
+    r[2] = _mm_unpacklo_epi64(b1, b5);
+    r[3] = _mm_unpackhi_epi64(b1, b5);
+    r[4] = _mm_unpacklo_epi64(b2, b6);
+    r[5] = _mm_unpackhi_epi64(b2, b6);
+    r[6] = _mm_unpacklo_epi64(b3, b7);
+    r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+// Multiply by the reciprocal quantizers, round half away from zero
+__attribute__((target("sse2")))
+static inline __m128i quantize4_sse2(__m128i x, const float *fdtbl) {
+    __m128 v = _mm_mul_ps(_mm_cvtepi32_ps(x), _mm_loadu_ps(fdtbl));
+    __m128 half = _mm_or_ps(_mm_and_ps(v, _mm_set1_ps(-0.0f)), _mm_set1_ps(0.5f));
+    return _mm_cvttps_epi32(_mm_add_ps(v, half));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i quantize_row_sse2(__m128i row, const float *fdtbl) {
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(row, row), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(row, row), 16);
+    return _mm_packs_epi32(quantize4_sse2(lo, fdtbl), quantize4_sse2(hi, fdtbl + 4));
+}
+
+__attribute__((target("sse2")))
+void fdct_quant_sse2(const short *plane, size_t stride, int blocks, const float *fdtbl, short *coef) {
+    for (int b = 0; b < blocks; b++, coef += 64) {
+        __m128i r[8];
+        for (int i = 0; i < 8; i++) {
+            r[i] = _mm_loadu_si128((const __m128i *)(plane + i * stride + b * 8));
+        }
+        fdct_pass_sse2(r);
+        transpose_sse2(r);
+        fdct_pass_sse2(r);
+        transpose_sse2(r);
+        for (int i = 0; i < 8; i++) {
+            _mm_storeu_si128((__m128i *)(coef + i * 8), quantize_row_sse2(r[i], fdtbl + i * 8));
+        }
+    }
+}
+
+// Y, Cb, Cr for four pixels held as (R, G) and (B, 1) int16 pairs
+__attribute__((target("sse2")))
+static inline void ycc4_sse2(__m128i rg, __m128i b1, __m128i *y, __m128i *cb, __m128i *cr) {
+    *y = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(rg, _mm_set1_epi32(YCC_PAIR(YCC_Y_R, YCC_Y_G))),
+                                      _mm_madd_epi16(b1, _mm_set1_epi32(YCC_PAIR(YCC_Y_B, 1 << 14)))), 15);
+    *cb = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(rg, _mm_set1_epi32(YCC_PAIR(YCC_CB_R, YCC_CB_G))),
+                                       _mm_madd_epi16(b1, _mm_set1_epi32(YCC_PAIR(YCC_CB_B, 1 << 12)))), 13);
+    *cr = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(rg, _mm_set1_epi32(YCC_PAIR(YCC_CR_R, YCC_CR_G))),
+                                       _mm_madd_epi16(b1, _mm_set1_epi32(YCC_PAIR(YCC_CR_B, 1 << 12)))), 13);
+}
+
+// Four pixels as 32-bit R | G << 8 | B << 16 lanes into madd pairs
+__attribute__((target("sse2")))
+static inline void split_pixels_sse2(__m128i px, __m128i *rg, __m128i *b1) {
+    __m128i byte = _mm_set1_epi32(0xFF);
+    __m128i r = _mm_and_si128(px, byte);
+    __m128i g = _mm_and_si128(_mm_srli_epi32(px, 8), byte);
+    __m128i b = _mm_and_si128(_mm_srli_epi32(px, 16), byte);
+    *rg = _mm_or_si128(r, _mm_slli_epi32(g, 16));
+    *b1 = _mm_or_si128(b, _mm_set1_epi32(1 << 16));
+}
+
+__attribute__((target("sse2")))
+void ycc_row_sse2(const unsigned char *src, int width, int channels, short *y, short *cb, short *cr) {
+    if (channels < 3) {
+        ycc_row_generic(src, width, channels, y, cb, cr);
+        return;
+    }
+
+    int n = width & ~7;
+    __m128i level = _mm_set1_epi16(128);
+    for (int x = 0; x < n; x += 8) {
+        __m128i px[2];
+        if (channels == 4) {
+            px[0] = _mm_loadu_si128((const __m128i *)(src + x * 4));
+            px[1] = _mm_loadu_si128((const __m128i *)(src + x * 4 + 16));
+        } else {
+            // No byte shuffle in SSE2: gather RGB triples into 32-bit lanes
+            const unsigned char *p = src + x * 3;
+            int lanes[8];
+            for (int i = 0; i < 8; i++) {
+                lanes[i] = p[i * 3] | p[i * 3 + 1] << 8 | p[i * 3 + 2] << 16;
+            }
+            px[0] = _mm_loadu_si128((const __m128i *)lanes);
+            px[1] = _mm_loadu_si128((const __m128i *)(lanes + 4));
+        }
+
+        __m128i yv[2], cbv[2], crv[2];
+        for (int h = 0; h < 2; h++) {
+            __m128i rg, b1;
+            split_pixels_sse2(px[h], &rg, &b1);
+            ycc4_sse2(rg, b1, &yv[h], &cbv[h], &crv[h]);
+        }
+        _mm_storeu_si128((__m128i *)(y + x), _mm_sub_epi16(_mm_packs_epi32(yv[0], yv[1]), level));
+        _mm_storeu_si128((__m128i *)(cb + x), _mm_packs_epi32(cbv[0], cbv[1]));
+        _mm_storeu_si128((__m128i *)(cr + x), _mm_packs_epi32(crv[0], crv[1]));
+    }
+    ycc_row_generic(src + (size_t)n * channels, width - n, channels, y + n, cb + n, cr + n);
+}
+
+// ---------------------------------------------------------------- AVX2 ---
+
+__attribute__((target("avx2")))
+static inline __m256i dct_mul_avx2(__m256i x, short c) {
+    __m256i a = _mm256_slli_epi16(x, DCT_PRE_SHIFT);
+    __m256i k = _mm256_set1_epi16(c);
+    return _mm256_add_epi16(_mm256_mulhi_epi16(a, k), _mm256_srli_epi16(_mm256_mullo_epi16(a, k), 15));
+}
+
+__attribute__((target("avx2")))
+static inline void fdct_pass_avx2(__m256i d[8]) {
+    __m256i tmp0 = _mm256_add_epi16(d[0], d[7]);
+    __m256i tmp7 = _mm256_sub_epi16(d[0], d[7]);
+    __m256i tmp1 = _mm256_add_epi16(d[1], d[6]);
+    __m256i tmp6 = _mm256_sub_epi16(d[1], d[6]);
+    __m256i tmp2 = _mm256_add_epi16(d[2], d[5]);
+    __m256i tmp5 = _mm256_sub_epi16(d[2], d[5]);
+    __m256i tmp3 = _mm256_add_epi16(d[3], d[4]);
+    __m256i tmp4 = _mm256_sub_epi16(d[3], d[4]);
+
+    // Even part
+    __m256i tmp10 = _mm256_add_epi16(tmp0, tmp3);
+    __m256i tmp13 = _mm256_sub_epi16(tmp0, tmp3);
+    __m256i tmp11 = _mm256_add_epi16(tmp1, tmp2);
+    __m256i tmp12 = _mm256_sub_epi16(tmp1, tmp2);
+
+    d[0] = _mm256_add_epi16(tmp10, tmp11);
+    d[4] = _mm256_sub_epi16(tmp10, tmp11);
+
+    __m256i z1 = dct_mul_avx2(_mm256_add_epi16(tmp12, tmp13), DCT_0_707106781);
+    d[2] = _mm256_add_epi16(tmp13, z1);
+    d[6] = _mm256_sub_epi16(tmp13, z1);
+
+    // Odd part
+    tmp10 = _mm256_add_epi16(tmp4, tmp5);
+    tmp11 = _mm256_add_epi16(tmp5, tmp6);
+    tmp12 = _mm256_add_epi16(tmp6, tmp7);
+
+    __m256i z5 = dct_mul_avx2(_mm256_sub_epi16(tmp10, tmp12), DCT_0_382683433);
+    __m256i z2 = _mm256_add_epi16(dct_mul_avx2(tmp10, DCT_0_541196100), z5);
+    __m256i z4 = _mm256_add_epi16(_mm256_add_epi16(dct_mul_avx2(tmp12, DCT_0_306562965), tmp12), z5);
+    __m256i z3 = dct_mul_avx2(tmp11, DCT_0_707106781);
+
+    __m256i z11 = _mm256_add_epi16(tmp7, z3);
+    __m256i z13 = _mm256_sub_epi16(tmp7, z3);
+
+    d[5] = _mm256_add_epi16(z13, z2);
+    d[3] = _mm256_sub_epi16(z13, z2);
+    d[1] = _mm256_add_epi16(z11, z4);
+    d[7] = _mm256_sub_epi16(z11, z4);
+}
+
+// Unpacks stay within 128-bit lanes, so this transposes both blocks
+__attribute__((target("avx2")))
+static inline void transpose_avx2(__m256i r[8]) {
+    __m256i a0 = _mm256_unpacklo_epi16(r[0], r[1]);
+    __m256i a1 = _mm256_unpackhi_epi16(r[0], r[1]);
+    __m256i a2 = _mm256_unpacklo_epi16(r[2], r[3]);
+    __m256i a3 = _mm256_unpackhi_epi16(r[2], r[3]);
+    __m256i a4 = _mm256_unpacklo_epi16(r[4], r[5]);
+    __m256i a5 = _mm256_unpackhi_epi16(r[4], r[5]);
+    __m256i a6 = _mm256_unpacklo_epi16(r[6], r[7]);
+    __m256i a7 = _mm256_unpackhi_epi16(r[6], r[7]);
+
+    __m256i b0 = _mm256_unpacklo_epi32(a0, a2);
+    __m256i b1 = _mm256_unpackhi_epi32(a0, a2);
+    __m256i b2 = _mm256_unpacklo_epi32(a1, a3);
+    __m256i b3 = _mm256_unpackhi_epi32(a1, a3);
+    __m256i b4 = _mm256_unpacklo_epi32(a4, a6);
+    __m256i b5 = _mm256_unpackhi_epi32(a4, a6);
+    __m256i b6 = _mm256_unpacklo_epi32(a5, a7);
+    __m256i b7 = _mm256_unpackhi_epi32(a5, a7);
+
+    r[0] = _mm256_unpacklo_epi64(b0, b4);
+    r[1] = _mm256_unpackhi_epi64(b0, b4);
+    r[2] = _mm256_unpacklo_epi64(b1, b5);
+    r[3] = _mm256_unpackhi_epi64(b1, b5);
+    r[4] = _mm256_unpacklo_epi64(b2, b6);
+    r[5] = _mm256_unpackhi_epi64(b2, b6);
+    r[6] = _mm256_unpacklo_epi64(b3, b7);
+    r[7] = _mm256_unpackhi_epi64(b3, b7);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i quantize8_avx2(__m128i row, __m256 fdtbl) {
+    __m256 v = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(row)), fdtbl);
+    __m256 half = _mm256_or_ps(_mm256_and_ps(v, _mm256_set1_ps(-0.0f)), _mm256_set1_ps(0.5f));
+    return _mm256_cvttps_epi32(_mm256_add_ps(v, half));
+}
+
+__attribute__((target("avx2")))
+void fdct_quant_avx2(const short *plane, size_t stride, int blocks, const float *fdtbl, short *coef) {
+    int b = 0;
+    for (; b + 2 <= blocks; b += 2, coef += 128) {
+        __m256i r[8];
+        for (int i = 0; i < 8; i++) {
+            r[i] = _mm256_loadu_si256((const __m256i *)(plane + i * stride + b * 8));
+        }
+        fdct_pass_avx2(r);
+        transpose_avx2(r);
+        fdct_pass_avx2(r);
+        transpose_avx2(r);
+        for (int i = 0; i < 8; i++) {
+            __m256 q = _mm256_loadu_ps(fdtbl + i * 8);
+            __m256i first = quantize8_avx2(_mm256_castsi256_si128(r[i]), q);
+            __m256i second = quantize8_avx2(_mm256_extracti128_si256(r[i], 1), q);
+            // packs interleaves 128-bit lanes; put each block's row back together
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(first, second), 0xD8);
+            _mm_storeu_si128((__m128i *)(coef + i * 8), _mm256_castsi256_si128(packed));
+            _mm_storeu_si128((__m128i *)(coef + 64 + i * 8), _mm256_extracti128_si256(packed, 1));
+        }
+    }
+    if (b < blocks) {
+        fdct_quant_sse2(plane + b * 8, stride, blocks - b, fdtbl, coef);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline void ycc8_avx2(__m256i px, __m256i *y, __m256i *cb, __m256i *cr) {
+    __m256i byte = _mm256_set1_epi32(0xFF);
+    __m256i r = _mm256_and_si256(px, byte);
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(px, 8), byte);
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(px, 16), byte);
+    __m256i rg = _mm256_or_si256(r, _mm256_slli_epi32(g, 16));
+    __m256i b1 = _mm256_or_si256(b, _mm256_set1_epi32(1 << 16));
+
+    *y = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(rg, _mm256_set1_epi32(YCC_PAIR(YCC_Y_R, YCC_Y_G))),
+                                            _mm256_madd_epi16(b1, _mm256_set1_epi32(YCC_PAIR(YCC_Y_B, 1 << 14)))), 15);
+    *cb = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(rg, _mm256_set1_epi32(YCC_PAIR(YCC_CB_R, YCC_CB_G))),
+                                             _mm256_madd_epi16(b1, _mm256_set1_epi32(YCC_PAIR(YCC_CB_B, 1 << 12)))), 13);
+    *cr = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(rg, _mm256_set1_epi32(YCC_PAIR(YCC_CR_R, YCC_CR_G))),
+                                             _mm256_madd_epi16(b1, _mm256_set1_epi32(YCC_PAIR(YCC_CR_B, 1 << 12)))), 13);
+}
+
+// Eight RGB pixels (24 bytes) into 32-bit lanes; reads 28 bytes
+__attribute__((target("avx2")))
+static inline __m256i load_rgb8_avx2(const unsigned char *p) {
+    const __m256i spread = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                        _mm_loadu_si128((const __m128i *)(p + 12)), 1);
+    return _mm256_shuffle_epi8(v, spread);
+}
+
+__attribute__((target("avx2")))
+void ycc_row_avx2(const unsigned char *src, int width, int channels, short *y, short *cb, short *cr) {
+    if (channels < 3) {
+        ycc_row_generic(src, width, channels, y, cb, cr);
+        return;
+    }
+
+    // RGB loads read 4 bytes past the 16th pixel, so keep them off the row end
+    int n = channels == 4 ? width & ~15 : (width - 2) & ~15;
+    if (n < 0) n = 0;
+    __m256i level = _mm256_set1_epi16(128);
+    for (int x = 0; x < n; x += 16) {
+        __m256i px[2];
+        if (channels == 4) {
+            px[0] = _mm256_loadu_si256((const __m256i *)(src + x * 4));
+            px[1] = _mm256_loadu_si256((const __m256i *)(src + x * 4 + 32));
+        } else {
+            px[0] = load_rgb8_avx2(src + x * 3);
+            px[1] = load_rgb8_avx2(src + x * 3 + 24);
+        }
+
+        __m256i yv[2], cbv[2], crv[2];
+        ycc8_avx2(px[0], &yv[0], &cbv[0], &crv[0]);
+        ycc8_avx2(px[1], &yv[1], &cbv[1], &crv[1]);
+        __m256i yo = _mm256_permute4x64_epi64(_mm256_packs_epi32(yv[0], yv[1]), 0xD8);
+        __m256i cbo = _mm256_permute4x64_epi64(_mm256_packs_epi32(cbv[0], cbv[1]), 0xD8);
+        __m256i cro = _mm256_permute4x64_epi64(_mm256_packs_epi32(crv[0], crv[1]), 0xD8);
+        _mm256_storeu_si256((__m256i *)(y + x), _mm256_sub_epi16(yo, level));
+        _mm256_storeu_si256((__m256i *)(cb + x), cbo);
+        _mm256_storeu_si256((__m256i *)(cr + x), cro);
+    }
+    ycc_row_sse2(src + (size_t)n * channels, width - n, channels, y + n, cb + n, cr + n);
+}
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * QOI Codec
+ * Straight implementation of the QOI 1.0 specification. Rows are read and
+ * written through the buffer stride, so crops and padded buffers need no
+ * packing copy.
+ */
+
+#include "qoi_codec.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define QOI_OP_INDEX 0x00      // 00xxxxxx
+#define QOI_OP_DIFF  0x40      // 01xxxxxx
+#define QOI_OP_LUMA  0x80      // 10xxxxxx
+#define QOI_OP_RUN   0xc0      // 11xxxxxx
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MASK_2   0xc0
+
+#define QOI_HASH(p) (((p).rgba.r * 3 + (p).rgba.g * 5 + (p).rgba.b * 7 + (p).rgba.a * 11) & 63)
+
+// Encoder output is handed to the sink in pieces of this size
+#define QOI_OUT_CHUNK 65536
+
+static const unsigned char qoi_padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+typedef union {
+    struct { unsigned char r, g, b, a; } rgba;
+    unsigned int v;
+} QoiPixel;
+
+static void write32(unsigned char *out, unsigned int v) {
+    out[0] = (unsigned char)(v >> 24);
+    out[1] = (unsigned char)(v >> 16);
+    out[2] = (unsigned char)(v >> 8);
+    out[3] = (unsigned char)v;
+}
+
+static unsigned int read32(const unsigned char *in) {
+    return (unsigned int)in[0] << 24 | (unsigned int)in[1] << 16 | (unsigned int)in[2] << 8 | in[3];
+}
+
+int qoi_probe(const unsigned char *data, size_t size) {
+    return data && size >= 4 && memcmp(data, "qoif", 4) == 0;
+}
+
+int qoi_encode(const ImageBuffer *image, WriteFn write, void *context) {
+    if (!image || !image->data || image->width <= 0 || image->height <= 0 ||
+        image->channels < 3 || image->channels > 4 ||
+        (size_t)image->width * image->height >= QOI_PIXELS_MAX) {
+        return 0;
+    }
+
+    unsigned char *out = malloc(QOI_OUT_CHUNK);
+    if (!out) return 0;
+
+    int channels = image->channels;
+    memcpy(out, "qoif", 4);
+    write32(out + 4, (unsigned int)image->width);
+    write32(out + 8, (unsigned int)image->height);
+    out[12] = (unsigned char)channels;
+    out[13] = 0;               // sRGB with linear alpha
+    size_t n = QOI_HEADER_SIZE;
+
+    QoiPixel index[64];
+    memset(index, 0, sizeof(index));
+    QoiPixel prev = { .rgba = { 0, 0, 0, 255 } };
+    QoiPixel px = prev;
+    int run = 0;
+
+    for (int y = 0; y < image->height; y++) {
+        const unsigned char *src = image->data + (size_t)y * image->stride;
+        for (int x = 0; x < image->width; x++, src += channels) {
+            px.rgba.r = src[0];
+            px.rgba.g = src[1];
+            px.rgba.b = src[2];
+            if (channels == 4) px.rgba.a = src[3];
+
+            if (px.v == prev.v) {
+                if (++run == 62) {
+                    out[n++] = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+            } else {
+                if (run > 0) {
+                    out[n++] = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+
+                int hash = QOI_HASH(px);
+                if (index[hash].v == px.v) {
+                    out[n++] = QOI_OP_INDEX | hash;
+                } else {
+                    index[hash] = px;
+                    if (px.rgba.a == prev.rgba.a) {
+                        signed char vr = (signed char)(px.rgba.r - prev.rgba.r);
+                        signed char vg = (signed char)(px.rgba.g - prev.rgba.g);
+                        signed char vb = (signed char)(px.rgba.b - prev.rgba.b);
+                        signed char vg_r = (signed char)(vr - vg);
+                        signed char vg_b = (signed char)(vb - vg);
+
+                        if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                            out[n++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                        } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                            out[n++] = QOI_OP_LUMA | (vg + 32);
+                            out[n++] = (unsigned char)((vg_r + 8) << 4 | (vg_b + 8));
+                        } else {
+                            out[n++] = QOI_OP_RGB;
+                            out[n++] = px.rgba.r;
+                            out[n++] = px.rgba.g;
+                            out[n++] = px.rgba.b;
+                        }
+                    } else {
+                        out[n++] = QOI_OP_RGBA;
+                        out[n++] = px.rgba.r;
+                        out[n++] = px.rgba.g;
+                        out[n++] = px.rgba.b;
+                        out[n++] = px.rgba.a;
+                    }
+                }
+            }
+            prev = px;
+
+            // Room for the longest op plus a pending run byte
+            if (n > QOI_OUT_CHUNK - 8) {
+                write(context, out, n);
+                n = 0;
+            }
+        }
+    }
+
+    if (run > 0) out[n++] = QOI_OP_RUN | (run - 1);
+    if (n > QOI_OUT_CHUNK - sizeof(qoi_padding)) {
+        write(context, out, n);
+        n = 0;
+    }
+    memcpy(out + n, qoi_padding, sizeof(qoi_padding));
+    write(context, out, n + sizeof(qoi_padding));
+
+    free(out);
+    return 1;
+}
+
+int qoi_info(const unsigned char *data, size_t size, int *width, int *height, int *channels) {
+    if (size < QOI_HEADER_SIZE + sizeof(qoi_padding) || !qoi_probe(data, size)) return 0;
+
+    unsigned int w = read32(data + 4);
+    unsigned int h = read32(data + 8);
+    int colorspace = data[13];
+    if (w == 0 || h == 0 || data[12] < 3 || data[12] > 4 || colorspace > 1 || h >= QOI_PIXELS_MAX / w) {
+        return 0;
+    }
+    *width = (int)w;
+    *height = (int)h;
+    *channels = data[12];
+    return 1;
+}
+
+ImageBuffer qoi_decode(const unsigned char *data, size_t size) {
+    ImageBuffer image = {0};
+    int width, height, channels;
+    if (!qoi_info(data, size, &width, &height, &channels)) return image;
+
+    image = image_buffer_alloc(width, height, channels);
+    if (image.data) qoi_decode_into(data, size, &image);
+    return image;
+}
+
+int qoi_decode_into(const unsigned char *data, size_t size, const ImageBuffer *image) {
+    int width, height, channels;
+    if (!qoi_info(data, size, &width, &height, &channels) ||
+        image->width != width || image->height != height || image->channels != channels) {
+        return 0;
+    }
+
+    QoiPixel index[64];
+    memset(index, 0, sizeof(index));
+    QoiPixel px = { .rgba = { 0, 0, 0, 255 } };
+    int run = 0;
+
+    // Ops are at most 5 bytes and the stream ends in 8 padding bytes, so
+    // any op that starts before the padding is read in bounds. A short
+    // stream repeats its last pixel, as the reference decoder does.
+    size_t p = QOI_HEADER_SIZE;
+    size_t chunks_len = size - sizeof(qoi_padding);
+
+    for (int y = 0; y < height; y++) {
+        unsigned char *dst = image->data + (size_t)y * image->stride;
+        for (int x = 0; x < width; x++, dst += channels) {
+            if (run > 0) {
+                run--;
+            } else if (p < chunks_len) {
+                int b1 = data[p++];
+
+                if (b1 == QOI_OP_RGB) {
+                    px.rgba.r = data[p++];
+                    px.rgba.g = data[p++];
+                    px.rgba.b = data[p++];
+                } else if (b1 == QOI_OP_RGBA) {
+                    px.rgba.r = data[p++];
+                    px.rgba.g = data[p++];
+                    px.rgba.b = data[p++];
+                    px.rgba.a = data[p++];
+                } else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+                    px = index[b1];
+                } else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+                    px.rgba.r += ((b1 >> 4) & 0x03) - 2;
+                    px.rgba.g += ((b1 >> 2) & 0x03) - 2;
+                    px.rgba.b += (b1 & 0x03) - 2;
+                } else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+                    int b2 = data[p++];
+                    int vg = (b1 & 0x3f) - 32;
+                    px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f);
+                    px.rgba.g += vg;
+                    px.rgba.b += vg - 8 + (b2 & 0x0f);
+                } else {
+                    run = b1 & 0x3f;
+                }
+
+                index[QOI_HASH(px)] = px;
+            }
+
+            dst[0] = px.rgba.r;
+            dst[1] = px.rgba.g;
+            dst[2] = px.rgba.b;
+            if (channels == 4) dst[3] = px.rgba.a;
+        }
+    }
+    return 1;
+}
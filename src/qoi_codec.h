@@ -0,0 +1,33 @@
+/*
+ * QOI Codec
+ * "Quite OK Image" format (qoiformat.org): lossless like PNG, but with a
+ * single byte-oriented pass per pixel instead of filtering and deflate,
+ * so both directions run an order of magnitude faster
+ */
+
+#ifndef QOI_CODEC_H
+#define QOI_CODEC_H
+
+#include "film_kernels.h"
+
+#define QOI_HEADER_SIZE 14
+#define QOI_PIXELS_MAX 400000000   // Same limit as the reference decoder
+
+// 1 if `data` starts with the QOI magic
+int qoi_probe(const unsigned char *data, size_t size);
+
+// Encode a 3- or 4-channel image through `write`; returns 1 on success
+int qoi_encode(const ImageBuffer *image, WriteFn write, void *context);
+
+// Size and channel count (3 or 4) from a valid header; 0 otherwise
+int qoi_info(const unsigned char *data, size_t size, int *width, int *height, int *channels);
+
+// Decode into a new owning buffer with the file's channel count
+// (data == NULL if the stream is invalid or allocation fails)
+ImageBuffer qoi_decode(const unsigned char *data, size_t size);
+
+// Decode into `image`, which must have the size and channels qoi_info
+// reports; returns 0 (image untouched) otherwise
+int qoi_decode_into(const unsigned char *data, size_t size, const ImageBuffer *image);
+
+#endif // QOI_CODEC_H
@@ -5,10 +5,10 @@
  */
 
 #include "film_processor.h"
-#include "stb_image_write.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -19,8 +19,8 @@
 
 #define DEFAULT_PORT 8080
 #define MAX_BUFFER 20971520  // 20MB max request size
+#define MAX_HEADER_SIZE 16384 // Request line and headers
 #define MAX_CLIENTS 200
-#define TEMP_DIR "/tmp"
 
 // Platform compatibility
 #ifndef MSG_NOSIGNAL
@@ -35,12 +35,22 @@ typedef struct {
     int port;
     int max_connections;
     int request_timeout;
+    int threads_per_request;   // Row-band parallelism cap per image (0 = whole pool)
+    int optimize_huffman[3];   // Per ProcessMode: optimized JPEG tables by default
+    double max_megapixels;     // Largest upload accepted, by its header (0 = no limit)
+    double inflight_megapixels; // Upload pixels processed at once (0 = no limit)
+    int budget_wait_ms;        // How long an upload queues for in-flight room
 } Config;
 
 Config config = {
     .port = DEFAULT_PORT,
     .max_connections = MAX_CLIENTS,
-    .request_timeout = 30
+    .request_timeout = 30,
+    .threads_per_request = 0,
+    .optimize_huffman = { 0, 0, 0 },
+    .max_megapixels = 100,
+    .inflight_megapixels = 400,
+    .budget_wait_ms = 10000
 };
 
 // Enhanced logging with levels
@@ -60,45 +70,140 @@ void log_msg(LogLevel level, const char *message) {
     fflush(stdout);
 }
 
-// Send HTTP response with proper headers
-void send_response(int client_socket, int status_code, const char *status_text,
-                   const char *content_type, const unsigned char *body, size_t body_len) {
+// Send the status line and headers; `framing` is the Content-Length or
+// Transfer-Encoding line. Returns 0 on failure.
+static int send_header(int client_socket, int status_code, const char *status_text,
+                       const char *content_type, const char *framing,
+                       const char *extra_headers) {
     char header[2048];
     int header_len = snprintf(header, sizeof(header),
         "HTTP/1.1 %d %s\r\n"
         "Content-Type: %s\r\n"
-        "Content-Length: %zu\r\n"
+        "%s"
         "Access-Control-Allow-Origin: *\r\n"
         "Access-Control-Allow-Methods: POST, GET, OPTIONS\r\n"
         "Access-Control-Allow-Headers: Content-Type\r\n"
+        "Access-Control-Expose-Headers: X-Grain-Seed, X-Invert-Path\r\n"
         "X-Content-Type-Options: nosniff\r\n"
         "X-Frame-Options: DENY\r\n"
         "X-XSS-Protection: 1; mode=block\r\n"
         "Server: FilmProcessor/2.0\r\n"
         "Connection: close\r\n"
+        "%s"
         "\r\n",
-        status_code, status_text, content_type, body_len);
+        status_code, status_text, content_type, framing, extra_headers ? extra_headers : "");
 
-    // Send header
     ssize_t sent = send(client_socket, header, header_len, MSG_NOSIGNAL);
     if (sent < 0) {
         log_msg(LOG_ERROR, "Failed to send response header");
+        return 0;
+    }
+    return 1;
+}
+
+// Send all of `data`; returns 0 on failure
+static int send_all(int client_socket, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    size_t total_sent = 0;
+    while (total_sent < len) {
+        ssize_t chunk_sent = send(client_socket, bytes + total_sent, len - total_sent, MSG_NOSIGNAL);
+        if (chunk_sent < 0) {
+            return 0;
+        }
+        total_sent += chunk_sent;
+    }
+    return 1;
+}
+
+// Send HTTP response with proper headers, plus optional extra header lines
+// (each terminated by \r\n)
+void send_response_with_headers(int client_socket, int status_code, const char *status_text,
+                                const char *content_type, const char *extra_headers,
+                                const unsigned char *body, size_t body_len) {
+    char framing[64];
+    snprintf(framing, sizeof(framing), "Content-Length: %zu\r\n", body_len);
+    if (!send_header(client_socket, status_code, status_text, content_type, framing,
+                     extra_headers)) {
         return;
     }
 
-    // Send body in chunks to handle large files
-    if (body && body_len > 0) {
-        size_t total_sent = 0;
-        while (total_sent < body_len) {
-            ssize_t chunk_sent = send(client_socket, body + total_sent,
-                                      body_len - total_sent, MSG_NOSIGNAL);
-            if (chunk_sent < 0) {
-                log_msg(LOG_ERROR, "Failed to send response body");
-                return;
-            }
-            total_sent += chunk_sent;
+    if (body && body_len > 0 && !send_all(client_socket, body, body_len)) {
+        log_msg(LOG_ERROR, "Failed to send response body");
+    }
+}
+
+// Send HTTP response with proper headers
+void send_response(int client_socket, int status_code, const char *status_text,
+                   const char *content_type, const unsigned char *body, size_t body_len) {
+    send_response_with_headers(client_socket, status_code, status_text, content_type, NULL,
+                               body, body_len);
+}
+
+// Chunked (HTTP/1.1) response body fed by an encoder's WriteFn. Headers
+// go out with the first chunk, so errors before any output can still be
+// reported with a normal error response.
+#define STREAM_CHUNK_SIZE 16384
+
+typedef struct {
+    int client_socket;
+    const char *content_type;
+    const char *extra_headers;
+    int started;               // Headers sent
+    int failed;                // Client gone; drop further output
+    size_t total;              // Body bytes sent
+    size_t used;
+    unsigned char chunk[STREAM_CHUNK_SIZE];
+} ChunkedStream;
+
+static void chunked_flush(ChunkedStream *stream) {
+    if (stream->failed || stream->used == 0) return;
+
+    if (!stream->started) {
+        stream->started = 1;
+        if (!send_header(stream->client_socket, 200, "OK", stream->content_type,
+                         "Transfer-Encoding: chunked\r\n", stream->extra_headers)) {
+            stream->failed = 1;
+            return;
         }
     }
+
+    char size_line[32];
+    int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", stream->used);
+    if (!send_all(stream->client_socket, size_line, size_len) ||
+        !send_all(stream->client_socket, stream->chunk, stream->used) ||
+        !send_all(stream->client_socket, "\r\n", 2)) {
+        log_msg(LOG_ERROR, "Failed to send response chunk");
+        stream->failed = 1;
+        return;
+    }
+    stream->total += stream->used;
+    stream->used = 0;
+}
+
+static void chunked_write(void *context, const void *data, size_t size) {
+    ChunkedStream *stream = context;
+    const unsigned char *bytes = data;
+
+    while (size > 0 && !stream->failed) {
+        size_t room = STREAM_CHUNK_SIZE - stream->used;
+        size_t n = size < room ? size : room;
+        memcpy(stream->chunk + stream->used, bytes, n);
+        stream->used += n;
+        bytes += n;
+        size -= n;
+        if (stream->used == STREAM_CHUNK_SIZE) chunked_flush(stream);
+    }
+}
+
+// Flush the tail and send the terminating zero-length chunk
+static int chunked_finish(ChunkedStream *stream) {
+    chunked_flush(stream);
+    if (stream->failed || !stream->started) return 0;
+    if (!send_all(stream->client_socket, "0\r\n\r\n", 5)) {
+        log_msg(LOG_ERROR, "Failed to send final chunk");
+        return 0;
+    }
+    return 1;
 }
 
 // Send JSON error response
@@ -115,6 +220,265 @@ void send_error(int client_socket, int status_code, const char *message) {
     log_msg(LOG_ERROR, log_buf);
 }
 
+// Encode metrics, served at GET /metrics. JPEG responses are split by
+// chroma subsampling and quality band so the size and time cost of each
+// setting shows up separately; JPEGs inverted in the DCT domain keep
+// their source quality and are counted on their own.
+#define QUALITY_BANDS 4
+#define JPEG_SLOTS (2 * QUALITY_BANDS)
+#define TRANSFORM_SLOT (JPEG_SLOTS + 3)
+#define OUTPUT_SLOTS (JPEG_SLOTS + 4)
+
+static const int quality_band_max[QUALITY_BANDS] = { 50, 75, 90, 100 };
+static const char *quality_band_names[QUALITY_BANDS] = { "1-50", "51-75", "76-90", "91-100" };
+
+typedef struct {
+    unsigned long long responses;
+    unsigned long long bytes;      // Response body bytes
+    unsigned long long encode_us;  // Encode time; streamed responses include sending
+} OutputStats;
+
+static OutputStats output_stats[OUTPUT_SLOTS];
+static time_t server_start;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// JPEG: [subsampling][quality band]; then PNG, BMP, QOI, transform-domain JPEG
+static int output_slot(const EncodeOptions *encode) {
+    if (encode->format == IMAGE_FORMAT_PNG) return JPEG_SLOTS;
+    if (encode->format == IMAGE_FORMAT_BMP) return JPEG_SLOTS + 1;
+    if (encode->format == IMAGE_FORMAT_QOI) return JPEG_SLOTS + 2;
+
+    int band = 0;
+    while (band < QUALITY_BANDS - 1 && encode->quality > quality_band_max[band]) band++;
+    return (encode_subsampling(encode) == SUBSAMPLING_444) * QUALITY_BANDS + band;
+}
+
+static void count_output(int slot, size_t bytes, double ms) {
+    OutputStats *stats = &output_stats[slot];
+    __atomic_add_fetch(&stats->responses, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->encode_us, (unsigned long long)(ms * 1000.0), __ATOMIC_RELAXED);
+}
+
+static void record_output(const EncodeOptions *encode, size_t bytes, double ms) {
+    count_output(output_slot(encode), bytes, ms);
+
+    char log_buf[256];
+    const char *tables = encode->optimize_huffman ? " optimized" : "";
+    if (encode->format == IMAGE_FORMAT_JPEG && encode->max_bytes > 0) {
+        snprintf(log_buf, sizeof(log_buf), "Encoded JPEG q%d %s%s: %zu bytes (budget %zu) in %.1f ms, %d passes",
+                 encode->quality, encode_subsampling(encode) == SUBSAMPLING_420 ? "4:2:0" : "4:4:4",
+                 tables, bytes, encode->max_bytes, ms, encode->stats->passes);
+    } else if (encode->format == IMAGE_FORMAT_JPEG) {
+        snprintf(log_buf, sizeof(log_buf), "Encoded JPEG q%d %s%s: %zu bytes in %.1f ms", encode->quality,
+                 encode_subsampling(encode) == SUBSAMPLING_420 ? "4:2:0" : "4:4:4", tables, bytes, ms);
+    } else {
+        snprintf(log_buf, sizeof(log_buf), "Encoded %s: %zu bytes in %.1f ms",
+                 image_format_mime_type(encode->format), bytes, ms);
+    }
+    log_msg(LOG_INFO, log_buf);
+}
+
+static void send_metrics(int client_socket) {
+    static const char *lossless_names[3] = { "png", "bmp", "qoi" };
+    char json[4096];
+    size_t len = snprintf(json, sizeof(json), "{\"uptime_seconds\":%ld,\"outputs\":[",
+                          (long)(time(NULL) - server_start));
+    int rows = 0;
+
+    for (int slot = 0; slot < OUTPUT_SLOTS; slot++) {
+        unsigned long long responses = __atomic_load_n(&output_stats[slot].responses, __ATOMIC_RELAXED);
+        if (responses == 0) continue;
+        unsigned long long bytes = __atomic_load_n(&output_stats[slot].bytes, __ATOMIC_RELAXED);
+        double encode_ms = __atomic_load_n(&output_stats[slot].encode_us, __ATOMIC_RELAXED) / 1000.0;
+
+        char label[96];
+        if (slot == TRANSFORM_SLOT) {
+            snprintf(label, sizeof(label), "\"format\":\"jpeg\",\"path\":\"transform\"");
+        } else if (slot < JPEG_SLOTS) {
+            snprintf(label, sizeof(label), "\"format\":\"jpeg\",\"subsampling\":\"%s\",\"quality\":\"%s\"",
+                     slot < QUALITY_BANDS ? "420" : "444", quality_band_names[slot % QUALITY_BANDS]);
+        } else {
+            snprintf(label, sizeof(label), "\"format\":\"%s\"", lossless_names[slot - JPEG_SLOTS]);
+        }
+        len += snprintf(json + len, sizeof(json) - len,
+            "%s{%s,\"responses\":%llu,\"bytes\":%llu,\"avg_bytes\":%llu,"
+            "\"encode_ms\":%.1f,\"avg_encode_ms\":%.2f}",
+            rows++ ? "," : "", label, responses, bytes, bytes / responses, encode_ms, encode_ms / responses);
+    }
+    BufferPoolStats pool = get_buffer_pool_stats();
+    len += snprintf(json + len, sizeof(json) - len,
+        "],\"buffer_pool\":{\"cached_bytes\":%zu,\"max_bytes\":%zu,\"hits\":%lu,\"misses\":%lu}}",
+        pool.cached_bytes, pool.max_bytes, pool.hits, pool.misses);
+
+    send_response(client_socket, 200, "OK", "application/json", (unsigned char *)json, len);
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Look up a query string parameter ("a=1&b=2"); returns 1 if present. The
+// value is URL-decoded: "%3A" is ':', '+' a space.
+int get_query_param(const char *query, const char *name, char *value, size_t value_size) {
+    size_t name_len = strlen(name);
+    const char *p = query;
+
+    while (p && *p) {
+        const char *end = strchr(p, '&');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+
+        if (len > name_len && strncmp(p, name, name_len) == 0 && p[name_len] == '=') {
+            const char *src = p + name_len + 1;
+            const char *src_end = p + len;
+            size_t vlen = 0;
+            while (src < src_end && vlen + 1 < value_size) {
+                int hi = *src == '%' && src_end - src >= 3 ? hex_digit(src[1]) : -1;
+                int lo = hi >= 0 ? hex_digit(src[2]) : -1;
+                if (lo >= 0) {
+                    value[vlen++] = (char)(hi << 4 | lo);
+                    src += 3;
+                } else {
+                    value[vlen++] = *src == '+' ? ' ' : *src;
+                    src++;
+                }
+            }
+            value[vlen] = '\0';
+            return 1;
+        }
+        p = end ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+// Look up a request header (name without the colon, case-insensitive) in
+// the header block only; returns 1 if present
+int get_header(const char *request, const char *name, char *value, size_t value_size) {
+    size_t name_len = strlen(name);
+    const char *line = strstr(request, "\r\n");   // Skip the request line
+
+    while (line) {
+        line += 2;
+        const char *end = strstr(line, "\r\n");
+        if (!end || end == line) break;             // Blank line ends the headers
+
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *v = line + name_len + 1;
+            while (v < end && (*v == ' ' || *v == '\t')) v++;
+            size_t vlen = end - v;
+            if (vlen >= value_size) vlen = value_size - 1;
+            memcpy(value, v, vlen);
+            value[vlen] = '\0';
+            return 1;
+        }
+        line = end;
+    }
+    return 0;
+}
+
+// Output formats in preference order (ties in Accept go to the first)
+static const struct {
+    const char *name;
+    ImageFormat format;
+} output_formats[] = {
+    { "jpeg", IMAGE_FORMAT_JPEG },
+    { "png", IMAGE_FORMAT_PNG },
+    { "qoi", IMAGE_FORMAT_QOI },
+    { "bmp", IMAGE_FORMAT_BMP },
+    { "jpg", IMAGE_FORMAT_JPEG }
+};
+#define OUTPUT_FORMAT_COUNT (sizeof(output_formats) / sizeof(output_formats[0]))
+
+// Parse a format= value; returns 1 on success
+int parse_format_name(const char *name, ImageFormat *format) {
+    for (size_t i = 0; i < OUTPUT_FORMAT_COUNT; i++) {
+        if (strcasecmp(name, output_formats[i].name) == 0) {
+            *format = output_formats[i].format;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// q-value an Accept header gives `mime`: that of the most specific
+// matching range (type/subtype, then image/*, then */*), 0 if none matches
+static double accept_quality(const char *accept, const char *mime) {
+    size_t mime_len = strlen(mime);
+    int best = -1;
+    double quality = 0.0;
+    const char *p = accept;
+
+    while (*p) {
+        while (*p == ' ' || *p == ',') p++;
+        if (!*p) break;
+
+        const char *range = p;
+        size_t range_len = strcspn(range, ";, \t");
+        const char *end = range + strcspn(range, ",");
+
+        double q = 1.0;
+        for (const char *param = range + range_len; param < end; param++) {
+            if (*param != ';') continue;
+            param++;
+            while (*param == ' ' || *param == '\t') param++;
+            if ((param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                q = strtod(param + 2, NULL);
+                if (q < 0.0) q = 0.0;
+                if (q > 1.0) q = 1.0;
+            }
+        }
+
+        int specificity = -1;
+        if (range_len == mime_len && strncasecmp(range, mime, mime_len) == 0) {
+            specificity = 2;
+        } else if (range_len == 7 && strncasecmp(range, "image/*", 7) == 0) {
+            specificity = 1;
+        } else if (range_len == 3 && strncmp(range, "*/*", 3) == 0) {
+            specificity = 0;
+        }
+        if (specificity > best) {
+            best = specificity;
+            quality = q;
+        }
+        p = end;
+    }
+    return quality;
+}
+
+// Pick the acceptable output format with the highest q-value; returns 0
+// if the header rules out every format
+int negotiate_format(const char *accept, ImageFormat *format) {
+    double best = 0.0;
+    for (size_t i = 0; i < OUTPUT_FORMAT_COUNT; i++) {
+        double q = accept_quality(accept, image_format_mime_type(output_formats[i].format));
+        if (q > best) {
+            best = q;
+            *format = output_formats[i].format;
+        }
+    }
+    return best > 0.0;
+}
+
+// Parse an unsigned 32-bit decimal; returns 1 on success
+int parse_uint(const char *text, unsigned int *out) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long value = strtoul(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || text[0] == '-' || value > 0xFFFFFFFFUL) {
+        return 0;
+    }
+    *out = (unsigned int)value;
+    return 1;
+}
+
 // Extract boundary from Content-Type header
 char* extract_boundary(const char *content_type) {
     const char *boundary_marker = "boundary=";
@@ -216,10 +580,276 @@ int parse_multipart_image(const char *body, size_t body_len, const char *boundar
     return 1;
 }
 
+// Invert a JPEG upload in the DCT domain and send it. Returns 0, with
+// nothing sent, when the input needs the pixel pipeline; 1 once a
+// response (the image or an error) has gone out.
+static int send_inverted_jpeg(int client_socket, const unsigned char *image_data, size_t image_size,
+                              const EncodeOptions *encode, int chunked) {
+    static const char *extra_headers = "Vary: Accept\r\nX-Invert-Path: transform\r\n";
+    const char *mime_type = image_format_mime_type(IMAGE_FORMAT_JPEG);
+    double start = now_ms();
+    size_t total;
+    int inverted;
+
+    if (chunked) {
+        ChunkedStream *stream = malloc(sizeof(ChunkedStream));
+        if (!stream) return 0;
+        stream->client_socket = client_socket;
+        stream->content_type = mime_type;
+        stream->extra_headers = extra_headers;
+        stream->started = 0;
+        stream->failed = 0;
+        stream->total = 0;
+        stream->used = 0;
+
+        inverted = invert_jpeg(image_data, image_size, encode, chunked_write, stream);
+        if (inverted == 0 || (inverted < 0 && !stream->started)) {
+            free(stream);
+            if (inverted < 0) send_error(client_socket, 500, "Failed to encode output image");
+            return inverted != 0;
+        }
+        if (inverted < 0 || !chunked_finish(stream)) {
+            log_msg(LOG_ERROR, "Image stream aborted");
+            free(stream);
+            return 1;
+        }
+        total = stream->total;
+        free(stream);
+    } else {
+        OutputBuffer output = {0};
+        inverted = invert_jpeg(image_data, image_size, encode, output_buffer_write, &output);
+        if (inverted == 0) {
+            output_buffer_free(&output);
+            return 0;
+        }
+        if (inverted < 0 || output.failed) {
+            output_buffer_free(&output);
+            send_error(client_socket, 500, "Failed to encode output image");
+            return 1;
+        }
+        send_response_with_headers(client_socket, 200, "OK", mime_type, extra_headers,
+                                   output.data, output.size);
+        total = output.size;
+        output_buffer_free(&output);
+    }
+
+    double ms = now_ms() - start;
+    count_output(TRANSFORM_SLOT, total, ms);
+
+    char log_buf[256];
+    snprintf(log_buf, sizeof(log_buf), "Inverted JPEG in the DCT domain%s: %zu bytes in %.1f ms",
+             encode->optimize_huffman ? ", optimized" : "", total, ms);
+    log_msg(LOG_INFO, log_buf);
+    log_msg(LOG_INFO, "Image processed successfully");
+    return 1;
+}
+
+// Process a JPEG upload to JPEG a band of rows at a time, so neither the
+// decoded nor the processed image is ever held whole. Returns 0, with
+// nothing sent, when the request needs the buffered pipeline; 1 once a
+// response (the image or an error) has gone out.
+static int send_streamed_jpeg(int client_socket, const unsigned char *image_data, size_t image_size,
+                              ProcessMode mode, ProcessOptions *options, const EncodeOptions *encode,
+                              int chunked) {
+    const char *mime_type = image_format_mime_type(IMAGE_FORMAT_JPEG);
+    char extra_headers[128] = "Vary: Accept\r\n";
+
+    // The seed header goes out before the image, so pick the seed up front
+    if (mode == MODE_TO_NEGATIVE) {
+        if (!options->use_seed) {
+            options->seed = new_grain_seed();
+            options->use_seed = 1;
+        }
+        size_t used = strlen(extra_headers);
+        snprintf(extra_headers + used, sizeof(extra_headers) - used, "X-Grain-Seed: %u\r\n", options->seed);
+    } else if (mode == MODE_INVERT) {
+        size_t used = strlen(extra_headers);
+        snprintf(extra_headers + used, sizeof(extra_headers) - used, "X-Invert-Path: pixel\r\n");
+    }
+
+    double start = now_ms();
+    size_t total;
+    int streamed;
+
+    if (chunked) {
+        ChunkedStream *stream = malloc(sizeof(ChunkedStream));
+        if (!stream) return 0;
+        stream->client_socket = client_socket;
+        stream->content_type = mime_type;
+        stream->extra_headers = extra_headers;
+        stream->started = 0;
+        stream->failed = 0;
+        stream->total = 0;
+        stream->used = 0;
+
+        streamed = process_image_stream(image_data, image_size, mode, options, encode, chunked_write, stream);
+        if (streamed == 0 || (streamed < 0 && !stream->started)) {
+            free(stream);
+            if (streamed < 0) send_error(client_socket, 500, "Image processing failed");
+            return streamed != 0;
+        }
+        if (streamed < 0 || !chunked_finish(stream)) {
+            log_msg(LOG_ERROR, "Image stream aborted");
+            free(stream);
+            return 1;
+        }
+        total = stream->total;
+        free(stream);
+    } else {
+        OutputBuffer output = {0};
+        streamed = process_image_stream(image_data, image_size, mode, options, encode,
+                                        output_buffer_write, &output);
+        if (streamed == 0) {
+            output_buffer_free(&output);
+            return 0;
+        }
+        if (streamed < 0 || output.failed) {
+            output_buffer_free(&output);
+            send_error(client_socket, 500, "Image processing failed");
+            return 1;
+        }
+        send_response_with_headers(client_socket, 200, "OK", mime_type, extra_headers,
+                                   output.data, output.size);
+        total = output.size;
+        output_buffer_free(&output);
+    }
+
+    // Encode time here covers decoding and processing too
+    double ms = now_ms() - start;
+    record_output(encode, total, ms);
+    log_msg(LOG_INFO, "Decoded, processed and encoded in row bands");
+    log_msg(LOG_INFO, "Image processed successfully");
+    return 1;
+}
+
+// Process an admitted upload and send the result: DCT-domain inversion or
+// the row-band pipeline when the request allows, else the buffered
+// pipeline. Takes ownership of image_data.
+static void send_processed_image(int client_socket, unsigned char *image_data, size_t image_size,
+                                 ProcessMode mode, ProcessOptions *options, EncodeOptions *encode,
+                                 int requantize, int chunked) {
+    const char *mime_type = image_format_mime_type(encode->format);
+
+    // Plain inversion from JPEG to JPEG at the source's own quality needs
+    // no pixels: try the DCT-domain path first, which leaves the request
+    // to the pixel pipeline when the input is not a sequential JPEG
+    if (mode == MODE_INVERT && encode->format == IMAGE_FORMAT_JPEG && !requantize && encode->max_bytes == 0 &&
+        options->max_dimension == 0 && send_inverted_jpeg(client_socket, image_data, image_size, encode, chunked)) {
+        free(image_data);
+        return;
+    }
+
+    // JPEG to JPEG without a byte budget, table pass or preview needs only
+    // a band of rows in memory at a time
+    if (encode->format == IMAGE_FORMAT_JPEG && encode->max_bytes == 0 && !encode->optimize_huffman &&
+        options->max_dimension == 0 &&
+        send_streamed_jpeg(client_socket, image_data, image_size, mode, options, encode, chunked)) {
+        free(image_data);
+        return;
+    }
+
+    // Process image
+    log_msg(LOG_INFO, "Processing image...");
+    ImageResult result = process_image_ex(image_data, image_size, mode, options);
+    free(image_data);
+
+    if (!result.success) {
+        char error_msg[512];
+        snprintf(error_msg, sizeof(error_msg), "Image processing failed: %s", result.error_message);
+        send_error(client_socket, 500, error_msg);
+        return;
+    }
+    if (options->max_dimension > 0) {
+        char log_buf[128];
+        snprintf(log_buf, sizeof(log_buf), "Preview %dx%d (decoded at 1/%d)",
+                 result.image.width, result.image.height, result.decode_scale);
+        log_msg(LOG_INFO, log_buf);
+    }
+
+    // The body depends on Accept, so caches must key on it
+    char extra_headers[128] = "Vary: Accept\r\n";
+    if (mode == MODE_TO_NEGATIVE) {
+        size_t used = strlen(extra_headers);
+        snprintf(extra_headers + used, sizeof(extra_headers) - used, "X-Grain-Seed: %u\r\n", result.seed);
+    } else if (mode == MODE_INVERT) {
+        size_t used = strlen(extra_headers);
+        snprintf(extra_headers + used, sizeof(extra_headers) - used, "X-Invert-Path: pixel\r\n");
+    }
+
+    if (chunked) {
+        // Stream the encoder output as it is produced
+        ChunkedStream *stream = malloc(sizeof(ChunkedStream));
+        if (!stream) {
+            free_image_result(&result);
+            send_error(client_socket, 500, "Failed to allocate response stream");
+            return;
+        }
+        stream->client_socket = client_socket;
+        stream->content_type = mime_type;
+        stream->extra_headers = extra_headers;
+        stream->started = 0;
+        stream->failed = 0;
+        stream->total = 0;
+        stream->used = 0;
+
+        double start = now_ms();
+        int encoded = encode_image(&result.image, encode, chunked_write, stream);
+        free_image_result(&result);
+
+        if (!encoded && !stream->started) {
+            free(stream);
+            if (encode->stats->over_budget) {
+                send_error(client_socket, 422, "Output cannot fit in max_bytes, even at quality 1");
+            } else {
+                send_error(client_socket, 500, "Failed to encode output image");
+            }
+            return;
+        }
+        if (encoded && chunked_finish(stream)) {
+            if (encode->max_bytes > 0) encode->quality = encode->stats->quality;
+            record_output(encode, stream->total, now_ms() - start);
+            log_msg(LOG_INFO, "Image processed successfully");
+        } else {
+            // Headers are out; the missing final chunk tells the client
+            log_msg(LOG_ERROR, "Image stream aborted");
+        }
+        free(stream);
+        return;
+    }
+
+    // HTTP/1.0 clients: encode into memory and send with Content-Length
+    OutputBuffer output = {0};
+    double start = now_ms();
+    int write_success = encode_image(&result.image, encode, output_buffer_write, &output) && !output.failed;
+    double encode_ms = now_ms() - start;
+    free_image_result(&result);
+
+    if (!write_success) {
+        output_buffer_free(&output);
+        if (encode->stats->over_budget) {
+            send_error(client_socket, 422, "Output cannot fit in max_bytes, even at quality 1");
+        } else {
+            send_error(client_socket, 500, "Failed to encode output image");
+        }
+        return;
+    }
+
+    if (encode->max_bytes > 0) encode->quality = encode->stats->quality;
+    record_output(encode, output.size, encode_ms);
+
+    log_msg(LOG_INFO, "Image processed successfully");
+    send_response_with_headers(client_socket, 200, "OK", mime_type, extra_headers,
+                               output.data, output.size);
+    output_buffer_free(&output);
+}
+
 // Handle POST request with improved parsing
-void handle_post_request(int client_socket, const char *path, const char *headers,
-                         const char *body, size_t body_len) {
+void handle_post_request(int client_socket, const char *path, const char *query,
+                         const char *headers, const char *body, size_t body_len,
+                         int chunked) {
     ProcessMode mode;
+    ProcessOptions options = {0};
+    options.max_threads = config.threads_per_request;
 
     if (strcmp(path, "/api/to-negative") == 0) {
         mode = MODE_TO_NEGATIVE;
@@ -227,11 +857,129 @@ void handle_post_request(int client_socket, const char *path, const char *header
     } else if (strcmp(path, "/api/to-positive") == 0) {
         mode = MODE_TO_POSITIVE;
         log_msg(LOG_INFO, "Processing: to-positive");
+    } else if (strcmp(path, "/api/invert") == 0) {
+        mode = MODE_INVERT;
+        log_msg(LOG_INFO, "Processing: invert");
     } else {
         send_error(client_socket, 404, "Endpoint not found");
         return;
     }
 
+    // Optional grain seed for reproducible output
+    char param[64];
+    if (get_query_param(query, "seed", param, sizeof(param))) {
+        if (!parse_uint(param, &options.seed)) {
+            send_error(client_socket, 400, "Invalid seed: must be an unsigned 32-bit integer");
+            return;
+        }
+        options.use_seed = 1;
+    }
+
+    // Optional grain source: cached texture (fast) or per-pixel hash
+    if (get_query_param(query, "grain", param, sizeof(param))) {
+        if (strcmp(param, "texture") == 0) {
+            options.grain_mode = GRAIN_TEXTURE;
+        } else if (strcmp(param, "hash") == 0) {
+            options.grain_mode = GRAIN_HASH;
+        } else {
+            send_error(client_socket, 400, "Invalid grain: must be texture or hash");
+            return;
+        }
+    }
+
+    // Optional to-positive border handling: keep (whitened) or crop
+    if (get_query_param(query, "border", param, sizeof(param))) {
+        if (strcmp(param, "crop") == 0) {
+            options.crop_border = 1;
+        } else if (strcmp(param, "keep") != 0) {
+            send_error(client_socket, 400, "Invalid border: must be keep or crop");
+            return;
+        }
+    }
+
+    // Optional preview size: the longer side is shrunk to max_dimension
+    if (get_query_param(query, "max_dimension", param, sizeof(param))) {
+        unsigned int max_dimension;
+        if (!parse_uint(param, &max_dimension) || max_dimension < 1 || max_dimension > 65535) {
+            send_error(client_socket, 400, "Invalid max_dimension: must be an integer from 1 to 65535");
+            return;
+        }
+        options.max_dimension = (int)max_dimension;
+    }
+
+    // Output format: format= overrides the Accept header; JPEG by default
+    ImageFormat format = IMAGE_FORMAT_JPEG;
+    char accept[1024];
+    if (get_query_param(query, "format", param, sizeof(param))) {
+        if (!parse_format_name(param, &format)) {
+            send_error(client_socket, 400, "Invalid format: must be jpeg, png, bmp or qoi");
+            return;
+        }
+    } else if (get_header(headers, "Accept", accept, sizeof(accept)) &&
+               !negotiate_format(accept, &format)) {
+        send_error(client_socket, 406, "Not acceptable: output is image/jpeg, image/png, image/bmp or image/qoi");
+        return;
+    }
+
+    // JPEG quality and chroma subsampling (lossless formats ignore them)
+    EncodeOptions encode = {0};
+    encode.format = format;
+    encode.quality = 90;
+    encode.max_threads = config.threads_per_request;
+    int requantize = 0;        // Quality or subsampling asked for explicitly
+    if (get_query_param(query, "quality", param, sizeof(param))) {
+        unsigned int quality;
+        if (!parse_uint(param, &quality) || quality < 1 || quality > 100) {
+            send_error(client_socket, 400, "Invalid quality: must be an integer from 1 to 100");
+            return;
+        }
+        encode.quality = (int)quality;
+        requantize = 1;
+    }
+    if (get_query_param(query, "subsampling", param, sizeof(param))) {
+        requantize = 1;
+        if (strcmp(param, "420") == 0 || strcmp(param, "4:2:0") == 0) {
+            encode.subsampling = SUBSAMPLING_420;
+        } else if (strcmp(param, "444") == 0 || strcmp(param, "4:4:4") == 0) {
+            encode.subsampling = SUBSAMPLING_444;
+        } else if (strcmp(param, "auto") != 0) {
+            send_error(client_socket, 400, "Invalid subsampling: must be 420, 444 or auto");
+            return;
+        }
+    }
+
+    // Huffman tables: the route default from FILM_OPTIMIZE_HUFFMAN, or
+    // huffman= per request
+    encode.optimize_huffman = config.optimize_huffman[mode];
+    if (get_query_param(query, "huffman", param, sizeof(param))) {
+        if (strcmp(param, "optimized") == 0) {
+            encode.optimize_huffman = 1;
+        } else if (strcmp(param, "standard") == 0) {
+            encode.optimize_huffman = 0;
+        } else {
+            send_error(client_socket, 400, "Invalid huffman: must be standard or optimized");
+            return;
+        }
+    }
+
+    // Byte budget: quality becomes the upper bound of the search
+    EncodeStats stats = {0};
+    encode.stats = &stats;
+    if (get_query_param(query, "max_bytes", param, sizeof(param))) {
+        unsigned int max_bytes;
+        if (!parse_uint(param, &max_bytes) || max_bytes < 1) {
+            send_error(client_socket, 400, "Invalid max_bytes: must be a positive integer");
+            return;
+        }
+        if (format != IMAGE_FORMAT_JPEG) {
+            send_error(client_socket, 400, "max_bytes applies to JPEG output only");
+            return;
+        }
+        encode.max_bytes = max_bytes;
+        // Settle auto subsampling on the requested quality, not the one found
+        encode.subsampling = encode_subsampling(&encode);
+    }
+
     // Validate request size
     if (body_len > MAX_BUFFER) {
         send_error(client_socket, 413, "Request too large");
@@ -271,83 +1019,29 @@ void handle_post_request(int client_socket, const char *path, const char *header
     }
     free(boundary);
 
-    // Process image
-    log_msg(LOG_INFO, "Processing image...");
-    ImageResult result = process_image(image_data, image_size, mode);
-    free(image_data);
-
-    if (!result.success) {
-        char error_msg[512];
-        snprintf(error_msg, sizeof(error_msg), "Image processing failed: %s", result.error_message);
-        send_error(client_socket, 500, error_msg);
-        return;
-    }
-
-    // Generate unique temporary filename
-    char temp_filename[512];
-    snprintf(temp_filename, sizeof(temp_filename), "%s/film_%ld_%d.jpg",
-             TEMP_DIR, (long)time(NULL), rand() % 10000);
-
-    // Write to file
-    int write_success = stbi_write_jpg(temp_filename, result.width, result.height,
-                                        result.channels, result.data, 90);
-    free_image_result(&result);
-
-    if (!write_success) {
-        send_error(client_socket, 500, "Failed to encode output image");
-        return;
-    }
-
-    // Ensure file is fully written to disk
-    sync();
-
-    // Read file
-    FILE *fp = fopen(temp_filename, "rb");
-    if (!fp) {
-        unlink(temp_filename);
-        send_error(client_socket, 500, "Failed to read output image");
-        return;
-    }
-
-    fseek(fp, 0, SEEK_END);
-    long file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    if (file_size <= 0) {
-        fclose(fp);
-        unlink(temp_filename);
-        send_error(client_socket, 500, "Invalid output file size");
-        return;
-    }
-
-    unsigned char *file_data = malloc(file_size);
-    if (!file_data) {
-        fclose(fp);
-        unlink(temp_filename);
-        send_error(client_socket, 500, "Memory allocation failed");
-        return;
-    }
-
-    size_t read_size = fread(file_data, 1, file_size, fp);
-    fclose(fp);
-    unlink(temp_filename);
-
-    if (read_size != (size_t)file_size) {
-        char log_buf[256];
-        snprintf(log_buf, sizeof(log_buf), "File size mismatch: expected %ld, read %zu", file_size, read_size);
-        log_msg(LOG_ERROR, log_buf);
-        free(file_data);
-        send_error(client_socket, 500, "Failed to read complete file");
-        return;
+    // Read the header and admit the image before any pixels are
+    // allocated: too large is refused outright, and a full in-flight
+    // budget queues the request for up to FILM_BUDGET_WAIT_MS
+    int width, height, channels;
+    if (probe_image(image_data, image_size, &width, &height, &channels)) {
+        BudgetStatus budget = acquire_pixel_budget(width, height);
+        if (budget != BUDGET_OK) {
+            free(image_data);
+            char error_msg[256];
+            if (budget == BUDGET_TOO_LARGE) {
+                snprintf(error_msg, sizeof(error_msg), "Image too large: %dx%d is over the %.1f megapixel limit",
+                         width, height, config.max_megapixels);
+                send_error(client_socket, 413, error_msg);
+            } else {
+                send_error(client_socket, 503, "Server busy: too many pixels in flight, retry later");
+            }
+            return;
+        }
+        options.budget_held = 1;
     }
 
-    char log_buf[256];
-    snprintf(log_buf, sizeof(log_buf), "Sending JPEG response: %zu bytes", read_size);
-    log_msg(LOG_DEBUG, log_buf);
-
-    log_msg(LOG_INFO, "Image processed successfully");
-    send_response(client_socket, 200, "OK", "image/jpeg", file_data, file_size);
-    free(file_data);
+    send_processed_image(client_socket, image_data, image_size, mode, &options, &encode, requantize, chunked);
+    if (options.budget_held) release_pixel_budget(width, height);
 }
 
 // Handle GET request
@@ -357,11 +1051,13 @@ void handle_get_request(int client_socket, const char *path) {
         send_response(client_socket, 200, "OK", "application/json",
                       (unsigned char *)response, strlen(response));
         log_msg(LOG_DEBUG, "Health check OK");
+    } else if (strcmp(path, "/metrics") == 0) {
+        send_metrics(client_socket);
     } else if (strcmp(path, "/") == 0) {
         const char *response =
             "{\"service\":\"Film Negative Processor\","
             "\"version\":\"2.0.0\","
-            "\"endpoints\":[\"/api/to-negative\",\"/api/to-positive\",\"/health\"],"
+            "\"endpoints\":[\"/api/to-negative\",\"/api/to-positive\",\"/api/invert\",\"/health\",\"/metrics\"],"
             "\"documentation\":\"https://github.com/yourusername/film-processor\"}";
         send_response(client_socket, 200, "OK", "application/json",
                       (unsigned char *)response, strlen(response));
@@ -380,7 +1076,7 @@ void* handle_client(void *arg) {
     int client_socket = *(int *)arg;
     free(arg);
 
-    char *buffer = malloc(MAX_BUFFER);
+    char *buffer = malloc(MAX_HEADER_SIZE + 1);
     if (!buffer) {
         close(client_socket);
         log_msg(LOG_ERROR, "Failed to allocate buffer for client");
@@ -393,14 +1089,59 @@ void* handle_client(void *arg) {
     timeout.tv_usec = 0;
     setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-    ssize_t received = recv(client_socket, buffer, MAX_BUFFER - 1, 0);
-    if (received <= 0) {
+    // Headers first, then as much body as Content-Length announces: the
+    // body buffer is sized from it, so an oversized upload is refused
+    // before anything is allocated for it
+    size_t received = 0;
+    char *header_end = NULL;
+    while (!header_end && received < MAX_HEADER_SIZE) {
+        ssize_t n = recv(client_socket, buffer + received, MAX_HEADER_SIZE - received, 0);
+        if (n <= 0) break;
+        received += (size_t)n;
+        buffer[received] = '\0';
+        header_end = strstr(buffer, "\r\n\r\n");
+    }
+    if (received == 0) {
         free(buffer);
         close(client_socket);
         return NULL;
     }
 
-    buffer[received] = '\0';
+    char length_text[32];
+    if (header_end && get_header(buffer, "Content-Length", length_text, sizeof(length_text))) {
+        size_t header_len = header_end + 4 - buffer;
+        unsigned long long content_length = strtoull(length_text, NULL, 10);
+        if (content_length > MAX_BUFFER) {
+            send_error(client_socket, 413, "Request too large");
+            free(buffer);
+            close(client_socket);
+            return NULL;
+        }
+
+        size_t request_len = header_len + (size_t)content_length;
+        if (request_len > received) {
+            char *grown = realloc(buffer, request_len + 1);
+            if (!grown) {
+                send_error(client_socket, 500, "Failed to allocate request buffer");
+                free(buffer);
+                close(client_socket);
+                return NULL;
+            }
+            buffer = grown;
+            while (received < request_len) {
+                ssize_t n = recv(client_socket, buffer + received, request_len - received, 0);
+                if (n <= 0) break;
+                received += (size_t)n;
+            }
+            buffer[received] = '\0';
+            if (received < request_len) {
+                send_error(client_socket, 400, "Incomplete request body");
+                free(buffer);
+                close(client_socket);
+                return NULL;
+            }
+        }
+    }
 
     // Parse request line
     char method[16] = {0}, path[512] = {0}, version[16] = {0};
@@ -415,6 +1156,14 @@ void* handle_client(void *arg) {
     snprintf(log_buf, sizeof(log_buf), "%s %s", method, path);
     log_msg(LOG_INFO, log_buf);
 
+    // Split off the query string
+    char *query = strchr(path, '?');
+    if (query) {
+        *query++ = '\0';
+    } else {
+        query = "";
+    }
+
     // Find body
     char *body = strstr(buffer, "\r\n\r\n");
     size_t body_len = 0;
@@ -427,7 +1176,9 @@ void* handle_client(void *arg) {
     if (strcmp(method, "GET") == 0) {
         handle_get_request(client_socket, path);
     } else if (strcmp(method, "POST") == 0) {
-        handle_post_request(client_socket, path, buffer, body, body_len);
+        // Chunked responses need an HTTP/1.1 client
+        int chunked = strcmp(version, "HTTP/1.0") != 0;
+        handle_post_request(client_socket, path, query, buffer, body, body_len, chunked);
     } else if (strcmp(method, "OPTIONS") == 0) {
         handle_options_request(client_socket);
     } else {
@@ -467,9 +1218,93 @@ int main(int argc, char *argv[]) {
     signal(SIGPIPE, SIG_IGN);  // Ignore broken pipe
 
     log_msg(LOG_INFO, "=== Film Negative Processor API v2.0 ===");
+    server_start = time(NULL);
+
     char msg[256];
     snprintf(msg, sizeof(msg), "Starting server on port %d", config.port);
     log_msg(LOG_INFO, msg);
+    snprintf(msg, sizeof(msg), "Pixel kernels: %s", get_kernel_name());
+    log_msg(LOG_INFO, msg);
+
+    // Codec backend for decoding uploads and encoding JPEG (FILM_CODEC)
+    char *codec_env = getenv("FILM_CODEC");
+    if (codec_env) {
+        const ImageCodec *codec = find_image_codec(codec_env);
+        if (codec) {
+            set_image_codec(codec);
+        } else {
+            snprintf(msg, sizeof(msg), "FILM_CODEC=%s not built in, using %s", codec_env, get_image_codec()->name);
+            log_msg(LOG_WARN, msg);
+        }
+    }
+    snprintf(msg, sizeof(msg), "Image codec: %s", get_image_codec()->name);
+    log_msg(LOG_INFO, msg);
+
+    // Precompute grain textures (FILM_GRAIN_CACHE_MB=0 disables them)
+    char *cache_env = getenv("FILM_GRAIN_CACHE_MB");
+    char *tile_env = getenv("FILM_GRAIN_TILE");
+    int cache_mb = cache_env ? atoi(cache_env) : 16;
+    if (cache_mb > 0) {
+        GrainCacheConfig grain_config = {0};
+        grain_config.tile_size = tile_env ? atoi(tile_env) : 0;
+        grain_config.max_bytes = (size_t)cache_mb << 20;
+        size_t grain_bytes = init_grain_cache(&grain_config);
+        snprintf(msg, sizeof(msg), "Grain texture cache: %zu KB", grain_bytes >> 10);
+        log_msg(LOG_INFO, msg);
+    }
+
+    // Shared pool for splitting images into row bands. Concurrent requests
+    // share its workers, FILM_THREADS_PER_REQUEST caps what one image takes.
+    char *threads_env = getenv("FILM_THREADS");
+    char *per_request_env = getenv("FILM_THREADS_PER_REQUEST");
+    if (per_request_env) {
+        config.threads_per_request = atoi(per_request_env);
+    }
+    int pool_threads = init_thread_pool(threads_env ? atoi(threads_env) : 0);
+    snprintf(msg, sizeof(msg), "Processing pool: %d workers, %d threads per request%s",
+             pool_threads, config.threads_per_request,
+             config.threads_per_request > 0 ? "" : " (unlimited)");
+    log_msg(LOG_INFO, msg);
+
+    // Routes whose JPEGs use optimized Huffman tables unless huffman=standard
+    // ("to-negative", "to-positive", "invert", comma-separated, or "all")
+    char *optimize_env = getenv("FILM_OPTIMIZE_HUFFMAN");
+    if (optimize_env) {
+        int all = strcmp(optimize_env, "all") == 0;
+        config.optimize_huffman[MODE_TO_NEGATIVE] = all || strstr(optimize_env, "to-negative") != NULL;
+        config.optimize_huffman[MODE_TO_POSITIVE] = all || strstr(optimize_env, "to-positive") != NULL;
+        config.optimize_huffman[MODE_INVERT] = all || strstr(optimize_env, "invert") != NULL;
+        snprintf(msg, sizeof(msg), "Optimized Huffman tables: to-negative %s, to-positive %s, invert %s",
+                 config.optimize_huffman[MODE_TO_NEGATIVE] ? "on" : "off",
+                 config.optimize_huffman[MODE_TO_POSITIVE] ? "on" : "off",
+                 config.optimize_huffman[MODE_INVERT] ? "on" : "off");
+        log_msg(LOG_INFO, msg);
+    }
+
+    // Freed image buffers kept for reuse by size class (FILM_BUFFER_POOL_MB=0
+    // returns them to the system)
+    char *pool_env = getenv("FILM_BUFFER_POOL_MB");
+    int pool_mb = pool_env ? atoi(pool_env) : 256;
+    init_buffer_pool(pool_mb > 0 ? (size_t)pool_mb << 20 : 0);
+    snprintf(msg, sizeof(msg), "Buffer pool: %d MB", pool_mb > 0 ? pool_mb : 0);
+    log_msg(LOG_INFO, msg);
+
+    // Pixel budget: uploads are admitted by the size in their header
+    // before any pixels are allocated
+    char *max_mp_env = getenv("FILM_MAX_MEGAPIXELS");
+    char *inflight_mp_env = getenv("FILM_INFLIGHT_MEGAPIXELS");
+    char *wait_env = getenv("FILM_BUDGET_WAIT_MS");
+    if (max_mp_env) config.max_megapixels = atof(max_mp_env);
+    if (inflight_mp_env) config.inflight_megapixels = atof(inflight_mp_env);
+    if (wait_env) config.budget_wait_ms = atoi(wait_env);
+    PixelBudgetConfig budget_config = {0};
+    budget_config.max_megapixels = config.max_megapixels;
+    budget_config.inflight_megapixels = config.inflight_megapixels;
+    budget_config.wait_ms = config.budget_wait_ms;
+    init_pixel_budget(&budget_config);
+    snprintf(msg, sizeof(msg), "Pixel budget: %.0f MP per image, %.0f MP in flight, %d ms queue",
+             config.max_megapixels, config.inflight_megapixels, config.budget_wait_ms);
+    log_msg(LOG_INFO, msg);
 
     // Create socket
     int server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -504,7 +1339,7 @@ int main(int argc, char *argv[]) {
 
     snprintf(msg, sizeof(msg), "Server ready at http://0.0.0.0:%d", config.port);
     log_msg(LOG_INFO, msg);
-    log_msg(LOG_INFO, "Endpoints: POST /api/to-negative, POST /api/to-positive, GET /health");
+    log_msg(LOG_INFO, "Endpoints: POST /api/to-negative, POST /api/to-positive, POST /api/invert, GET /health, GET /metrics");
 
     // Accept connections
     while (server_running) {
@@ -0,0 +1,143 @@
+/*
+ * Shared Thread Pool Implementation
+ */
+
+#include "thread_pool.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// A thread_pool_run call; lives on the caller's stack
+typedef struct Batch {
+    PoolTaskFn fn;
+    void *arg;
+    int tasks;
+    int next;                 // Next task to hand out
+    int remaining;            // Tasks not yet finished
+    pthread_cond_t done;
+    struct Batch *next_batch;
+} Batch;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    Batch *head;
+    Batch *tail;
+    pthread_t *threads;
+    int count;
+    int started;
+    int stopping;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, NULL, 0, 0, 0 };
+
+// Take the next task of a batch and dequeue it once fully handed out.
+// Caller holds the lock.
+static int take_task(Batch *batch) {
+    int task = batch->next++;
+    if (batch->next == batch->tasks) {
+        Batch **link = &pool.head;
+        Batch *prev = NULL;
+        while (*link && *link != batch) {
+            prev = *link;
+            link = &(*link)->next_batch;
+        }
+        if (*link) {
+            *link = batch->next_batch;
+            if (pool.tail == batch) pool.tail = prev;
+        }
+    }
+    return task;
+}
+
+// Run one task and account for it; called and returns with the lock held
+static void run_task(Batch *batch, int task) {
+    pthread_mutex_unlock(&pool.lock);
+    batch->fn(batch->arg, task);
+    pthread_mutex_lock(&pool.lock);
+    if (--batch->remaining == 0) {
+        pthread_cond_signal(&batch->done);
+    }
+}
+
+static void *worker_main(void *unused) {
+    (void)unused;
+    pthread_mutex_lock(&pool.lock);
+    while (!pool.stopping) {
+        if (!pool.head) {
+            pthread_cond_wait(&pool.work, &pool.lock);
+            continue;
+        }
+        Batch *batch = pool.head;
+        run_task(batch, take_task(batch));
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+int thread_pool_init(int threads) {
+    pthread_mutex_lock(&pool.lock);
+    if (!pool.started) {
+        if (threads <= 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            threads = cpus > 1 ? (int)cpus - 1 : 0;
+        }
+        pool.threads = threads > 0 ? malloc(sizeof(pthread_t) * threads) : NULL;
+        pool.count = 0;
+        for (int i = 0; pool.threads && i < threads; i++) {
+            if (pthread_create(&pool.threads[i], NULL, worker_main, NULL) != 0) break;
+            pool.count++;
+        }
+        pool.started = 1;
+    }
+    int count = pool.count;
+    pthread_mutex_unlock(&pool.lock);
+    return count;
+}
+
+int thread_pool_size(void) {
+    return thread_pool_init(0);
+}
+
+void thread_pool_run(PoolTaskFn fn, void *arg, int tasks) {
+    if (tasks <= 0) return;
+    if (tasks == 1 || thread_pool_size() == 0) {
+        for (int i = 0; i < tasks; i++) fn(arg, i);
+        return;
+    }
+
+    Batch batch = { fn, arg, tasks, 0, tasks, PTHREAD_COND_INITIALIZER, NULL };
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.tail) {
+        pool.tail->next_batch = &batch;
+    } else {
+        pool.head = &batch;
+    }
+    pool.tail = &batch;
+    pthread_cond_broadcast(&pool.work);
+
+    // Help with our own batch, so it completes even if every worker is busy
+    while (batch.next < batch.tasks) {
+        run_task(&batch, take_task(&batch));
+    }
+    while (batch.remaining > 0) {
+        pthread_cond_wait(&batch.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    pthread_cond_destroy(&batch.done);
+}
+
+void thread_pool_shutdown(void) {
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < pool.count; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.count = 0;
+    pool.stopping = 0;
+    pool.started = 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * Shared Thread Pool
+ * Fixed-size worker pool owned by the library, used to split one image
+ * across cores without creating threads per request
+ */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+// One unit of work: fn(arg, task) for task in [0, tasks)
+typedef void (*PoolTaskFn)(void *arg, int task);
+
+// Start the pool with `threads` workers (0 = online CPUs - 1). Only the
+// first call has an effect; returns the worker count.
+int thread_pool_init(int threads);
+
+// Worker count (starts the default pool if needed)
+int thread_pool_size(void);
+
+// Run all tasks, with the calling thread working alongside the pool;
+// returns once every task has finished. Safe to call from many threads.
+void thread_pool_run(PoolTaskFn fn, void *arg, int tasks);
+
+// Stop and join the workers (no thread_pool_run may be in flight)
+void thread_pool_shutdown(void);
+
+#endif // THREAD_POOL_H
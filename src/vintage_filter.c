@@ -14,195 +14,66 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
+#include "film_kernels.h"
+#include "qoi_codec.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <time.h>
 #include <string.h>
 
-// Clamp value between 0 and 255
-unsigned char clamp(int value) {
-    if (value < 0) return 0;
-    if (value > 255) return 255;
-    return (unsigned char)value;
-}
-
-// Generate random number between -range and +range for grain effect
-int random_grain(int range) {
-    return (rand() % (range * 2 + 1)) - range;
-}
-
-// Invert colors to create negative effect
-void apply_negative(unsigned char *img, int width, int height, int channels) {
-    for (int i = 0; i < width * height; i++) {
-        int idx = i * channels;
-
-        // Invert each color channel
-        img[idx] = 255 - img[idx];         // R
-        img[idx + 1] = 255 - img[idx + 1]; // G
-        img[idx + 2] = 255 - img[idx + 2]; // B
-    }
-}
-
-// Apply orange/amber color cast like real film negatives
-void apply_film_color_cast(unsigned char *img, int width, int height, int channels) {
-    for (int i = 0; i < width * height; i++) {
-        int idx = i * channels;
-
-        unsigned char r = img[idx];
-        unsigned char g = img[idx + 1];
-        unsigned char b = img[idx + 2];
-
-        // Film negative has orange/amber base
-        // Boost orange and red tones
-        int new_r = (int)(r * 1.15f + 20);
-        int new_g = (int)(g * 1.05f + 10);
-        int new_b = (int)(b * 0.85f);
-
-        img[idx] = clamp(new_r);
-        img[idx + 1] = clamp(new_g);
-        img[idx + 2] = clamp(new_b);
-    }
-}
-
-// Remove orange/amber color cast (reverse operation)
-void remove_film_color_cast(unsigned char *img, int width, int height, int channels) {
-    for (int i = 0; i < width * height; i++) {
-        int idx = i * channels;
-
-        unsigned char r = img[idx];
-        unsigned char g = img[idx + 1];
-        unsigned char b = img[idx + 2];
-
-        // Reverse the color cast adjustments
-        int new_r = (int)((r - 20) / 1.15f);
-        int new_g = (int)((g - 10) / 1.05f);
-        int new_b = (int)(b / 0.85f);
-
-        img[idx] = clamp(new_r);
-        img[idx + 1] = clamp(new_g);
-        img[idx + 2] = clamp(new_b);
-    }
-}
-
-// Crop sprocket holes from image
-void crop_sprocket_holes(unsigned char *img, int width, int height, int channels) {
-    int border_height = height / 15;
-
-    // Fill borders with black (or you could crop the image)
-    for (int y = 0; y < border_height; y++) {
-        for (int x = 0; x < width; x++) {
-            int top_idx = (y * width + x) * channels;
-            int bottom_idx = ((height - 1 - y) * width + x) * channels;
-
-            // Make borders black/transparent
-            img[top_idx] = 0;
-            img[top_idx + 1] = 0;
-            img[top_idx + 2] = 0;
-
-            img[bottom_idx] = 0;
-            img[bottom_idx + 1] = 0;
-            img[bottom_idx + 2] = 0;
-        }
-    }
-}
-
-// Apply film grain effect
-void apply_grain(unsigned char *img, int width, int height, int channels, int intensity) {
-    for (int i = 0; i < width * height; i++) {
-        int idx = i * channels;
-
-        int grain = random_grain(intensity);
-
-        img[idx] = clamp(img[idx] + grain);
-        img[idx + 1] = clamp(img[idx + 1] + grain);
-        img[idx + 2] = clamp(img[idx + 2] + grain);
-    }
-}
-
-// Draw film sprocket holes at top and bottom
-void draw_sprocket_holes(unsigned char *img, int width, int height, int channels) {
-    int border_height = height / 15;  // Height of film border
-    int hole_width = width / 25;
-    int hole_height = border_height / 2;
-    int spacing = width / 12;
-
-    // Draw top and bottom borders
-    for (int y = 0; y < border_height; y++) {
-        for (int x = 0; x < width; x++) {
-            int top_idx = (y * width + x) * channels;
-            int bottom_idx = ((height - 1 - y) * width + x) * channels;
-
-            // Orange/pink film base color
-            img[top_idx] = 220;
-            img[top_idx + 1] = 150;
-            img[top_idx + 2] = 130;
-
-            img[bottom_idx] = 220;
-            img[bottom_idx + 1] = 150;
-            img[bottom_idx + 2] = 130;
-        }
-    }
-
-    // Draw sprocket holes
-    for (int hole_num = 0; hole_num < width / spacing; hole_num++) {
-        int hole_x = hole_num * spacing + spacing / 4;
-
-        for (int y = border_height / 4; y < border_height / 4 + hole_height; y++) {
-            for (int x = hole_x; x < hole_x + hole_width && x < width; x++) {
-                int top_idx = (y * width + x) * channels;
-                int bottom_idx = ((height - 1 - y) * width + x) * channels;
-
-                // White holes
-                img[top_idx] = 240;
-                img[top_idx + 1] = 240;
-                img[top_idx + 2] = 240;
-
-                img[bottom_idx] = 240;
-                img[bottom_idx + 1] = 240;
-                img[bottom_idx + 2] = 240;
-            }
-        }
-    }
-
-    // Add frame numbers on the border
-    // (simplified - just adds some visual elements)
-}
-
 // Main film negative filter function
-void apply_film_negative_filter(unsigned char *img, int width, int height, int channels) {
+void apply_film_negative_filter(unsigned char *img, int width, int height, int channels,
+                                unsigned int seed) {
     printf("Applying film negative effects...\n");
 
     printf("  - Inverting colors (negative effect)...\n");
-    apply_negative(img, width, height, channels);
-
     printf("  - Applying film color cast (orange/amber)...\n");
-    apply_film_color_cast(img, width, height, channels);
-
     printf("  - Adding film grain texture...\n");
-    apply_grain(img, width, height, channels, 12);
-
     printf("  - Drawing film sprocket holes...\n");
-    draw_sprocket_holes(img, width, height, channels);
+    fused_to_negative(img, width, height, channels, FILM_GRAIN_INTENSITY, seed);
 
     printf("Film negative filter applied successfully!\n");
 }
 
-// Reverse film negative back to positive (color) image
-void reverse_film_negative(unsigned char *img, int width, int height, int channels) {
+// Reverse film negative back to positive (color) image. With crop, the
+// border rows are skipped and *height shrinks to the picture rows, which
+// start at the returned row.
+unsigned char *reverse_film_negative(unsigned char *img, int width, int *height, int channels, int crop) {
     printf("Reversing film negative to positive image...\n");
 
-    printf("  - Removing sprocket hole borders...\n");
-    crop_sprocket_holes(img, width, height, channels);
+    ImageBuffer image = image_buffer_wrap(img, width, *height, channels, 0);
+    int border_height = *height / 15;
 
+    printf(crop ? "  - Cropping sprocket hole borders...\n" : "  - Removing sprocket hole borders...\n");
     printf("  - Removing film color cast...\n");
-    remove_film_color_cast(img, width, height, channels);
-
     printf("  - Inverting colors back to positive...\n");
-    apply_negative(img, width, height, channels);
+    if (crop) {
+        ImageBuffer picture = image_buffer_view(&image, 0, border_height, width, *height - 2 * border_height);
+        fused_to_positive_picture_rows(&picture, 0, picture.height);
+        img = picture.data;
+        *height = picture.height;
+    } else {
+        fused_to_positive_rows(&image, 0, *height);
+    }
 
     printf("Negative to positive conversion complete!\n");
     printf("Note: Film grain cannot be fully removed as it's random.\n");
+    return img;
+}
+
+static void file_write(void *context, const void *data, size_t size) {
+    fwrite(data, 1, size, (FILE *)context);
+}
+
+// Write a QOI file; returns 1 on success
+static int write_qoi(const char *filename, unsigned char *pixels, int width, int height, int channels) {
+    FILE *file = fopen(filename, "wb");
+    if (!file) return 0;
+    ImageBuffer image = image_buffer_wrap(pixels, width, height, channels, 0);
+    int ok = qoi_encode(&image, file_write, file);
+    ok = !ferror(file) && ok;
+    return fclose(file) == 0 && ok;
 }
 
 int main(int argc, char *argv[]) {
@@ -213,12 +84,15 @@ int main(int argc, char *argv[]) {
         printf("\nModes:\n");
         printf("  -n  : Convert to negative (default)\n");
         printf("  -r  : Reverse negative back to positive\n");
+        printf("  -c  : Reverse to positive and crop the sprocket border\n");
         printf("\nExamples:\n");
         printf("  %s photo.jpg film_negative.jpg      # Convert to negative\n", argv[0]);
         printf("  %s negative.jpg restored.jpg -r     # Reverse to positive\n", argv[0]);
+        printf("  %s negative.jpg restored.jpg -c     # Reverse and crop the border\n", argv[0]);
+        printf("\nSet FILM_SEED=<n> for reproducible grain.\n");
         printf("\nSupported formats:\n");
         printf("  Input:  JPG, PNG, BMP, TGA\n");
-        printf("  Output: JPG, PNG, BMP, TGA\n");
+        printf("  Output: JPG, PNG, BMP, TGA, QOI\n");
         return 1;
     }
 
@@ -226,8 +100,9 @@ int main(int argc, char *argv[]) {
     char *output_file = argv[2];
     char *mode = (argc == 4) ? argv[3] : "-n";  // Default to negative mode
 
-    // Initialize random seed for grain effect
-    srand(time(NULL));
+    // Grain seed: FILM_SEED makes the output reproducible
+    char *seed_env = getenv("FILM_SEED");
+    unsigned int seed = seed_env ? (unsigned int)strtoul(seed_env, NULL, 10) : (unsigned int)time(NULL);
 
     printf("\n=== Film Negative Filter ===\n\n");
     printf("Loading image: %s\n", input_file);
@@ -251,13 +126,14 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // Apply filter based on mode
-    if (strcmp(mode, "-r") == 0) {
+    // Apply filter based on mode; out is the first row to save
+    unsigned char *out = img;
+    if (strcmp(mode, "-r") == 0 || strcmp(mode, "-c") == 0) {
         // Reverse negative to positive
-        reverse_film_negative(img, width, height, channels);
+        out = reverse_film_negative(img, width, &height, channels, strcmp(mode, "-c") == 0);
     } else {
         // Default: Apply negative filter
-        apply_film_negative_filter(img, width, height, channels);
+        apply_film_negative_filter(img, width, height, channels, seed);
     }
 
     // Determine output format from extension
@@ -268,20 +144,22 @@ int main(int argc, char *argv[]) {
 
     if (ext != NULL) {
         if (strcmp(ext, ".png") == 0 || strcmp(ext, ".PNG") == 0) {
-            result = stbi_write_png(output_file, width, height, channels, img, width * channels);
+            result = stbi_write_png(output_file, width, height, channels, out, width * channels);
         } else if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".JPG") == 0 ||
                    strcmp(ext, ".jpeg") == 0 || strcmp(ext, ".JPEG") == 0) {
-            result = stbi_write_jpg(output_file, width, height, channels, img, 90);
+            result = stbi_write_jpg(output_file, width, height, channels, out, 90);
         } else if (strcmp(ext, ".bmp") == 0 || strcmp(ext, ".BMP") == 0) {
-            result = stbi_write_bmp(output_file, width, height, channels, img);
+            result = stbi_write_bmp(output_file, width, height, channels, out);
         } else if (strcmp(ext, ".tga") == 0 || strcmp(ext, ".TGA") == 0) {
-            result = stbi_write_tga(output_file, width, height, channels, img);
+            result = stbi_write_tga(output_file, width, height, channels, out);
+        } else if (strcmp(ext, ".qoi") == 0 || strcmp(ext, ".QOI") == 0) {
+            result = write_qoi(output_file, out, width, height, channels);
         } else {
             printf("Warning: Unknown format, defaulting to PNG\n");
-            result = stbi_write_png(output_file, width, height, channels, img, width * channels);
+            result = stbi_write_png(output_file, width, height, channels, out, width * channels);
         }
     } else {
-        result = stbi_write_png(output_file, width, height, channels, img, width * channels);
+        result = stbi_write_png(output_file, width, height, channels, out, width * channels);
     }
 
     if (result) {